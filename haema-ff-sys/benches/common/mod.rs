@@ -0,0 +1,37 @@
+// test clips of the benches, haema-server's benches include this file by path
+#![allow(dead_code)]
+
+use std::{
+    path::{Path, PathBuf},
+    process::Command,
+};
+
+pub const CLIP_DURATION: u32 = 20;
+const CLIP_FRAME_RATE: u32 = 24;
+// the clips have a keyframe every CLIP_GOP seconds so segments on multiples
+// of it can be remuxed
+pub const CLIP_GOP: f64 = 2.0;
+
+/// a h264/aac mp4 generated by the ffmpeg cli from lavfi test sources
+pub fn generate_clip(dir: &Path, width: u32, height: u32) -> PathBuf {
+    let path = dir.join(format!("testsrc-{height}p.mp4"));
+    let video =
+        format!("testsrc2=size={width}x{height}:rate={CLIP_FRAME_RATE}:duration={CLIP_DURATION}");
+    let audio = format!("sine=frequency=440:sample_rate=48000:duration={CLIP_DURATION}");
+    let gop = (CLIP_GOP * CLIP_FRAME_RATE as f64).to_string();
+    let status = Command::new("ffmpeg")
+        .args(["-y", "-loglevel", "error"])
+        .args(["-f", "lavfi", "-i", &video, "-f", "lavfi", "-i", &audio])
+        .args(["-c:v", "libx264", "-preset", "fast", "-pix_fmt", "yuv420p"])
+        .args(["-g", &gop, "-keyint_min", &gop, "-sc_threshold", "0"])
+        .args(["-c:a", "aac", "-shortest"])
+        .arg(&path)
+        .status()
+        .expect("failed to run ffmpeg, it has to be on PATH to generate the clips");
+    assert!(
+        status.success(),
+        "ffmpeg failed to generate {}",
+        path.display()
+    );
+    path
+}
@@ -0,0 +1,201 @@
+mod common;
+
+use std::{fs, hint::black_box, time::Duration};
+
+use common::{CLIP_GOP as GOP, generate_clip};
+use criterion::{Criterion, criterion_group, criterion_main};
+use haema_ff_sys::{Backend, EncoderOptions, EncoderProfile, Format, HMContext, media_offset};
+
+const SEGMENT_DURATION: f64 = 4.0;
+
+// software codecs only, numbers don't depend on the gpu of the box
+const ENCODER: &str = "libx264";
+
+fn bench_ffi(c: &mut Criterion) {
+    let dir = std::env::temp_dir().join(format!("haema-ff-sys-bench-{}", std::process::id()));
+    fs::create_dir_all(&dir).unwrap();
+    let clip = generate_clip(&dir, 1280, 720);
+    let clip = clip.to_str().unwrap();
+    let ctx = HMContext::with_backend(Backend::Software, 0);
+    // the server keeps inputs open between segments as well
+    ctx.set_input_cache(2, Duration::from_secs(30));
+    let latency = EncoderOptions::profile(EncoderProfile::Latency);
+    let quality = EncoderOptions::profile(EncoderProfile::Quality);
+
+    // a round trip into C that does nothing else
+    c.bench_function("ffi/call", |b| b.iter(|| black_box(ctx.backend())));
+    c.bench_function("ffi/probe", |b| {
+        b.iter(|| haema_ff_sys::probe(black_box(clip)).unwrap())
+    });
+    c.bench_function("ffi/keyframes", |b| {
+        b.iter(|| haema_ff_sys::get_keyframes(black_box(clip)).unwrap())
+    });
+
+    let mut group = c.benchmark_group("remux");
+    for format in [Format::MpegTs, Format::Fmp4] {
+        group.bench_function(format!("{format:?}"), |b| {
+            b.iter(|| {
+                haema_ff_sys::remux_segment(clip, format, 2.0 * GOP, SEGMENT_DURATION, None, None)
+                    .unwrap()
+            })
+        });
+    }
+    group.bench_function("MpegTs/chunks", |b| {
+        b.iter(|| {
+            haema_ff_sys::remux_segment_to(
+                clip,
+                Format::MpegTs,
+                2.0 * GOP,
+                SEGMENT_DURATION,
+                None,
+                None,
+                |chunk| {
+                    black_box(chunk);
+                },
+            )
+            .unwrap()
+        })
+    });
+    group.finish();
+
+    let segment =
+        haema_ff_sys::remux_segment(clip, Format::Fmp4, 0.0, SEGMENT_DURATION, None, None)
+            .unwrap()
+            .to_vec();
+    c.bench_function("media_offset", |b| {
+        b.iter(|| media_offset(black_box(&segment)).unwrap())
+    });
+
+    // transcodes take seconds, criterion's minimum of 10 samples is plenty
+    let mut group = c.benchmark_group("transcode");
+    group.sample_size(10);
+    // a start between keyframes has to decode the frames before it
+    for (name, start) in [("keyframe", 2.0 * GOP), ("mid_gop", 2.0 * GOP + GOP / 2.0)] {
+        group.bench_function(format!("720p/{name}"), |b| {
+            b.iter(|| {
+                ctx.transcode_segment(
+                    clip,
+                    ENCODER,
+                    &latency,
+                    0,
+                    Format::MpegTs,
+                    start,
+                    SEGMENT_DURATION,
+                    None,
+                )
+                .unwrap()
+            })
+        });
+    }
+    group.bench_function("480p", |b| {
+        b.iter(|| {
+            ctx.transcode_segment(
+                clip,
+                ENCODER,
+                &latency,
+                480,
+                Format::MpegTs,
+                0.0,
+                SEGMENT_DURATION,
+                None,
+            )
+            .unwrap()
+        })
+    });
+    // what the quality profile costs over the latency one above
+    group.bench_function("480p/quality", |b| {
+        b.iter(|| {
+            ctx.transcode_segment(
+                clip,
+                ENCODER,
+                &quality,
+                480,
+                Format::MpegTs,
+                0.0,
+                SEGMENT_DURATION,
+                None,
+            )
+            .unwrap()
+        })
+    });
+    group.bench_function("480p/fmp4", |b| {
+        b.iter(|| {
+            ctx.transcode_segment(
+                clip,
+                ENCODER,
+                &latency,
+                480,
+                Format::Fmp4,
+                0.0,
+                SEGMENT_DURATION,
+                None,
+            )
+            .unwrap()
+        })
+    });
+    group.bench_function("480p/chunks", |b| {
+        b.iter(|| {
+            ctx.transcode_segment_to(
+                clip,
+                ENCODER,
+                &latency,
+                480,
+                Format::MpegTs,
+                0.0,
+                SEGMENT_DURATION,
+                None,
+                |chunk| {
+                    black_box(chunk);
+                },
+            )
+            .unwrap()
+        })
+    });
+    group.bench_function("ladder", |b| {
+        let renditions = [720, 480, 360].map(|height| haema_ff_sys::Rendition {
+            encoder_name: ENCODER,
+            options: &latency,
+            height,
+        });
+        b.iter(|| {
+            ctx.transcode_renditions(
+                clip,
+                &renditions,
+                Format::MpegTs,
+                0.0,
+                SEGMENT_DURATION,
+                None,
+            )
+            .unwrap()
+        })
+    });
+    // 4 segments out of one session against 4 separate transcodes above
+    group.bench_function("session", |b| {
+        let starts: Vec<f64> = (0..4).map(|i| i as f64 * SEGMENT_DURATION).collect();
+        let end = starts.len() as f64 * SEGMENT_DURATION;
+        b.iter(|| {
+            let mut session = ctx
+                .open_session(
+                    clip,
+                    ENCODER,
+                    &latency,
+                    480,
+                    Format::MpegTs,
+                    &starts,
+                    end,
+                    None,
+                )
+                .unwrap();
+            while let Some(segment) = session.next_segment() {
+                black_box(segment.unwrap());
+            }
+        })
+    });
+    group.finish();
+
+    drop(ctx);
+    let _ = fs::remove_dir_all(&dir);
+}
+
+criterion_group!(benches, bench_ffi);
+criterion_main!(benches);
@@ -15,7 +15,9 @@ fn main() {
     cc::Build::new()
         .file("c_src/hm_context.c")
         .file("c_src/hm_transcode.c")
+        .file("c_src/hm_input.c")
         .file("c_src/hm_probe.c")
+        .file("c_src/hm_keyframes.c")
         .include("c_src/include")
         .flag("-Wall")
         .compile("hmff");
@@ -26,7 +28,13 @@ fn main() {
 
     println!("cargo::rerun-if-changed=c_src/hm_context.c");
     println!("cargo::rerun-if-changed=c_src/hm_transcode.c");
+    println!("cargo::rerun-if-changed=c_src/hm_input.c");
     println!("cargo::rerun-if-changed=c_src/hm_probe.c");
+    println!("cargo::rerun-if-changed=c_src/hm_keyframes.c");
+    println!("cargo::rerun-if-changed=c_src/include/hm_keyframes.h");
+    println!("cargo::rerun-if-changed=c_src/include/hm_probe.h");
+    println!("cargo::rerun-if-changed=c_src/include/hm_context.h");
+    println!("cargo::rerun-if-changed=c_src/include/hm_transcode.h");
     println!("cargo::rerun-if-changed=c_src/include/hm_util.h");
 }
 
@@ -1,24 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libavcodec/avcodec.h>
 #include <libavutil/error.h>
 #include <libavutil/hwcontext.h>
 
 #include "include/hm_context.h"
+#include "include/hm_util.h"
+
+#define DEFAULT_MAX_INPUTS 2
+#define DEFAULT_INPUT_IDLE_TIMEOUT (30 * 1000000LL)
+
+const char *hm_backend_name(HMBackend backend) {
+  switch (backend) {
+  case HM_BACKEND_QSV:
+    return "qsv";
+  case HM_BACKEND_VAAPI:
+    return "vaapi";
+  case HM_BACKEND_SW:
+    return "sw";
+  default:
+    return "auto";
+  }
+}
+
+enum AVPixelFormat hm_backend_pix_fmt(HMBackend backend) {
+  switch (backend) {
+  case HM_BACKEND_QSV:
+    return AV_PIX_FMT_QSV;
+  case HM_BACKEND_VAAPI:
+    return AV_PIX_FMT_VAAPI;
+  default:
+    return AV_PIX_FMT_NONE;
+  }
+}
 
-HMContext *hm_ctx_create() {
+static enum AVHWDeviceType backend_device_type(HMBackend backend) {
+  switch (backend) {
+  case HM_BACKEND_QSV:
+    return AV_HWDEVICE_TYPE_QSV;
+  case HM_BACKEND_VAAPI:
+    return AV_HWDEVICE_TYPE_VAAPI;
+  default:
+    return AV_HWDEVICE_TYPE_NONE;
+  }
+}
+
+// name of the h264 encoder every hardware backend must at least provide
+static const char *backend_probe_encoder(HMBackend backend) {
+  switch (backend) {
+  case HM_BACKEND_QSV:
+    return "h264_qsv";
+  case HM_BACKEND_VAAPI:
+    return "h264_vaapi";
+  default:
+    return NULL;
+  }
+}
+
+// tries to open the device of a hardware backend, returns NULL when the
+// backend is unusable on this host
+static AVBufferRef *open_backend_device(HMBackend backend) {
+  AVBufferRef *hw_device_ctx = NULL;
+  const char *probe_encoder = backend_probe_encoder(backend);
+  int ret;
+
+  if (probe_encoder == NULL ||
+      avcodec_find_encoder_by_name(probe_encoder) == NULL) {
+    fprintf(stderr, "Backend %s is not compiled into ffmpeg\n",
+            hm_backend_name(backend));
+    return NULL;
+  }
+
+  if ((ret = av_hwdevice_ctx_create(&hw_device_ctx,
+                                    backend_device_type(backend), NULL, NULL,
+                                    0)) < 0) {
+    fprintf(stderr, "Failed to create %s device, error: %s\n",
+            hm_backend_name(backend), av_err2str(ret));
+    return NULL;
+  }
+  return hw_device_ctx;
+}
+
+/**
+ * - create context using backend, HM_BACKEND_AUTO picks the first usable
+ * backend in order of QSV, VAAPI, SW
+ * - when the requested hardware backend is not usable the next one in that
+ * order is tried so that a context is always returned
+ */
+HMContext *hm_ctx_create(HMBackend backend, int threads) {
   HMContext *ctx = malloc(sizeof(HMContext));
   AVBufferRef *hw_device_ctx = NULL;
-  int ret = 0;
-  if ((ret = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_QSV, NULL,
-                                    NULL, 0)) < 0) {
-    fprintf(stderr, "Failed to create QSV device, error: %s\n",
-            av_err2str(ret));
+  HMBackend cur = backend == HM_BACKEND_AUTO ? HM_BACKEND_QSV : backend;
+
+  for (; cur < HM_BACKEND_SW; cur++) {
+    if ((hw_device_ctx = open_backend_device(cur)) != NULL)
+      break;
   }
+  if (cur != backend && backend != HM_BACKEND_AUTO) {
+    fprintf(stderr, "Backend %s unavailable, falling back to %s\n",
+            hm_backend_name(backend), hm_backend_name(cur));
+  }
+
+  ctx->backend = cur;
   ctx->hw_device_ctx = hw_device_ctx;
+  ctx->threads = threads < 0 ? 0 : threads;
+  ctx->output_size_hint = 0;
+  ctx->nb_inputs = 0;
+  ctx->max_inputs = DEFAULT_MAX_INPUTS;
+  ctx->input_idle_timeout = DEFAULT_INPUT_IDLE_TIMEOUT;
+  ctx->scratch = NULL;
+  ctx->interrupt = NULL;
   return ctx;
 }
 
+HMBackend hm_ctx_backend(HMContext *ctx) { return ctx->backend; }
+
+// *interrupt may be set from any thread, it has to outlive every transcode
+// started before the context's interrupt is set back to NULL
+void hm_ctx_set_interrupt(HMContext *ctx, const int *interrupt) {
+  ctx->interrupt = interrupt;
+}
+
+HMBackend hm_probe_backend(void) {
+  HMContext *ctx = hm_ctx_create(HM_BACKEND_AUTO, 0);
+  HMBackend backend = ctx->backend;
+  hm_ctx_free(ctx);
+  return backend;
+}
 
 void hm_ctx_free(HMContext *ctx) {
-    av_buffer_unref(&ctx->hw_device_ctx); 
+    hm_ctx_set_input_cache(ctx, 0, 0);
+    free_scratch(&ctx->scratch);
+    av_buffer_unref(&ctx->hw_device_ctx);
     free(ctx);
 }
-
@@ -0,0 +1,279 @@
+/*
+ * Haema Input
+ * Copyright (c) 2025 Hajin Chung <hajinchung1@gmail.com>
+ * Don't know what to say here
+ * just do whatever you want with this code
+ *
+ * Haema Input opens sources for hm_transcode and keeps them open in the
+ * HMContext, so sequential segments of a file skip avformat_open_input,
+ * avformat_find_stream_info and opening the decoder.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+
+#include "include/hm_context.h"
+#include "include/hm_util.h"
+
+static int get_format(AVCodecContext *avctx,
+                      const enum AVPixelFormat *pix_fmts) {
+    InputContext *input = avctx->opaque;
+
+    while (*pix_fmts != AV_PIX_FMT_NONE) {
+        if (*pix_fmts == input->hw_pix_fmt) {
+            return input->hw_pix_fmt;
+        }
+
+        pix_fmts++;
+    }
+
+    fprintf(stderr, "The %s pixel format not offered in get_format()\n",
+            av_get_pix_fmt_name(input->hw_pix_fmt));
+
+    return AV_PIX_FMT_NONE;
+}
+
+// size and mtime of in_filename, both -1 when it can't be stat'ed
+static void stat_input(const char *in_filename, int64_t *mtime,
+                       int64_t *size) {
+    struct stat st;
+
+    if (stat(in_filename, &st) < 0) {
+        *mtime = *size = -1;
+        return;
+    }
+    *mtime = st.st_mtime;
+    *size = st.st_size;
+}
+
+static int input_interrupt_cb(void *opaque) {
+    InputContext *input = opaque;
+
+    return interrupted(input->interrupt);
+}
+
+/**
+ * - opens in_filename and picks its best video and audio streams
+ * - the decoder is left closed, open_input_decoder opens it for transcodes
+ * - opening gives up with AVERROR_EXIT once interrupt is set, the input
+ *   keeps interrupt until its owner changes it
+ * - returns negative value on error and input is left NULL
+ */
+int open_input(InputContext **input, const char *in_filename,
+               HMBackend backend, const int *interrupt) {
+    InputContext *in = av_mallocz(sizeof(InputContext));
+    int ret;
+
+    *input = NULL;
+    if (!in || !(in->in_filename = av_strdup(in_filename))) {
+        av_free(in);
+        return AVERROR(ENOMEM);
+    }
+    stat_input(in_filename, &in->mtime, &in->size);
+    in->backend = backend;
+    in->hw_pix_fmt = AV_PIX_FMT_NONE;
+    in->interrupt = interrupt;
+
+    if (!(in->ifmt_ctx = avformat_alloc_context())) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    in->ifmt_ctx->interrupt_callback.callback = input_interrupt_cb;
+    in->ifmt_ctx->interrupt_callback.opaque = in;
+
+    if ((ret = avformat_open_input(&in->ifmt_ctx, in_filename, 0, 0)) < 0) {
+        fprintf(stderr, "Could not open input filename '%s'\n", in_filename);
+        goto fail;
+    }
+
+    if ((ret = avformat_find_stream_info(in->ifmt_ctx, 0)) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        goto fail;
+    }
+
+    if ((ret = av_find_best_stream(in->ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1,
+                                   NULL, 0)) < 0) {
+        fprintf(stderr, "Cannot find a video stream in input file: %s\n",
+                av_err2str(ret));
+        goto fail;
+    }
+    in->in_video_stream_index = ret;
+    in->in_video_stream = in->ifmt_ctx->streams[ret];
+
+    if ((ret = av_find_best_stream(in->ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1,
+                                   NULL, 0)) < 0) {
+        fprintf(stderr, "Cannot find a audio stream in input file: %s\n",
+                av_err2str(ret));
+        goto fail;
+    }
+    in->in_audio_stream_index = ret;
+    in->in_audio_stream = in->ifmt_ctx->streams[ret];
+
+    // subtitles, extra audio tracks and attachments are dropped by the
+    // demuxer instead of being read and thrown away
+    for (unsigned int i = 0; i < in->ifmt_ctx->nb_streams; i++) {
+        if (i != in->in_video_stream_index && i != in->in_audio_stream_index)
+            in->ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    *input = in;
+    return 0;
+fail:
+    free_input(&in);
+    return ret;
+}
+
+// opens the video decoder of input once, later calls keep the open one
+int open_input_decoder(InputContext *input, AVBufferRef *hw_device_ctx,
+                       int threads) {
+    AVStream *stream = input->in_video_stream;
+    AVCodecContext *dec_ctx;
+    int ret;
+
+    if (input->dec_ctx)
+        return 0;
+
+    enum AVCodecID codec_id = stream->codecpar->codec_id;
+    const AVCodec *dec_codec = find_backend_decoder(input->backend, codec_id);
+    if (!dec_codec && input->backend != HM_BACKEND_SW) {
+        fprintf(stderr, "%s can't decode %s, falling back to software\n",
+                hm_backend_name(input->backend), avcodec_get_name(codec_id));
+        input->backend = HM_BACKEND_SW;
+        dec_codec = find_backend_decoder(input->backend, codec_id);
+    }
+    if (!dec_codec) {
+        fprintf(stderr, "Failed to find decoder\n");
+        return -1;
+    }
+
+    dec_ctx = avcodec_alloc_context3(dec_codec);
+    if (!dec_ctx) {
+        fprintf(stderr, "Failed to allocate decoder context");
+        return AVERROR(ENOMEM);
+    }
+    input->dec_ctx = dec_ctx;
+
+    ret = avcodec_parameters_to_context(dec_ctx, stream->codecpar);
+    if (ret < 0) {
+        fprintf(stderr,
+                "Failed to copy decoder params to input decoder context");
+        goto fail;
+    }
+
+    dec_ctx->pkt_timebase = stream->time_base;
+    dec_ctx->framerate = av_guess_frame_rate(input->ifmt_ctx, stream, NULL);
+    if (input->backend == HM_BACKEND_SW) {
+        dec_ctx->thread_count = threads;
+        dec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    } else {
+        input->hw_pix_fmt = hm_backend_pix_fmt(input->backend);
+        dec_ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+        if (!dec_ctx->hw_device_ctx) {
+            fprintf(stderr, "A hardware device reference create failed\n");
+            ret = -1;
+            goto fail;
+        }
+        dec_ctx->opaque = input;
+        dec_ctx->get_format = get_format;
+    }
+
+    if ((ret = avcodec_open2(dec_ctx, dec_codec, NULL)) < 0) {
+        fprintf(stderr, "Failed to open decoder\n");
+        goto fail;
+    }
+    return 0;
+fail:
+    avcodec_free_context(&input->dec_ctx);
+    return ret;
+}
+
+void free_input(InputContext **input) {
+    InputContext *in = *input;
+
+    if (!in)
+        return;
+    avcodec_free_context(&in->dec_ctx);
+    avformat_close_input(&in->ifmt_ctx);
+    av_free(in->in_filename);
+    av_freep(input);
+}
+
+// closes the inputs from index from on
+static void close_inputs_from(HMContext *ctx, int from) {
+    while (ctx->nb_inputs > from)
+        free_input(&ctx->inputs[--ctx->nb_inputs]);
+}
+
+/**
+ * - hands out the open input of in_filename and removes it from ctx, NULL
+ * when there is none or the file changed since it was opened
+ * - the caller owns the input until it gives it back with put_input
+ */
+InputContext *take_input(HMContext *ctx, const char *in_filename) {
+    int64_t mtime, size;
+
+    hm_ctx_expire_inputs(ctx);
+    for (int i = 0; i < ctx->nb_inputs; i++) {
+        InputContext *input = ctx->inputs[i];
+        if (strcmp(input->in_filename, in_filename) != 0)
+            continue;
+
+        memmove(&ctx->inputs[i], &ctx->inputs[i + 1],
+                (ctx->nb_inputs - i - 1) * sizeof(*ctx->inputs));
+        ctx->nb_inputs--;
+
+        stat_input(in_filename, &mtime, &size);
+        if (mtime != input->mtime || size != input->size || mtime < 0) {
+            free_input(&input);
+            return NULL;
+        }
+        return input;
+    }
+    return NULL;
+}
+
+// keeps input open as the most recently used one, the least recently used
+// inputs over max_inputs are closed
+void put_input(HMContext *ctx, InputContext *input) {
+    if (ctx->max_inputs <= 0) {
+        free_input(&input);
+        return;
+    }
+
+    close_inputs_from(ctx, ctx->max_inputs - 1);
+    memmove(&ctx->inputs[1], &ctx->inputs[0],
+            ctx->nb_inputs * sizeof(*ctx->inputs));
+    ctx->inputs[0] = input;
+    ctx->nb_inputs++;
+    input->last_used = av_gettime_relative();
+}
+
+// caps the open inputs to max_inputs and closes inputs unused for
+// idle_timeout microseconds
+void hm_ctx_set_input_cache(HMContext *ctx, int max_inputs,
+                            int64_t idle_timeout) {
+    ctx->max_inputs = av_clip(max_inputs, 0, HM_MAX_INPUTS);
+    ctx->input_idle_timeout = FFMAX(idle_timeout, 0);
+    close_inputs_from(ctx, ctx->max_inputs);
+    hm_ctx_expire_inputs(ctx);
+}
+
+// closes inputs that were unused for longer than the idle timeout
+void hm_ctx_expire_inputs(HMContext *ctx) {
+    int64_t now = av_gettime_relative();
+    int i;
+
+    // most recently used first, everything after the first expired one is
+    // expired too
+    for (i = 0; i < ctx->nb_inputs; i++) {
+        if (now - ctx->inputs[i]->last_used > ctx->input_idle_timeout)
+            break;
+    }
+    close_inputs_from(ctx, i);
+}
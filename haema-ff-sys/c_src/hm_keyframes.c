@@ -0,0 +1,134 @@
+/*
+ * Haema Keyframes
+ * Copyright (c) 2025 Hajin Chung <hajinchung1@gmail.com>
+ * Don't know what to say here
+ * just do whatever you want with this code
+ *
+ * Haema Keyframes is binary + library for listing keyframes of the best
+ * video stream. packets are only demuxed, nothing is decoded.
+ */
+#include <stdio.h>
+
+#include <libavformat/avformat.h>
+
+#include "include/hm_keyframes.h"
+
+/**
+ * - keyframes is set to an array of nb_keyframes entries in the order they
+ * appear in the file, free it with hm_free_buffer
+ * - pts of keyframes use the same timeline as start of hm_transcode_segment
+ * - returns negative AVERROR on failure
+ */
+int hm_keyframes(const char *in_filename, HMKeyframe **keyframes,
+                 int *nb_keyframes) {
+    AVFormatContext *ifmt_ctx = NULL;
+    AVPacket *pkt = NULL;
+    HMKeyframe *kfs = NULL;
+    int nb_kfs = 0, cap = 0;
+    int ret;
+
+    *keyframes = NULL;
+    *nb_keyframes = 0;
+
+    if ((ret = avformat_open_input(&ifmt_ctx, in_filename, 0, 0)) < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", in_filename);
+        return ret;
+    }
+
+    if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        goto end;
+    }
+
+    if ((ret = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL,
+                                   0)) < 0) {
+        fprintf(stderr, "Could not find a video stream in input file '%s'\n",
+                in_filename);
+        goto end;
+    }
+    int vs_idx = ret;
+    AVStream *vs = ifmt_ctx->streams[vs_idx];
+
+    // let the demuxer skip everything but the video stream
+    for (unsigned int i = 0; i < ifmt_ctx->nb_streams; i++) {
+        if ((int)i != vs_idx)
+            ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    // same arithmetic as hm_transcode_segment so keyframe starts land exactly
+    // on the keyframe there
+    int64_t stream_start_ts =
+        av_rescale_q(vs->start_time, vs->time_base, AV_TIME_BASE_Q);
+
+    pkt = av_packet_alloc();
+    if (!pkt) {
+        fprintf(stderr, "Could not allocate AVPacket\n");
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while ((ret = av_read_frame(ifmt_ctx, pkt)) >= 0) {
+        if (pkt->stream_index != vs_idx) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        if ((pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE) {
+            if (nb_kfs == cap) {
+                cap = cap ? cap * 2 : 256;
+                HMKeyframe *grown =
+                    av_realloc_array(kfs, cap, sizeof(HMKeyframe));
+                if (!grown) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                kfs = grown;
+            }
+            kfs[nb_kfs].pts =
+                av_rescale_q(pkt->pts, vs->time_base, AV_TIME_BASE_Q) -
+                stream_start_ts;
+            kfs[nb_kfs].pos = pkt->pos;
+            kfs[nb_kfs].gop_size = 0;
+            nb_kfs++;
+        }
+        if (nb_kfs > 0)
+            kfs[nb_kfs - 1].gop_size++;
+        av_packet_unref(pkt);
+    }
+
+    if (ret != AVERROR_EOF) {
+        fprintf(stderr, "Failed reading packets of '%s': %s\n", in_filename,
+                av_err2str(ret));
+        goto end;
+    }
+
+    *keyframes = kfs;
+    *nb_keyframes = nb_kfs;
+    kfs = NULL;
+    ret = 0;
+end:
+    av_free(kfs);
+    av_packet_free(&pkt);
+    avformat_close_input(&ifmt_ctx);
+    return ret;
+}
+
+#if 0
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <input file>\n", argv[0]);
+        return 1;
+    }
+
+    HMKeyframe *keyframes = NULL;
+    int nb_keyframes = 0;
+    if (hm_keyframes(argv[1], &keyframes, &nb_keyframes) < 0)
+        return 1;
+    for (int i = 0; i < nb_keyframes; i++) {
+        printf("%ld %ld %d\n", keyframes[i].pts, keyframes[i].pos,
+               keyframes[i].gop_size);
+    }
+    av_free(keyframes);
+    return 0;
+}
+#endif
@@ -5,41 +5,72 @@
  * just do whatever you want with this code
  *
  * Haema Probe is binary + library for correctly getting total duration of best
- * video stream.
+ * video stream along with its codecs, size and frame rate.
  */
 #include <stdio.h>
+#include <string.h>
 
+#include "include/hm_probe.h"
 #include "include/hm_util.h"
 
-double hm_probe(const char *in_filename) {
+/**
+ * - fills info with everything the server needs to know about in_filename,
+ * one probe is meant to be cached for as long as the file doesn't change
+ * - returns negative AVERROR on failure
+ */
+int hm_probe(const char *in_filename, HMProbeInfo *info) {
     AVFormatContext *ifmt_ctx = NULL;
     AVStream *vs = NULL;
-    int vs_idx;
     int ret;
 
+    memset(info, 0, sizeof(*info));
+
     if ((ret = avformat_open_input(&ifmt_ctx, in_filename, 0, 0)) < 0) {
         fprintf(stderr, "Could not open input file '%s'\n", in_filename);
-        return 0;
+        return ret;
     }
 
     if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
         fprintf(stderr, "Failed to retrieve input stream information\n");
-        return 0;
+        goto end;
     }
-    
+
     if ((ret = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
         fprintf(stderr, "Could not find a video stream in input file '%s'\n", in_filename);
-        return 0;
+        goto end;
     }
-    vs_idx = ret;
-    vs = ifmt_ctx->streams[vs_idx];
-    
-    int64_t duration_vstb = vs->duration;
-    int64_t duration_ts = av_rescale_q(duration_vstb, vs->time_base, AV_TIME_BASE_Q);
-    double duration_s = (double)duration_ts / AV_TIME_BASE;
+    vs = ifmt_ctx->streams[ret];
+
+    if (vs->duration != AV_NOPTS_VALUE)
+        info->duration = vs->duration * av_q2d(vs->time_base);
+    else if (ifmt_ctx->duration != AV_NOPTS_VALUE)
+        info->duration = (double)ifmt_ctx->duration / AV_TIME_BASE;
+    if (vs->start_time != AV_NOPTS_VALUE)
+        info->start_time = vs->start_time * av_q2d(vs->time_base);
+
+    snprintf(info->video_codec, sizeof(info->video_codec), "%s",
+             avcodec_get_name(vs->codecpar->codec_id));
+    info->width = vs->codecpar->width;
+    info->height = vs->codecpar->height;
+    AVRational frame_rate = av_guess_frame_rate(ifmt_ctx, vs, NULL);
+    if (frame_rate.num > 0 && frame_rate.den > 0)
+        info->frame_rate = av_q2d(frame_rate);
 
+    for (unsigned int i = 0; i < ifmt_ctx->nb_streams; i++) {
+        if (ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+            info->nb_audio_tracks++;
+    }
+    ret = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (ret >= 0) {
+        snprintf(info->audio_codec, sizeof(info->audio_codec), "%s",
+                 avcodec_get_name(ifmt_ctx->streams[ret]->codecpar->codec_id));
+    }
+
+    info->bit_rate = FFMAX(ifmt_ctx->bit_rate, 0);
+    ret = 0;
+end:
     avformat_close_input(&ifmt_ctx);
-    return duration_s;
+    return ret;
 }
 
 #if 0
@@ -50,8 +81,10 @@ int main(int argc, char **argv) {
     } 
 
     const char *in_filename = argv[1];
-    float ret = hm_probe(in_filename);
-    printf("%lf\n", ret);
+    HMProbeInfo info;
+    if (hm_probe(in_filename, &info) < 0)
+        return 1;
+    printf("%lf\n", info.duration);
     return 0;
 }
 #endif
@@ -7,251 +7,617 @@
  * Haema Transcode is binary + library for correctly segmenting and transcoding
  * parts of a large video very fast.
  *
- * Currently utilizes intel's qsv hardware accelerated codecs.
+ * Runs on intel's qsv or vaapi hardware accelerated codecs and falls back to
+ * multi-threaded software codecs when no hardware is available.
  * timestamps of source video are preserved in segmented output.
  */
 
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <libavcodec/packet.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
 #include <libavformat/avio.h>
 #include <libavutil/avutil.h>
 #include <libavutil/opt.h>
 #include <libavutil/mathematics.h>
+#include <libavutil/pixdesc.h>
 
 #include "include/hm_context.h"
+#include "include/hm_transcode.h"
 #include "include/hm_util.h"
 
 const int OUT_VIDEO_STREAM_INDEX = 0;
 const int OUT_AUDIO_STREAM_INDEX = 1;
 
-int get_format(AVCodecContext *avctx, const enum AVPixelFormat *pix_fmts) {
-    while (*pix_fmts != AV_PIX_FMT_NONE) {
-        if (*pix_fmts == AV_PIX_FMT_QSV) {
-            return AV_PIX_FMT_QSV;
-        }
-
-        pix_fmts++;
+// whole ts packets are handed to write_packet
+#define OUTPUT_IO_BUFFER_SIZE (188 * 256)
+#define MIN_OUTPUT_BUFFER_SIZE (1 << 16)
+
+// a fragment per keyframe, tfdt is taken from the packets instead of
+// counting from 0 and the moov is written up front with no samples
+#define FMP4_MOVFLAGS                                                          \
+    "+cmaf+empty_moov+default_base_moof+frag_keyframe+frag_discont+skip_trailer"
+// b-frames put the first decode timestamps before the source's start, every
+// fmp4 output is shifted by the same amount to keep tfdt positive
+#define FMP4_TS_OFFSET AV_TIME_BASE
+// encoded video a session holds back past a cut while audio catches up, a
+// source whose audio ends early or is sparse is cut on video alone after it
+#define SESSION_MAX_AUDIO_LAG (2 * AV_TIME_BASE)
+
+static int output_buffer_write(void *opaque, const uint8_t *buf, int buf_size) {
+    OutputBuffer *out = opaque;
+
+    if (out->size + buf_size > out->capacity) {
+        // the hint was too small, grow like a dyn buf would
+        int64_t capacity = FFMAX(out->capacity * 2, out->size + buf_size);
+        if (capacity > INT_MAX)
+            return AVERROR(ENOMEM);
+        uint8_t *data = av_realloc(out->data, capacity);
+        if (!data)
+            return AVERROR(ENOMEM);
+        out->data = data;
+        out->capacity = capacity;
     }
-
-    fprintf(stderr, "The QSV pixel format not offered in get_format()\n");
-
-    return AV_PIX_FMT_NONE;
+    memcpy(out->data + out->size, buf, buf_size);
+    out->size += buf_size;
+    return buf_size;
 }
 
-AVCodecContext *config_dec_ctx(AVStream *stream, AVFormatContext *ifmt_ctx,
-                               AVBufferRef *hw_device_ctx) {
-    int ret;
-    const AVCodec *dec_codec = find_qsv_decoder(stream->codecpar->codec_id);
-    if (!dec_codec) {
-        fprintf(stderr, "Failed to find decoder\n");
-        return NULL;
+int open_output_io(OutputContext *out) {
+    if (!out->write_packet) {
+        int64_t capacity = FFMIN(
+            FFMAX(out->output_size_hint, MIN_OUTPUT_BUFFER_SIZE), INT_MAX);
+        out->output.data = av_malloc(capacity);
+        if (!out->output.data)
+            return AVERROR(ENOMEM);
+        out->output.size = 0;
+        out->output.capacity = capacity;
+        out->write_packet = output_buffer_write;
+        out->write_opaque = &out->output;
     }
 
-    AVCodecContext *dec_ctx = avcodec_alloc_context3(dec_codec);
-    if (!dec_ctx) {
-        fprintf(stderr, "Failed to allocate decoder context");
-        return NULL;
+    uint8_t *buffer = av_malloc(OUTPUT_IO_BUFFER_SIZE);
+    if (!buffer)
+        return AVERROR(ENOMEM);
+    out->ofmt_ctx->pb =
+        avio_alloc_context(buffer, OUTPUT_IO_BUFFER_SIZE, 1, out->write_opaque,
+                           NULL, out->write_packet, NULL);
+    if (!out->ofmt_ctx->pb) {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
     }
+    return 0;
+}
 
-    ret = avcodec_parameters_to_context(dec_ctx, stream->codecpar);
-    if (ret < 0) {
-        fprintf(stderr,
-                "Failed to copy decoder params to input decoder context");
-        return NULL;
-    }
+// checks that everything reached write_packet and hands a buffered output to
+// output_buffer
+int close_output_io(OutputContext *out) {
+    AVIOContext *pb = out->ofmt_ctx->pb;
+    int ret;
 
-    dec_ctx->pkt_timebase = stream->time_base;
-    dec_ctx->framerate = av_guess_frame_rate(ifmt_ctx, stream, NULL);
-    dec_ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
-    if (!dec_ctx->hw_device_ctx) {
-        fprintf(stderr, "A hardware device reference create failed\n");
-        return NULL;
+    avio_flush(pb);
+    ret = pb->error;
+    av_freep(&pb->buffer);
+    avio_context_free(&out->ofmt_ctx->pb);
+    if (ret < 0 || !out->output.data)
+        return ret;
+
+    OutputBuffer *buf = &out->output;
+    // give back a badly overestimated tail, shrinking is usually in place
+    if (buf->capacity - buf->size > buf->size / 4) {
+        uint8_t *data = av_realloc(buf->data, FFMAX(buf->size, 1));
+        if (data)
+            buf->data = data;
     }
-    dec_ctx->get_format = get_format;
+    *out->output_buffer = buf->data;
+    *out->output_size = (int)buf->size;
+    buf->data = NULL;
+    return 0;
+}
 
-    if ((ret = avcodec_open2(dec_ctx, dec_codec, NULL)) < 0) {
-        fprintf(stderr, "Failed to open decoder\n");
-        return NULL;
+void free_output_io(OutputContext *out) {
+    if (out->ofmt_ctx && out->ofmt_ctx->pb) {
+        av_freep(&out->ofmt_ctx->pb->buffer);
+        avio_context_free(&out->ofmt_ctx->pb);
     }
+    av_freep(&out->output.data);
+}
 
-    return dec_ctx;
+void free_output(OutputContext *out) {
+    free_output_io(out);
+    avformat_free_context(out->ofmt_ctx);
+    out->ofmt_ctx = NULL;
+    avfilter_graph_free(&out->filter_graph);
+    avcodec_free_context(&out->enc_ctx);
 }
 
-int config_input(TranscodeContext *tctx) {
+// muxer of out->format, segments muxed one by one get the same fmp4 header
+// and timeline
+static int alloc_output_format(OutputContext *out) {
+    const char *format_name =
+        out->format == HM_FORMAT_FMP4 ? "mp4" : "mpegts";
     int ret;
-    tctx->ifmt_ctx = NULL;
-    if ((ret = avformat_open_input(&tctx->ifmt_ctx, tctx->in_filename, 0, 0)) <
-        0) {
-        fprintf(stderr, "Could not open input filename '%s'\n",
-                tctx->in_filename);
-        return ret;
-    }
 
-    if ((ret = avformat_find_stream_info(tctx->ifmt_ctx, 0)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information\n");
-        return ret;
+    out->ofmt_ctx = NULL;
+    if ((ret = avformat_alloc_output_context2(&out->ofmt_ctx, NULL,
+                                              format_name, NULL)) < 0 ||
+        !out->ofmt_ctx) {
+        fprintf(stderr, "Could not create %s output context\n", format_name);
+        return ret < 0 ? ret : -1;
     }
+    if (out->format != HM_FORMAT_FMP4)
+        return 0;
 
-    if ((ret = av_find_best_stream(tctx->ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1,
-                                   NULL, 0)) < 0) {
-        fprintf(stderr, "Cannot find a video stream in input file: %s\n",
-                av_err2str(ret));
+    // no creation time or muxer version in the moov
+    out->ofmt_ctx->flags |= AVFMT_FLAG_BITEXACT;
+    // shifting every segment to zero on its own would break the timeline
+    out->ofmt_ctx->avoid_negative_ts = AVFMT_AVOID_NEG_TS_DISABLED;
+    out->ofmt_ctx->output_ts_offset = FMP4_TS_OFFSET;
+    if ((ret = av_opt_set(out->ofmt_ctx->priv_data, "movflags", FMP4_MOVFLAGS,
+                          0)) < 0 ||
+        (ret = av_opt_set_int(out->ofmt_ctx->priv_data, "use_editlist", 0,
+                              0)) < 0) {
+        fprintf(stderr, "Failed to set fmp4 options: %s\n", av_err2str(ret));
         return ret;
     }
-    tctx->in_video_stream_index = ret;
-    tctx->in_video_stream = tctx->ifmt_ctx->streams[ret];
-
-    tctx->dec_ctx = config_dec_ctx(tctx->in_video_stream, tctx->ifmt_ctx,
-                                   tctx->hw_device_ctx);
-    if (tctx->dec_ctx == NULL) {
-        fprintf(stderr, "Failed to config decoder context for video stream\n");
-        return -1;
-    }
+    return 0;
+}
 
-    if ((ret = av_find_best_stream(tctx->ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1,
-                                   NULL, 0)) < 0) {
-        fprintf(stderr, "Cannot find a audio stream in input file: %s\n",
-                av_err2str(ret));
-        return ret;
-    }
-    tctx->in_audio_stream_index = ret;
-    tctx->in_audio_stream = tctx->ifmt_ctx->streams[ret];
+// players want parameter sets in hvc1's sample entry, the default hev1 is
+// not accepted by every hls player
+static void set_output_video_tag(OutputContext *out) {
+    AVCodecParameters *par = out->out_video_stream->codecpar;
 
-    return 0;
+    par->codec_tag = 0;
+    if (out->format == HM_FORMAT_FMP4 && par->codec_id == AV_CODEC_ID_HEVC)
+        par->codec_tag = MKTAG('h', 'v', 'c', '1');
 }
 
-int config_output(TranscodeContext *tctx, const char *encoder_name) {
+// muxer and streams of out, the video stream is filled in once the encoder
+// is open
+int config_output_format(TranscodeContext *tctx, OutputContext *out,
+                         const AVCodec *enc_codec) {
     AVStream *out_video_stream, *out_audio_stream;
     int ret;
 
-    tctx->ofmt_ctx = NULL;
-
-    const AVOutputFormat *mpegts_ofmt =
-        av_guess_format(NULL, NULL, "video/MP2T");
-    if (mpegts_ofmt == NULL) {
-        fprintf(stderr, "Failed guessing mpegts format\n");
-        return -1;
-    }
-
-    if ((ret = avformat_alloc_output_context2(&tctx->ofmt_ctx, mpegts_ofmt,
-                                              NULL, NULL)) < 0 ||
-        !tctx->ofmt_ctx) {
-        fprintf(stderr, "Could not create output context\n");
+    if ((ret = alloc_output_format(out)) < 0)
         return ret;
-    }
-
-    const AVCodec *enc_codec = avcodec_find_encoder_by_name(encoder_name);
-    if (!enc_codec) {
-        fprintf(stderr, "Could not find encoder: %s\n", encoder_name);
-        return -1;
-    }
-    tctx->enc_ctx = avcodec_alloc_context3(enc_codec);
-    if (tctx->enc_ctx == NULL) {
-        fprintf(stderr, "Failed to configure encoder context\n");
-        return -1;
-    }
 
     // config output video stream
-    out_video_stream = avformat_new_stream(tctx->ofmt_ctx, enc_codec);
+    out_video_stream = avformat_new_stream(out->ofmt_ctx, enc_codec);
     if (!out_video_stream) {
         fprintf(stderr, "Failed allocating output video stream\n");
         return -1;
     }
-    tctx->out_video_stream = out_video_stream;
+    out->out_video_stream = out_video_stream;
 
     // config output audio stream
-    out_audio_stream = avformat_new_stream(tctx->ofmt_ctx, NULL);
+    out_audio_stream = avformat_new_stream(out->ofmt_ctx, NULL);
     if (!out_audio_stream) {
         fprintf(stderr, "Failed allocating output video stream\n");
         return -1;
     }
-    tctx->out_audio_stream = out_audio_stream;
+    out->out_audio_stream = out_audio_stream;
 
     ret = avcodec_parameters_copy(out_audio_stream->codecpar,
-                                  tctx->in_audio_stream->codecpar);
+                                  tctx->input->in_audio_stream->codecpar);
     if (ret < 0) {
         fprintf(stderr, "Failed to copy audio stream codec params\n");
         return ret;
     }
     out_audio_stream->codecpar->codec_tag = 0;
-    out_audio_stream->time_base = tctx->in_audio_stream->time_base;
+    out_audio_stream->time_base = tctx->input->in_audio_stream->time_base;
 
-    if ((ret = avio_open_dyn_buf(&tctx->ofmt_ctx->pb)) < 0) {
+    if ((ret = open_output_io(out)) < 0) {
         fprintf(stderr, "Cannot open output file: %s\n", av_err2str(ret));
         return ret;
     }
-
     return 0;
 }
 
-int config_enc(TranscodeContext *tctx) {
-    AVCodecContext *enc_ctx = tctx->enc_ctx;
-    AVCodecContext *dec_ctx = tctx->dec_ctx;
+int config_output(TranscodeContext *tctx, OutputContext *out) {
+    const AVCodec *enc_codec =
+        find_backend_encoder(tctx->input->backend, out->encoder_name);
+    if (!enc_codec) {
+        fprintf(stderr, "Could not find %s encoder: %s\n",
+                hm_backend_name(tctx->input->backend), out->encoder_name);
+        return -1;
+    }
+    out->enc_ctx = avcodec_alloc_context3(enc_codec);
+    if (out->enc_ctx == NULL) {
+        fprintf(stderr, "Failed to configure encoder context\n");
+        return -1;
+    }
+
+    return config_output_format(tctx, out, enc_codec);
+}
+
+// output of stream copied segments, no encoder involved so the header is
+// written right away
+int config_remux_output(TranscodeContext *tctx, OutputContext *out) {
+    AVStream *out_video_stream, *out_audio_stream;
     int ret;
 
-    enc_ctx->hw_frames_ctx = av_buffer_ref(dec_ctx->hw_frames_ctx);
-    if (!enc_ctx->hw_frames_ctx) {
-        fprintf(stderr, "Failed to reference decoder context hw_frames_ctx\n");
+    if ((ret = alloc_output_format(out)) < 0)
+        return ret;
+
+    out_video_stream = avformat_new_stream(out->ofmt_ctx, NULL);
+    out_audio_stream = avformat_new_stream(out->ofmt_ctx, NULL);
+    if (!out_video_stream || !out_audio_stream) {
+        fprintf(stderr, "Failed allocating output streams\n");
         return -1;
     }
+    out->out_video_stream = out_video_stream;
+    out->out_audio_stream = out_audio_stream;
+
+    if ((ret = avcodec_parameters_copy(out_video_stream->codecpar,
+                                       tctx->input->in_video_stream->codecpar)) < 0 ||
+        (ret = avcodec_parameters_copy(out_audio_stream->codecpar,
+                                       tctx->input->in_audio_stream->codecpar)) < 0) {
+        fprintf(stderr, "Failed to copy stream codec params\n");
+        return ret;
+    }
+    // the source's tags may not fit the output, the muxer picks its own and
+    // inserts the bitstream filters it needs
+    set_output_video_tag(out);
+    out_audio_stream->codecpar->codec_tag = 0;
+    out_video_stream->time_base = tctx->input->in_video_stream->time_base;
+    out_audio_stream->time_base = tctx->input->in_audio_stream->time_base;
 
-    enc_ctx->time_base = dec_ctx->pkt_timebase;
-    enc_ctx->framerate = dec_ctx->framerate;
-    enc_ctx->pix_fmt = AV_PIX_FMT_QSV;
-
-    // TODO: variable out video dimensions
-    enc_ctx->width = dec_ctx->width;
-    enc_ctx->height = dec_ctx->height;
+    if ((ret = open_output_io(out)) < 0) {
+        fprintf(stderr, "Cannot open output file: %s\n", av_err2str(ret));
+        return ret;
+    }
 
-    // TODO: handle encoder options
-    if ((ret = av_opt_set(enc_ctx->priv_data, "preset", "veryslow", 0)) < 0) {
-        fprintf(stderr, "Failed to set preset to slower: %s\n", av_err2str(ret));
+    if ((ret = avformat_write_header(out->ofmt_ctx, NULL)) < 0) {
+        fprintf(stderr, "Error while writing stream header: %s\n",
+                av_err2str(ret));
         return ret;
     }
+    // a streamed fmp4 output hands its init segment out before the first
+    // fragment is done
+    avio_flush(out->ofmt_ctx->pb);
 
-    if ((ret = avcodec_open2(enc_ctx, enc_ctx->codec, NULL)) < 0) {
-        fprintf(stderr, "Failed to open encode codec: %s\n", av_err2str(ret));
+    return 0;
+}
+
+// byte seek to the keyframe at seek_pos when the format allows it, otherwise
+// seek backward to the keyframe before start_ts
+void seek_input(TranscodeContext *tctx, int64_t start_ts, int64_t seek_pos) {
+    int ret = -1;
+    if (seek_pos >= 0 &&
+        !(tctx->input->ifmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+        ret = avformat_seek_file(tctx->input->ifmt_ctx, -1, seek_pos, seek_pos,
+                                 seek_pos, AVSEEK_FLAG_BYTE);
+    }
+    if (ret < 0) {
+        // seek based on video stream
+        int64_t start_ts_vtb = av_rescale_q(start_ts, AV_TIME_BASE_Q,
+                                            tctx->input->in_video_stream->time_base);
+        avformat_seek_file(tctx->input->ifmt_ctx, tctx->input->in_video_stream_index,
+                           INT64_MIN, start_ts_vtb, start_ts_vtb,
+                           AVSEEK_FLAG_BACKWARD);
+    }
+}
+
+// rescale a packet of in_stream into out_stream and hand it to the muxer
+int write_copied_packet(OutputContext *out, AVPacket *pkt, AVStream *in_stream,
+                        AVStream *out_stream) {
+    pkt->stream_index = out_stream->index;
+    pkt->pos = -1;
+    av_packet_rescale_ts(pkt, in_stream->time_base, out_stream->time_base);
+    return av_interleaved_write_frame(out->ofmt_ctx, pkt);
+}
+
+// muxes the input audio packet pkt into out through tmp. with keep set a new
+// reference goes to the muxer and pkt stays valid for the other outputs,
+// otherwise pkt is moved and blank afterwards, which allocates nothing
+int write_audio_packet(TranscodeContext *tctx, OutputContext *out,
+                       AVPacket *tmp, AVPacket *pkt, int keep) {
+    int ret;
+
+    if (!keep)
+        av_packet_move_ref(tmp, pkt);
+    else if ((ret = av_packet_ref(tmp, pkt)) < 0)
         return ret;
+    ret = write_copied_packet(out, tmp, tctx->input->in_audio_stream,
+                              out->out_audio_stream);
+    stats_charge(tctx, HM_STAGE_MUX);
+    return ret;
+}
+
+void hm_encoder_options_init(HMEncoderOptions *opts, HMEncoderProfile profile) {
+    *opts = (HMEncoderOptions){
+        .profile = profile,
+        .quality = -1,
+        .gop_size = -1,
+        .lookahead = -1,
+        .b_frames = -1,
+    };
+}
+
+// a segment a player waits on has to be done well within its duration, the
+// quality presets are several times slower
+static const char *profile_preset(HMBackend backend, HMEncoderProfile profile) {
+    switch (backend) {
+    case HM_BACKEND_QSV:
+        return profile == HM_PROFILE_QUALITY ? "veryslow" : "veryfast";
+    case HM_BACKEND_SW:
+        return profile == HM_PROFILE_QUALITY ? "slow" : "veryfast";
+    default:
+        // vaapi encoders have no preset option
+        return NULL;
+    }
+}
+
+// encoders name the same option differently, the first name the encoder
+// has is set
+static int set_encoder_int(AVCodecContext *enc_ctx, const char *const *names,
+                           int64_t val) {
+    for (; *names; names++) {
+        if (av_opt_set_int(enc_ctx, *names, val, AV_OPT_SEARCH_CHILDREN) >= 0)
+            return 0;
+    }
+    return AVERROR_OPTION_NOT_FOUND;
+}
+
+static void set_encoder_str(AVCodecContext *enc_ctx, const char *name,
+                            const char *val) {
+    int ret;
+
+    // not every encoder names its presets and tunes like x264
+    if ((ret = av_opt_set(enc_ctx->priv_data, name, val, 0)) < 0)
+        fprintf(stderr, "Failed to set %s to %s, using default: %s\n", name,
+                val, av_err2str(ret));
+}
+
+// applies the options of out to its encoder before it is opened
+static void set_encoder_options(TranscodeContext *tctx, OutputContext *out) {
+    static const char *const crf_names[] = {"crf", NULL};
+    static const char *const lookahead_names[] = {"rc-lookahead",
+                                                  "look_ahead_depth", NULL};
+    AVCodecContext *enc_ctx = out->enc_ctx;
+    HMBackend backend = tctx->input->backend;
+    const HMEncoderOptions *opts = out->enc_opts;
+    HMEncoderOptions defaults;
+
+    if (!opts) {
+        hm_encoder_options_init(&defaults, HM_PROFILE_LATENCY);
+        opts = &defaults;
+    }
+
+    // the latency profile holds no frame back: no b-frames, no lookahead
+    // and x264's zerolatency tune. options that are set win
+    int latency = opts->profile == HM_PROFILE_LATENCY;
+    const char *preset =
+        opts->preset ? opts->preset : profile_preset(backend, opts->profile);
+    if (preset)
+        set_encoder_str(enc_ctx, "preset", preset);
+    if (opts->tune)
+        set_encoder_str(enc_ctx, "tune", opts->tune);
+    else if (latency && backend == HM_BACKEND_SW)
+        // encoders without the tune keep their default quietly
+        av_opt_set(enc_ctx->priv_data, "tune", "zerolatency", 0);
+
+    if (opts->bit_rate > 0) {
+        enc_ctx->bit_rate = opts->bit_rate;
+    } else if (opts->quality >= 0) {
+        if (backend != HM_BACKEND_SW)
+            enc_ctx->global_quality = opts->quality;
+        else if (set_encoder_int(enc_ctx, crf_names, opts->quality) < 0)
+            fprintf(stderr, "Encoder has no constant quality, using default\n");
+    }
+    if (opts->max_rate > 0) {
+        // rc_buffer_size is an int, the rate is clamped before it is doubled
+        int64_t buffer_rate = FFMIN(opts->max_rate, INT_MAX / 2);
+        enc_ctx->rc_max_rate = opts->max_rate;
+        enc_ctx->rc_buffer_size = (int)(buffer_rate * 2);
+    }
+
+    if (opts->gop_size >= 0)
+        enc_ctx->gop_size = opts->gop_size;
+    if (opts->b_frames >= 0)
+        enc_ctx->max_b_frames = opts->b_frames;
+    else if (latency)
+        enc_ctx->max_b_frames = 0;
+    if (opts->lookahead >= 0) {
+        if (set_encoder_int(enc_ctx, lookahead_names, opts->lookahead) < 0)
+            fprintf(stderr, "Encoder has no lookahead, using default\n");
+    } else if (latency) {
+        set_encoder_int(enc_ctx, lookahead_names, 0);
+    }
+}
+
+static const char *backend_scale_filter(HMBackend backend) {
+    switch (backend) {
+    case HM_BACKEND_QSV:
+        return "scale_qsv";
+    case HM_BACKEND_VAAPI:
+        return "scale_vaapi";
+    default:
+        return "scale";
+    }
+}
+
+/**
+ * - builds buffer -> scaler -> buffersink for frames like frame when
+ * out_height of out asks for a smaller picture
+ * - hardware frames stay on the device and are scaled by the backend's
+ * scaler, software frames go through swscale
+ * - width follows the source aspect ratio rounded to an even number
+ */
+int config_scaler(TranscodeContext *tctx, OutputContext *out,
+                  const AVFrame *frame) {
+    AVCodecContext *dec_ctx = tctx->input->dec_ctx;
+    AVFilterInOut *outputs = NULL, *inputs = NULL;
+    char args[512], desc[128];
+    int ret;
+
+    if (out->out_height <= 0 || out->out_height >= frame->height)
+        return 0;
+
+    int height = out->out_height & ~1;
+    int width = (int)av_rescale(frame->width, height, frame->height);
+    width += width & 1;
+
+    out->filter_graph = avfilter_graph_alloc();
+    outputs = avfilter_inout_alloc();
+    inputs = avfilter_inout_alloc();
+    if (!out->filter_graph || !outputs || !inputs) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    out->filter_graph->nb_threads = tctx->threads;
+
+    snprintf(args, sizeof(args),
+             "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+             frame->width, frame->height, frame->format,
+             dec_ctx->pkt_timebase.num, dec_ctx->pkt_timebase.den,
+             FFMAX(frame->sample_aspect_ratio.num, 0),
+             FFMAX(frame->sample_aspect_ratio.den, 1));
+    if ((ret = avfilter_graph_create_filter(
+             &out->buffersrc_ctx, avfilter_get_by_name("buffer"), "in", args,
+             NULL, out->filter_graph)) < 0) {
+        fprintf(stderr, "Cannot create buffer source\n");
+        goto end;
+    }
+
+    if (frame->hw_frames_ctx) {
+        AVBufferSrcParameters *par = av_buffersrc_parameters_alloc();
+        if (!par) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        par->hw_frames_ctx = frame->hw_frames_ctx;
+        ret = av_buffersrc_parameters_set(out->buffersrc_ctx, par);
+        av_free(par);
+        if (ret < 0) {
+            fprintf(stderr, "Cannot pass hw frames to buffer source\n");
+            goto end;
+        }
+    }
+
+    if ((ret = avfilter_graph_create_filter(
+             &out->buffersink_ctx, avfilter_get_by_name("buffersink"), "out",
+             NULL, NULL, out->filter_graph)) < 0) {
+        fprintf(stderr, "Cannot create buffer sink\n");
+        goto end;
     }
 
-    tctx->out_video_stream->time_base = enc_ctx->time_base;
-    ret = avcodec_parameters_from_context(tctx->out_video_stream->codecpar,
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = out->buffersrc_ctx;
+    outputs->pad_idx = 0;
+    outputs->next = NULL;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = out->buffersink_ctx;
+    inputs->pad_idx = 0;
+    inputs->next = NULL;
+
+    snprintf(desc, sizeof(desc), "%s=w=%d:h=%d",
+             backend_scale_filter(tctx->input->backend), width, height);
+    if ((ret = avfilter_graph_parse_ptr(out->filter_graph, desc, &inputs,
+                                        &outputs, NULL)) < 0) {
+        fprintf(stderr, "Failed to parse filter graph %s\n", desc);
+        goto end;
+    }
+
+    if ((ret = avfilter_graph_config(out->filter_graph, NULL)) < 0) {
+        fprintf(stderr, "Failed to configure filter graph %s: %s\n", desc,
+                av_err2str(ret));
+        goto end;
+    }
+
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return ret;
+}
+
+// takes the video stream parameters from the open encoder
+int write_output_header(OutputContext *out) {
+    AVCodecContext *enc_ctx = out->enc_ctx;
+    int ret;
+
+    out->out_video_stream->time_base = enc_ctx->time_base;
+    ret = avcodec_parameters_from_context(out->out_video_stream->codecpar,
                                           enc_ctx);
     if (ret < 0) {
         fprintf(stderr, "Failed to copy codec parameters to stream\n");
         return ret;
     }
+    set_output_video_tag(out);
 
-    if ((ret = avformat_write_header(tctx->ofmt_ctx, NULL)) < 0) {
+    if ((ret = avformat_write_header(out->ofmt_ctx, NULL)) < 0) {
         fprintf(stderr, "Error while writing stream header: %s\n",
                 av_err2str(ret));
         return ret;
     }
+    // a streamed fmp4 output hands its init segment out before the first
+    // fragment is done
+    avio_flush(out->ofmt_ctx->pb);
+    return 0;
+}
 
-    while (tctx->audio_pktq->len) {
-        AVPacket *pkt = packet_queue_pop(tctx->audio_pktq);
+int config_enc(TranscodeContext *tctx, OutputContext *out) {
+    AVCodecContext *enc_ctx = out->enc_ctx;
+    AVCodecContext *dec_ctx = tctx->input->dec_ctx;
+    AVFilterContext *sink = out->buffersink_ctx;
+    int ret;
 
-        pkt->stream_index = OUT_AUDIO_STREAM_INDEX;
-        pkt->pos = -1;
-        av_packet_rescale_ts(pkt, tctx->in_audio_stream->time_base,
-                             tctx->out_audio_stream->time_base);
-        // log_packet(pkt, tctx->out_audio_stream, "out");
+    // frames come out of the scaler when there is one
+    AVBufferRef *hw_frames_ctx =
+        sink ? av_buffersink_get_hw_frames_ctx(sink) : dec_ctx->hw_frames_ctx;
 
-        ret = av_interleaved_write_frame(tctx->ofmt_ctx, pkt);
-        if (ret < 0) {
-            fprintf(stderr, "Error muxing audio packet\n");
-            break;
+    if (tctx->input->backend == HM_BACKEND_SW) {
+        enc_ctx->pix_fmt = sink ? av_buffersink_get_format(sink)
+                                : dec_ctx->pix_fmt;
+        enc_ctx->thread_count = tctx->threads;
+    } else {
+        enc_ctx->hw_frames_ctx = av_buffer_ref(hw_frames_ctx);
+        if (!enc_ctx->hw_frames_ctx) {
+            fprintf(stderr, "Failed to reference hw_frames_ctx\n");
+            return -1;
         }
+        enc_ctx->pix_fmt = tctx->input->hw_pix_fmt;
     }
-    packet_queue_free(tctx->audio_pktq);
-    return 0;
+
+    enc_ctx->time_base = dec_ctx->pkt_timebase;
+    enc_ctx->framerate = dec_ctx->framerate;
+
+    if (sink) {
+        enc_ctx->width = av_buffersink_get_w(sink);
+        enc_ctx->height = av_buffersink_get_h(sink);
+        enc_ctx->sample_aspect_ratio =
+            av_buffersink_get_sample_aspect_ratio(sink);
+    } else {
+        enc_ctx->width = dec_ctx->width;
+        enc_ctx->height = dec_ctx->height;
+        enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+    }
+
+    set_encoder_options(tctx, out);
+
+    // the fmp4 init segment carries the parameter sets, they can't come in
+    // band after it was written
+    if (out->ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if ((ret = avcodec_open2(enc_ctx, enc_ctx->codec, NULL)) < 0) {
+        fprintf(stderr, "Failed to open encode codec: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    return write_output_header(out);
 }
 
-int encode_write(TranscodeContext *tctx, AVPacket *pkt, AVFrame *frame) {
-    AVCodecContext *enc_ctx = tctx->enc_ctx;
+int encode_write(TranscodeContext *tctx, OutputContext *out, AVPacket *pkt,
+                 AVFrame *frame) {
+    AVCodecContext *enc_ctx = out->enc_ctx;
     int ret = 0;
 
     av_packet_unref(pkt);
@@ -260,15 +626,27 @@ int encode_write(TranscodeContext *tctx, AVPacket *pkt, AVFrame *frame) {
         fprintf(stderr, "Error during encoding: %s\n", av_err2str(ret));
         goto encode_write_end;
     }
+    if (frame && tctx->stats)
+        tctx->stats->frames_encoded++;
     while (1) {
-        if ((ret = avcodec_receive_packet(enc_ctx, pkt)))
+        ret = avcodec_receive_packet(enc_ctx, pkt);
+        stats_charge(tctx, HM_STAGE_ENCODE);
+        if (ret)
             break;
 
+        if (out->write_video_packet) {
+            if ((ret = out->write_video_packet(out, pkt)) < 0)
+                return ret;
+            continue;
+        }
+
         pkt->stream_index = OUT_VIDEO_STREAM_INDEX;
-        // log_packet(pkt, tctx->out_video_stream, "out");
-        av_packet_rescale_ts(pkt, tctx->dec_ctx->pkt_timebase,
-                             tctx->out_video_stream->time_base);
-        if ((ret = av_interleaved_write_frame(tctx->ofmt_ctx, pkt)) < 0) {
+        // log_packet(pkt, out->out_video_stream, "out");
+        av_packet_rescale_ts(pkt, tctx->input->dec_ctx->pkt_timebase,
+                             out->out_video_stream->time_base);
+        ret = av_interleaved_write_frame(out->ofmt_ctx, pkt);
+        stats_charge(tctx, HM_STAGE_MUX);
+        if (ret < 0) {
             fprintf(stderr, "Error during writing data to output file: %s\n",
                     av_err2str(ret));
             return ret;
@@ -282,129 +660,311 @@ encode_write_end:
     return ret;
 }
 
+// pushes frame through the scaler of out and encodes what comes out, frame
+// is left untouched for the other outputs, a NULL frame flushes the scaler
+int filter_encode_write(TranscodeContext *tctx, OutputContext *out,
+                        AVPacket *pkt, AVFrame *frame) {
+    AVFrame *filt_frame = tctx->filt_frame;
+    int ret;
+
+    ret = av_buffersrc_add_frame_flags(out->buffersrc_ctx, frame,
+                                       AV_BUFFERSRC_FLAG_KEEP_REF);
+    stats_charge(tctx, HM_STAGE_SCALE);
+    if (ret < 0) {
+        fprintf(stderr, "Error while feeding the scaler: %s\n",
+                av_err2str(ret));
+        return ret;
+    }
+
+    while (1) {
+        ret = av_buffersink_get_frame(out->buffersink_ctx, filt_frame);
+        stats_charge(tctx, HM_STAGE_SCALE);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            ret = 0;
+            break;
+        } else if (ret < 0) {
+            fprintf(stderr, "Error while scaling: %s\n", av_err2str(ret));
+            break;
+        }
+
+        ret = encode_write(tctx, out, pkt, filt_frame);
+        av_frame_unref(filt_frame);
+        if (ret < 0)
+            break;
+    }
+    return ret;
+}
+
+// stage decoding a packet or frame at ts of the decoder's time base is
+// charged to
+static HMStage decode_stage(TranscodeContext *tctx, int64_t ts,
+                            int64_t start_ts, int64_t end_ts) {
+    if (ts == AV_NOPTS_VALUE)
+        return HM_STAGE_DECODE;
+    ts = av_rescale_q(ts, tctx->input->dec_ctx->pkt_timebase, AV_TIME_BASE_Q);
+    if (ts < start_ts)
+        return HM_STAGE_PREROLL;
+    return ts < end_ts ? HM_STAGE_DECODE : HM_STAGE_TAIL;
+}
+
+// hands the audio that waited for the encoders to every output, they are
+// all open by now. the last one gets the queued packets themselves
+static int write_queued_audio(TranscodeContext *tctx) {
+    int ret = 0;
+
+    for (int i = 0; i < tctx->nb_outputs && ret >= 0; i++) {
+        int keep = i < tctx->nb_outputs - 1;
+        for (int j = 0; j < tctx->audio_pktq->len && ret >= 0; j++)
+            ret = write_audio_packet(tctx, &tctx->outputs[i], tctx->audio_pkt,
+                                     packet_queue_at(tctx->audio_pktq, j),
+                                     keep);
+    }
+    packet_queue_clear(tctx->audio_pktq);
+    return ret;
+}
+
+// frames of packets outside [start_ts, end_ts) are thrown away, the decoder
+// skips the ones no other frame references instead of decoding them. returns
+// whether pkt is outside
+static int set_skip_frame(AVCodecContext *dec_ctx, const AVPacket *pkt,
+                          int64_t start_ts, int64_t end_ts) {
+    int outside = 0;
+
+    if (pkt->data && pkt->pts != AV_NOPTS_VALUE) {
+        int64_t pkt_ts =
+            av_rescale_q(pkt->pts, dec_ctx->pkt_timebase, AV_TIME_BASE_Q);
+        outside = pkt_ts < start_ts || end_ts <= pkt_ts;
+    }
+    dec_ctx->skip_frame = outside ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    return outside;
+}
+
+// decodes pkt and hands every frame in [start_ts, end_ts) to each output
 int dec_enc(TranscodeContext *tctx, AVPacket *pkt, int64_t start_ts,
             int64_t end_ts) {
-    AVCodecContext *enc_ctx = tctx->enc_ctx;
-    AVCodecContext *dec_ctx = tctx->dec_ctx;
-    AVFrame *frame;
+    AVCodecContext *dec_ctx = tctx->input->dec_ctx;
+    HMStage pkt_stage = decode_stage(tctx, pkt->pts, start_ts, end_ts);
+    AVFrame *frame = tctx->frame;
     int ret = 0;
 
+    if (set_skip_frame(dec_ctx, pkt, start_ts, end_ts))
+        tctx->outside_packets++;
     ret = avcodec_send_packet(dec_ctx, pkt);
+    stats_charge(tctx, pkt_stage);
     if (ret < 0) {
         fprintf(stderr, "Error during decoding: %s\n", av_err2str(ret));
         return ret;
     }
 
     while (ret >= 0) {
-        if (!(frame = av_frame_alloc())) {
-            fprintf(stderr, "Failed allocating frame\n");
-            return -1;
-        }
-
         ret = avcodec_receive_frame(dec_ctx, frame);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            av_frame_free(&frame);
+            stats_charge(tctx, pkt_stage);
             return 0;
         } else if (ret < 0) {
             fprintf(stderr, "Error while decoding: %s\n", av_err2str(ret));
-            av_frame_free(&frame);
             return ret;
         }
-
-        if (!enc_ctx->hw_frames_ctx) {
-            if ((ret = config_enc(tctx)) < 0) {
+        stats_charge(tctx, decode_stage(tctx, frame->pts, start_ts, end_ts));
+
+        for (int i = 0; i < tctx->nb_outputs; i++) {
+            OutputContext *out = &tctx->outputs[i];
+            if (avcodec_is_open(out->enc_ctx))
+                continue;
+            if ((ret = config_scaler(tctx, out, frame)) < 0) {
+                fprintf(stderr, "Failed to configure scaler\n");
+                goto dec_enc_end;
+            }
+            if ((ret = config_enc(tctx, out)) < 0) {
                 fprintf(stderr, "Failed to configure encoder\n");
                 goto dec_enc_end;
             }
+            stats_charge(tctx, HM_STAGE_OPEN);
+        }
+        if (tctx->audio_pktq->len && (ret = write_queued_audio(tctx)) < 0) {
+            fprintf(stderr, "Error muxing audio packet\n");
+            goto dec_enc_end;
         }
 
         int64_t frame_ts =
             av_rescale_q(frame->pts, dec_ctx->pkt_timebase, AV_TIME_BASE_Q);
+        if (tctx->stats)
+            tctx->stats->frames_decoded++;
 
         if (frame_ts < start_ts || end_ts <= frame_ts) {
+            if (tctx->stats)
+                tctx->stats->frames_discarded++;
             // fprintf(stderr,
             //         "Video frame ts %ld(%ld) is out of range [%ld, %ld)\n",
             //         frame->pts, frame_ts, start_ts, end_ts);
             goto dec_enc_end;
         }
-        if ((ret = encode_write(tctx, pkt, frame)) < 0)
-            fprintf(stderr, "Error during encoding and writing\n");
+        // let the encoder pick its own gop instead of mirroring the source
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+        for (int i = 0; i < tctx->nb_outputs && ret >= 0; i++) {
+            OutputContext *out = &tctx->outputs[i];
+            if (out->filter_graph)
+                ret = filter_encode_write(tctx, out, pkt, frame);
+            else
+                ret = encode_write(tctx, out, pkt, frame);
+            if (ret < 0)
+                fprintf(stderr, "Error during encoding and writing\n");
+        }
 
     dec_enc_end:
-        av_frame_free(&frame);
+        av_frame_unref(frame);
     }
     return ret;
 }
 
+// allocated once per context, transcodes after the first reuse it
+static TranscodeScratch *get_scratch(HMContext *hm_ctx) {
+    TranscodeScratch *scratch = hm_ctx->scratch;
+
+    if (scratch)
+        return scratch;
+    if (!(scratch = av_mallocz(sizeof(TranscodeScratch))))
+        return NULL;
+    scratch->pkt = av_packet_alloc();
+    scratch->audio_pkt = av_packet_alloc();
+    scratch->frame = av_frame_alloc();
+    scratch->filt_frame = av_frame_alloc();
+    if (!scratch->pkt || !scratch->audio_pkt || !scratch->frame ||
+        !scratch->filt_frame) {
+        free_scratch(&scratch);
+        return NULL;
+    }
+    hm_ctx->scratch = scratch;
+    return scratch;
+}
+
+void free_scratch(TranscodeScratch **scratch) {
+    TranscodeScratch *s = *scratch;
+
+    if (!s)
+        return;
+    av_packet_free(&s->pkt);
+    av_packet_free(&s->audio_pkt);
+    av_frame_free(&s->frame);
+    av_frame_free(&s->filt_frame);
+    packet_queue_uninit(&s->audio_pktq);
+    av_freep(scratch);
+}
+
 /**
  * - seek to start and transcode duration length segment from file of
- * in_filename
- * - use encoder specified by encoder_name for video and copy audio
- * - output in mpegts format
+ * in_filename into each of nb_outputs outputs
+ * - video is decoded once, every output scales and encodes the frames with
+ * its own encoder and audio is copied into all of them
+ * - output height scales the video down keeping its aspect ratio, 0 keeps the
+ * source size
+ * - output in mpegts or fmp4 format as set in the outputs
  * - start and duration are in seconds
- * - returns -1 on error
+ * - seek_pos is the byte offset of the keyframe at start or -1, formats that
+ * support it seek there directly instead of searching by timestamp
+ * - returns -1 on error, AVERROR_EXIT when hm_ctx's interrupt was set
  * - segment range is exactly [start_ts, end_ts)
+ * - stats is filled in when it is not NULL, the cpu times only when its
+ * process_cpu is set
  */
-// TODO: add arguments for decoding and encoding
-int hm_transcode_segment(HMContext *hm_ctx, const char *in_filename, const char *encoder_name,
-                      const double start, const double duration,
-                      uint8_t **output_buffer, int *output_size) {
+static int transcode_segment(HMContext *hm_ctx, const char *in_filename,
+                             OutputContext *outputs, const int nb_outputs,
+                             const double start, const double duration,
+                             const int64_t seek_pos, HMTranscodeStats *stats) {
     int64_t start_ts = (int64_t)round(start * AV_TIME_BASE);
     int64_t end_ts = (int64_t)round((duration + start) * AV_TIME_BASE);
-    TranscodeContext *tctx = malloc(sizeof(TranscodeContext));
-    AVPacket *pkt = NULL;
+    TranscodeContext transcode_ctx = {0}, *tctx = &transcode_ctx;
+    TranscodeScratch *scratch;
+    AVPacket *pkt = NULL, *audio_pkt = NULL;
+    // set when the check between packets stopped the segment, the interrupt
+    // callback also fails reads and opens halfway with AVERROR_EXIT
+    int stopped_between_packets = 0;
     int ret;
 
-    tctx->in_filename = in_filename;
-
-    pkt = av_packet_alloc();
-    if (!pkt) {
+    stats_start(tctx, stats);
+    if (!(scratch = get_scratch(hm_ctx))) {
         fprintf(stderr, "Could not allocate AVPacket\n");
-        return -1;
+        ret = -1;
+        goto end;
+    }
+    pkt = scratch->pkt;
+    audio_pkt = scratch->audio_pkt;
+    tctx->frame = scratch->frame;
+    tctx->filt_frame = scratch->filt_frame;
+    tctx->audio_pktq = &scratch->audio_pktq;
+    tctx->audio_pkt = audio_pkt;
+
+    tctx->outputs = outputs;
+    tctx->nb_outputs = nb_outputs;
+    for (int i = 0; i < nb_outputs; i++) {
+        // a little headroom over the average so most segments fit
+        outputs[i].output_size_hint =
+            hm_ctx->output_size_hint + hm_ctx->output_size_hint / 4;
     }
 
     tctx->hw_device_ctx = hm_ctx->hw_device_ctx;
+    tctx->threads = hm_ctx->threads;
 
-    if ((ret = config_input(tctx)) < 0) {
+    // the previous segment of the same file left its input open
+    tctx->input = take_input(hm_ctx, in_filename);
+    if (!tctx->input &&
+        (ret = open_input(&tctx->input, in_filename, hm_ctx->backend,
+                          hm_ctx->interrupt)) < 0) {
         fprintf(stderr, "Failed to config input '%s'\n", in_filename);
         goto end;
     }
+    tctx->input->interrupt = hm_ctx->interrupt;
 
-    if ((ret = config_output(tctx, encoder_name)) < 0) {
-        fprintf(stderr, "Failed to config output\n");
+    if ((ret = open_input_decoder(tctx->input, tctx->hw_device_ctx,
+                                  tctx->threads)) < 0) {
+        fprintf(stderr, "Failed to config decoder context for video stream\n");
         goto end;
     }
 
-    tctx->audio_pktq = packet_queue_new();
+    for (int i = 0; i < nb_outputs; i++) {
+        if ((ret = config_output(tctx, &outputs[i])) < 0) {
+            fprintf(stderr, "Failed to config output\n");
+            goto end;
+        }
+    }
+    stats_charge(tctx, HM_STAGE_OPEN);
 
     // adjust start timestamp with stream's start time stamp
     int64_t stream_start_ts =
-        av_rescale_q(tctx->in_video_stream->start_time,
-                     tctx->in_video_stream->time_base, AV_TIME_BASE_Q);
+        av_rescale_q(tctx->input->in_video_stream->start_time,
+                     tctx->input->in_video_stream->time_base, AV_TIME_BASE_Q);
 
     end_ts += stream_start_ts;
 
-    // seek based on video stream
-    int64_t start_ts_vtb = av_rescale_q(start_ts, AV_TIME_BASE_Q,
-                                        tctx->in_video_stream->time_base);
-    avformat_seek_file(tctx->ifmt_ctx, tctx->in_video_stream_index, INT64_MIN,
-                       start_ts_vtb, start_ts_vtb, AVSEEK_FLAG_BACKWARD);
+    seek_input(tctx, start_ts, seek_pos);
 
-    avcodec_flush_buffers(tctx->dec_ctx);
+    avcodec_flush_buffers(tctx->input->dec_ctx);
     start_ts += stream_start_ts;
+    stats_charge(tctx, HM_STAGE_SEEK);
 
     // fprintf(stderr, "start: %ld\tend: %ld\n", start_ts, end_ts);
     int video_stream_end = 0, audio_stream_end = 0;
     while (ret >= 0 && !(video_stream_end && audio_stream_end)) {
-        if ((ret = av_read_frame(tctx->ifmt_ctx, pkt)) < 0)
+        // checked once a packet so a cancelled segment gives its encoder
+        // back within a frame
+        if (interrupted(hm_ctx->interrupt)) {
+            stopped_between_packets = 1;
+            ret = AVERROR_EXIT;
+            break;
+        }
+        ret = av_read_frame(tctx->input->ifmt_ctx, pkt);
+        stats_charge(tctx, HM_STAGE_READ);
+        if (ret < 0)
             break;
+        if (tctx->stats)
+            tctx->stats->packets_read++;
 
         int64_t pkt_pts = av_rescale_q(
-            pkt->pts, tctx->ifmt_ctx->streams[pkt->stream_index]->time_base,
+            pkt->pts, tctx->input->ifmt_ctx->streams[pkt->stream_index]->time_base,
             av_get_time_base_q());
-        // log_packet(pkt, tctx->ifmt_ctx->streams[pkt->stream_index], "in");
+        // log_packet(pkt, tctx->input->ifmt_ctx->streams[pkt->stream_index], "in");
 
-        if (pkt->stream_index == tctx->in_video_stream_index &&
+        if (pkt->stream_index == tctx->input->in_video_stream_index &&
             !video_stream_end) {
             if (pkt_pts >= end_ts && (pkt->flags & AV_PKT_FLAG_KEY)) {
                 video_stream_end = 1;
@@ -417,7 +977,7 @@ int hm_transcode_segment(HMContext *hm_ctx, const char *in_filename, const char
                 fprintf(stderr, "Error on dec_enc %d\n", ret);
             }
             av_packet_unref(pkt);
-        } else if (pkt->stream_index == tctx->in_audio_stream_index &&
+        } else if (pkt->stream_index == tctx->input->in_audio_stream_index &&
                    !audio_stream_end) {
             if (end_ts <= pkt_pts)
                 audio_stream_end = 1;
@@ -427,29 +987,33 @@ int hm_transcode_segment(HMContext *hm_ctx, const char *in_filename, const char
                 goto cont_main_loop;
             }
 
-            if (!tctx->enc_ctx->hw_frames_ctx) {
-                packet_queue_push(tctx->audio_pktq, pkt);
-                // fprintf(stderr, "encoder hw_frames_ctx not initialized yet\n");
+            // the encoders open on the first decoded frame, audio before it
+            // waits for them
+            if (!avcodec_is_open(outputs[0].enc_ctx)) {
+                if ((ret = packet_queue_push(tctx->audio_pktq, pkt)) < 0)
+                    fprintf(stderr, "Failed to queue audio packet\n");
                 goto cont_main_loop;
             }
-            // copy audio codecs
-            // continue;
-            pkt->stream_index = OUT_AUDIO_STREAM_INDEX;
-            pkt->pos = -1;
-            av_packet_rescale_ts(pkt, tctx->in_audio_stream->time_base,
-                                 tctx->out_audio_stream->time_base);
-            // log_packet(pkt, tctx->out_audio_stream, "out");
-
-            ret = av_interleaved_write_frame(tctx->ofmt_ctx, pkt);
-            if (ret < 0) {
-                fprintf(stderr, "Error muxing audio packet\n");
-                goto cont_main_loop;
+
+            // copy audio codecs, the last output takes pkt itself
+            for (int i = 0; i < nb_outputs; i++) {
+                OutputContext *out = &outputs[i];
+                ret = write_audio_packet(tctx, out, audio_pkt, pkt,
+                                         i < nb_outputs - 1);
+                if (ret < 0) {
+                    fprintf(stderr, "Error muxing audio packet\n");
+                    break;
+                }
             }
         }
     cont_main_loop:
         av_packet_unref(pkt);
     }
 
+    // nobody wants the rest of the segment
+    if (ret == AVERROR_EXIT)
+        goto end;
+
     // flush decoder
     av_packet_unref(pkt);
     if ((ret = dec_enc(tctx, pkt, start_ts, end_ts)) < 0) {
@@ -457,30 +1021,778 @@ int hm_transcode_segment(HMContext *hm_ctx, const char *in_filename, const char
         goto end;
     }
 
-    if ((ret = encode_write(tctx, pkt, NULL)) < 0) {
+    for (int i = 0; i < nb_outputs; i++) {
+        OutputContext *out = &outputs[i];
+
+        if (out->filter_graph &&
+            (ret = filter_encode_write(tctx, out, pkt, NULL)) < 0) {
+            fprintf(stderr, "Failed to flush scaler %s\n", av_err2str(ret));
+            goto end;
+        }
+
+        if ((ret = encode_write(tctx, out, pkt, NULL)) < 0) {
+            fprintf(stderr, "Failed to flush encoder %s\n", av_err2str(ret));
+            goto end;
+        }
+
+        if ((ret = av_write_trailer(out->ofmt_ctx)) < 0) {
+            fprintf(stderr, "Failed to write trailer %s\n", av_err2str(ret));
+            goto end;
+        }
+        if (tctx->stats)
+            tctx->stats->bytes_out += avio_tell(out->ofmt_ctx->pb);
+
+        if ((ret = close_output_io(out)) < 0) {
+            fprintf(stderr, "Failed to write output %s\n", av_err2str(ret));
+            goto end;
+        }
+        stats_charge(tctx, HM_STAGE_MUX);
+    }
+
+    // renditions of different sizes would skew the estimate
+    if (nb_outputs == 1 && outputs[0].output_size) {
+        int64_t size = *outputs[0].output_size;
+        hm_ctx->output_size_hint =
+            hm_ctx->output_size_hint
+                ? (hm_ctx->output_size_hint * 3 + size) / 4
+                : size;
+    }
+
+    ret = 0;
+end:
+    for (int i = 0; i < nb_outputs; i++)
+        free_output(&outputs[i]);
+    if (tctx->input) {
+        tctx->input->interrupt = NULL;
+        // a failed segment may leave the demuxer or decoder in a bad state,
+        // so may one interrupted inside a read. one stopped between packets
+        // is fine, the next segment seeks
+        if (ret < 0 && !stopped_between_packets)
+            free_input(&tctx->input);
+        else
+            put_input(hm_ctx, tctx->input);
+    }
+    stats_finish(tctx);
+    // the scratch goes back blank for the next segment
+    if (pkt) {
+        av_packet_unref(pkt);
+        av_packet_unref(audio_pkt);
+        av_frame_unref(tctx->frame);
+        av_frame_unref(tctx->filt_frame);
+        packet_queue_clear(tctx->audio_pktq);
+    }
+    return ret;
+}
+
+// output_buffer is set to the whole segment, free it with hm_free_buffer.
+// stats can be NULL, with its process_cpu set timing every stage costs a few
+// syscalls per frame
+int hm_transcode_segment(HMContext *hm_ctx, const char *in_filename,
+                         const char *encoder_name,
+                         const HMEncoderOptions *options, const int height,
+                         const HMFormat format, const double start,
+                         const double duration, const int64_t seek_pos,
+                         uint8_t **output_buffer, int *output_size,
+                         HMTranscodeStats *stats) {
+    OutputContext out = {
+        .format = format,
+        .encoder_name = encoder_name,
+        .enc_opts = options,
+        .out_height = height,
+        .output_buffer = output_buffer,
+        .output_size = output_size,
+    };
+    return transcode_segment(hm_ctx, in_filename, &out, 1, start, duration,
+                             seek_pos, stats);
+}
+
+// output is passed to write_packet in chunks while the segment is transcoded,
+// stats can be NULL
+int hm_transcode_segment_stream(HMContext *hm_ctx, const char *in_filename,
+                                const char *encoder_name,
+                                const HMEncoderOptions *options,
+                                const int height, const HMFormat format,
+                                const double start, const double duration,
+                                const int64_t seek_pos,
+                                HMWritePacket write_packet, void *opaque,
+                                HMTranscodeStats *stats) {
+    OutputContext out = {
+        .format = format,
+        .encoder_name = encoder_name,
+        .enc_opts = options,
+        .out_height = height,
+        .write_packet = write_packet,
+        .write_opaque = opaque,
+    };
+    return transcode_segment(hm_ctx, in_filename, &out, 1, start, duration,
+                             seek_pos, stats);
+}
+
+// every rendition gets the whole segment in its output_buffer, on error none
+// of them is set
+int hm_transcode_renditions(HMContext *hm_ctx, const char *in_filename,
+                            HMRendition *renditions, const int nb_renditions,
+                            const HMFormat format, const double start,
+                            const double duration, const int64_t seek_pos) {
+    OutputContext *outputs;
+    int ret;
+
+    if (nb_renditions <= 0)
+        return -1;
+    outputs = calloc(nb_renditions, sizeof(OutputContext));
+    if (!outputs)
+        return -1;
+
+    for (int i = 0; i < nb_renditions; i++) {
+        renditions[i].output_buffer = NULL;
+        renditions[i].output_size = 0;
+        outputs[i].format = format;
+        outputs[i].encoder_name = renditions[i].encoder_name;
+        outputs[i].enc_opts = renditions[i].options;
+        outputs[i].out_height = renditions[i].height;
+        outputs[i].output_buffer = &renditions[i].output_buffer;
+        outputs[i].output_size = &renditions[i].output_size;
+    }
+
+    ret = transcode_segment(hm_ctx, in_filename, outputs, nb_renditions, start,
+                            duration, seek_pos, NULL);
+    if (ret < 0) {
+        for (int i = 0; i < nb_renditions; i++) {
+            av_freep(&renditions[i].output_buffer);
+            renditions[i].output_size = 0;
+        }
+    }
+    free(outputs);
+    return ret;
+}
+
+/**
+ * - a session keeps one demux -> decode -> encode -> mux pipeline running
+ * over consecutive segments of a file, so the segments after the first skip
+ * the seek, the decoder warm-up and the encoder's rate control restart
+ * - segment i is [bounds[i], bounds[i + 1]) in AV_TIME_BASE shifted by the
+ * video stream's start time
+ * - the frame at or after every bound is forced to a keyframe and the
+ * encoded video is cut there into a new muxer. audio packets of the
+ * next segment wait in audio_pktq until video reaches the cut and video
+ * packets past the cut wait in video_pktq until audio reaches it, or until
+ * they run SESSION_MAX_AUDIO_LAG past the cut
+ */
+struct HMSession {
+    TranscodeContext tctx;
+    OutputContext out;
+    char *encoder_name;
+    // out.enc_opts, pointing to its own copies of preset and tune
+    HMEncoderOptions enc_opts;
+    char *preset, *tune;
+
+    int64_t *bounds;
+    int nb_segments;
+    // segment muxed into out.ofmt_ctx
+    int cur;
+    // first bound whose keyframe is not forced yet
+    int next_key;
+    // the encoder crossed bounds[cur + 1], its packets go to video_pktq
+    int cutting;
+    PacketQueue video_pktq;
+    PacketQueue audio_pktq;
+    // pts of the last audio packet read and the last video packet encoded
+    int64_t audio_ts, video_ts;
+    int video_end, audio_end;
+
+    // drain_pkt takes the held back packets while they are routed again
+    AVPacket *pkt, *enc_pkt, *audio_pkt, *drain_pkt;
+    AVFrame *frame, *filt_frame;
+    // running estimate of segment sizes
+    int64_t size_hint;
+
+    // finished segments by index, hm_session_next hands them out in order
+    uint8_t **buffers;
+    int *sizes;
+    int nb_finished;
+    int next_out;
+    // first error, every later call returns it
+    int error;
+};
+
+// muxes an encoded video packet into the open segment, or holds it back once
+// the encoder crossed the end of the segment
+static int session_route_video(HMSession *s, AVPacket *pkt) {
+    OutputContext *out = &s->out;
+    int64_t pts =
+        av_rescale_q(pkt->pts, out->enc_ctx->time_base, AV_TIME_BASE_Q);
+
+    s->video_ts = FFMAX(s->video_ts, pts);
+    if (!s->cutting && s->cur + 1 < s->nb_segments &&
+        (pkt->flags & AV_PKT_FLAG_KEY) && pts >= s->bounds[s->cur + 1])
+        s->cutting = 1;
+    if (s->cutting)
+        return packet_queue_push(&s->video_pktq, pkt);
+
+    pkt->stream_index = OUT_VIDEO_STREAM_INDEX;
+    av_packet_rescale_ts(pkt, out->enc_ctx->time_base,
+                         out->out_video_stream->time_base);
+    return av_interleaved_write_frame(out->ofmt_ctx, pkt);
+}
+
+// muxes an input audio packet into the open segment, holds back packets of
+// later segments and drops the ones of finished segments
+static int session_route_audio(HMSession *s, AVPacket *pkt) {
+    InputContext *input = s->tctx.input;
+    int64_t pts = av_rescale_q(pkt->pts, input->in_audio_stream->time_base,
+                               AV_TIME_BASE_Q);
+
+    if (pts < s->bounds[s->cur])
+        return 0;
+    if (avcodec_is_open(s->out.enc_ctx) && pts < s->bounds[s->cur + 1])
+        return write_audio_packet(&s->tctx, &s->out, s->audio_pkt, pkt, 0);
+    return packet_queue_push(&s->audio_pktq, pkt);
+}
+
+// routes the held back packets again after the segment changed, the ones
+// held back again go to the back of their queue and are not seen twice
+static int session_drain(HMSession *s) {
+    int nb_video = s->video_pktq.len, nb_audio = s->audio_pktq.len;
+    int ret = 0;
+
+    for (; ret >= 0 && nb_video > 0; nb_video--) {
+        packet_queue_pop(&s->video_pktq, s->drain_pkt);
+        ret = session_route_video(s, s->drain_pkt);
+        av_packet_unref(s->drain_pkt);
+    }
+    for (; ret >= 0 && nb_audio > 0; nb_audio--) {
+        packet_queue_pop(&s->audio_pktq, s->drain_pkt);
+        ret = session_route_audio(s, s->drain_pkt);
+        av_packet_unref(s->drain_pkt);
+    }
+    return ret;
+}
+
+// closes the current segment into buffers[cur]
+static int session_finish_segment(HMSession *s) {
+    OutputContext *out = &s->out;
+    int ret;
+
+    if ((ret = av_write_trailer(out->ofmt_ctx)) < 0) {
+        fprintf(stderr, "Failed to write trailer %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    out->output_buffer = &s->buffers[s->cur];
+    out->output_size = &s->sizes[s->cur];
+    if ((ret = close_output_io(out)) < 0) {
+        fprintf(stderr, "Failed to write output %s\n", av_err2str(ret));
+        return ret;
+    }
+    avformat_free_context(out->ofmt_ctx);
+    out->ofmt_ctx = NULL;
+
+    int64_t size = s->sizes[s->cur];
+    s->size_hint = s->size_hint ? (s->size_hint * 3 + size) / 4 : size;
+    s->nb_finished = s->cur + 1;
+    return 0;
+}
+
+// finishes the current segment and opens the muxer of the next one, the
+// encoder and scaler stay as they are
+static int session_next_segment(HMSession *s) {
+    OutputContext *out = &s->out;
+    int ret;
+
+    if ((ret = session_finish_segment(s)) < 0)
+        return ret;
+    s->cur++;
+    s->cutting = 0;
+
+    // a new buffer for every segment
+    out->write_packet = NULL;
+    out->output_size_hint = s->size_hint + s->size_hint / 4;
+    if ((ret = config_output_format(&s->tctx, out, out->enc_ctx->codec)) < 0 ||
+        (ret = write_output_header(out)) < 0) {
+        fprintf(stderr, "Failed to config output of segment %d\n", s->cur);
+        return ret;
+    }
+    return session_drain(s);
+}
+
+// moves on while both video and audio reached the end of the segment, or
+// video is too far ahead to keep waiting for audio. audio of a segment that
+// arrives after its cut is dropped
+static int session_try_advance(HMSession *s) {
+    int ret;
+
+    while (s->cutting &&
+           (s->audio_end || s->audio_ts >= s->bounds[s->cur + 1] ||
+            s->video_ts - s->bounds[s->cur + 1] >= SESSION_MAX_AUDIO_LAG)) {
+        if ((ret = session_next_segment(s)) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int session_write_video(OutputContext *out, AVPacket *pkt) {
+    HMSession *s = out->opaque;
+    int ret;
+
+    if ((ret = session_route_video(s, pkt)) < 0)
+        return ret;
+    av_packet_unref(pkt);
+    return session_try_advance(s);
+}
+
+// decodes pkt and encodes every frame inside the session, a blank pkt
+// flushes the decoder
+static int session_dec_enc(HMSession *s, AVPacket *pkt) {
+    TranscodeContext *tctx = &s->tctx;
+    OutputContext *out = &s->out;
+    AVCodecContext *dec_ctx = tctx->input->dec_ctx;
+    AVFrame *frame = s->frame;
+    int ret;
+
+    set_skip_frame(dec_ctx, pkt, s->bounds[0], s->bounds[s->nb_segments]);
+    if ((ret = avcodec_send_packet(dec_ctx, pkt)) < 0) {
+        fprintf(stderr, "Error during decoding: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    while (1) {
+        ret = avcodec_receive_frame(dec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        if (ret < 0) {
+            fprintf(stderr, "Error while decoding: %s\n", av_err2str(ret));
+            return ret;
+        }
+
+        if (!avcodec_is_open(out->enc_ctx)) {
+            if ((ret = config_scaler(tctx, out, frame)) < 0 ||
+                (ret = config_enc(tctx, out)) < 0 ||
+                (ret = session_drain(s)) < 0) {
+                fprintf(stderr, "Failed to configure encoder\n");
+                break;
+            }
+        }
+
+        int64_t frame_ts =
+            av_rescale_q(frame->pts, dec_ctx->pkt_timebase, AV_TIME_BASE_Q);
+        if (frame_ts >= s->bounds[0] &&
+            frame_ts < s->bounds[s->nb_segments]) {
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            // every segment starts on a keyframe so it can be cut there
+            while (s->next_key < s->nb_segments &&
+                   frame_ts >= s->bounds[s->next_key]) {
+                frame->pict_type = AV_PICTURE_TYPE_I;
+                s->next_key++;
+            }
+            if (out->filter_graph)
+                ret = filter_encode_write(tctx, out, s->enc_pkt, frame);
+            else
+                ret = encode_write(tctx, out, s->enc_pkt, frame);
+            if (ret < 0) {
+                fprintf(stderr, "Error during encoding and writing\n");
+                break;
+            }
+        }
+        av_frame_unref(frame);
+    }
+    av_frame_unref(frame);
+    return ret;
+}
+
+// flushes the pipeline at the end of the input or the session and finishes
+// every segment left, segments past the end of the input come out empty
+static int session_finish(HMSession *s) {
+    OutputContext *out = &s->out;
+    int ret;
+
+    s->video_end = s->audio_end = 1;
+    av_packet_unref(s->pkt);
+    if ((ret = session_dec_enc(s, s->pkt)) < 0) {
+        fprintf(stderr, "Failed to flush decoder %s\n", av_err2str(ret));
+        return ret;
+    }
+    if (!avcodec_is_open(out->enc_ctx)) {
+        fprintf(stderr, "No video frames in the session\n");
+        return -1;
+    }
+
+    if (out->filter_graph &&
+        (ret = filter_encode_write(&s->tctx, out, s->enc_pkt, NULL)) < 0) {
+        fprintf(stderr, "Failed to flush scaler %s\n", av_err2str(ret));
+        return ret;
+    }
+    if ((ret = encode_write(&s->tctx, out, s->enc_pkt, NULL)) < 0) {
         fprintf(stderr, "Failed to flush encoder %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    while (s->cur + 1 < s->nb_segments) {
+        s->cutting = 1;
+        if ((ret = session_try_advance(s)) < 0)
+            return ret;
+    }
+    return session_finish_segment(s);
+}
+
+// reads and handles one input packet
+static int session_step(HMSession *s) {
+    InputContext *input = s->tctx.input;
+    AVPacket *pkt = s->pkt;
+    int64_t end_ts = s->bounds[s->nb_segments];
+    int ret;
+
+    if (s->video_end && s->audio_end)
+        return session_finish(s);
+    if (interrupted(input->interrupt))
+        return AVERROR_EXIT;
+
+    if ((ret = av_read_frame(input->ifmt_ctx, pkt)) < 0) {
+        if (ret != AVERROR_EOF) {
+            fprintf(stderr, "Failed reading packets: %s\n", av_err2str(ret));
+            return ret;
+        }
+        return session_finish(s);
+    }
+
+    AVStream *in_stream = input->ifmt_ctx->streams[pkt->stream_index];
+    int64_t pkt_pts =
+        av_rescale_q(pkt->pts, in_stream->time_base, AV_TIME_BASE_Q);
+
+    if (pkt->stream_index == input->in_video_stream_index && !s->video_end) {
+        if (pkt_pts >= end_ts && (pkt->flags & AV_PKT_FLAG_KEY))
+            s->video_end = 1;
+        else if ((ret = session_dec_enc(s, pkt)) < 0)
+            fprintf(stderr, "Error on dec_enc %d\n", ret);
+    } else if (pkt->stream_index == input->in_audio_stream_index &&
+               !s->audio_end) {
+        if (end_ts <= pkt_pts) {
+            s->audio_end = 1;
+        } else if (pkt_pts >= s->bounds[0]) {
+            s->audio_ts = pkt_pts;
+            ret = session_route_audio(s, pkt);
+        }
+        if (ret >= 0)
+            ret = session_try_advance(s);
+    }
+    av_packet_unref(pkt);
+    return ret;
+}
+
+/**
+ * - opens a session over the nb_segments segments starting at starts, the
+ * last one ends at end
+ * - starts and end are in seconds, seek_pos is the byte offset of the
+ * keyframe at starts[0] or -1
+ * - the session owns its input, it doesn't use the context's open inputs
+ * - returns NULL on error
+ */
+HMSession *hm_session_open(HMContext *hm_ctx, const char *in_filename,
+                           const char *encoder_name,
+                           const HMEncoderOptions *options, const int height,
+                           const HMFormat format, const double *starts,
+                           const int nb_segments, const double end,
+                           const int64_t seek_pos) {
+    HMSession *s;
+    int ret;
+
+    if (nb_segments <= 0)
+        return NULL;
+    if (!(s = av_mallocz(sizeof(HMSession))))
+        return NULL;
+
+    s->nb_segments = nb_segments;
+    s->bounds = av_calloc(nb_segments + 1, sizeof(*s->bounds));
+    s->buffers = av_calloc(nb_segments, sizeof(*s->buffers));
+    s->sizes = av_calloc(nb_segments, sizeof(*s->sizes));
+    s->encoder_name = av_strdup(encoder_name);
+    // the encoder is opened by hm_session_next, after options went away
+    if (options)
+        s->enc_opts = *options;
+    else
+        hm_encoder_options_init(&s->enc_opts, HM_PROFILE_LATENCY);
+    s->enc_opts.preset = s->preset = av_strdup(s->enc_opts.preset);
+    s->enc_opts.tune = s->tune = av_strdup(s->enc_opts.tune);
+    s->pkt = av_packet_alloc();
+    s->enc_pkt = av_packet_alloc();
+    s->audio_pkt = av_packet_alloc();
+    s->drain_pkt = av_packet_alloc();
+    s->frame = av_frame_alloc();
+    s->filt_frame = av_frame_alloc();
+    if (!s->bounds || !s->buffers || !s->sizes || !s->encoder_name ||
+        (options && options->preset && !s->preset) ||
+        (options && options->tune && !s->tune) || !s->pkt || !s->enc_pkt ||
+        !s->audio_pkt || !s->drain_pkt || !s->frame || !s->filt_frame) {
+        fprintf(stderr, "Could not allocate session\n");
+        goto fail;
+    }
+
+    s->tctx.threads = hm_ctx->threads;
+    if (hm_ctx->hw_device_ctx &&
+        !(s->tctx.hw_device_ctx = av_buffer_ref(hm_ctx->hw_device_ctx)))
+        goto fail;
+    s->tctx.outputs = &s->out;
+    s->tctx.nb_outputs = 1;
+    s->tctx.filt_frame = s->filt_frame;
+
+    s->out.format = format;
+    s->out.encoder_name = s->encoder_name;
+    s->out.enc_opts = &s->enc_opts;
+    s->out.out_height = height;
+    s->out.write_video_packet = session_write_video;
+    s->out.opaque = s;
+    s->size_hint = hm_ctx->output_size_hint;
+    s->out.output_size_hint = s->size_hint + s->size_hint / 4;
+
+    if ((ret = open_input(&s->tctx.input, in_filename, hm_ctx->backend,
+                          NULL)) < 0) {
+        fprintf(stderr, "Failed to config input '%s'\n", in_filename);
+        goto fail;
+    }
+    if ((ret = open_input_decoder(s->tctx.input, s->tctx.hw_device_ctx,
+                                  s->tctx.threads)) < 0) {
+        fprintf(stderr, "Failed to config decoder context for video stream\n");
+        goto fail;
+    }
+    if ((ret = config_output(&s->tctx, &s->out)) < 0) {
+        fprintf(stderr, "Failed to config output\n");
+        goto fail;
+    }
+    // keyframes are forced at the bounds, encoders that tell idr frames from
+    // other intra frames have to make them idr frames to cut there
+    av_opt_set_int(s->out.enc_ctx, "forced-idr", 1, AV_OPT_SEARCH_CHILDREN);
+    av_opt_set_int(s->out.enc_ctx, "forced_idr", 1, AV_OPT_SEARCH_CHILDREN);
+
+    int64_t stream_start_ts =
+        av_rescale_q(s->tctx.input->in_video_stream->start_time,
+                     s->tctx.input->in_video_stream->time_base, AV_TIME_BASE_Q);
+    for (int i = 0; i < nb_segments; i++)
+        s->bounds[i] = (int64_t)round(starts[i] * AV_TIME_BASE) + stream_start_ts;
+    s->bounds[nb_segments] = (int64_t)round(end * AV_TIME_BASE) + stream_start_ts;
+
+    seek_input(&s->tctx, s->bounds[0] - stream_start_ts, seek_pos);
+    s->audio_ts = INT64_MIN;
+    s->next_key = 1;
+    return s;
+fail:
+    hm_session_free(s);
+    return NULL;
+}
+
+// hm_session_next gives up with AVERROR_EXIT once *interrupt is set, the
+// session is done then. NULL makes it uninterruptible
+void hm_session_set_interrupt(HMSession *s, const int *interrupt) {
+    s->tctx.input->interrupt = interrupt;
+}
+
+/**
+ * - runs the session until the next segment is finished and hands it to
+ * output_buffer, free it with hm_free_buffer
+ * - returns AVERROR_EOF after the last segment and negative value on error
+ */
+int hm_session_next(HMSession *s, uint8_t **output_buffer, int *output_size) {
+    int ret;
+
+    *output_buffer = NULL;
+    *output_size = 0;
+    if (s->error < 0)
+        return s->error;
+    if (s->next_out >= s->nb_segments)
+        return AVERROR_EOF;
+
+    while (s->nb_finished <= s->next_out) {
+        if ((ret = session_step(s)) < 0) {
+            s->error = ret;
+            return ret;
+        }
+    }
+
+    *output_buffer = s->buffers[s->next_out];
+    *output_size = s->sizes[s->next_out];
+    s->buffers[s->next_out++] = NULL;
+    return 0;
+}
+
+void hm_session_free(HMSession *s) {
+    if (!s)
+        return;
+    free_output(&s->out);
+    free_input(&s->tctx.input);
+    av_buffer_unref(&s->tctx.hw_device_ctx);
+    for (int i = 0; s->buffers && i < s->nb_segments; i++)
+        av_free(s->buffers[i]);
+    av_free(s->buffers);
+    av_free(s->sizes);
+    av_free(s->bounds);
+    av_free(s->encoder_name);
+    av_free(s->preset);
+    av_free(s->tune);
+    packet_queue_uninit(&s->video_pktq);
+    packet_queue_uninit(&s->audio_pktq);
+    av_packet_free(&s->pkt);
+    av_packet_free(&s->enc_pkt);
+    av_packet_free(&s->audio_pkt);
+    av_packet_free(&s->drain_pkt);
+    av_frame_free(&s->frame);
+    av_frame_free(&s->filt_frame);
+    av_free(s);
+}
+
+/**
+ * - copy the packets of the segment [start, start + duration) into out's
+ * format without decoding or encoding anything
+ * - start and start + duration must be keyframes of the video stream, the
+ * segment always begins with the first keyframe at or after start and ends
+ * before the first keyframe at or after start + duration
+ * - seek_pos is the byte offset of the keyframe at start or -1
+ * - returns negative value on error, AVERROR_EXIT once *interrupt is set.
+ * NULL makes it uninterruptible
+ */
+static int remux_segment(const char *in_filename, const double start,
+                         const double duration, const int64_t seek_pos,
+                         const int *interrupt, OutputContext *out) {
+    int64_t start_ts = (int64_t)round(start * AV_TIME_BASE);
+    int64_t end_ts = (int64_t)round((duration + start) * AV_TIME_BASE);
+    TranscodeContext *tctx = calloc(1, sizeof(TranscodeContext));
+    AVPacket *pkt = NULL;
+    int ret;
+
+    tctx->outputs = out;
+    tctx->nb_outputs = 1;
+
+    pkt = av_packet_alloc();
+    if (!pkt) {
+        fprintf(stderr, "Could not allocate AVPacket\n");
+        free(tctx);
+        return -1;
+    }
+
+    // nothing is decoded, the backend doesn't matter
+    if ((ret = open_input(&tctx->input, in_filename, HM_BACKEND_SW,
+                          interrupt)) < 0) {
+        fprintf(stderr, "Failed to config input '%s'\n", in_filename);
+        goto end;
+    }
+
+    // copied packets keep the source bitrate, the container adds a few
+    // percent
+    if (tctx->input->ifmt_ctx->bit_rate > 0) {
+        out->output_size_hint =
+            (int64_t)(tctx->input->ifmt_ctx->bit_rate / 8 * duration * 1.1);
+    }
+
+    if ((ret = config_remux_output(tctx, out)) < 0) {
+        fprintf(stderr, "Failed to config output\n");
+        goto end;
+    }
+
+    int64_t stream_start_ts =
+        av_rescale_q(tctx->input->in_video_stream->start_time,
+                     tctx->input->in_video_stream->time_base, AV_TIME_BASE_Q);
+    seek_input(tctx, start_ts, seek_pos);
+
+    start_ts += stream_start_ts;
+    end_ts += stream_start_ts;
+
+    int video_stream_start = 0, video_stream_end = 0, audio_stream_end = 0;
+    while (!(video_stream_end && audio_stream_end)) {
+        // an abandoned segment stops within a packet like a transcode
+        if (interrupted(interrupt)) {
+            ret = AVERROR_EXIT;
+            break;
+        }
+        if ((ret = av_read_frame(tctx->input->ifmt_ctx, pkt)) < 0)
+            break;
+
+        AVStream *in_stream = tctx->input->ifmt_ctx->streams[pkt->stream_index];
+        int64_t pkt_pts =
+            av_rescale_q(pkt->pts, in_stream->time_base, AV_TIME_BASE_Q);
+
+        if (pkt->stream_index == tctx->input->in_video_stream_index &&
+            !video_stream_end) {
+            int key = pkt->flags & AV_PKT_FLAG_KEY;
+            if (key && pkt_pts >= end_ts) {
+                video_stream_end = 1;
+                goto cont_remux_loop;
+            }
+            // packets in decode order from the starting keyframe on belong to
+            // the segment, including leading frames of an open gop
+            if (!video_stream_start) {
+                if (!key || pkt_pts < start_ts)
+                    goto cont_remux_loop;
+                video_stream_start = 1;
+            }
+            if ((ret = write_copied_packet(out, pkt, in_stream,
+                                           out->out_video_stream)) < 0) {
+                fprintf(stderr, "Error muxing video packet\n");
+                goto end;
+            }
+        } else if (pkt->stream_index == tctx->input->in_audio_stream_index &&
+                   !audio_stream_end) {
+            if (end_ts <= pkt_pts)
+                audio_stream_end = 1;
+            if (pkt_pts < start_ts || end_ts <= pkt_pts)
+                goto cont_remux_loop;
+
+            if ((ret = write_copied_packet(out, pkt, in_stream,
+                                           out->out_audio_stream)) < 0) {
+                fprintf(stderr, "Error muxing audio packet\n");
+                goto end;
+            }
+        }
+    cont_remux_loop:
+        av_packet_unref(pkt);
+    }
+
+    if (ret < 0 && ret != AVERROR_EOF) {
+        fprintf(stderr, "Failed reading packets: %s\n", av_err2str(ret));
         goto end;
     }
 
-    if ((ret = av_write_trailer(tctx->ofmt_ctx)) < 0) {
+    if ((ret = av_write_trailer(out->ofmt_ctx)) < 0) {
         fprintf(stderr, "Failed to write trailer %s\n", av_err2str(ret));
         goto end;
     }
 
-    *output_size = avio_close_dyn_buf(tctx->ofmt_ctx->pb, output_buffer);
-    tctx->ofmt_ctx->pb = NULL;
+    if ((ret = close_output_io(out)) < 0) {
+        fprintf(stderr, "Failed to write output %s\n", av_err2str(ret));
+        goto end;
+    }
 
     ret = 0;
 end:
-    avformat_close_input(&tctx->ifmt_ctx);
-    avformat_free_context(tctx->ofmt_ctx);
-    avcodec_free_context(&tctx->dec_ctx);
-    avcodec_free_context(&tctx->enc_ctx);
+    free_output(out);
+    free_input(&tctx->input);
     free(tctx);
     av_packet_free(&pkt);
     return ret;
 }
 
+int hm_remux_segment(const char *in_filename, const HMFormat format,
+                     const double start, const double duration,
+                     const int64_t seek_pos, const int *interrupt,
+                     uint8_t **output_buffer, int *output_size) {
+    OutputContext out = {
+        .format = format,
+        .output_buffer = output_buffer,
+        .output_size = output_size,
+    };
+    return remux_segment(in_filename, start, duration, seek_pos, interrupt,
+                         &out);
+}
+
+int hm_remux_segment_stream(const char *in_filename, const HMFormat format,
+                            const double start, const double duration,
+                            const int64_t seek_pos, const int *interrupt,
+                            HMWritePacket write_packet, void *opaque) {
+    OutputContext out = {
+        .format = format,
+        .write_packet = write_packet,
+        .write_opaque = opaque,
+    };
+    return remux_segment(in_filename, start, duration, seek_pos, interrupt,
+                         &out);
+}
+
 void hm_free_buffer(uint8_t *buffer) {
     av_free(buffer);
 }
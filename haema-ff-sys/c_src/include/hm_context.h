@@ -1,5 +1,54 @@
+#ifndef HM_CONTEXT_H
+#define HM_CONTEXT_H
+
+#include <stdint.h>
+
 #include <libavutil/buffer.h>
+#include <libavutil/pixfmt.h>
+
+// upper bound of inputs a context keeps open
+#define HM_MAX_INPUTS 8
+
+// order matters, HM_BACKEND_AUTO probes from QSV down to SW
+typedef enum HMBackend {
+  HM_BACKEND_AUTO = 0,
+  HM_BACKEND_QSV = 1,
+  HM_BACKEND_VAAPI = 2,
+  HM_BACKEND_SW = 3,
+} HMBackend;
 
 typedef struct HMContext {
+  HMBackend backend;
   AVBufferRef *hw_device_ctx;
+  // threads used by software decoders and encoders, 0 lets ffmpeg decide
+  int threads;
+  // running estimate of buffered segment sizes so the output buffer is
+  // allocated once at about the right size
+  int64_t output_size_hint;
+  // inputs kept open between segments, most recently used first
+  struct InputContext *inputs[HM_MAX_INPUTS];
+  int nb_inputs;
+  // at most HM_MAX_INPUTS, 0 closes every input after its segment
+  int max_inputs;
+  // microseconds an unused input stays open
+  int64_t input_idle_timeout;
+  // packets, frames and queues transcodes reuse, allocated by the first one
+  struct TranscodeScratch *scratch;
+  // transcodes give up with AVERROR_EXIT once this is set to nonzero, NULL
+  // when nobody can cancel them
+  const int *interrupt;
 } HMContext;
+
+HMContext *hm_ctx_create(HMBackend backend, int threads);
+void hm_ctx_free(HMContext *ctx);
+HMBackend hm_ctx_backend(HMContext *ctx);
+HMBackend hm_probe_backend(void);
+void hm_ctx_set_input_cache(HMContext *ctx, int max_inputs,
+                            int64_t idle_timeout);
+void hm_ctx_expire_inputs(HMContext *ctx);
+void hm_ctx_set_interrupt(HMContext *ctx, const int *interrupt);
+
+const char *hm_backend_name(HMBackend backend);
+enum AVPixelFormat hm_backend_pix_fmt(HMBackend backend);
+
+#endif
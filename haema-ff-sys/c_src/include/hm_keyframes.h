@@ -0,0 +1,18 @@
+#ifndef HM_KEYFRAMES_H
+#define HM_KEYFRAMES_H
+
+#include <stdint.h>
+
+typedef struct HMKeyframe {
+    // microseconds since the start of the best video stream
+    int64_t pts;
+    // byte offset of the keyframe packet, -1 when the demuxer doesn't know
+    int64_t pos;
+    // number of video packets from this keyframe up to the next one
+    int32_t gop_size;
+} HMKeyframe;
+
+int hm_keyframes(const char *in_filename, HMKeyframe **keyframes,
+                 int *nb_keyframes);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef HM_PROBE_H
+#define HM_PROBE_H
+
+#include <stdint.h>
+
+#define HM_CODEC_NAME_SIZE 32
+
+typedef struct HMProbeInfo {
+    // seconds of the best video stream, the container's when the stream
+    // doesn't know
+    double duration;
+    // seconds, start of the best video stream on the demuxer's timeline
+    double start_time;
+    // ffmpeg codec name of the best video stream like "h264" or "hevc"
+    char video_codec[HM_CODEC_NAME_SIZE];
+    int width;
+    int height;
+    // frames per second, 0 when unknown
+    double frame_rate;
+    // codec of the best audio stream, empty when there is none
+    char audio_codec[HM_CODEC_NAME_SIZE];
+    int nb_audio_tracks;
+    // container bit rate in bits per second, 0 when unknown
+    int64_t bit_rate;
+} HMProbeInfo;
+
+int hm_probe(const char *in_filename, HMProbeInfo *info);
+
+#endif
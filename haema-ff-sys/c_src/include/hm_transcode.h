@@ -0,0 +1,171 @@
+#ifndef HM_TRANSCODE_H
+#define HM_TRANSCODE_H
+
+#include <stdint.h>
+
+#include "hm_context.h"
+
+// container of the segments
+// - fmp4 segments are cmaf fragments that start with the init segment
+// (ftyp and moov), the same for every segment of an encoder and size, it is
+// followed by moof and mdat boxes
+// - both keep the source timestamps so segments muxed one by one line up
+typedef enum HMFormat {
+    HM_FORMAT_MPEGTS = 0,
+    HM_FORMAT_FMP4 = 1,
+} HMFormat;
+
+// receives muxed output as it is produced, returns buf_size or a negative
+// AVERROR to abort
+typedef int (*HMWritePacket)(void *opaque, const uint8_t *buf, int buf_size);
+
+// speed against quality of the encoder, picks the preset of the backend
+// when HMEncoderOptions leaves it out
+typedef enum HMEncoderProfile {
+    // a player waits on the segment, encode as fast as the backend can with
+    // no frame held back: no b-frames or lookahead and the zerolatency tune
+    // of software encoders, unless the options set them
+    HM_PROFILE_LATENCY = 0,
+    // nobody waits on it, spend the time on quality
+    HM_PROFILE_QUALITY = 1,
+} HMEncoderProfile;
+
+// encoder parameters of a transcode, NULL or hm_encoder_options_init()
+// leaves everything but the profile's settings to the encoder. options the
+// encoder doesn't have are skipped with a warning
+typedef struct HMEncoderOptions {
+    HMEncoderProfile profile;
+    // NULL for the profile's preset
+    const char *preset;
+    // NULL for the profile's, none outside the latency profile
+    const char *tune;
+    // average bits per second, 0 leaves rate control to the encoder
+    int64_t bit_rate;
+    // peak bits per second with a buffer of twice that (at most INT_MAX
+    // bits), 0 for none
+    int64_t max_rate;
+    // constant quality (crf of software encoders, global_quality of
+    // hardware ones) used when bit_rate is 0, -1 for none
+    int quality;
+    // frames from one keyframe to the next, -1 for the encoder's default
+    int gop_size;
+    // frames the rate control looks ahead, -1 for the profile's default (0
+    // for latency, the preset's for quality)
+    int lookahead;
+    // consecutive b-frames, -1 for the profile's default like lookahead
+    int b_frames;
+} HMEncoderOptions;
+
+void hm_encoder_options_init(HMEncoderOptions *opts, HMEncoderProfile profile);
+
+// one output of hm_transcode_renditions
+typedef struct HMRendition {
+    // codec or encoder name, mapped to the context's backend
+    const char *encoder_name;
+    // NULL for the latency profile
+    const HMEncoderOptions *options;
+    // output height, 0 keeps the source size
+    int height;
+    // set to the whole segment on success, free it with hm_free_buffer
+    uint8_t *output_buffer;
+    int output_size;
+} HMRendition;
+
+// parts of a transcoded segment, its time is charged to exactly one of them
+typedef enum HMStage {
+    // opening the input, its decoder, the output and the encoder
+    HM_STAGE_OPEN = 0,
+    HM_STAGE_SEEK,
+    // demuxing packets
+    HM_STAGE_READ,
+    // decoding the frames before start that are thrown away, from the
+    // keyframe the seek landed on
+    HM_STAGE_PREROLL,
+    // decoding the frames of the segment
+    HM_STAGE_DECODE,
+    // decoding the frames after the end that are thrown away, up to the next
+    // keyframe
+    HM_STAGE_TAIL,
+    HM_STAGE_SCALE,
+    HM_STAGE_ENCODE,
+    // muxing and writing the output
+    HM_STAGE_MUX,
+    HM_NB_STAGES,
+} HMStage;
+
+typedef struct HMStageTime {
+    // microseconds
+    int64_t wall;
+    // microseconds of the whole process, codec threads included, 0 unless
+    // process_cpu was set
+    int64_t cpu;
+} HMStageTime;
+
+// where the time of a segment went, filled in by hm_transcode_segment and
+// hm_transcode_segment_stream
+typedef struct HMTranscodeStats {
+    // set by the caller, nonzero also measures the cpu times. they cost a
+    // syscall per charge where the wall clock is read from the vdso
+    int process_cpu;
+    HMStageTime stages[HM_NB_STAGES];
+    // the whole call, cleaning up after the segment is in no stage
+    HMStageTime total;
+    int64_t packets_read;
+    int64_t frames_decoded;
+    // decoded frames outside the segment
+    int64_t frames_discarded;
+    // frames outside the segment that no other frame references, the
+    // decoder skipped them instead of decoding them
+    int64_t frames_skipped;
+    int64_t frames_encoded;
+    int64_t bytes_out;
+} HMTranscodeStats;
+
+int hm_transcode_segment(HMContext *hm_ctx, const char *in_filename,
+                         const char *encoder_name,
+                         const HMEncoderOptions *options, const int height,
+                         const HMFormat format, const double start,
+                         const double duration, const int64_t seek_pos,
+                         uint8_t **output_buffer, int *output_size,
+                         HMTranscodeStats *stats);
+int hm_transcode_segment_stream(HMContext *hm_ctx, const char *in_filename,
+                                const char *encoder_name,
+                                const HMEncoderOptions *options,
+                                const int height, const HMFormat format,
+                                const double start, const double duration,
+                                const int64_t seek_pos,
+                                HMWritePacket write_packet, void *opaque,
+                                HMTranscodeStats *stats);
+int hm_transcode_renditions(HMContext *hm_ctx, const char *in_filename,
+                            HMRendition *renditions, const int nb_renditions,
+                            const HMFormat format, const double start,
+                            const double duration, const int64_t seek_pos);
+
+// long-lived transcode of consecutive segments of one file
+typedef struct HMSession HMSession;
+
+HMSession *hm_session_open(HMContext *hm_ctx, const char *in_filename,
+                           const char *encoder_name,
+                           const HMEncoderOptions *options, const int height,
+                           const HMFormat format, const double *starts,
+                           const int nb_segments, const double end,
+                           const int64_t seek_pos);
+void hm_session_set_interrupt(HMSession *session, const int *interrupt);
+int hm_session_next(HMSession *session, uint8_t **output_buffer,
+                    int *output_size);
+void hm_session_free(HMSession *session);
+
+// both give up with AVERROR_EXIT once *interrupt is set, NULL makes them
+// uninterruptible
+int hm_remux_segment(const char *in_filename, const HMFormat format,
+                     const double start, const double duration,
+                     const int64_t seek_pos, const int *interrupt,
+                     uint8_t **output_buffer, int *output_size);
+int hm_remux_segment_stream(const char *in_filename, const HMFormat format,
+                            const double start, const double duration,
+                            const int64_t seek_pos, const int *interrupt,
+                            HMWritePacket write_packet, void *opaque);
+
+void hm_free_buffer(uint8_t *buffer);
+
+#endif
@@ -1,68 +1,160 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavfilter/avfilter.h>
 #include <libavutil/buffer.h>
+#include <libavutil/time.h>
 #include <libavutil/timestamp.h>
+#include <string.h>
+#include <time.h>
 
-typedef struct PacketQueueNode {
-    AVPacket *pkt;
-    struct PacketQueueNode *next;
-} PacketQueueNode;
+#include "hm_context.h"
+#include "hm_transcode.h"
 
+// fifo of packets in a ring of packets that are allocated once and reused,
+// it only allocates when it grows past its capacity
 typedef struct PacketQueue {
-    PacketQueueNode *head;
-    PacketQueueNode *tail;
+    AVPacket **pkts;
+    int capacity;
+    // index of the oldest packet
+    int head;
     int len;
 } PacketQueue;
 
-static inline PacketQueue *packet_queue_new() {
-    PacketQueue *pktq = (PacketQueue *)av_mallocz(sizeof(PacketQueue));
-    pktq->len = 0; 
-    pktq->head = pktq->tail = NULL;
-    return pktq;
+#define PACKET_QUEUE_MIN_CAPACITY 16
+
+// i'th packet from the oldest, it stays in the queue
+static inline AVPacket *packet_queue_at(PacketQueue *pktq, int i) {
+    return pktq->pkts[(pktq->head + i) % pktq->capacity];
+}
+
+// doubles the ring keeping the order of the packets
+static inline int packet_queue_grow(PacketQueue *pktq) {
+    int capacity = FFMAX(PACKET_QUEUE_MIN_CAPACITY, pktq->capacity * 2);
+    AVPacket **pkts = av_calloc(capacity, sizeof(*pkts));
+
+    if (!pkts)
+        return AVERROR(ENOMEM);
+    for (int i = 0; i < pktq->capacity; i++)
+        pkts[i] = packet_queue_at(pktq, i);
+    for (int i = pktq->capacity; i < capacity; i++) {
+        if (!(pkts[i] = av_packet_alloc())) {
+            while (--i >= pktq->capacity)
+                av_packet_free(&pkts[i]);
+            av_free(pkts);
+            return AVERROR(ENOMEM);
+        }
+    }
+    av_free(pktq->pkts);
+    pktq->pkts = pkts;
+    pktq->capacity = capacity;
+    pktq->head = 0;
+    return 0;
 }
 
+// moves pkt into the queue, pkt is blank afterwards. a new reference would
+// allocate an AVBufferRef per packet, only packets without a buffer are
+// copied
 static inline int packet_queue_push(PacketQueue *pktq, AVPacket *pkt) {
-    PacketQueueNode *new_node = (PacketQueueNode *)av_mallocz(sizeof(PacketQueueNode));
-    new_node->pkt = av_packet_clone(pkt);
-    new_node->next = NULL;
+    AVPacket *dst;
+    int ret;
 
-    if (pktq->len == 0) {
-        pktq->head = pktq->tail = new_node;
+    if (pktq->len == pktq->capacity && (ret = packet_queue_grow(pktq)) < 0)
+        return ret;
+    dst = packet_queue_at(pktq, pktq->len);
+    if (pkt->buf) {
+        av_packet_move_ref(dst, pkt);
     } else {
-        pktq->tail->next = new_node;
-        pktq->tail = new_node;
+        if ((ret = av_packet_ref(dst, pkt)) < 0)
+            return ret;
+        av_packet_unref(pkt);
     }
     pktq->len++;
-
     return 0;
 }
 
-// ownership of AVPacket goes to you so you must av_packet_free returned packet
-static inline AVPacket *packet_queue_pop(PacketQueue *pktq) {
-    AVPacket *ret = pktq->head->pkt;
-    PacketQueueNode *new_head = pktq->head->next;
-    av_free(pktq->head);
-    pktq->head = new_head;
+// moves the oldest packet into pkt, which must be blank
+static inline void packet_queue_pop(PacketQueue *pktq, AVPacket *pkt) {
+    av_packet_move_ref(pkt, packet_queue_at(pktq, 0));
+    pktq->head = (pktq->head + 1) % pktq->capacity;
     pktq->len--;
-    if (pktq->len == 0) 
-        pktq->tail = NULL;
-    return ret;
 }
 
-static inline void packet_queue_free(PacketQueue *pktq) {
-    while (pktq->len) {
-        AVPacket *pkt = packet_queue_pop(pktq);
-        av_packet_free(&pkt);
-    }
-    av_free(pktq);
+// drops the queued packets, the ring is kept
+static inline void packet_queue_clear(PacketQueue *pktq) {
+    for (int i = 0; i < pktq->len; i++)
+        av_packet_unref(packet_queue_at(pktq, i));
+    pktq->head = pktq->len = 0;
 }
 
-typedef struct TranscodeContext {
-    AVBufferRef *hw_device_ctx;
+static inline void packet_queue_uninit(PacketQueue *pktq) {
+    for (int i = 0; i < pktq->capacity; i++)
+        av_packet_free(&pktq->pkts[i]);
+    av_freep(&pktq->pkts);
+    pktq->capacity = pktq->head = pktq->len = 0;
+}
+
+// whole segment output owned by the caller once the segment is done
+typedef struct OutputBuffer {
+    uint8_t *data;
+    int64_t size;
+    int64_t capacity;
+} OutputBuffer;
+
+// one output of a segment, a transcode fans the decoded frames out to each
+// of them
+typedef struct OutputContext OutputContext;
+struct OutputContext {
+    HMFormat format;
+
+    // output goes to write_packet when set, otherwise into output which is
+    // preallocated with output_size_hint bytes and handed to output_buffer
+    HMWritePacket write_packet;
+    void *write_opaque;
+    OutputBuffer output;
+    int64_t output_size_hint;
+    uint8_t **output_buffer;
+    int *output_size;
 
-    const char *in_filename;
-    AVFormatContext *ifmt_ctx;
     AVFormatContext *ofmt_ctx;
+    AVStream *out_video_stream;
+    AVStream *out_audio_stream;
+
+    // video encoder, NULL when packets are copied
+    const char *encoder_name;
+    // NULL for the latency profile
+    const HMEncoderOptions *enc_opts;
+    AVCodecContext *enc_ctx;
+    // takes the encoded video packets in the encoder's time base instead of
+    // ofmt_ctx when set, a session cuts its segments here
+    int (*write_video_packet)(OutputContext *out, AVPacket *pkt);
+    void *opaque;
+
+    // output height, 0 or anything not smaller than the source keeps the
+    // source size and leaves filter_graph NULL
+    int out_height;
+    AVFilterGraph *filter_graph;
+    AVFilterContext *buffersrc_ctx;
+    AVFilterContext *buffersink_ctx;
+};
+
+// opened source of segments, HMContext keeps it open between segments of
+// the same file so they skip opening and probing it
+typedef struct InputContext {
+    char *in_filename;
+    // identity of the opened file, a changed file is opened again
+    int64_t mtime;
+    int64_t size;
+
+    // backend of the decoder, may drop to HM_BACKEND_SW when the hardware
+    // decoder can't handle the input codec
+    HMBackend backend;
+    enum AVPixelFormat hw_pix_fmt;
+
+    AVFormatContext *ifmt_ctx;
+
+    // interrupt of the transcode using the input, checked by blocking io of
+    // ifmt_ctx. NULL while the input is idle
+    const int *interrupt;
 
     // best video stream's index
     int in_video_stream_index;
@@ -72,18 +164,111 @@ typedef struct TranscodeContext {
 
     AVStream *in_video_stream;
     AVStream *in_audio_stream;
-    AVStream *out_video_stream;
-    AVStream *out_audio_stream;
 
-    PacketQueue *audio_pktq;
-
-    // both decoder and encoder contexts are for video since audio is copied
+    // video decoder, audio is copied. opened by the first transcode and
+    // flushed by the ones after it
     AVCodecContext *dec_ctx;
-    AVCodecContext *enc_ctx;
 
-    AVCodec *video_enc_codec;
+    // av_gettime_relative() when it was last handed back
+    int64_t last_used;
+} InputContext;
+
+// packets, frames and the audio queue transcode_segment works with, the
+// HMContext keeps them so a warmed up context allocates none of them per
+// segment or frame
+typedef struct TranscodeScratch {
+    AVPacket *pkt;
+    AVPacket *audio_pkt;
+    AVFrame *frame;
+    AVFrame *filt_frame;
+    PacketQueue audio_pktq;
+} TranscodeScratch;
+
+typedef struct TranscodeContext {
+    AVBufferRef *hw_device_ctx;
+    int threads;
+
+    InputContext *input;
+
+    OutputContext *outputs;
+    int nb_outputs;
+
+    // reused for every decoded and every scaled frame
+    AVFrame *frame;
+    AVFrame *filt_frame;
+    // audio packets that arrive before the encoders are open, every output
+    // gets them once they are
+    PacketQueue *audio_pktq;
+    AVPacket *audio_pkt;
+
+    // filled in when set, the time since stats_wall and stats_cpu goes to
+    // the stage charged next
+    HMTranscodeStats *stats;
+    int64_t stats_wall;
+    int64_t stats_cpu;
+    // video packets sent to the decoder outside the segment, the ones that
+    // came out as discarded frames were not skipped
+    int64_t outside_packets;
 } TranscodeContext;
 
+static inline int64_t process_cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void stats_start(TranscodeContext *tctx,
+                               HMTranscodeStats *stats) {
+    tctx->stats = stats;
+    if (!stats)
+        return;
+    int process_cpu = stats->process_cpu;
+    memset(stats, 0, sizeof(*stats));
+    stats->process_cpu = process_cpu;
+    tctx->stats_wall = av_gettime_relative();
+    tctx->stats_cpu = process_cpu ? process_cpu_time() : 0;
+    stats->total.wall = -tctx->stats_wall;
+    stats->total.cpu = -tctx->stats_cpu;
+}
+
+// charges the time since the last charge to stage
+static inline void stats_charge(TranscodeContext *tctx, HMStage stage) {
+    if (!tctx->stats)
+        return;
+    int64_t wall = av_gettime_relative();
+    tctx->stats->stages[stage].wall += wall - tctx->stats_wall;
+    tctx->stats_wall = wall;
+    if (!tctx->stats->process_cpu)
+        return;
+    int64_t cpu = process_cpu_time();
+    tctx->stats->stages[stage].cpu += cpu - tctx->stats_cpu;
+    tctx->stats_cpu = cpu;
+}
+
+static inline void stats_finish(TranscodeContext *tctx) {
+    if (!tctx->stats)
+        return;
+    tctx->stats->frames_skipped =
+        FFMAX(0, tctx->outside_packets - tctx->stats->frames_discarded);
+    tctx->stats->total.wall += av_gettime_relative();
+    if (tctx->stats->process_cpu)
+        tctx->stats->total.cpu += process_cpu_time();
+}
+
+// nonzero once the transcode behind interrupt was cancelled
+static inline int interrupted(const int *interrupt) {
+    return interrupt && __atomic_load_n(interrupt, __ATOMIC_RELAXED);
+}
+
+int open_input(InputContext **input, const char *in_filename,
+               HMBackend backend, const int *interrupt);
+int open_input_decoder(InputContext *input, AVBufferRef *hw_device_ctx,
+                       int threads);
+void free_input(InputContext **input);
+InputContext *take_input(HMContext *ctx, const char *in_filename);
+void put_input(HMContext *ctx, InputContext *input);
+void free_scratch(TranscodeScratch **scratch);
+
 static inline char *limit(char *str, int limit) {
     // FIXME: check strlen for out of bounds error
     str[limit] = '\0';
@@ -112,34 +297,38 @@ static inline void log_frame(AVFrame *frame, AVStream *stream, const char *tag)
 }
 
 static inline void dump_transcode_context(TranscodeContext *tctx) {
-    if (tctx->ifmt_ctx == NULL) {
+    InputContext *input = tctx->input;
+    if (input->ifmt_ctx == NULL) {
         fprintf(stderr, "ifmt_ctx is NULL\n");
     } else {
-        av_dump_format(tctx->ifmt_ctx, 0, tctx->in_filename, 0);
+        av_dump_format(input->ifmt_ctx, 0, input->in_filename, 0);
     }
 
     fprintf(stderr, "\tInput video stream index: %d\n",
-            tctx->in_video_stream_index);
+            input->in_video_stream_index);
     fprintf(stderr, "\tInput video start time: %s\n",
-            av_ts2timestr(tctx->in_video_stream->start_time,
-                          &tctx->in_video_stream->time_base));
+            av_ts2timestr(input->in_video_stream->start_time,
+                          &input->in_video_stream->time_base));
     fprintf(stderr, "\tInput audio stream index: %d\n",
-            tctx->in_audio_stream_index);
+            input->in_audio_stream_index);
     fprintf(stderr, "\tInput audio start time: %s\n",
-            av_ts2timestr(tctx->in_audio_stream->start_time,
-                          &tctx->in_audio_stream->time_base));
+            av_ts2timestr(input->in_audio_stream->start_time,
+                          &input->in_audio_stream->time_base));
     fprintf(stderr, "\tInput audio stream time base: %d / %d\n",
-            tctx->in_audio_stream->time_base.num,
-            tctx->in_audio_stream->time_base.den);
+            input->in_audio_stream->time_base.num,
+            input->in_audio_stream->time_base.den);
 
-    if (tctx->ofmt_ctx == NULL) {
-        fprintf(stderr, "ofmt_ctx is NULL\n");
-    } else {
-        av_dump_format(tctx->ofmt_ctx, 0, NULL, 1);
+    for (int i = 0; i < tctx->nb_outputs; i++) {
+        OutputContext *out = &tctx->outputs[i];
+        if (out->ofmt_ctx == NULL) {
+            fprintf(stderr, "ofmt_ctx of output %d is NULL\n", i);
+            continue;
+        }
+        av_dump_format(out->ofmt_ctx, i, NULL, 1);
+        fprintf(stderr, "\tOutput audio stream time base: %d / %d\n",
+                out->out_audio_stream->time_base.num,
+                out->out_audio_stream->time_base.den);
     }
-    fprintf(stderr, "\tOutput audio stream time base: %d / %d\n",
-            tctx->out_audio_stream->time_base.num,
-            tctx->out_audio_stream->time_base.den);
 }
 
 static inline const char *find_qsv_codec(enum AVCodecID id) {
@@ -185,3 +374,129 @@ static inline const AVCodec *find_qsv_encoder_by_name(const char *name) {
     }
 }
 
+
+static inline const char *find_vaapi_codec(enum AVCodecID id) {
+    switch (id) {
+    case AV_CODEC_ID_H264:
+        return "h264_vaapi";
+    case AV_CODEC_ID_HEVC:
+        return "hevc_vaapi";
+    case AV_CODEC_ID_VP9:
+        return "vp9_vaapi";
+    case AV_CODEC_ID_VP8:
+        return "vp8_vaapi";
+    case AV_CODEC_ID_AV1:
+        return "av1_vaapi";
+    case AV_CODEC_ID_MPEG2VIDEO:
+        return "mpeg2_vaapi";
+    case AV_CODEC_ID_MJPEG:
+        return "mjpeg_vaapi";
+    default:
+        fprintf(stderr, "Codec is not supportted by vaapi\n");
+        return NULL;
+    }
+}
+
+// preferred software encoders, avcodec_find_encoder is used for the rest
+static inline const char *find_sw_encoder_name(enum AVCodecID id) {
+    switch (id) {
+    case AV_CODEC_ID_H264:
+        return "libx264";
+    case AV_CODEC_ID_HEVC:
+        return "libx265";
+    case AV_CODEC_ID_AV1:
+        return "libsvtav1";
+    case AV_CODEC_ID_VP9:
+        return "libvpx-vp9";
+    default:
+        return NULL;
+    }
+}
+
+static inline int codec_supports_device(const AVCodec *codec,
+                                        enum AVHWDeviceType type) {
+    const AVCodecHWConfig *config;
+    for (int i = 0; (config = avcodec_get_hw_config(codec, i)); i++) {
+        if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) &&
+            config->device_type == type)
+            return 1;
+    }
+    return 0;
+}
+
+// pixel format of the hardware frames an encoder consumes, AV_PIX_FMT_NONE
+// for software encoders
+static inline enum AVPixelFormat encoder_hw_pix_fmt(const AVCodec *codec) {
+    const AVCodecHWConfig *config;
+    for (int i = 0; (config = avcodec_get_hw_config(codec, i)); i++) {
+        if (config->pix_fmt == AV_PIX_FMT_QSV ||
+            config->pix_fmt == AV_PIX_FMT_VAAPI)
+            return config->pix_fmt;
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+static inline const AVCodec *find_backend_decoder(HMBackend backend,
+                                                  enum AVCodecID id) {
+    const AVCodec *dec_codec;
+    switch (backend) {
+    case HM_BACKEND_QSV:
+        return find_qsv_decoder(id);
+    case HM_BACKEND_VAAPI:
+        // vaapi decoding is a hwaccel of the native decoder
+        dec_codec = avcodec_find_decoder(id);
+        if (dec_codec &&
+            codec_supports_device(dec_codec, AV_HWDEVICE_TYPE_VAAPI))
+            return dec_codec;
+        return NULL;
+    default:
+        return avcodec_find_decoder(id);
+    }
+}
+
+/**
+ * - name can be a codec name ("h264", "hevc", "av1") or an encoder name
+ * ("h264_qsv", "libx264")
+ * - an encoder name that doesn't match backend is mapped to the encoder of
+ * the same codec on backend
+ */
+static inline const AVCodec *find_backend_encoder(HMBackend backend,
+                                                  const char *name) {
+    const AVCodecDescriptor *desc = avcodec_descriptor_get_by_name(name);
+    const AVCodec *enc_codec = NULL;
+    const char *enc_name = NULL;
+    enum AVCodecID id;
+
+    if (desc) {
+        id = desc->id;
+    } else {
+        enc_codec = avcodec_find_encoder_by_name(name);
+        if (!enc_codec)
+            return NULL;
+        if (encoder_hw_pix_fmt(enc_codec) == hm_backend_pix_fmt(backend))
+            return enc_codec;
+        id = enc_codec->id;
+    }
+
+    switch (backend) {
+    case HM_BACKEND_QSV:
+        enc_name = find_qsv_codec(id);
+        break;
+    case HM_BACKEND_VAAPI:
+        enc_name = find_vaapi_codec(id);
+        break;
+    default:
+        enc_name = find_sw_encoder_name(id);
+        break;
+    }
+
+    if (enc_name && (enc_codec = avcodec_find_encoder_by_name(enc_name)))
+        return enc_codec;
+    if (backend != HM_BACKEND_SW)
+        return NULL;
+
+    enc_codec = avcodec_find_encoder(id);
+    if (enc_codec && encoder_hw_pix_fmt(enc_codec) != AV_PIX_FMT_NONE)
+        return NULL;
+    return enc_codec;
+}
@@ -4,526 +4,387 @@
  * Don't know what to say here
  * just do whatever you want with this code
  *
- * Haema Transcode is binary + library for correctly segmenting and transcoding
- * parts of a large video very fast.
- *
- * Currently utilizes intel's qsv hardware accelerated codecs.
- * timestamps of source video are preserved in segmented output.
+ * Transcodes consecutive segments of a file with hm_transcode_segment and
+ * reports where the time went, per segment and summed over all of them.
+ * `make bench` runs it over a clip generated from lavfi test sources,
+ * `make allocs` counts the heap allocations a warmed up context makes per
+ * frame and fails when the library sources make any of their own.
  */
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <libavcodec/packet.h>
-#include <libavformat/avio.h>
-#include <libavutil/avutil.h>
-#include <libavutil/mathematics.h>
-#include <libavutil/opt.h>
-
-#include "../include/hm_util.h"
+#include <libavutil/common.h>
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
 
-const int OUT_VIDEO_STREAM_INDEX = 0;
-const int OUT_AUDIO_STREAM_INDEX = 1;
+#include "../include/hm_context.h"
+#include "../include/hm_transcode.h"
 
-int get_format(AVCodecContext *avctx, const enum AVPixelFormat *pix_fmts) {
-  while (*pix_fmts != AV_PIX_FMT_NONE) {
-    if (*pix_fmts == AV_PIX_FMT_QSV) {
-      return AV_PIX_FMT_QSV;
-    }
-
-    pix_fmts++;
-  }
+#ifdef __GLIBC__
+// every heap allocation of the process goes through these, libav* included
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
 
-  fprintf(stderr, "The QSV pixel format not offered in get_format()\n");
+static int64_t nb_allocs;
 
-  return AV_PIX_FMT_NONE;
+static inline void count_alloc(void) {
+  __atomic_fetch_add(&nb_allocs, 1, __ATOMIC_RELAXED);
 }
 
-AVCodecContext *config_dec_ctx(AVStream *stream, AVFormatContext *ifmt_ctx,
-                               AVBufferRef *hw_device_ctx) {
-  int ret;
-  const AVCodec *dec_codec = find_qsv_decoder(stream->codecpar->codec_id);
-  if (!dec_codec) {
-    fprintf(stderr, "Failed to find decoder\n");
-    return NULL;
-  }
-
-  AVCodecContext *dec_ctx = avcodec_alloc_context3(dec_codec);
-  if (!dec_ctx) {
-    fprintf(stderr, "Failed to allocate decoder context");
-    return NULL;
-  }
-
-  ret = avcodec_parameters_to_context(dec_ctx, stream->codecpar);
-  if (ret < 0) {
-    fprintf(stderr, "Failed to copy decoder params to input decoder context");
-    return NULL;
-  }
-
-  dec_ctx->pkt_timebase = stream->time_base;
-  dec_ctx->framerate = av_guess_frame_rate(ifmt_ctx, stream, NULL);
-  dec_ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
-  if (!dec_ctx->hw_device_ctx) {
-    fprintf(stderr, "A hardware device reference create failed\n");
-    return NULL;
-  }
-  dec_ctx->get_format = get_format;
-
-  if ((ret = avcodec_open2(dec_ctx, dec_codec, NULL)) < 0) {
-    fprintf(stderr, "Failed to open decoder\n");
-    return NULL;
-  }
-
-  return dec_ctx;
+void *malloc(size_t size) {
+  count_alloc();
+  return __libc_malloc(size);
 }
 
-int config_input(TranscodeContext *tctx) {
-  int ret;
-  tctx->ifmt_ctx = NULL;
-  if ((ret = avformat_open_input(&tctx->ifmt_ctx, tctx->in_filename, 0, 0)) <
-      0) {
-    fprintf(stderr, "Could not open input filename '%s'\n", tctx->in_filename);
-    return ret;
-  }
-
-  if ((ret = avformat_find_stream_info(tctx->ifmt_ctx, 0)) < 0) {
-    fprintf(stderr, "Failed to retrieve input stream information\n");
-    return ret;
-  }
-
-  if ((ret = av_find_best_stream(tctx->ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1,
-                                 NULL, 0)) < 0) {
-    fprintf(stderr, "Cannot find a video stream in input file: %s\n",
-            av_err2str(ret));
-    return ret;
-  }
-  tctx->in_video_stream_index = ret;
-  tctx->in_video_stream = tctx->ifmt_ctx->streams[ret];
-
-  tctx->dec_ctx = config_dec_ctx(tctx->in_video_stream, tctx->ifmt_ctx,
-                                 tctx->hw_device_ctx);
-  if (tctx->dec_ctx == NULL) {
-    fprintf(stderr, "Failed to config decoder context for video stream\n");
-    return -1;
-  }
-
-  if ((ret = av_find_best_stream(tctx->ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1,
-                                 NULL, 0)) < 0) {
-    fprintf(stderr, "Cannot find a audio stream in input file: %s\n",
-            av_err2str(ret));
-    return ret;
-  }
-  tctx->in_audio_stream_index = ret;
-  tctx->in_audio_stream = tctx->ifmt_ctx->streams[ret];
-
-  return 0;
+void *calloc(size_t nmemb, size_t size) {
+  count_alloc();
+  return __libc_calloc(nmemb, size);
 }
 
-int config_output(TranscodeContext *tctx, const char *encoder_name) {
-  AVStream *out_video_stream, *out_audio_stream;
-  int ret;
-
-  tctx->ofmt_ctx = NULL;
-
-  const AVOutputFormat *mpegts_ofmt = av_guess_format(NULL, NULL, "video/MP2T");
-  if (mpegts_ofmt == NULL) {
-    fprintf(stderr, "Failed guessing mpegts format\n");
-    return -1;
-  }
-
-  if ((ret = avformat_alloc_output_context2(&tctx->ofmt_ctx, mpegts_ofmt, NULL,
-                                            NULL)) < 0 ||
-      !tctx->ofmt_ctx) {
-    fprintf(stderr, "Could not create output context\n");
-    return ret;
-  }
-
-  const AVCodec *enc_codec = avcodec_find_encoder_by_name(encoder_name);
-  if (!enc_codec) {
-    fprintf(stderr, "Could not find encoder: %s\n", encoder_name);
-    return -1;
-  }
-  tctx->enc_ctx = avcodec_alloc_context3(enc_codec);
-  if (tctx->enc_ctx == NULL) {
-    fprintf(stderr, "Failed to configure encoder context\n");
-    return -1;
-  }
-
-  // config output video stream
-  out_video_stream = avformat_new_stream(tctx->ofmt_ctx, enc_codec);
-  if (!out_video_stream) {
-    fprintf(stderr, "Failed allocating output video stream\n");
-    return -1;
-  }
-  tctx->out_video_stream = out_video_stream;
-
-  // config output audio stream
-  out_audio_stream = avformat_new_stream(tctx->ofmt_ctx, NULL);
-  if (!out_audio_stream) {
-    fprintf(stderr, "Failed allocating output video stream\n");
-    return -1;
-  }
-  tctx->out_audio_stream = out_audio_stream;
+void *realloc(void *ptr, size_t size) {
+  count_alloc();
+  return __libc_realloc(ptr, size);
+}
 
-  ret = avcodec_parameters_copy(out_audio_stream->codecpar,
-                                tctx->in_audio_stream->codecpar);
-  if (ret < 0) {
-    fprintf(stderr, "Failed to copy audio stream codec params\n");
-    return ret;
-  }
-  out_audio_stream->codecpar->codec_tag = 0;
-  out_audio_stream->time_base = tctx->in_audio_stream->time_base;
+void *memalign(size_t alignment, size_t size) {
+  count_alloc();
+  return __libc_memalign(alignment, size);
+}
 
-  if ((ret = avio_open_dyn_buf(&tctx->ofmt_ctx->pb)) < 0) {
-    fprintf(stderr, "Cannot open output file: %s\n", av_err2str(ret));
-    return ret;
-  }
+void *aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
 
+// av_malloc's allocator
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (!(*memptr = memalign(alignment, size)))
+    return ENOMEM;
   return 0;
 }
 
-int config_enc(TranscodeContext *tctx) {
-  AVCodecContext *enc_ctx = tctx->enc_ctx;
-  AVCodecContext *dec_ctx = tctx->dec_ctx;
-  int ret;
-
-  enc_ctx->hw_frames_ctx = av_buffer_ref(dec_ctx->hw_frames_ctx);
-  if (!enc_ctx->hw_frames_ctx) {
-    fprintf(stderr, "Failed to reference decoder context hw_frames_ctx\n");
-    return -1;
-  }
-
-  enc_ctx->time_base = dec_ctx->pkt_timebase;
-  enc_ctx->framerate = dec_ctx->framerate;
-  enc_ctx->pix_fmt = AV_PIX_FMT_QSV;
-
-  // TODO: variable out video dimensions
-  enc_ctx->width = dec_ctx->width;
-  enc_ctx->height = dec_ctx->height;
-
-  // TODO: handle encoder options
-  if ((ret = av_opt_set(enc_ctx->priv_data, "preset", "veryslow", 0)) < 0) {
-    fprintf(stderr, "Failed to set preset to slower: %s\n", av_err2str(ret));
-    return ret;
-  }
-
-  if ((ret = avcodec_open2(enc_ctx, enc_ctx->codec, NULL)) < 0) {
-    fprintf(stderr, "Failed to open encode codec: %s\n", av_err2str(ret));
-    return ret;
-  }
-
-  tctx->out_video_stream->time_base = enc_ctx->time_base;
-  ret = avcodec_parameters_from_context(tctx->out_video_stream->codecpar,
-                                        enc_ctx);
-  if (ret < 0) {
-    fprintf(stderr, "Failed to copy codec parameters to stream\n");
-    return ret;
-  }
-
-  if ((ret = avformat_write_header(tctx->ofmt_ctx, NULL)) < 0) {
-    fprintf(stderr, "Error while writing stream header: %s\n", av_err2str(ret));
-    return ret;
-  }
-
-  while (tctx->audio_pktq->len) {
-    AVPacket *pkt = packet_queue_pop(tctx->audio_pktq);
-
-    pkt->stream_index = OUT_AUDIO_STREAM_INDEX;
-    pkt->pos = -1;
-    av_packet_rescale_ts(pkt, tctx->in_audio_stream->time_base,
-                         tctx->out_audio_stream->time_base);
-    // log_packet(pkt, tctx->out_audio_stream, "out");
-
-    ret = av_interleaved_write_frame(tctx->ofmt_ctx, pkt);
-    if (ret < 0) {
-      fprintf(stderr, "Error muxing audio packet\n");
-      break;
-    }
-  }
-  packet_queue_free(tctx->audio_pktq);
-  return 0;
+static int64_t allocs_now(void) {
+  return __atomic_load_n(&nb_allocs, __ATOMIC_RELAXED);
+}
+#else
+static int64_t allocs_now(void) { return -1; }
+#endif
+
+// the Makefile --wraps these for the library sources only, so they count the
+// allocations hm_*.c makes itself apart from the ones inside libav*
+static int64_t nb_owned_allocs;
+
+#define WRAP_ALLOC(type, name, params, args)                                   \
+  extern type __real_##name params;                                            \
+  type __wrap_##name params {                                                  \
+    __atomic_fetch_add(&nb_owned_allocs, 1, __ATOMIC_RELAXED);                 \
+    return __real_##name args;                                                 \
+  }
+
+WRAP_ALLOC(void *, av_malloc, (size_t size), (size))
+WRAP_ALLOC(void *, av_mallocz, (size_t size), (size))
+WRAP_ALLOC(void *, av_calloc, (size_t nmemb, size_t size), (nmemb, size))
+WRAP_ALLOC(void *, av_realloc, (void *ptr, size_t size), (ptr, size))
+WRAP_ALLOC(char *, av_strdup, (const char *s), (s))
+WRAP_ALLOC(AVPacket *, av_packet_alloc, (void), ())
+WRAP_ALLOC(AVFrame *, av_frame_alloc, (void), ())
+// a new reference of a packet allocates its AVBufferRef
+WRAP_ALLOC(int, av_packet_ref, (AVPacket *dst, const AVPacket *src),
+           (dst, src))
+
+static int64_t owned_allocs_now(void) {
+  return __atomic_load_n(&nb_owned_allocs, __ATOMIC_RELAXED);
 }
 
-int encode_write(TranscodeContext *tctx, AVPacket *pkt, AVFrame *frame) {
-  AVCodecContext *enc_ctx = tctx->enc_ctx;
-  int ret = 0;
+// the library sources allocate per segment, never per frame, so a segment
+// twice as long makes as many of their allocations. it may still grow its
+// output buffer a time or two more
+#define MAX_OWNED_EXTRA_ALLOCS 2
+
+static const char *stage_names[HM_NB_STAGES] = {
+    [HM_STAGE_OPEN] = "open",
+    [HM_STAGE_SEEK] = "seek",
+    [HM_STAGE_READ] = "read",
+    [HM_STAGE_PREROLL] = "preroll",
+    [HM_STAGE_DECODE] = "decode",
+    [HM_STAGE_TAIL] = "tail",
+    [HM_STAGE_SCALE] = "scale",
+    [HM_STAGE_ENCODE] = "encode",
+    [HM_STAGE_MUX] = "mux",
+};
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options] <input file>\n"
+          "  -n <segments>  segments to transcode (default 10)\n"
+          "  -d <seconds>   segment duration (default 4)\n"
+          "  -s <seconds>   start of the first segment (default 0)\n"
+          "  -e <encoder>   codec or encoder name (default h264)\n"
+          "  -p <profile>   latency or quality (default latency)\n"
+          "  -P <preset>    encoder preset instead of the profile's\n"
+          "  -H <height>    output height, 0 keeps the source size\n"
+          "  -f <ts|fmp4>   output format (default ts)\n"
+          "  -b <backend>   auto, qsv, vaapi or sw (default auto)\n"
+          "  -t <threads>   threads of software codecs, 0 lets ffmpeg decide\n"
+          "  -c             close the input after every segment\n"
+          "  -v             print the stages of every segment\n"
+          "  -a             count heap allocations per frame afterwards, fails\n"
+          "                 when the library sources allocate per frame\n",
+          argv0);
+}
 
-  av_packet_unref(pkt);
+static HMBackend parse_backend(const char *name) {
+  if (!strcmp(name, "qsv"))
+    return HM_BACKEND_QSV;
+  if (!strcmp(name, "vaapi"))
+    return HM_BACKEND_VAAPI;
+  if (!strcmp(name, "sw"))
+    return HM_BACKEND_SW;
+  return HM_BACKEND_AUTO;
+}
 
-  if ((ret = avcodec_send_frame(enc_ctx, frame)) < 0) {
-    fprintf(stderr, "Error during encoding: %s\n", av_err2str(ret));
-    goto encode_write_end;
-  }
-  while (1) {
-    if ((ret = avcodec_receive_packet(enc_ctx, pkt)))
-      break;
+static void add_time(HMStageTime *sum, const HMStageTime *t) {
+  sum->wall += t->wall;
+  sum->cpu += t->cpu;
+}
 
-    pkt->stream_index = OUT_VIDEO_STREAM_INDEX;
-    // log_packet(pkt, tctx->out_video_stream, "out");
-    av_packet_rescale_ts(pkt, tctx->dec_ctx->pkt_timebase,
-                         tctx->out_video_stream->time_base);
-    if ((ret = av_interleaved_write_frame(tctx->ofmt_ctx, pkt)) < 0) {
-      fprintf(stderr, "Error during writing data to output file: %s\n",
-              av_err2str(ret));
-      return ret;
-    }
-  }
+static void add_stats(HMTranscodeStats *sum, const HMTranscodeStats *stats) {
+  for (int i = 0; i < HM_NB_STAGES; i++)
+    add_time(&sum->stages[i], &stats->stages[i]);
+  add_time(&sum->total, &stats->total);
+  sum->packets_read += stats->packets_read;
+  sum->frames_decoded += stats->frames_decoded;
+  sum->frames_discarded += stats->frames_discarded;
+  sum->frames_skipped += stats->frames_skipped;
+  sum->frames_encoded += stats->frames_encoded;
+  sum->bytes_out += stats->bytes_out;
+}
 
-encode_write_end:
-  if (ret == AVERROR_EOF)
-    return 0;
-  ret = ((ret == AVERROR(EAGAIN)) ? 0 : -1);
-  return ret;
+static void print_segment(int idx, double start,
+                          const HMTranscodeStats *stats) {
+  printf("segment %d at %.3fs: %.1fms", idx, start, stats->total.wall / 1e3);
+  for (int i = 0; i < HM_NB_STAGES; i++)
+    printf(" %s %.1f", stage_names[i], stats->stages[i].wall / 1e3);
+  printf(" | %" PRId64 " packets, %" PRId64 "/%" PRId64 "/%" PRId64
+         " frames decoded/discarded/skipped, %" PRId64 " encoded, %" PRId64
+         " bytes\n",
+         stats->packets_read, stats->frames_decoded, stats->frames_discarded,
+         stats->frames_skipped, stats->frames_encoded, stats->bytes_out);
 }
 
-int dec_enc(TranscodeContext *tctx, AVPacket *pkt, int64_t start_ts,
-            int64_t end_ts) {
-  AVCodecContext *enc_ctx = tctx->enc_ctx;
-  AVCodecContext *dec_ctx = tctx->dec_ctx;
-  AVFrame *frame;
-  int ret = 0;
+// wall and cpu time of every stage summed over nb_segments segments, the
+// share is of the total wall time
+static void print_summary(const HMTranscodeStats *sum, int nb_segments,
+                          int64_t min_wall, int64_t max_wall) {
+  double total = sum->total.wall > 0 ? sum->total.wall : 1;
+  int64_t staged = 0;
+
+  printf("\n%-10s %12s %12s %12s %7s\n", "stage", "wall ms", "ms/segment",
+         "cpu ms", "share");
+  for (int i = 0; i < HM_NB_STAGES; i++) {
+    const HMStageTime *t = &sum->stages[i];
+    staged += t->wall;
+    printf("%-10s %12.1f %12.2f %12.1f %6.1f%%\n", stage_names[i],
+           t->wall / 1e3, t->wall / 1e3 / nb_segments, t->cpu / 1e3,
+           100.0 * t->wall / total);
+  }
+  printf("%-10s %12.1f %12.2f %12s %6.1f%%\n", "other",
+         (sum->total.wall - staged) / 1e3,
+         (sum->total.wall - staged) / 1e3 / nb_segments, "",
+         100.0 * (sum->total.wall - staged) / total);
+  printf("%-10s %12.1f %12.2f %12.1f\n", "total", sum->total.wall / 1e3,
+         sum->total.wall / 1e3 / nb_segments, sum->total.cpu / 1e3);
+
+  printf("\nsegments: %d, %.1fms min, %.1fms max\n", nb_segments,
+         min_wall / 1e3, max_wall / 1e3);
+  printf("packets read: %" PRId64 "\n", sum->packets_read);
+  printf("frames decoded: %" PRId64 ", discarded: %" PRId64
+         " (%.1f%%), encoded: %" PRId64 "\n",
+         sum->frames_decoded, sum->frames_discarded,
+         sum->frames_decoded
+             ? 100.0 * sum->frames_discarded / sum->frames_decoded
+             : 0.0,
+         sum->frames_encoded);
+  printf("frames skipped: %" PRId64 "\n", sum->frames_skipped);
+  printf("bytes out: %" PRId64 "\n", sum->bytes_out);
+}
 
-  ret = avcodec_send_packet(dec_ctx, pkt);
-  if (ret < 0) {
-    fprintf(stderr, "Error during decoding: %s\n", av_err2str(ret));
-    return ret;
+// heap allocations per frame of the warmed up ctx: a segment twice as long as
+// the first one only differs from it in its frames, the allocations of
+// opening the encoder and the muxer cancel out. fails when the library
+// sources allocate per frame themselves
+static int report_allocs(HMContext *ctx, const char *in_filename,
+                         const char *encoder_name,
+                         const HMEncoderOptions *opts, int height,
+                         HMFormat format, double start, double duration) {
+  int64_t allocs[2], owned[2], frames[2];
+
+  if (allocs_now() < 0) {
+    fprintf(stderr, "counting allocations needs glibc\n");
+    return -1;
   }
-
-  while (ret >= 0) {
-    if (!(frame = av_frame_alloc())) {
-      fprintf(stderr, "Failed allocating frame\n");
-      return -1;
-    }
-
-    ret = avcodec_receive_frame(dec_ctx, frame);
-    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-      av_frame_free(&frame);
-      return 0;
-    } else if (ret < 0) {
-      fprintf(stderr, "Error while decoding: %s\n", av_err2str(ret));
-      av_frame_free(&frame);
+  for (int i = 0; i < 2; i++) {
+    HMTranscodeStats stats = {0};
+    uint8_t *buffer = NULL;
+    int buffer_size = 0;
+    int64_t before = allocs_now(), owned_before = owned_allocs_now();
+    int ret = hm_transcode_segment(ctx, in_filename, encoder_name, opts,
+                                   height, format, start, duration * (i + 1),
+                                   -1, &buffer, &buffer_size, &stats);
+
+    allocs[i] = allocs_now() - before;
+    owned[i] = owned_allocs_now() - owned_before;
+    frames[i] = stats.frames_decoded;
+    av_free(buffer);
+    if (ret < 0) {
+      fprintf(stderr, "failed to transcode segment for counting\n");
       return ret;
     }
-
-    if (!enc_ctx->hw_frames_ctx) {
-      if ((ret = config_enc(tctx)) < 0) {
-        fprintf(stderr, "Failed to configure encoder\n");
-        goto dec_enc_end;
-      }
-    }
-
-    int64_t frame_ts =
-        av_rescale_q(frame->pts, dec_ctx->pkt_timebase, AV_TIME_BASE_Q);
-
-    if (frame_ts < start_ts || end_ts <= frame_ts) {
-      // fprintf(stderr,
-      //         "Video frame ts %ld(%ld) is out of range [%ld, %ld)\n",
-      //         frame->pts, frame_ts, start_ts, end_ts);
-      goto dec_enc_end;
-    }
-    if ((ret = encode_write(tctx, pkt, frame)) < 0)
-      fprintf(stderr, "Error during encoding and writing\n");
-
-  dec_enc_end:
-    av_frame_free(&frame);
   }
-  return ret;
-}
 
-/**
- * - seek to start and transcode duration length segment from file of
- * in_filename
- * - use encoder specified by encoder_name for video and copy audio
- * - output in mpegts format
- * - start and duration are in seconds
- * - returns -1 on error
- * - segment range is exactly [start_ts, end_ts)
- */
-// TODO: add arguments for decoding and encoding
-int hm_transcode_segment(AVBufferRef *hw_device_ctx, const char *in_filename,
-                         const char *encoder_name, const double start,
-                         const double duration, uint8_t **output_buffer,
-                         int *output_size) {
-  int64_t start_ts = (int64_t)round(start * AV_TIME_BASE);
-  int64_t end_ts = (int64_t)round((duration + start) * AV_TIME_BASE);
-  TranscodeContext *tctx = malloc(sizeof(TranscodeContext));
-  AVPacket *pkt = NULL;
-  int ret;
-
-  tctx->in_filename = in_filename;
-
-  pkt = av_packet_alloc();
-  if (!pkt) {
-    fprintf(stderr, "Could not allocate AVPacket\n");
+  printf("\nallocations: %" PRId64 " for %" PRId64 " frames, %" PRId64
+         " for %" PRId64 " frames\n",
+         allocs[0], frames[0], allocs[1], frames[1]);
+  printf("of them by the library sources: %" PRId64 ", %" PRId64 "\n",
+         owned[0], owned[1]);
+  if (frames[1] <= frames[0]) {
+    fprintf(stderr, "the longer segment has no more frames, the input is too "
+                    "short to count\n");
     return -1;
   }
-  tctx->hw_device_ctx = hw_device_ctx;
-
-  if ((ret = config_input(tctx)) < 0) {
-    fprintf(stderr, "Failed to config input '%s'\n", in_filename);
-    goto end;
-  }
-
-  if ((ret = config_output(tctx, encoder_name)) < 0) {
-    fprintf(stderr, "Failed to config output\n");
-    goto end;
+  double per_frame =
+      (double)(allocs[1] - allocs[0]) / (frames[1] - frames[0]);
+  double owned_per_frame =
+      (double)(owned[1] - owned[0]) / (frames[1] - frames[0]);
+  printf("allocations per frame: %.2f, by the library sources: %.2f\n",
+         per_frame, owned_per_frame);
+  if (owned[1] - owned[0] > MAX_OWNED_EXTRA_ALLOCS) {
+    fprintf(stderr,
+            "the library sources allocate per frame, the longer segment made "
+            "%" PRId64 " more allocations, at most %d are allowed\n",
+            owned[1] - owned[0], MAX_OWNED_EXTRA_ALLOCS);
+    return -1;
   }
+  return 0;
+}
 
-  tctx->audio_pktq = packet_queue_new();
-
-  // adjust start timestamp with stream's start time stamp
-  int64_t stream_start_ts =
-      av_rescale_q(tctx->in_video_stream->start_time,
-                   tctx->in_video_stream->time_base, AV_TIME_BASE_Q);
-
-  end_ts += stream_start_ts;
-
-  // seek based on video stream
-  int64_t start_ts_vtb =
-      av_rescale_q(start_ts, AV_TIME_BASE_Q, tctx->in_video_stream->time_base);
-  avformat_seek_file(tctx->ifmt_ctx, tctx->in_video_stream_index, INT64_MIN,
-                     start_ts_vtb, start_ts_vtb, AVSEEK_FLAG_BACKWARD);
-
-  avcodec_flush_buffers(tctx->dec_ctx);
-  start_ts += stream_start_ts;
-
-  // fprintf(stderr, "start: %ld\tend: %ld\n", start_ts, end_ts);
-  int video_stream_end = 0, audio_stream_end = 0;
-  while (ret >= 0 && !(video_stream_end && audio_stream_end)) {
-    if ((ret = av_read_frame(tctx->ifmt_ctx, pkt)) < 0)
+int main(int argc, char **argv) {
+  int nb_segments = 10, height = 0, threads = 0, keep_inputs = 1, verbose = 0;
+  int allocs = 0;
+  double duration = 4.0, first_start = 0.0;
+  const char *encoder_name = "h264";
+  HMFormat format = HM_FORMAT_MPEGTS;
+  HMBackend backend = HM_BACKEND_AUTO;
+  HMEncoderOptions opts;
+  int opt;
+
+  hm_encoder_options_init(&opts, HM_PROFILE_LATENCY);
+  while ((opt = getopt(argc, argv, "n:d:s:e:p:P:H:f:b:t:cva")) != -1) {
+    switch (opt) {
+    case 'n':
+      nb_segments = atoi(optarg);
       break;
-
-    int64_t pkt_pts = av_rescale_q(
-        pkt->pts, tctx->ifmt_ctx->streams[pkt->stream_index]->time_base,
-        av_get_time_base_q());
-    // log_packet(pkt, tctx->ifmt_ctx->streams[pkt->stream_index], "in");
-
-    if (pkt->stream_index == tctx->in_video_stream_index && !video_stream_end) {
-      if (pkt_pts >= end_ts && (pkt->flags & AV_PKT_FLAG_KEY)) {
-        video_stream_end = 1;
-        // fprintf(stderr, "video stream end pkt_pts %ld > end_ts %ld\n",
-        //         pkt_pts, end_ts);
-        goto cont_main_loop;
-      }
-      // decode packet then encode frame
-      if ((ret = dec_enc(tctx, pkt, start_ts, end_ts)) < 0) {
-        fprintf(stderr, "Error on dec_enc %d\n", ret);
-      }
-      av_packet_unref(pkt);
-    } else if (pkt->stream_index == tctx->in_audio_stream_index &&
-               !audio_stream_end) {
-      if (end_ts <= pkt_pts)
-        audio_stream_end = 1;
-      if (pkt_pts < start_ts || end_ts <= pkt_pts) {
-        // fprintf(stderr, "Audio packet %ld is not in range  [%ld %ld)\n",
-        //         pkt_pts, start_ts, end_ts);
-        goto cont_main_loop;
-      }
-
-      if (!tctx->enc_ctx->hw_frames_ctx) {
-        packet_queue_push(tctx->audio_pktq, pkt);
-        // fprintf(stderr, "encoder hw_frames_ctx not initialized yet\n");
-        goto cont_main_loop;
-      }
-      // copy audio codecs
-      // continue;
-      pkt->stream_index = OUT_AUDIO_STREAM_INDEX;
-      pkt->pos = -1;
-      av_packet_rescale_ts(pkt, tctx->in_audio_stream->time_base,
-                           tctx->out_audio_stream->time_base);
-      // log_packet(pkt, tctx->out_audio_stream, "out");
-
-      ret = av_interleaved_write_frame(tctx->ofmt_ctx, pkt);
-      if (ret < 0) {
-        fprintf(stderr, "Error muxing audio packet\n");
-        goto cont_main_loop;
-      }
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 's':
+      first_start = atof(optarg);
+      break;
+    case 'e':
+      encoder_name = optarg;
+      break;
+    case 'p':
+      opts.profile =
+          strcmp(optarg, "quality") ? HM_PROFILE_LATENCY : HM_PROFILE_QUALITY;
+      break;
+    case 'P':
+      opts.preset = optarg;
+      break;
+    case 'H':
+      height = atoi(optarg);
+      break;
+    case 'f':
+      format = strcmp(optarg, "fmp4") ? HM_FORMAT_MPEGTS : HM_FORMAT_FMP4;
+      break;
+    case 'b':
+      backend = parse_backend(optarg);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'c':
+      keep_inputs = 0;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'a':
+      allocs = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
     }
-  cont_main_loop:
-    av_packet_unref(pkt);
-  }
-
-  // flush decoder
-  av_packet_unref(pkt);
-  if ((ret = dec_enc(tctx, pkt, start_ts, end_ts)) < 0) {
-    fprintf(stderr, "Failed to flush decoder %s\n", av_err2str(ret));
-    goto end;
-  }
-
-  if ((ret = encode_write(tctx, pkt, NULL)) < 0) {
-    fprintf(stderr, "Failed to flush encoder %s\n", av_err2str(ret));
-    goto end;
-  }
-
-  if ((ret = av_write_trailer(tctx->ofmt_ctx)) < 0) {
-    fprintf(stderr, "Failed to write trailer %s\n", av_err2str(ret));
-    goto end;
   }
-
-  *output_size = avio_close_dyn_buf(tctx->ofmt_ctx->pb, output_buffer);
-  tctx->ofmt_ctx->pb = NULL;
-
-  ret = 0;
-end:
-  avformat_close_input(&tctx->ifmt_ctx);
-  avformat_free_context(tctx->ofmt_ctx);
-  avcodec_free_context(&tctx->dec_ctx);
-  avcodec_free_context(&tctx->enc_ctx);
-  av_packet_free(&pkt);
-  return ret;
-}
-
-void hm_free_buffer(uint8_t *buffer) { av_free(buffer); }
-
-int main(int argc, char **argv) {
-  if (argc != 6) {
-    fprintf(stderr,
-            "usage: %s <input file> <encoder> <start> <end> <segment size>\n",
-            argv[0]);
+  if (optind != argc - 1 || nb_segments <= 0 || duration <= 0) {
+    usage(argv[0]);
     return 1;
   }
+  const char *in_filename = argv[optind];
 
-  const char *in_filename = argv[1];
-  const char *encoder_name = argv[2];
-  const double start = atof(argv[3]);
-  const double end = atof(argv[4]);
-  const double duration = atof(argv[5]);
-
-  AVBufferRef *hw_device_ctx = NULL;
-  int ret = 0;
-
-  if ((ret = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_QSV, NULL,
-                                    NULL, 0)) < 0) {
-    fprintf(stderr, "Failed to create a QSV device. Error code: %s\n",
-            av_err2str(ret));
+  HMContext *ctx = hm_ctx_create(backend, threads);
+  if (!ctx) {
+    fprintf(stderr, "failed to create context\n");
     return 1;
   }
+  hm_ctx_set_input_cache(ctx, keep_inputs, 30 * 1000000LL);
+  printf("%s: %d segments of %.3fs with %s (%s) on %s\n", in_filename,
+         nb_segments, duration, encoder_name,
+         opts.profile == HM_PROFILE_QUALITY ? "quality" : "latency",
+         hm_backend_name(hm_ctx_backend(ctx)));
 
-  for (double cur = start; cur < end; cur += duration) {
+  HMTranscodeStats sum = {0};
+  int64_t min_wall = INT64_MAX, max_wall = 0;
+  int ret = 0;
+  for (int i = 0; i < nb_segments; i++) {
+    double start = first_start + i * duration;
+    HMTranscodeStats stats = {.process_cpu = 1};
     uint8_t *buffer = NULL;
     int buffer_size = 0;
-    ret = hm_transcode_segment(hw_device_ctx, in_filename, encoder_name, cur,
-                               duration, &buffer, &buffer_size);
 
+    ret = hm_transcode_segment(ctx, in_filename, encoder_name, &opts, height,
+                               format, start, duration, -1, &buffer,
+                               &buffer_size, &stats);
+    av_free(buffer);
     if (ret < 0) {
       fprintf(stderr,
               "failed to transcode segment from %s starting at %lf for %lf "
-              "seconds",
-              in_filename, cur, duration);
-      av_free(buffer);
-      return 1;
+              "seconds\n",
+              in_filename, start, duration);
+      break;
     }
 
-    if (buffer && buffer_size > 0) {
-      printf("buf size: %d\n", buffer_size);
-      // fwrite(buffer, 1, buffer_size, stdout);
-      // fflush(stdout);
-    }
+    if (verbose)
+      print_segment(i, start, &stats);
+    add_stats(&sum, &stats);
+    min_wall = FFMIN(min_wall, stats.total.wall);
+    max_wall = FFMAX(max_wall, stats.total.wall);
+  }
 
-    av_free(buffer);
+  if (ret >= 0) {
+    print_summary(&sum, nb_segments, min_wall, max_wall);
+    if (allocs)
+      ret = report_allocs(ctx, in_filename, encoder_name, &opts, height,
+                          format, first_start, duration);
   }
-  av_buffer_unref(&hw_device_ctx);
-  return 0;
+  hm_ctx_free(ctx);
+  return ret < 0 ? 1 : 0;
 }
-
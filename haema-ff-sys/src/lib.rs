@@ -1,25 +1,493 @@
-use std::ffi::CString;
-use std::os::raw::{c_char, c_double, c_int};
+use std::ffi::{CStr, CString};
+use std::fmt;
+use std::os::raw::{c_char, c_double, c_int, c_void};
+use std::ops::Deref;
+use std::ptr::NonNull;
 use std::slice;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicI32, Ordering};
+use std::time::Duration;
+
+use bytes::Bytes;
 
 unsafe extern "C" {
-    fn hm_ctx_create() -> *const u8;
+    fn hm_ctx_create(backend: c_int, threads: c_int) -> *const u8;
 
     fn hm_ctx_free(ctx: *const u8);
 
+    fn hm_ctx_backend(ctx: *const u8) -> c_int;
+
+    fn hm_probe_backend() -> c_int;
+
+    fn hm_ctx_set_input_cache(ctx: *const u8, max_inputs: c_int, idle_timeout: i64);
+
+    fn hm_ctx_expire_inputs(ctx: *const u8);
+
+    fn hm_ctx_set_interrupt(ctx: *const u8, interrupt: *const c_int);
+
     fn hm_transcode_segment(
         hm_ctx: *const u8,
         in_filename: *const c_char,
         encoder_name: *const c_char,
+        options: *const RawEncoderOptions,
+        height: c_int,
+        format: c_int,
+        start: c_double,
+        duration: c_double,
+        seek_pos: i64,
+        output_buffer: *mut *mut u8,
+        output_size: *mut c_int,
+        stats: *mut TranscodeStats,
+    ) -> c_int;
+
+    fn hm_transcode_segment_stream(
+        hm_ctx: *const u8,
+        in_filename: *const c_char,
+        encoder_name: *const c_char,
+        options: *const RawEncoderOptions,
+        height: c_int,
+        format: c_int,
+        start: c_double,
+        duration: c_double,
+        seek_pos: i64,
+        write_packet: WritePacket,
+        opaque: *mut c_void,
+        stats: *mut TranscodeStats,
+    ) -> c_int;
+
+    fn hm_transcode_renditions(
+        hm_ctx: *const u8,
+        in_filename: *const c_char,
+        renditions: *mut RawRendition,
+        nb_renditions: c_int,
+        format: c_int,
+        start: c_double,
+        duration: c_double,
+        seek_pos: i64,
+    ) -> c_int;
+
+    fn hm_session_open(
+        hm_ctx: *const u8,
+        in_filename: *const c_char,
+        encoder_name: *const c_char,
+        options: *const RawEncoderOptions,
+        height: c_int,
+        format: c_int,
+        starts: *const c_double,
+        nb_segments: c_int,
+        end: c_double,
+        seek_pos: i64,
+    ) -> *mut u8;
+
+    fn hm_session_set_interrupt(session: *mut u8, interrupt: *const c_int);
+
+    fn hm_session_next(
+        session: *mut u8,
+        output_buffer: *mut *mut u8,
+        output_size: *mut c_int,
+    ) -> c_int;
+
+    fn hm_session_free(session: *mut u8);
+
+    fn hm_remux_segment_stream(
+        in_filename: *const c_char,
+        format: c_int,
+        start: c_double,
+        duration: c_double,
+        seek_pos: i64,
+        interrupt: *const c_int,
+        write_packet: WritePacket,
+        opaque: *mut c_void,
+    ) -> c_int;
+
+    fn hm_remux_segment(
+        in_filename: *const c_char,
+        format: c_int,
         start: c_double,
         duration: c_double,
+        seek_pos: i64,
+        interrupt: *const c_int,
         output_buffer: *mut *mut u8,
         output_size: *mut c_int,
     ) -> c_int;
 
     fn hm_free_buffer(buffer: *mut u8);
 
-    fn hm_probe(in_filename: *const c_char) -> c_double;
+    fn hm_probe(in_filename: *const c_char, info: *mut RawProbeInfo) -> c_int;
+
+    fn hm_keyframes(
+        in_filename: *const c_char,
+        keyframes: *mut *mut Keyframe,
+        nb_keyframes: *mut c_int,
+    ) -> c_int;
+}
+
+type WritePacket = extern "C" fn(opaque: *mut c_void, buf: *const u8, buf_size: c_int) -> c_int;
+
+// `opaque` is the `W` passed to one of the *_stream functions
+extern "C" fn write_packet<W: FnMut(&[u8])>(
+    opaque: *mut c_void,
+    buf: *const u8,
+    buf_size: c_int,
+) -> c_int {
+    let write = unsafe { &mut *(opaque as *mut W) };
+    write(unsafe { slice::from_raw_parts(buf, buf_size as usize) });
+    buf_size
+}
+
+const CODEC_NAME_SIZE: usize = 32;
+
+// mirrors HMProbeInfo in hm_probe.h
+#[repr(C)]
+struct RawProbeInfo {
+    duration: c_double,
+    start_time: c_double,
+    video_codec: [c_char; CODEC_NAME_SIZE],
+    width: c_int,
+    height: c_int,
+    frame_rate: c_double,
+    audio_codec: [c_char; CODEC_NAME_SIZE],
+    nb_audio_tracks: c_int,
+    bit_rate: i64,
+}
+
+// mirrors HMRendition in hm_transcode.h
+#[repr(C)]
+struct RawRendition {
+    encoder_name: *const c_char,
+    options: *const RawEncoderOptions,
+    height: c_int,
+    output_buffer: *mut u8,
+    output_size: c_int,
+}
+
+// mirrors HMEncoderOptions in hm_transcode.h
+#[repr(C)]
+struct RawEncoderOptions {
+    profile: c_int,
+    preset: *const c_char,
+    tune: *const c_char,
+    bit_rate: i64,
+    max_rate: i64,
+    quality: c_int,
+    gop_size: c_int,
+    lookahead: c_int,
+    b_frames: c_int,
+}
+
+/// speed against quality of the encoder, mirrors HMEncoderProfile in
+/// hm_transcode.h
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, Hash)]
+pub enum EncoderProfile {
+    /// a player waits on the segment, encode as fast as the backend can with
+    /// no b-frames, no lookahead and the zerolatency tune of software
+    /// encoders unless the options set them
+    #[default]
+    Latency,
+    /// nobody waits on it, spend the time on quality
+    Quality,
+}
+
+impl EncoderProfile {
+    fn as_raw(self) -> c_int {
+        match self {
+            EncoderProfile::Latency => 0,
+            EncoderProfile::Quality => 1,
+        }
+    }
+}
+
+impl fmt::Display for EncoderProfile {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            EncoderProfile::Latency => write!(f, "latency"),
+            EncoderProfile::Quality => write!(f, "quality"),
+        }
+    }
+}
+
+/// encoder parameters of a transcode, `None` leaves a parameter to the
+/// profile. parameters the encoder doesn't have are skipped
+#[derive(Clone, Debug, Default, PartialEq, Eq, Hash)]
+pub struct EncoderOptions {
+    pub profile: EncoderProfile,
+    /// replaces the profile's preset
+    pub preset: Option<String>,
+    pub tune: Option<String>,
+    /// average bits per second
+    pub bit_rate: Option<u64>,
+    /// peak bits per second, the rate control buffer holds two seconds of it
+    /// up to `i32::MAX` bits
+    pub max_rate: Option<u64>,
+    /// constant quality (crf of software encoders, global_quality of
+    /// hardware ones) used without `bit_rate`
+    pub quality: Option<u32>,
+    /// frames from one keyframe to the next
+    pub gop_size: Option<u32>,
+    /// frames the rate control looks ahead
+    pub lookahead: Option<u32>,
+    pub b_frames: Option<u32>,
+}
+
+impl EncoderOptions {
+    /// the `profile` settings with everything else left to the encoder
+    pub fn profile(profile: EncoderProfile) -> Self {
+        Self {
+            profile,
+            ..Default::default()
+        }
+    }
+
+    fn to_raw(&self) -> EncoderOptionsArg {
+        let preset = self.preset.as_deref().map(|s| CString::new(s).unwrap());
+        let tune = self.tune.as_deref().map(|s| CString::new(s).unwrap());
+        let int = |value: Option<u32>| value.map_or(-1, |v| v.min(c_int::MAX as u32) as c_int);
+        let rate = |value: Option<u64>| value.map_or(0, |v| v.min(i64::MAX as u64) as i64);
+        EncoderOptionsArg {
+            raw: RawEncoderOptions {
+                profile: self.profile.as_raw(),
+                preset: preset.as_ref().map_or(std::ptr::null(), |s| s.as_ptr()),
+                tune: tune.as_ref().map_or(std::ptr::null(), |s| s.as_ptr()),
+                bit_rate: rate(self.bit_rate),
+                max_rate: rate(self.max_rate),
+                quality: int(self.quality),
+                gop_size: int(self.gop_size),
+                lookahead: int(self.lookahead),
+                b_frames: int(self.b_frames),
+            },
+            _preset: preset,
+            _tune: tune,
+        }
+    }
+}
+
+// RawEncoderOptions with the strings it points to
+struct EncoderOptionsArg {
+    raw: RawEncoderOptions,
+    _preset: Option<CString>,
+    _tune: Option<CString>,
+}
+
+/// one output of `HMContext::transcode_renditions`
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Rendition<'a> {
+    pub encoder_name: &'a str,
+    pub options: &'a EncoderOptions,
+    /// output height, 0 keeps the source size
+    pub height: u32,
+}
+
+/// keyframe of the best video stream, mirrors HMKeyframe in hm_keyframes.h
+#[repr(C)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Keyframe {
+    /// microseconds since the start of the video stream
+    pub pts: i64,
+    /// byte offset of the keyframe packet, -1 when unknown
+    pub pos: i64,
+    /// video packets from this keyframe up to the next one
+    pub gop_size: i32,
+}
+
+/// wall and cpu time of one stage, cpu time is of the whole process so codec
+/// threads are included. it costs a syscall per stage change, so only the c
+/// harness measures it and `cpu` is 0 here
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct StageTime {
+    /// microseconds
+    pub wall: i64,
+    /// microseconds
+    pub cpu: i64,
+}
+
+/// where the time of a transcoded segment went, mirrors HMTranscodeStats in
+/// hm_transcode.h (the stages are the HMStage array)
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct TranscodeStats {
+    /// always 0, the transcodes only read the wall clock
+    process_cpu: c_int,
+    /// opening the input, its decoder, the output and the encoder
+    pub open: StageTime,
+    pub seek: StageTime,
+    pub read: StageTime,
+    /// decoding frames before the start that are thrown away
+    pub preroll: StageTime,
+    pub decode: StageTime,
+    /// decoding frames after the end that are thrown away
+    pub tail: StageTime,
+    pub scale: StageTime,
+    pub encode: StageTime,
+    pub mux: StageTime,
+    /// the whole call, cleaning up is in no stage
+    pub total: StageTime,
+    pub packets_read: i64,
+    pub frames_decoded: i64,
+    /// decoded frames outside the segment
+    pub frames_discarded: i64,
+    /// frames outside the segment no other frame references, skipped
+    /// instead of decoded
+    pub frames_skipped: i64,
+    pub frames_encoded: i64,
+    pub bytes_out: i64,
+}
+
+/// number of stages, HM_NB_STAGES
+pub const NB_STAGES: usize = 9;
+
+impl TranscodeStats {
+    /// every stage with its name in the order of HMStage
+    pub fn stages(&self) -> [(&'static str, StageTime); NB_STAGES] {
+        [
+            ("open", self.open),
+            ("seek", self.seek),
+            ("read", self.read),
+            ("preroll", self.preroll),
+            ("decode", self.decode),
+            ("tail", self.tail),
+            ("scale", self.scale),
+            ("encode", self.encode),
+            ("mux", self.mux),
+        ]
+    }
+}
+
+/// what transcodes return when they were interrupted, AVERROR_EXIT
+pub const AVERROR_EXIT: i32 = -i32::from_le_bytes(*b"EXIT");
+
+/// cancels the transcodes it is set on, see `HMContext::interrupt_on`,
+/// `TranscodeSession::set_interrupt` and `remux_segment`. they stop within a
+/// packet of it
+#[derive(Debug, Default)]
+#[repr(transparent)]
+pub struct Interrupt(AtomicI32);
+
+impl Interrupt {
+    pub fn interrupt(&self) {
+        self.0.store(1, Ordering::Relaxed);
+    }
+
+    pub fn is_interrupted(&self) -> bool {
+        self.0.load(Ordering::Relaxed) != 0
+    }
+
+    fn as_ptr(&self) -> *const c_int {
+        self.0.as_ptr()
+    }
+}
+
+/// codec backend of a HMContext, mirrors HMBackend in hm_context.h
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Backend {
+    Auto,
+    Qsv,
+    Vaapi,
+    Software,
+}
+
+impl Backend {
+    fn as_raw(self) -> c_int {
+        match self {
+            Backend::Auto => 0,
+            Backend::Qsv => 1,
+            Backend::Vaapi => 2,
+            Backend::Software => 3,
+        }
+    }
+
+    fn from_raw(raw: c_int) -> Self {
+        match raw {
+            1 => Backend::Qsv,
+            2 => Backend::Vaapi,
+            3 => Backend::Software,
+            _ => Backend::Auto,
+        }
+    }
+}
+
+impl fmt::Display for Backend {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Backend::Auto => write!(f, "auto"),
+            Backend::Qsv => write!(f, "qsv"),
+            Backend::Vaapi => write!(f, "vaapi"),
+            Backend::Software => write!(f, "sw"),
+        }
+    }
+}
+
+/// container of the segments, mirrors HMFormat in hm_transcode.h
+///
+/// fmp4 segments are cmaf fragments that start with their init segment, it
+/// ends at `media_offset`
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+pub enum Format {
+    MpegTs,
+    Fmp4,
+}
+
+impl Format {
+    fn as_raw(self) -> c_int {
+        match self {
+            Format::MpegTs => 0,
+            Format::Fmp4 => 1,
+        }
+    }
+}
+
+/// offset of the first moof or styp box in the top level boxes of `buf`, what
+/// comes before it is the init segment (ftyp and moov). `None` when `buf`
+/// ends before one
+pub fn media_offset(buf: &[u8]) -> Option<usize> {
+    let mut offset = 0;
+    loop {
+        let header = buf.get(offset..offset + 8)?;
+        let size = u32::from_be_bytes(header[0..4].try_into().unwrap()) as u64;
+        if &header[4..8] == b"moof" || &header[4..8] == b"styp" {
+            return Some(offset);
+        }
+        let size = match size {
+            // 64-bit size after the type
+            1 => u64::from_be_bytes(buf.get(offset + 8..offset + 16)?.try_into().unwrap()),
+            // runs to the end, there is no media after it
+            0 => return None,
+            size => size,
+        };
+        if size < 8 {
+            return None;
+        }
+        offset = offset.checked_add(usize::try_from(size).ok()?)?;
+    }
+}
+
+/// size of the init segment at the start of `buf`, the offset right after its
+/// moov box. `None` while `buf` ends before the whole moov
+pub fn init_size(buf: &[u8]) -> Option<usize> {
+    let mut offset = 0;
+    loop {
+        let header = buf.get(offset..offset + 8)?;
+        let size = match u32::from_be_bytes(header[0..4].try_into().unwrap()) as u64 {
+            1 => u64::from_be_bytes(buf.get(offset + 8..offset + 16)?.try_into().unwrap()),
+            // runs to the end, there is no moov after it
+            0 => return None,
+            size => size,
+        };
+        // media before any moov, there is no init segment
+        if size < 8 || &header[4..8] == b"moof" || &header[4..8] == b"styp" {
+            return None;
+        }
+        let end = offset.checked_add(usize::try_from(size).ok()?)?;
+        if &header[4..8] == b"moov" {
+            return (end <= buf.len()).then_some(end);
+        }
+        offset = end;
+    }
+}
+
+/// first usable backend on this host in order of qsv, vaapi and software
+pub fn probe_backend() -> Backend {
+    Backend::from_raw(unsafe { hm_probe_backend() })
 }
 
 pub struct HMContext {
@@ -28,20 +496,117 @@ pub struct HMContext {
 
 impl HMContext {
     pub fn new() -> Self {
+        Self::with_backend(Backend::Auto, 0)
+    }
+
+    /// falls back to the next usable backend when `backend` is not available,
+    /// `threads` is used by software codecs only (0 lets ffmpeg decide)
+    pub fn with_backend(backend: Backend, threads: usize) -> Self {
         HMContext {
-            hm_ctx: unsafe { hm_ctx_create() },
+            hm_ctx: unsafe { hm_ctx_create(backend.as_raw(), threads as c_int) },
+        }
+    }
+
+    pub fn backend(&self) -> Backend {
+        Backend::from_raw(unsafe { hm_ctx_backend(self.hm_ctx) })
+    }
+
+    /// keeps up to `max_inputs` sources open between segments so the next
+    /// segment of the same file skips opening and probing it, inputs unused
+    /// for `idle_timeout` are closed
+    pub fn set_input_cache(&self, max_inputs: usize, idle_timeout: Duration) {
+        unsafe {
+            hm_ctx_set_input_cache(
+                self.hm_ctx,
+                max_inputs.min(c_int::MAX as usize) as c_int,
+                idle_timeout.as_micros().min(i64::MAX as u128) as i64,
+            )
         }
     }
 
+    /// closes the inputs that were idle for longer than the idle timeout,
+    /// otherwise that only happens when the context transcodes
+    pub fn expire_inputs(&self) {
+        unsafe { hm_ctx_expire_inputs(self.hm_ctx) }
+    }
+
+    /// transcodes of the context fail with `AVERROR_EXIT` once `interrupt` is
+    /// set, until the returned guard is dropped
+    pub fn interrupt_on<'a>(&'a self, interrupt: &'a Interrupt) -> InterruptGuard<'a> {
+        unsafe { hm_ctx_set_interrupt(self.hm_ctx, interrupt.as_ptr()) };
+        InterruptGuard { ctx: self }
+    }
+
+    /// `seek_pos` is the byte offset of the keyframe at `start` if known,
+    /// `height` scales the video down keeping its aspect ratio (0 keeps the
+    /// source size), `options` trade encode speed for quality
     pub fn transcode_segment(
         &self,
         in_filename: &str,
         encoder_name: &str,
+        options: &EncoderOptions,
+        height: u32,
+        format: Format,
+        start: f64,
+        duration: f64,
+        seek_pos: Option<i64>,
+    ) -> Result<OutputBuffer, i32> {
+        self.transcode_segment_raw(
+            in_filename,
+            encoder_name,
+            options,
+            height,
+            format,
+            start,
+            duration,
+            seek_pos,
+            std::ptr::null_mut(),
+        )
+    }
+
+    /// like `transcode_segment` but also times every stage of it on the wall
+    /// clock
+    pub fn transcode_segment_with_stats(
+        &self,
+        in_filename: &str,
+        encoder_name: &str,
+        options: &EncoderOptions,
+        height: u32,
+        format: Format,
+        start: f64,
+        duration: f64,
+        seek_pos: Option<i64>,
+    ) -> Result<(OutputBuffer, TranscodeStats), i32> {
+        let mut stats = TranscodeStats::default();
+        self.transcode_segment_raw(
+            in_filename,
+            encoder_name,
+            options,
+            height,
+            format,
+            start,
+            duration,
+            seek_pos,
+            &mut stats,
+        )
+        .map(|buffer| (buffer, stats))
+    }
+
+    fn transcode_segment_raw(
+        &self,
+        in_filename: &str,
+        encoder_name: &str,
+        options: &EncoderOptions,
+        height: u32,
+        format: Format,
         start: f64,
         duration: f64,
-    ) -> Result<Vec<u8>, i32> {
+        seek_pos: Option<i64>,
+        stats: *mut TranscodeStats,
+    ) -> Result<OutputBuffer, i32> {
         let in_filename = CString::new(in_filename).unwrap();
         let encoder_name = CString::new(encoder_name).unwrap();
+        let options = options.to_raw();
         let mut output_data: *mut u8 = std::ptr::null_mut();
         let mut output_size: i32 = 0;
 
@@ -50,28 +615,481 @@ impl HMContext {
                 self.hm_ctx,
                 in_filename.as_ptr(),
                 encoder_name.as_ptr(),
+                &options.raw,
+                height as c_int,
+                format.as_raw(),
                 start,
                 duration,
+                seek_pos.unwrap_or(-1),
                 &mut output_data,
                 &mut output_size,
+                stats,
+            )
+        };
+
+        if ret < 0 {
+            return Err(ret);
+        }
+
+        Ok(OutputBuffer::new(output_data, output_size))
+    }
+
+    /// like `transcode_segment` but hands the output to `write` in chunks while
+    /// it is produced
+    pub fn transcode_segment_to<W: FnMut(&[u8])>(
+        &self,
+        in_filename: &str,
+        encoder_name: &str,
+        options: &EncoderOptions,
+        height: u32,
+        format: Format,
+        start: f64,
+        duration: f64,
+        seek_pos: Option<i64>,
+        write: W,
+    ) -> Result<(), i32> {
+        self.transcode_segment_to_raw(
+            in_filename,
+            encoder_name,
+            options,
+            height,
+            format,
+            start,
+            duration,
+            seek_pos,
+            write,
+            std::ptr::null_mut(),
+        )
+    }
+
+    /// like `transcode_segment_to` but also times every stage of it
+    pub fn transcode_segment_to_with_stats<W: FnMut(&[u8])>(
+        &self,
+        in_filename: &str,
+        encoder_name: &str,
+        options: &EncoderOptions,
+        height: u32,
+        format: Format,
+        start: f64,
+        duration: f64,
+        seek_pos: Option<i64>,
+        write: W,
+    ) -> Result<TranscodeStats, i32> {
+        let mut stats = TranscodeStats::default();
+        self.transcode_segment_to_raw(
+            in_filename,
+            encoder_name,
+            options,
+            height,
+            format,
+            start,
+            duration,
+            seek_pos,
+            write,
+            &mut stats,
+        )
+        .map(|_| stats)
+    }
+
+    fn transcode_segment_to_raw<W: FnMut(&[u8])>(
+        &self,
+        in_filename: &str,
+        encoder_name: &str,
+        options: &EncoderOptions,
+        height: u32,
+        format: Format,
+        start: f64,
+        duration: f64,
+        seek_pos: Option<i64>,
+        mut write: W,
+        stats: *mut TranscodeStats,
+    ) -> Result<(), i32> {
+        let in_filename = CString::new(in_filename).unwrap();
+        let encoder_name = CString::new(encoder_name).unwrap();
+        let options = options.to_raw();
+
+        let ret = unsafe {
+            hm_transcode_segment_stream(
+                self.hm_ctx,
+                in_filename.as_ptr(),
+                encoder_name.as_ptr(),
+                &options.raw,
+                height as c_int,
+                format.as_raw(),
+                start,
+                duration,
+                seek_pos.unwrap_or(-1),
+                write_packet::<W>,
+                &mut write as *mut W as *mut c_void,
+                stats,
             )
         };
 
         if ret < 0 {
             return Err(ret);
         }
+        Ok(())
+    }
+
+    /// transcodes one segment into every rendition decoding the source once,
+    /// the outputs are in the order of `renditions`
+    pub fn transcode_renditions(
+        &self,
+        in_filename: &str,
+        renditions: &[Rendition],
+        format: Format,
+        start: f64,
+        duration: f64,
+        seek_pos: Option<i64>,
+    ) -> Result<Vec<OutputBuffer>, i32> {
+        let in_filename = CString::new(in_filename).unwrap();
+        let encoder_names: Vec<CString> = renditions
+            .iter()
+            .map(|rendition| CString::new(rendition.encoder_name).unwrap())
+            .collect();
+        let options: Vec<EncoderOptionsArg> = renditions
+            .iter()
+            .map(|rendition| rendition.options.to_raw())
+            .collect();
+        let mut raw: Vec<RawRendition> = renditions
+            .iter()
+            .zip(encoder_names.iter().zip(&options))
+            .map(|(rendition, (encoder_name, options))| RawRendition {
+                encoder_name: encoder_name.as_ptr(),
+                options: &options.raw,
+                height: rendition.height as c_int,
+                output_buffer: std::ptr::null_mut(),
+                output_size: 0,
+            })
+            .collect();
+
+        let ret = unsafe {
+            hm_transcode_renditions(
+                self.hm_ctx,
+                in_filename.as_ptr(),
+                raw.as_mut_ptr(),
+                raw.len() as c_int,
+                format.as_raw(),
+                start,
+                duration,
+                seek_pos.unwrap_or(-1),
+            )
+        };
 
-        let slc = unsafe { slice::from_raw_parts(output_data, output_size as usize) };
-        let data_vec = slc.to_vec();
-        unsafe { hm_free_buffer(output_data) };
+        if ret < 0 {
+            return Err(ret);
+        }
+
+        Ok(raw
+            .iter()
+            .map(|raw| OutputBuffer::new(raw.output_buffer, raw.output_size))
+            .collect())
+    }
 
-        Ok(data_vec)
+    /// opens a long-lived transcode of the consecutive segments starting at
+    /// `starts`, the last one ends at `end`. `seek_pos` is the byte offset of
+    /// the keyframe at the first start if known
+    pub fn open_session(
+        &self,
+        in_filename: &str,
+        encoder_name: &str,
+        options: &EncoderOptions,
+        height: u32,
+        format: Format,
+        starts: &[f64],
+        end: f64,
+        seek_pos: Option<i64>,
+    ) -> Result<TranscodeSession, i32> {
+        let in_filename = CString::new(in_filename).unwrap();
+        let encoder_name = CString::new(encoder_name).unwrap();
+        let options = options.to_raw();
+
+        let session = unsafe {
+            hm_session_open(
+                self.hm_ctx,
+                in_filename.as_ptr(),
+                encoder_name.as_ptr(),
+                &options.raw,
+                height as c_int,
+                format.as_raw(),
+                starts.as_ptr(),
+                starts.len() as c_int,
+                end,
+                seek_pos.unwrap_or(-1),
+            )
+        };
+
+        match NonNull::new(session) {
+            Some(session) => Ok(TranscodeSession {
+                session,
+                remaining: starts.len(),
+                interrupt: None,
+            }),
+            None => Err(-1),
+        }
+    }
+}
+
+/// makes the transcodes of a context uninterruptible again when dropped,
+/// returned by `HMContext::interrupt_on`
+pub struct InterruptGuard<'a> {
+    ctx: &'a HMContext,
+}
+
+impl Drop for InterruptGuard<'_> {
+    fn drop(&mut self) {
+        unsafe { hm_ctx_set_interrupt(self.ctx.hm_ctx, std::ptr::null()) };
     }
 }
 
-pub fn get_video_duration(in_filename: &str) -> f64 {
+/// one demux -> decode -> encode -> mux pipeline over consecutive segments,
+/// created by `HMContext::open_session`
+pub struct TranscodeSession {
+    session: NonNull<u8>,
+    remaining: usize,
+    // kept alive for as long as the session reads it
+    interrupt: Option<Arc<Interrupt>>,
+}
+
+// the session is used by one thread at a time and shares nothing with the
+// context that opened it
+unsafe impl Send for TranscodeSession {}
+
+impl TranscodeSession {
+    /// segments not handed out yet
+    pub fn remaining(&self) -> usize {
+        self.remaining
+    }
+
+    /// `next_segment` fails with `AVERROR_EXIT` once `interrupt` is set, the
+    /// session is unusable then. replaces the interrupt set before
+    pub fn set_interrupt(&mut self, interrupt: Arc<Interrupt>) {
+        unsafe { hm_session_set_interrupt(self.session.as_ptr(), interrupt.as_ptr()) };
+        self.interrupt = Some(interrupt);
+    }
+
+    /// runs the pipeline until the next segment is cut, `None` after the last
+    /// one. blocks for as long as transcoding the segment takes
+    pub fn next_segment(&mut self) -> Option<Result<OutputBuffer, i32>> {
+        if self.remaining == 0 {
+            return None;
+        }
+        let mut output_data: *mut u8 = std::ptr::null_mut();
+        let mut output_size: i32 = 0;
+
+        let ret =
+            unsafe { hm_session_next(self.session.as_ptr(), &mut output_data, &mut output_size) };
+        if ret < 0 {
+            // the session is unusable after an error
+            self.remaining = 0;
+            return Some(Err(ret));
+        }
+        self.remaining -= 1;
+        Some(Ok(OutputBuffer::new(output_data, output_size)))
+    }
+}
+
+impl Drop for TranscodeSession {
+    fn drop(&mut self) {
+        unsafe { hm_session_free(self.session.as_ptr()) };
+    }
+}
+
+/// copies the packets of a segment into `format` without transcoding, `start`
+/// and `start + duration` must be keyframes of the video stream. fails with
+/// `AVERROR_EXIT` once `interrupt` is set
+pub fn remux_segment(
+    in_filename: &str,
+    format: Format,
+    start: f64,
+    duration: f64,
+    seek_pos: Option<i64>,
+    interrupt: Option<&Interrupt>,
+) -> Result<OutputBuffer, i32> {
     let in_filename = CString::new(in_filename).unwrap();
-    unsafe { hm_probe(in_filename.as_ptr()) }
+    let mut output_data: *mut u8 = std::ptr::null_mut();
+    let mut output_size: i32 = 0;
+
+    let ret = unsafe {
+        hm_remux_segment(
+            in_filename.as_ptr(),
+            format.as_raw(),
+            start,
+            duration,
+            seek_pos.unwrap_or(-1),
+            interrupt.map_or(std::ptr::null(), Interrupt::as_ptr),
+            &mut output_data,
+            &mut output_size,
+        )
+    };
+
+    if ret < 0 {
+        return Err(ret);
+    }
+
+    Ok(OutputBuffer::new(output_data, output_size))
+}
+
+/// like `remux_segment` but hands the output to `write` in chunks while it is
+/// produced
+pub fn remux_segment_to<W: FnMut(&[u8])>(
+    in_filename: &str,
+    format: Format,
+    start: f64,
+    duration: f64,
+    seek_pos: Option<i64>,
+    interrupt: Option<&Interrupt>,
+    mut write: W,
+) -> Result<(), i32> {
+    let in_filename = CString::new(in_filename).unwrap();
+
+    let ret = unsafe {
+        hm_remux_segment_stream(
+            in_filename.as_ptr(),
+            format.as_raw(),
+            start,
+            duration,
+            seek_pos.unwrap_or(-1),
+            interrupt.map_or(std::ptr::null(), Interrupt::as_ptr),
+            write_packet::<W>,
+            &mut write as *mut W as *mut c_void,
+        )
+    };
+
+    if ret < 0 {
+        return Err(ret);
+    }
+    Ok(())
+}
+
+/// segment output allocated by ffmpeg, freed with hm_free_buffer on drop
+pub struct OutputBuffer {
+    data: Option<NonNull<u8>>,
+    len: usize,
+}
+
+// the buffer is exclusively owned and never written after it is handed over
+unsafe impl Send for OutputBuffer {}
+unsafe impl Sync for OutputBuffer {}
+
+impl OutputBuffer {
+    fn new(data: *mut u8, len: c_int) -> Self {
+        Self {
+            data: NonNull::new(data),
+            len: len as usize,
+        }
+    }
+}
+
+impl Deref for OutputBuffer {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self.data {
+            Some(data) => unsafe { slice::from_raw_parts(data.as_ptr(), self.len) },
+            None => &[],
+        }
+    }
+}
+
+impl AsRef<[u8]> for OutputBuffer {
+    fn as_ref(&self) -> &[u8] {
+        self
+    }
+}
+
+impl Drop for OutputBuffer {
+    fn drop(&mut self) {
+        if let Some(data) = self.data {
+            unsafe { hm_free_buffer(data.as_ptr()) };
+        }
+    }
+}
+
+impl From<OutputBuffer> for Bytes {
+    /// no copy, the ffmpeg allocation is freed when the last `Bytes` drops
+    fn from(buffer: OutputBuffer) -> Self {
+        Bytes::from_owner(buffer)
+    }
+}
+
+/// what `probe` found out about a source, the video fields are of the best
+/// video stream
+#[derive(Clone, Debug, PartialEq)]
+pub struct ProbeInfo {
+    /// seconds
+    pub duration: f64,
+    /// seconds, start of the video stream on the demuxer's timeline
+    pub start_time: f64,
+    /// ffmpeg codec name like "h264" or "hevc"
+    pub video_codec: String,
+    pub width: u32,
+    pub height: u32,
+    /// frames per second, 0 when unknown
+    pub frame_rate: f64,
+    /// codec of the best audio stream, `None` without audio
+    pub audio_codec: Option<String>,
+    pub audio_tracks: u32,
+    /// container bit rate in bits per second, 0 when unknown
+    pub bit_rate: u64,
+}
+
+/// opens the source and reads its stream info, expensive enough that the
+/// result should be cached
+pub fn probe(in_filename: &str) -> Result<ProbeInfo, i32> {
+    let in_filename = CString::new(in_filename).unwrap();
+    let mut info = RawProbeInfo {
+        duration: 0.0,
+        start_time: 0.0,
+        video_codec: [0; CODEC_NAME_SIZE],
+        width: 0,
+        height: 0,
+        frame_rate: 0.0,
+        audio_codec: [0; CODEC_NAME_SIZE],
+        nb_audio_tracks: 0,
+        bit_rate: 0,
+    };
+
+    let ret = unsafe { hm_probe(in_filename.as_ptr(), &mut info) };
+    if ret < 0 {
+        return Err(ret);
+    }
+
+    let video_codec = unsafe { CStr::from_ptr(info.video_codec.as_ptr()) };
+    let audio_codec = unsafe { CStr::from_ptr(info.audio_codec.as_ptr()) };
+    Ok(ProbeInfo {
+        duration: info.duration,
+        start_time: info.start_time,
+        video_codec: video_codec.to_string_lossy().into_owned(),
+        width: info.width.max(0) as u32,
+        height: info.height.max(0) as u32,
+        frame_rate: info.frame_rate,
+        audio_codec: (!audio_codec.is_empty()).then(|| audio_codec.to_string_lossy().into_owned()),
+        audio_tracks: info.nb_audio_tracks.max(0) as u32,
+        bit_rate: info.bit_rate.max(0) as u64,
+    })
+}
+
+/// scans the packets of the best video stream for keyframes, this reads the
+/// whole file so the result should be persisted
+pub fn get_keyframes(in_filename: &str) -> Result<Vec<Keyframe>, i32> {
+    let in_filename = CString::new(in_filename).unwrap();
+    let mut keyframes: *mut Keyframe = std::ptr::null_mut();
+    let mut nb_keyframes: c_int = 0;
+
+    let ret = unsafe { hm_keyframes(in_filename.as_ptr(), &mut keyframes, &mut nb_keyframes) };
+    if ret < 0 {
+        return Err(ret);
+    }
+    if keyframes.is_null() {
+        return Ok(vec![]);
+    }
+
+    let slc = unsafe { slice::from_raw_parts(keyframes, nb_keyframes as usize) };
+    let keyframes_vec = slc.to_vec();
+    unsafe { hm_free_buffer(keyframes as *mut u8) };
+
+    Ok(keyframes_vec)
 }
 
 impl Drop for HMContext {
@@ -88,13 +1106,53 @@ mod tests {
     use std::ffi::CString;
     use std::time::Instant;
 
+    fn mp4_box(kind: &[u8; 4], payload: usize) -> Vec<u8> {
+        let mut buf = ((8 + payload) as u32).to_be_bytes().to_vec();
+        buf.extend_from_slice(kind);
+        buf.resize(8 + payload, 0);
+        buf
+    }
+
+    #[test]
+    fn test_media_offset() {
+        let init = [mp4_box(b"ftyp", 16), mp4_box(b"moov", 100)].concat();
+        let segment = [init.clone(), mp4_box(b"moof", 20), mp4_box(b"mdat", 50)].concat();
+        assert_eq!(media_offset(&segment), Some(init.len()));
+        assert_eq!(init_size(&segment), Some(init.len()));
+        // the moof header isn't there yet
+        assert_eq!(media_offset(&segment[..init.len() + 4]), None);
+        assert_eq!(init_size(&segment[..init.len() + 4]), Some(init.len()));
+        // the moov isn't complete yet
+        assert_eq!(init_size(&segment[..init.len() - 1]), None);
+        assert_eq!(media_offset(&init), None);
+        assert_eq!(media_offset(&[]), None);
+        // a 64-bit size
+        let mut large = vec![0, 0, 0, 1];
+        large.extend_from_slice(b"ftyp");
+        large.extend_from_slice(&24u64.to_be_bytes());
+        large.resize(24, 0);
+        let segment = [large, mp4_box(b"moof", 0)].concat();
+        assert_eq!(media_offset(&segment), Some(24));
+        assert_eq!(init_size(&segment), None);
+        // a box smaller than its header
+        assert_eq!(media_offset(&[0, 0, 0, 4, b'f', b't', b'y', b'p']), None);
+    }
+
+    #[test]
+    fn test_transcode_stats_layout() {
+        // process_cpu and its padding, the stages and the total, the counters
+        let size = 8 + (NB_STAGES + 1) * size_of::<StageTime>() + 6 * 8;
+        assert_eq!(size_of::<TranscodeStats>(), size);
+        assert_eq!(TranscodeStats::default().stages().len(), NB_STAGES);
+    }
+
     #[test]
     fn test_hm_transcode_segment() {
-        let hm_ctx: *const u8 = unsafe { hm_ctx_create() };
+        let hm_ctx: *const u8 = unsafe { hm_ctx_create(Backend::Auto.as_raw(), 0) };
 
         // let in_filename = CString::new("/mnt/d/vod/25.08.12 뀨.mp4").unwrap();
         let in_filename = CString::new("/mnt/d/anime/01.mp4").unwrap();
-        let encoder_name = CString::new("h264_qsv").unwrap();
+        let encoder_name = CString::new("h264").unwrap();
         let duration: f64 = 4.0;
         let mut output_buffer: *mut u8 = std::ptr::null_mut();
         let mut output_size: i32 = 0;
@@ -105,10 +1163,15 @@ mod tests {
                     hm_ctx,
                     in_filename.as_ptr(),
                     encoder_name.as_ptr(),
+                    std::ptr::null(),
+                    0,
+                    Format::MpegTs.as_raw(),
                     duration * i as f64,
                     duration,
+                    -1,
                     &mut output_buffer,
                     &mut output_size,
+                    std::ptr::null_mut(),
                 );
                 hm_free_buffer(output_buffer);
                 assert_eq!(result, 0);
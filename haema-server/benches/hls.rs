@@ -0,0 +1,87 @@
+use std::hint::black_box;
+
+use criterion::{Criterion, criterion_group, criterion_main};
+use haema_ff_sys::{Format, Keyframe};
+use haema_server::{
+    domain::{SEGMENT_DURATION, SegmentLayout, StreamType},
+    services::{create_hls_media_playlist, parse_segment_filename, segment_encoding},
+};
+
+// keyframe spacing of the synthetic videos
+const GOP: f64 = 2.0;
+
+/// keyframes of a `hours` long video, one every GOP seconds except for every
+/// 16th so the playlist has segments that can't be copied
+fn keyframes(hours: u32) -> Vec<Keyframe> {
+    let count = (hours as f64 * 3600.0 / GOP) as i64;
+    (0..count)
+        .filter(|i| i % 16 != 15)
+        .map(|i| Keyframe {
+            pts: (i as f64 * GOP * 1_000_000.0) as i64,
+            pos: i * 1_000_000,
+            gop_size: 48,
+        })
+        .collect()
+}
+
+fn bench_playlist(c: &mut Criterion) {
+    let source = haema_ff_sys::ProbeInfo {
+        duration: 0.0,
+        start_time: 0.0,
+        video_codec: "h264".into(),
+        width: 1920,
+        height: 1080,
+        frame_rate: 24.0,
+        audio_codec: Some("aac".into()),
+        audio_tracks: 1,
+        bit_rate: 0,
+    };
+    let copy: StreamType = "source,none,aac".parse().unwrap();
+
+    let mut group = c.benchmark_group("playlist");
+    for hours in [1, 3, 12] {
+        let keyframes = keyframes(hours);
+        let duration = hours as f64 * 3600.0;
+        group.bench_function(format!("layout/{hours}h"), |b| {
+            b.iter(|| {
+                SegmentLayout::from_keyframes(
+                    black_box(&keyframes).iter().copied(),
+                    duration,
+                    SEGMENT_DURATION,
+                )
+            })
+        });
+
+        let layout =
+            SegmentLayout::from_keyframes(keyframes.into_iter(), duration, SEGMENT_DURATION);
+        for format in [Format::MpegTs, Format::Fmp4] {
+            group.bench_function(format!("media/{hours}h/{format:?}"), |b| {
+                b.iter(|| {
+                    create_hls_media_playlist(black_box(&layout), format, |idx, segment| {
+                        segment_encoding(&layout, idx, segment, &copy, &source)
+                    })
+                })
+            });
+        }
+    }
+    group.finish();
+}
+
+fn bench_parse(c: &mut Criterion) {
+    let mut group = c.benchmark_group("parse");
+    for name in ["1234.ts", "1234.m4s", "init-1234.mp4", "1234.mkv"] {
+        let name = name.to_string();
+        group.bench_function(format!("segment_filename/{name}"), |b| {
+            b.iter(|| parse_segment_filename(black_box(&name)))
+        });
+    }
+    for stream_type in ["source,none,aac", "720p,h264,aac", "720p,vp8,aac"] {
+        group.bench_function(format!("stream_type/{stream_type}"), |b| {
+            b.iter(|| black_box(stream_type).parse::<StreamType>())
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_playlist, bench_parse);
+criterion_main!(benches);
@@ -0,0 +1,43 @@
+use criterion::{Criterion, criterion_group, criterion_main};
+use haema_server::pool::{Job, Pool};
+use tokio::{runtime::Runtime, task::JoinSet};
+
+// transcoders of a software backend on a 16 core box
+const POOL_SIZE: usize = 4;
+const GETS_PER_TASK: usize = 100;
+
+/// `tasks` tasks take an item, yield while holding it and hand it back
+async fn contend(pool: &Pool<u64>, tasks: usize) {
+    let mut set = JoinSet::new();
+    for _ in 0..tasks {
+        let pool = pool.clone();
+        set.spawn(async move {
+            for _ in 0..GETS_PER_TASK {
+                let mut item = pool.get(Job::batch()).await;
+                *item += 1;
+                tokio::task::yield_now().await;
+            }
+        });
+    }
+    set.join_all().await;
+}
+
+fn bench_pool(c: &mut Criterion) {
+    let rt = Runtime::new().unwrap();
+    let pool = Pool::new(|| 0, POOL_SIZE);
+
+    let mut group = c.benchmark_group("pool");
+    group.bench_function("get/uncontended", |b| {
+        b.to_async(&rt)
+            .iter(|| async { drop(pool.get(Job::batch()).await) })
+    });
+    for tasks in [1, POOL_SIZE, 4 * POOL_SIZE, 16 * POOL_SIZE] {
+        group.bench_function(format!("get/{tasks}_tasks"), |b| {
+            b.to_async(&rt).iter(|| contend(&pool, tasks))
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_pool);
+criterion_main!(benches);
@@ -0,0 +1,112 @@
+#[path = "../../haema-ff-sys/benches/common/mod.rs"]
+mod common;
+
+use std::fs;
+
+use common::generate_clip;
+use criterion::{Criterion, criterion_group, criterion_main};
+use haema_ff_sys::Format;
+use haema_server::{
+    cache::SegmentKey,
+    config::Config,
+    domain::{Resolution, StreamType},
+    pool::Job,
+    services::{get_source_mtime, load_video_segment, stream_video_segment},
+    state::AppState,
+};
+use tokio::runtime::Runtime;
+
+/// segments go through the same path as a request for them, nothing is
+/// cached so every iteration produces the segment again
+fn bench_segment(c: &mut Criterion) {
+    let dir = std::env::temp_dir().join(format!("haema-server-bench-{}", std::process::id()));
+    fs::create_dir_all(&dir).unwrap();
+    let clip = generate_clip(&dir, 1920, 1080);
+    let clip = clip.to_str().unwrap().to_owned();
+
+    let rt = Runtime::new().unwrap();
+    let config = Config {
+        target_path: dir.clone(),
+        db: dir.join("haema.db"),
+        cache: false,
+        cache_path: dir.join("cache"),
+        memory_cache_limit: 0,
+        prefetch_segments: 0,
+        renditions: vec![Resolution::Height(480), Resolution::Height(360)],
+        ..Config::default()
+    };
+    // the clip is passed by path, indexing and watching the temp dir would
+    // only run next to the measurements
+    let state = rt.block_on(async { AppState::without_library_tasks(config) });
+    // the regular layout, segment 1 is a whole SEGMENT_DURATION
+    let key = |stream_type: &str, format| SegmentKey {
+        video_id: "bench".into(),
+        stream_type: stream_type.parse::<StreamType>().unwrap(),
+        segment_idx: 1,
+        format,
+        mtime: get_source_mtime(&clip).unwrap(),
+        fast_start: false,
+    };
+    // builds the keyframe index outside of the measurements
+    rt.block_on(load_video_segment(
+        &state,
+        &key("source,none,aac", Format::MpegTs),
+        &clip,
+        Job::batch(),
+    ))
+    .unwrap();
+
+    let mut group = c.benchmark_group("segment");
+    for format in [Format::MpegTs, Format::Fmp4] {
+        let key = key("source,none,aac", format);
+        group.bench_function(format!("copy/{format:?}"), |b| {
+            b.to_async(&rt).iter(|| async {
+                load_video_segment(&state, &key, &clip, Job::playback(None))
+                    .await
+                    .unwrap()
+            })
+        });
+    }
+    group.sample_size(10);
+    // a streamed segment is transcoded on its own
+    let key_480p = key("480p,h264,aac", Format::MpegTs);
+    group.bench_function("transcode/480p", |b| {
+        b.to_async(&rt).iter(|| async {
+            stream_video_segment(&state, &key_480p, &clip, Job::playback(None))
+                .bytes()
+                .await
+                .unwrap()
+        })
+    });
+    // the first short segment of a fast start, what a player waits on before
+    // it shows anything
+    let key_fast_start = SegmentKey {
+        segment_idx: 0,
+        fast_start: true,
+        ..key_480p.clone()
+    };
+    group.bench_function("transcode/480p/fast_start", |b| {
+        b.to_async(&rt).iter(|| async {
+            stream_video_segment(&state, &key_fast_start, &clip, Job::playback(None))
+                .bytes()
+                .await
+                .unwrap()
+        })
+    });
+    // a buffered one takes the rest of the ladder along
+    group.bench_function("transcode/480p+360p", |b| {
+        b.to_async(&rt).iter(|| async {
+            load_video_segment(&state, &key_480p, &clip, Job::playback(None))
+                .await
+                .unwrap()
+        })
+    });
+    group.finish();
+
+    drop(state);
+    drop(rt);
+    let _ = fs::remove_dir_all(&dir);
+}
+
+criterion_group!(benches, bench_segment);
+criterion_main!(benches);
@@ -0,0 +1,388 @@
+use std::{
+    collections::HashSet,
+    fs, io,
+    path::{Path, PathBuf},
+    sync::{
+        Mutex,
+        atomic::{AtomicU64, Ordering},
+    },
+};
+
+use axum::body::Bytes;
+use tokio::fs as afs;
+
+use super::{SegmentKey, escape, lru::Lru};
+
+const INDEX_FILE: &str = "index";
+const INDEX_MAGIC: &[u8; 8] = b"HMCIDX01";
+const TMP_DIR: &str = "tmp";
+
+/// in memory view of the segments on disk keyed by their relative path
+#[derive(Default)]
+struct Index {
+    lru: Lru<String, ()>,
+    dirty: bool,
+}
+
+impl Index {
+    fn touch(&mut self, path: &str) -> bool {
+        let found = self.lru.get(&path.to_string()).is_some();
+        self.dirty |= found;
+        found
+    }
+
+    fn insert(&mut self, path: String, size: u64) {
+        self.lru.insert(path, (), size);
+        self.dirty = true;
+    }
+
+    fn remove(&mut self, path: &str) -> bool {
+        let found = self.lru.remove(&path.to_string()).is_some();
+        self.dirty |= found;
+        found
+    }
+
+    fn evict(&mut self, limit: u64) -> Vec<String> {
+        let victims: Vec<String> = self.lru.evict(limit).into_iter().map(|(p, _)| p).collect();
+        self.dirty |= !victims.is_empty();
+        victims
+    }
+
+    /// paths of the index, taken before a walk of the disk for `merge`
+    fn paths(&self) -> HashSet<String> {
+        self.lru.iter().map(|(path, _, _)| path.clone()).collect()
+    }
+
+    /// merges the files a walk `found` into the index, `before` are the paths
+    /// indexed when the walk started
+    ///
+    /// - orphans go in front of the lru order
+    /// - files missing from the walk are dropped, unless they were put while
+    /// it ran
+    /// - files found but no longer indexed were evicted or removed while it
+    /// ran and stay out
+    fn merge(&mut self, before: &HashSet<String>, found: &[(String, u64)]) {
+        let on_disk: HashSet<&str> = found.iter().map(|(p, _)| p.as_str()).collect();
+        for path in before {
+            if !on_disk.contains(path.as_str()) {
+                self.remove(path);
+            }
+        }
+        for (path, size) in found {
+            if !before.contains(path) && !self.lru.contains(path) {
+                self.lru.insert_oldest(path.clone(), (), *size);
+                self.dirty = true;
+            }
+        }
+    }
+
+    fn encode(&self) -> Vec<u8> {
+        let mut buf = Vec::with_capacity(INDEX_MAGIC.len() + self.lru.len() * 64);
+        buf.extend_from_slice(INDEX_MAGIC);
+        for (path, _, size) in self.lru.iter() {
+            buf.extend_from_slice(&(path.len() as u16).to_le_bytes());
+            buf.extend_from_slice(path.as_bytes());
+            buf.extend_from_slice(&size.to_le_bytes());
+        }
+        buf
+    }
+
+    fn decode(buf: &[u8]) -> Option<Self> {
+        let mut rest = buf.strip_prefix(INDEX_MAGIC)?;
+        let mut index = Index::default();
+        while !rest.is_empty() {
+            let path_len = u16::from_le_bytes(rest.get(..2)?.try_into().ok()?) as usize;
+            rest = &rest[2..];
+            let path = std::str::from_utf8(rest.get(..path_len)?).ok()?;
+            rest = &rest[path_len..];
+            let size = u64::from_le_bytes(rest.get(..8)?.try_into().ok()?);
+            rest = &rest[8..];
+            index.insert(path.to_string(), size);
+        }
+        index.dirty = false;
+        Some(index)
+    }
+}
+
+/// segment cache on disk limited to `limit` bytes
+///
+/// - segments are written to tmp/ then renamed so a crash never leaves a torn
+/// segment behind
+/// - the index is a snapshot of paths in lru order, files written after the
+/// last snapshot are picked up by `reconcile`
+pub struct DiskCache {
+    root: PathBuf,
+    limit: u64,
+    index: Mutex<Index>,
+    tmp_seq: AtomicU64,
+    evictions: AtomicU64,
+}
+
+impl DiskCache {
+    pub fn open(root: &Path, limit: u64) -> io::Result<Self> {
+        let tmp = root.join(TMP_DIR);
+        let _ = fs::remove_dir_all(&tmp);
+        fs::create_dir_all(&tmp)?;
+
+        let index = match fs::read(root.join(INDEX_FILE)) {
+            Ok(buf) => Index::decode(&buf),
+            Err(_) => None,
+        };
+        let cache = Self {
+            root: root.to_path_buf(),
+            limit,
+            index: Mutex::new(index.unwrap_or_default()),
+            tmp_seq: AtomicU64::new(0),
+            evictions: AtomicU64::new(0),
+        };
+        Ok(cache)
+    }
+
+    fn path_of(&self, rel_path: &str) -> PathBuf {
+        self.root.join(rel_path)
+    }
+
+    /// total size of the segments in the index
+    pub fn size(&self) -> u64 {
+        self.index.lock().unwrap().lru.size()
+    }
+
+    /// number of segments dropped to stay within `limit`
+    pub fn evictions(&self) -> u64 {
+        self.evictions.load(Ordering::Relaxed)
+    }
+
+    /// whether the index has the segment, the file itself is not checked
+    pub fn contains(&self, key: &SegmentKey) -> bool {
+        self.index.lock().unwrap().lru.contains(&key.rel_path())
+    }
+
+    pub async fn get(&self, key: &SegmentKey) -> Option<Bytes> {
+        let rel_path = key.rel_path();
+        if !self.index.lock().unwrap().touch(&rel_path) {
+            return None;
+        }
+
+        match afs::read(self.path_of(&rel_path)).await {
+            Ok(data) => Some(Bytes::from(data)),
+            Err(_) => {
+                // removed behind our back
+                self.index.lock().unwrap().remove(&rel_path);
+                None
+            }
+        }
+    }
+
+    pub async fn put(&self, key: &SegmentKey, data: &[u8]) -> io::Result<()> {
+        let size = data.len() as u64;
+        if size > self.limit {
+            return Ok(());
+        }
+
+        let rel_path = key.rel_path();
+        let path = self.path_of(&rel_path);
+        let tmp_path = self.root.join(TMP_DIR).join(format!(
+            "{}.part",
+            self.tmp_seq.fetch_add(1, Ordering::Relaxed)
+        ));
+        write_atomic(&tmp_path, &path, data).await?;
+
+        let victims = {
+            let mut index = self.index.lock().unwrap();
+            index.insert(rel_path, size);
+            index.evict(self.limit)
+        };
+        self.evictions
+            .fetch_add(victims.len() as u64, Ordering::Relaxed);
+        for victim in victims {
+            let _ = afs::remove_file(self.path_of(&victim)).await;
+        }
+        Ok(())
+    }
+
+    /// drops every segment of `video_ids` from the index and the disk
+    pub async fn remove_videos(&self, video_ids: &HashSet<String>) -> io::Result<()> {
+        let dirs: HashSet<String> = video_ids.iter().map(|id| escape(id)).collect();
+        {
+            let mut index = self.index.lock().unwrap();
+            let paths: Vec<String> = index
+                .lru
+                .iter()
+                .map(|(path, _, _)| path)
+                .filter(|path| {
+                    path.split_once('/')
+                        .is_some_and(|(dir, _)| dirs.contains(dir))
+                })
+                .cloned()
+                .collect();
+            for path in paths {
+                index.remove(&path);
+            }
+        }
+        for dir in &dirs {
+            match afs::remove_dir_all(self.path_of(dir)).await {
+                Err(err) if err.kind() != io::ErrorKind::NotFound => return Err(err),
+                _ => {}
+            }
+        }
+        Ok(())
+    }
+
+    /// writes the index snapshot if it changed since the last call
+    pub async fn persist_index(&self) -> io::Result<()> {
+        let buf = {
+            let mut index = self.index.lock().unwrap();
+            if !index.dirty {
+                return Ok(());
+            }
+            index.dirty = false;
+            index.encode()
+        };
+        let tmp_path = self.root.join(TMP_DIR).join(INDEX_FILE);
+        write_atomic(&tmp_path, &self.root.join(INDEX_FILE), &buf).await
+    }
+
+    /// syncs the index with the files on disk, segments missing from the
+    /// index are treated as least recently used. runs next to `put` and
+    /// `remove_videos`, the walk is merged into the live index
+    pub async fn reconcile(&self) -> io::Result<()> {
+        let before = self.index.lock().unwrap().paths();
+        let mut found = vec![];
+        let mut dirs = vec![self.root.clone()];
+        while let Some(dir) = dirs.pop() {
+            let mut rd = afs::read_dir(&dir).await?;
+            while let Some(ent) = rd.next_entry().await? {
+                let file_type = ent.file_type().await?;
+                let path = ent.path();
+                if file_type.is_dir() {
+                    if path != self.root.join(TMP_DIR) {
+                        dirs.push(path);
+                    }
+                } else if path
+                    .extension()
+                    .is_some_and(|ext| ext == "ts" || ext == "m4s")
+                {
+                    let rel_path = path.strip_prefix(&self.root).unwrap();
+                    let size = ent.metadata().await?.len();
+                    found.push((rel_path.to_string_lossy().into_owned(), size));
+                }
+            }
+        }
+
+        let victims = {
+            let mut index = self.index.lock().unwrap();
+            index.merge(&before, &found);
+            index.evict(self.limit)
+        };
+        self.evictions
+            .fetch_add(victims.len() as u64, Ordering::Relaxed);
+        for victim in victims {
+            let _ = afs::remove_file(self.path_of(&victim)).await;
+        }
+        Ok(())
+    }
+}
+
+async fn write_atomic(tmp_path: &Path, path: &Path, data: &[u8]) -> io::Result<()> {
+    if let Some(parent) = path.parent() {
+        afs::create_dir_all(parent).await?;
+    }
+    let mut file = afs::File::create(tmp_path).await?;
+    tokio::io::AsyncWriteExt::write_all(&mut file, data).await?;
+    file.sync_all().await?;
+    drop(file);
+    afs::rename(tmp_path, path).await
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use haema_ff_sys::Format;
+
+    fn found(paths: &[(&str, u64)]) -> Vec<(String, u64)> {
+        paths.iter().map(|(p, s)| (p.to_string(), *s)).collect()
+    }
+
+    fn paths(index: &Index) -> Vec<&str> {
+        index.lru.iter().map(|(p, _, _)| p.as_str()).collect()
+    }
+
+    #[test]
+    fn test_index_roundtrip() {
+        let mut index = Index::default();
+        index.insert("a/b/1-0.ts".into(), 10);
+        index.insert("a/b/1-1.ts".into(), 20);
+        index.touch("a/b/1-0.ts");
+        let decoded = Index::decode(&index.encode()).unwrap();
+        assert_eq!(paths(&decoded), ["a/b/1-1.ts", "a/b/1-0.ts"]);
+        assert_eq!(decoded.lru.size(), 30);
+        assert!(!decoded.dirty);
+    }
+
+    #[test]
+    fn test_index_decode_rejects_bad_input() {
+        let mut index = Index::default();
+        index.insert("a/b/1-0.ts".into(), 10);
+        let buf = index.encode();
+        assert!(Index::decode(&buf[..buf.len() - 1]).is_none());
+        assert!(Index::decode(b"HMCIDX00").is_none());
+        assert!(Index::decode(b"").is_none());
+        assert_eq!(Index::decode(INDEX_MAGIC).unwrap().lru.len(), 0);
+    }
+
+    #[test]
+    fn test_merge_orphans_and_missing() {
+        let mut index = Index::default();
+        index.insert("kept".into(), 1);
+        index.insert("missing".into(), 1);
+        let before = index.paths();
+        index.merge(&before, &found(&[("orphan", 5), ("kept", 1)]));
+        assert_eq!(paths(&index), ["orphan", "kept"]);
+        assert_eq!(index.lru.size(), 6);
+    }
+
+    #[test]
+    fn test_merge_keeps_changes_during_walk() {
+        let mut index = Index::default();
+        index.insert("evicted".into(), 1);
+        index.insert("kept".into(), 1);
+        let before = index.paths();
+        // put after the walk passed its directory, evicted after the walk saw
+        // its file
+        index.insert("put".into(), 1);
+        index.remove("evicted");
+        index.merge(&before, &found(&[("evicted", 1), ("kept", 1)]));
+        assert_eq!(paths(&index), ["kept", "put"]);
+    }
+
+    #[tokio::test]
+    async fn test_reconcile() {
+        let root = std::env::temp_dir().join(format!("haema-disk-test-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&root);
+        let cache = DiskCache::open(&root, 10).unwrap();
+        let key = |segment_idx| SegmentKey {
+            video_id: "v".into(),
+            stream_type: "480p,h264,aac".parse().unwrap(),
+            segment_idx,
+            format: Format::MpegTs,
+            mtime: 1,
+            fast_start: false,
+        };
+        cache.put(&key(0), &[0; 4]).await.unwrap();
+        // written by an earlier run after its last index snapshot
+        fs::write(root.join(key(1).rel_path()), [0; 4]).unwrap();
+
+        cache.reconcile().await.unwrap();
+        assert_eq!(cache.size(), 8);
+        assert!(cache.contains(&key(1)));
+
+        // the orphan is the least recently used
+        cache.put(&key(2), &[0; 4]).await.unwrap();
+        assert!(!cache.contains(&key(1)));
+        assert!(cache.contains(&key(0)));
+        assert!(!root.join(key(1).rel_path()).exists());
+        assert_eq!(cache.evictions(), 1);
+
+        fs::remove_dir_all(&root).unwrap();
+    }
+}
@@ -0,0 +1,190 @@
+use std::{
+    collections::{HashMap, HashSet},
+    fs, io,
+    path::{Path, PathBuf},
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicU64, Ordering},
+    },
+};
+
+use haema_ff_sys::Keyframe;
+use memmap2::Mmap;
+use tokio::{sync::OnceCell, task};
+
+use super::escape;
+use crate::error::AppError;
+
+const MAGIC: &[u8; 8] = b"HMKF0001";
+// pts: i64, pos: i64, gop_size: i32 in little endian without padding
+const RECORD_SIZE: usize = 20;
+
+/// memory mapped keyframe index of one source file
+pub struct KeyframeIndex {
+    map: Mmap,
+}
+
+impl KeyframeIndex {
+    fn open(path: &Path) -> io::Result<Self> {
+        let file = fs::File::open(path)?;
+        // the file is only ever replaced by rename, never written in place
+        let map = unsafe { Mmap::map(&file)? };
+        let valid = map.starts_with(MAGIC) && (map.len() - MAGIC.len()) % RECORD_SIZE == 0;
+        if !valid {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "corrupt keyframe index",
+            ));
+        }
+        Ok(Self { map })
+    }
+
+    pub fn len(&self) -> usize {
+        (self.map.len() - MAGIC.len()) / RECORD_SIZE
+    }
+
+    pub fn get(&self, idx: usize) -> Option<Keyframe> {
+        let offset = MAGIC.len() + idx * RECORD_SIZE;
+        let record = self.map.get(offset..offset + RECORD_SIZE)?;
+        Some(Keyframe {
+            pts: i64::from_le_bytes(record[0..8].try_into().unwrap()),
+            pos: i64::from_le_bytes(record[8..16].try_into().unwrap()),
+            gop_size: i32::from_le_bytes(record[16..20].try_into().unwrap()),
+        })
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = Keyframe> + '_ {
+        (0..self.len()).filter_map(|idx| self.get(idx))
+    }
+}
+
+/// keyframe indexes stored as `{video_id}-{mtime}.kf` files in `dir`
+///
+/// - concurrent misses of the same index share one scan of the source, the
+/// entry of `builds` lives until that scan is done
+pub struct KeyframeStore {
+    dir: PathBuf,
+    tmp_seq: AtomicU64,
+    builds: Mutex<HashMap<PathBuf, Arc<OnceCell<()>>>>,
+}
+
+impl KeyframeStore {
+    pub fn new(dir: &Path) -> io::Result<Self> {
+        fs::create_dir_all(dir)?;
+        Ok(Self {
+            dir: dir.to_path_buf(),
+            tmp_seq: AtomicU64::new(0),
+            builds: Mutex::new(HashMap::new()),
+        })
+    }
+
+    fn path_of(&self, video_id: &str, mtime: u64) -> PathBuf {
+        self.dir.join(format!("{}-{}.kf", escape(video_id), mtime))
+    }
+
+    pub fn open(&self, video_id: &str, mtime: u64) -> Option<KeyframeIndex> {
+        KeyframeIndex::open(&self.path_of(video_id, mtime)).ok()
+    }
+
+    /// opens the index of `video_id`, scanning `video_path` for its keyframes
+    /// when there is none yet
+    pub async fn open_or_build(
+        self: &Arc<Self>,
+        video_id: &str,
+        mtime: u64,
+        video_path: &str,
+    ) -> Result<KeyframeIndex, AppError> {
+        let path = self.path_of(video_id, mtime);
+        let build = self
+            .builds
+            .lock()
+            .unwrap()
+            .entry(path.clone())
+            .or_default()
+            .clone();
+
+        let store = self.clone();
+        let video_id = video_id.to_owned();
+        let video_path = video_path.to_owned();
+        let built = build
+            .get_or_try_init(|| async move {
+                task::spawn_blocking(move || {
+                    if store.open(&video_id, mtime).is_some() {
+                        return Ok(());
+                    }
+                    let keyframes = haema_ff_sys::get_keyframes(&video_path).map_err(|err| {
+                        AppError::Error(format!("hm_keyframes failed with code {err}"))
+                    })?;
+                    store
+                        .save(&video_id, mtime, &keyframes)
+                        .map(|_| ())
+                        .map_err(|err| AppError::Error(err.to_string()))
+                })
+                .await
+                .map_err(|err| AppError::Error(err.to_string()))?
+            })
+            .await
+            .cloned();
+
+        {
+            let mut builds = self.builds.lock().unwrap();
+            if builds
+                .get(&path)
+                .is_some_and(|entry| Arc::ptr_eq(entry, &build))
+            {
+                builds.remove(&path);
+            }
+        }
+        built?;
+        KeyframeIndex::open(&path).map_err(|err| AppError::Error(err.to_string()))
+    }
+
+    pub fn save(
+        &self,
+        video_id: &str,
+        mtime: u64,
+        keyframes: &[Keyframe],
+    ) -> io::Result<KeyframeIndex> {
+        let mut buf = Vec::with_capacity(MAGIC.len() + keyframes.len() * RECORD_SIZE);
+        buf.extend_from_slice(MAGIC);
+        for keyframe in keyframes {
+            buf.extend_from_slice(&keyframe.pts.to_le_bytes());
+            buf.extend_from_slice(&keyframe.pos.to_le_bytes());
+            buf.extend_from_slice(&keyframe.gop_size.to_le_bytes());
+        }
+
+        let path = self.path_of(video_id, mtime);
+        let tmp_path = self.dir.join(format!(
+            "{}.tmp",
+            self.tmp_seq.fetch_add(1, Ordering::Relaxed)
+        ));
+        fs::write(&tmp_path, &buf)?;
+        fs::File::open(&tmp_path)?.sync_all()?;
+        fs::rename(&tmp_path, &path)?;
+        KeyframeIndex::open(&path)
+    }
+
+    /// removes the indexes of every mtime of `video_ids` in one pass over the
+    /// directory, open indexes stay mapped until they are dropped
+    pub fn remove(&self, video_ids: &HashSet<String>) -> io::Result<()> {
+        let escaped: HashSet<String> = video_ids.iter().map(|id| escape(id)).collect();
+        for ent in fs::read_dir(&self.dir)? {
+            let name = ent?.file_name();
+            // escaped ids may contain '-', mtimes don't
+            let Some((video_id, mtime)) = name
+                .to_str()
+                .and_then(|name| name.strip_suffix(".kf"))
+                .and_then(|rest| rest.rsplit_once('-'))
+            else {
+                continue;
+            };
+            if escaped.contains(video_id)
+                && !mtime.is_empty()
+                && mtime.bytes().all(|b| b.is_ascii_digit())
+            {
+                fs::remove_file(self.dir.join(&name))?;
+            }
+        }
+        Ok(())
+    }
+}
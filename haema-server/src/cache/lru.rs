@@ -0,0 +1,169 @@
+use std::{
+    collections::{BTreeMap, HashMap},
+    hash::Hash,
+};
+
+struct Entry<V> {
+    value: V,
+    size: u64,
+    tick: i64,
+}
+
+/// size aware lru map, `order` sorts keys from least to most recently used
+pub struct Lru<K, V> {
+    entries: HashMap<K, Entry<V>>,
+    order: BTreeMap<i64, K>,
+    tick: i64,
+    size: u64,
+}
+
+impl<K, V> Default for Lru<K, V> {
+    fn default() -> Self {
+        Self {
+            entries: HashMap::new(),
+            order: BTreeMap::new(),
+            tick: 0,
+            size: 0,
+        }
+    }
+}
+
+impl<K: Hash + Eq + Clone, V> Lru<K, V> {
+    /// total size of all entries
+    pub fn size(&self) -> u64 {
+        self.size
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    pub fn contains(&self, key: &K) -> bool {
+        self.entries.contains_key(key)
+    }
+
+    /// marks the entry as most recently used
+    pub fn get(&mut self, key: &K) -> Option<&V> {
+        let entry = self.entries.get_mut(key)?;
+        self.order.remove(&entry.tick);
+        self.tick += 1;
+        entry.tick = self.tick;
+        self.order.insert(self.tick, key.clone());
+        Some(&entry.value)
+    }
+
+    pub fn insert(&mut self, key: K, value: V, size: u64) {
+        self.remove(&key);
+        self.tick += 1;
+        self.order.insert(self.tick, key.clone());
+        self.entries.insert(
+            key,
+            Entry {
+                value,
+                size,
+                tick: self.tick,
+            },
+        );
+        self.size += size;
+    }
+
+    /// inserts the entry as the least recently used one
+    pub fn insert_oldest(&mut self, key: K, value: V, size: u64) {
+        self.remove(&key);
+        let tick = self
+            .order
+            .first_key_value()
+            .map_or(self.tick, |(t, _)| t - 1);
+        self.order.insert(tick, key.clone());
+        self.entries.insert(key, Entry { value, size, tick });
+        self.size += size;
+    }
+
+    pub fn remove(&mut self, key: &K) -> Option<V> {
+        let entry = self.entries.remove(key)?;
+        self.order.remove(&entry.tick);
+        self.size -= entry.size;
+        Some(entry.value)
+    }
+
+    /// removes least recently used entries until `size` fits into `limit`
+    pub fn evict(&mut self, limit: u64) -> Vec<(K, V)> {
+        let mut victims = vec![];
+        while self.size > limit {
+            let Some((_, key)) = self.order.pop_first() else {
+                break;
+            };
+            if let Some(entry) = self.entries.remove(&key) {
+                self.size -= entry.size;
+                victims.push((key, entry.value));
+            }
+        }
+        victims
+    }
+
+    /// entries from least to most recently used as (key, value, size)
+    pub fn iter(&self) -> impl Iterator<Item = (&K, &V, u64)> {
+        self.order.values().map(|key| {
+            let entry = &self.entries[key];
+            (key, &entry.value, entry.size)
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn keys(lru: &Lru<&'static str, ()>) -> Vec<&'static str> {
+        lru.iter().map(|(k, _, _)| *k).collect()
+    }
+
+    #[test]
+    fn test_get_moves_to_back() {
+        let mut lru = Lru::default();
+        lru.insert("a", (), 1);
+        lru.insert("b", (), 1);
+        lru.insert("c", (), 1);
+        assert!(lru.get(&"a").is_some());
+        assert_eq!(keys(&lru), ["b", "c", "a"]);
+        assert!(lru.get(&"d").is_none());
+    }
+
+    #[test]
+    fn test_insert_replaces_size() {
+        let mut lru = Lru::default();
+        lru.insert("a", (), 5);
+        lru.insert("a", (), 3);
+        assert_eq!(lru.len(), 1);
+        assert_eq!(lru.size(), 3);
+        assert_eq!(lru.remove(&"a"), Some(()));
+        assert_eq!(lru.size(), 0);
+        assert_eq!(lru.remove(&"a"), None);
+    }
+
+    #[test]
+    fn test_insert_oldest() {
+        let mut lru = Lru::default();
+        lru.insert_oldest("a", (), 1);
+        lru.insert("b", (), 1);
+        lru.insert_oldest("c", (), 1);
+        lru.insert_oldest("b", (), 1);
+        assert_eq!(keys(&lru), ["b", "c", "a"]);
+        assert_eq!(lru.size(), 3);
+    }
+
+    #[test]
+    fn test_evict_least_recent_first() {
+        let mut lru = Lru::default();
+        lru.insert("a", (), 4);
+        lru.insert("b", (), 4);
+        lru.insert("c", (), 4);
+        lru.get(&"a");
+        let victims: Vec<_> = lru.evict(8).into_iter().map(|(k, _)| k).collect();
+        assert_eq!(victims, ["b"]);
+        assert_eq!(lru.size(), 8);
+        assert!(lru.evict(8).is_empty());
+        assert_eq!(lru.evict(0).len(), 2);
+        assert_eq!(lru.size(), 0);
+    }
+}
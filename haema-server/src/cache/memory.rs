@@ -0,0 +1,71 @@
+use std::{
+    collections::HashSet,
+    sync::{
+        Mutex,
+        atomic::{AtomicU64, Ordering},
+    },
+};
+
+use axum::body::Bytes;
+
+use super::{SegmentKey, lru::Lru};
+
+/// recently produced segments kept in memory, limited to `limit` bytes
+pub struct MemoryCache {
+    limit: u64,
+    lru: Mutex<Lru<SegmentKey, Bytes>>,
+    evictions: AtomicU64,
+}
+
+impl MemoryCache {
+    pub fn new(limit: u64) -> Self {
+        Self {
+            limit,
+            lru: Mutex::new(Lru::default()),
+            evictions: AtomicU64::new(0),
+        }
+    }
+
+    pub fn get(&self, key: &SegmentKey) -> Option<Bytes> {
+        self.lru.lock().unwrap().get(key).cloned()
+    }
+
+    pub fn put(&self, key: SegmentKey, segment: Bytes) {
+        let size = segment.len() as u64;
+        if size > self.limit {
+            return;
+        }
+        let mut lru = self.lru.lock().unwrap();
+        lru.insert(key, segment, size);
+        // victims are dropped outside of the hot path of other callers
+        let victims = lru.evict(self.limit);
+        drop(lru);
+        self.evictions
+            .fetch_add(victims.len() as u64, Ordering::Relaxed);
+        drop(victims);
+    }
+
+    /// total size of the cached segments
+    pub fn size(&self) -> u64 {
+        self.lru.lock().unwrap().size()
+    }
+
+    /// number of segments dropped to stay within `limit`
+    pub fn evictions(&self) -> u64 {
+        self.evictions.load(Ordering::Relaxed)
+    }
+
+    /// drops every segment of `video_ids`
+    pub fn remove_videos(&self, video_ids: &HashSet<String>) {
+        let mut lru = self.lru.lock().unwrap();
+        let keys: Vec<SegmentKey> = lru
+            .iter()
+            .map(|(key, _, _)| key)
+            .filter(|key| video_ids.contains(&key.video_id))
+            .cloned()
+            .collect();
+        let removed: Vec<Bytes> = keys.iter().filter_map(|key| lru.remove(key)).collect();
+        drop(lru);
+        drop(removed);
+    }
+}
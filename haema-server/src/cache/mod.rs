@@ -0,0 +1,332 @@
+pub mod disk;
+pub mod keyframes;
+mod lru;
+pub mod memory;
+pub mod probe;
+pub mod stream;
+
+pub use disk::DiskCache;
+pub use keyframes::{KeyframeIndex, KeyframeStore};
+pub use memory::MemoryCache;
+pub use probe::ProbeCache;
+pub use stream::{Demand, SegmentStream};
+
+use std::{
+    collections::{HashMap, HashSet},
+    future::Future,
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicU64, Ordering},
+    },
+};
+
+use axum::body::Bytes;
+use haema_ff_sys::Format;
+
+use crate::{domain::StreamType, error::AppError};
+
+/// identifies one produced segment, `mtime` of the source file is part of the
+/// key so a replaced source never serves stale segments
+#[derive(Clone, Debug, PartialEq, Eq, Hash)]
+pub struct SegmentKey {
+    pub video_id: String,
+    pub stream_type: StreamType,
+    pub segment_idx: usize,
+    pub format: Format,
+    pub mtime: u64,
+    /// `segment_idx` counts the short segments of a fast start, when the
+    /// stream has them (see `video_service::has_fast_start`)
+    pub fast_start: bool,
+}
+
+impl SegmentKey {
+    /// path of the segment relative to the cache root
+    pub fn rel_path(&self) -> String {
+        format!(
+            "{}/{}/{}-{}{}.{}",
+            escape(&self.video_id),
+            escape(&self.stream_type.to_string()),
+            self.mtime,
+            if self.fast_start { "f" } else { "" },
+            self.segment_idx,
+            segment_extension(self.format)
+        )
+    }
+}
+
+/// file extension of segments in `format`, fmp4 segments are cached with
+/// their init segment in front
+pub fn segment_extension(format: Format) -> &'static str {
+    match format {
+        Format::MpegTs => "ts",
+        Format::Fmp4 => "m4s",
+    }
+}
+
+// percent escapes everything that is not safe in a single path component
+pub(crate) fn escape(s: &str) -> String {
+    let mut escaped = String::with_capacity(s.len());
+    for b in s.bytes() {
+        match b {
+            b'a'..=b'z' | b'A'..=b'Z' | b'0'..=b'9' | b'-' | b'_' | b',' => {
+                escaped.push(b as char)
+            }
+            _ => escaped.push_str(&format!("%{:02X}", b)),
+        }
+    }
+    escaped
+}
+
+/// a cached segment or one that is still being produced
+pub enum SegmentBody {
+    Ready(Bytes),
+    /// the caller is already counted as a reader
+    Streaming(Demand),
+}
+
+impl SegmentBody {
+    /// waits until the whole segment is available
+    pub async fn bytes(self) -> Result<Bytes, AppError> {
+        match self {
+            SegmentBody::Ready(segment) => Ok(segment),
+            SegmentBody::Streaming(demand) => demand.wait().await,
+        }
+    }
+}
+
+/// where lookups of `get_or_produce` were served from
+#[derive(Default)]
+pub struct CacheStats {
+    pub memory_hits: AtomicU64,
+    pub disk_hits: AtomicU64,
+    /// joined a segment that was already being produced
+    pub inflight_hits: AtomicU64,
+    /// produced from the source
+    pub misses: AtomicU64,
+    /// every reader went away before the segment was produced
+    pub abandoned: AtomicU64,
+}
+
+/// memory cache in front of the optional disk cache
+///
+/// a missing segment is produced by a detached task into a `SegmentStream`,
+/// concurrent requests for it read the same stream. when every reader goes
+/// away before it is finished the producer is interrupted, a later request
+/// starts over
+pub struct SegmentCache {
+    memory: MemoryCache,
+    disk: Option<Arc<DiskCache>>,
+    inflight: Mutex<HashMap<SegmentKey, Arc<SegmentStream>>>,
+    stats: CacheStats,
+}
+
+impl SegmentCache {
+    pub fn new(memory_limit: u64, disk: Option<Arc<DiskCache>>) -> Self {
+        Self {
+            memory: MemoryCache::new(memory_limit),
+            disk,
+            inflight: Mutex::new(HashMap::new()),
+            stats: CacheStats::default(),
+        }
+    }
+
+    pub fn memory(&self) -> &MemoryCache {
+        &self.memory
+    }
+
+    pub fn disk(&self) -> Option<&Arc<DiskCache>> {
+        self.disk.as_ref()
+    }
+
+    pub fn stats(&self) -> &CacheStats {
+        &self.stats
+    }
+
+    /// `produce` writes the segment into the stream it is given, it only runs
+    /// when the segment is neither cached nor already being produced
+    pub fn get_or_produce<F, Fut>(self: &Arc<Self>, key: &SegmentKey, produce: F) -> SegmentBody
+    where
+        F: FnOnce(Arc<SegmentStream>) -> Fut + Send + 'static,
+        Fut: Future<Output = Result<(), AppError>> + Send + 'static,
+    {
+        if let Some(segment) = self.memory.get(key) {
+            self.stats.memory_hits.fetch_add(1, Ordering::Relaxed);
+            return SegmentBody::Ready(segment);
+        }
+
+        let demand = {
+            let mut inflight = self.inflight.lock().unwrap();
+            // an abandoned producer is about to give up, its entry is
+            // replaced. the caller joins under the lock so the segment can't
+            // be abandoned before it starts reading
+            if let Some(demand) = inflight.get(key).and_then(|stream| stream.join()) {
+                self.stats.inflight_hits.fetch_add(1, Ordering::Relaxed);
+                return SegmentBody::Streaming(demand);
+            }
+            let stream = Arc::new(SegmentStream::default());
+            inflight.insert(key.clone(), stream.clone());
+            stream.join().expect("a new segment is not abandoned")
+        };
+
+        let cache = self.clone();
+        let key = key.clone();
+        let task_stream = demand.stream().clone();
+        tokio::spawn(async move {
+            let result = cache.load_or_produce(&key, &task_stream, produce).await;
+            if let Ok(segment) = &result {
+                cache.memory.put(key.clone(), segment.clone());
+            }
+            // later requests hit the memory cache before the entry is gone
+            cache.remove_inflight(&key, &task_stream);
+            task_stream.finish(result);
+        });
+        SegmentBody::Streaming(demand)
+    }
+
+    async fn load_or_produce<F, Fut>(
+        &self,
+        key: &SegmentKey,
+        stream: &Arc<SegmentStream>,
+        produce: F,
+    ) -> Result<Bytes, AppError>
+    where
+        F: FnOnce(Arc<SegmentStream>) -> Fut + Send + 'static,
+        Fut: Future<Output = Result<(), AppError>> + Send + 'static,
+    {
+        if let Some(disk) = &self.disk {
+            if let Some(segment) = disk.get(key).await {
+                self.stats.disk_hits.fetch_add(1, Ordering::Relaxed);
+                stream.push(segment.clone());
+                return Ok(segment);
+            }
+        }
+        self.stats.misses.fetch_add(1, Ordering::Relaxed);
+
+        // a panicking producer must still finish the stream
+        tokio::spawn(produce(stream.clone()))
+            .await
+            .map_err(|err| AppError::Error(err.to_string()))??;
+        let segment = stream.collect();
+
+        self.spawn_disk_put(key, &segment);
+        Ok(segment)
+    }
+
+    /// whether `key` is in memory or being produced, a disk hit still counts
+    /// as missing
+    pub fn contains(&self, key: &SegmentKey) -> bool {
+        self.memory.get(key).is_some() || self.inflight.lock().unwrap().contains_key(key)
+    }
+
+    /// caches a segment that was produced along with another one
+    pub fn put(&self, key: SegmentKey, segment: Bytes) {
+        self.spawn_disk_put(&key, &segment);
+        self.memory.put(key, segment);
+    }
+
+    /// registers the caller as the producer of `key`, `None` when the segment
+    /// is cached in memory or on disk or already being produced. requests
+    /// for the key wait on the claim until it is completed
+    pub fn claim(self: &Arc<Self>, key: &SegmentKey) -> Option<SegmentClaim> {
+        if self.memory.get(key).is_some()
+            || self.disk.as_ref().is_some_and(|disk| disk.contains(key))
+        {
+            return None;
+        }
+
+        let mut inflight = self.inflight.lock().unwrap();
+        if inflight
+            .get(key)
+            .is_some_and(|stream| !stream.is_abandoned())
+        {
+            return None;
+        }
+        let stream = Arc::new(SegmentStream::default());
+        inflight.insert(key.clone(), stream.clone());
+        Some(SegmentClaim {
+            cache: self.clone(),
+            key: key.clone(),
+            stream,
+            done: false,
+        })
+    }
+
+    /// drops the cached segments of `video_ids`, segments being produced are
+    /// left alone and keyed by the mtime of the old source anyway
+    pub async fn invalidate(&self, video_ids: &HashSet<String>) {
+        self.memory.remove_videos(video_ids);
+        if let Some(disk) = &self.disk {
+            if let Err(err) = disk.remove_videos(video_ids).await {
+                println!("failed to remove cached segments: {err}");
+            }
+        }
+    }
+
+    // the entry may already belong to the producer that replaced an
+    // abandoned `stream`
+    fn remove_inflight(&self, key: &SegmentKey, stream: &Arc<SegmentStream>) {
+        if stream.is_abandoned() {
+            self.stats.abandoned.fetch_add(1, Ordering::Relaxed);
+        }
+        let mut inflight = self.inflight.lock().unwrap();
+        if inflight
+            .get(key)
+            .is_some_and(|entry| Arc::ptr_eq(entry, stream))
+        {
+            inflight.remove(key);
+        }
+    }
+
+    // don't hold the response back on fsync
+    fn spawn_disk_put(&self, key: &SegmentKey, segment: &Bytes) {
+        if let Some(disk) = self.disk.clone() {
+            let key = key.clone();
+            let segment = segment.clone();
+            tokio::spawn(async move {
+                if let Err(err) = disk.put(&key, &segment).await {
+                    println!("failed to cache segment {}: {err}", key.rel_path());
+                }
+            });
+        }
+    }
+}
+
+/// a segment produced outside of `get_or_produce`, dropping it without
+/// `complete` fails its readers so a cancelled producer never leaves them
+/// hanging, and interrupts a transcode still running for it
+pub struct SegmentClaim {
+    cache: Arc<SegmentCache>,
+    key: SegmentKey,
+    stream: Arc<SegmentStream>,
+    done: bool,
+}
+
+impl SegmentClaim {
+    pub fn stream(&self) -> &Arc<SegmentStream> {
+        &self.stream
+    }
+
+    /// caches the segment and hands it to the readers
+    pub fn complete(mut self, result: Result<Bytes, AppError>) {
+        self.finish(result);
+    }
+
+    fn finish(&mut self, result: Result<Bytes, AppError>) {
+        if let Ok(segment) = &result {
+            self.stream.push(segment.clone());
+            self.cache.put(self.key.clone(), segment.clone());
+        }
+        self.cache.remove_inflight(&self.key, &self.stream);
+        self.stream.finish(result);
+        self.done = true;
+    }
+}
+
+impl Drop for SegmentClaim {
+    fn drop(&mut self) {
+        if !self.done {
+            self.stream.abandon();
+            self.finish(Err(AppError::Error("segment producer went away".into())));
+        }
+    }
+}
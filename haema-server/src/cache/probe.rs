@@ -0,0 +1,83 @@
+use std::{
+    collections::HashMap,
+    fs,
+    sync::{Arc, Mutex},
+    time::UNIX_EPOCH,
+};
+
+use haema_ff_sys::ProbeInfo;
+use tokio::{sync::OnceCell, task};
+
+use crate::error::AppError;
+
+/// a probe is reused only while the source keeps its mtime and size
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+struct SourceStamp {
+    mtime: u64,
+    size: u64,
+}
+
+struct Entry {
+    stamp: SourceStamp,
+    info: Arc<OnceCell<Arc<ProbeInfo>>>,
+}
+
+/// probe results of the sources keyed by path
+///
+/// - a changed source replaces its entry so there is one entry per path
+/// - concurrent misses of the same source share one probe
+#[derive(Default)]
+pub struct ProbeCache {
+    entries: Mutex<HashMap<String, Entry>>,
+}
+
+impl ProbeCache {
+    pub async fn get(&self, video_path: &str) -> Result<Arc<ProbeInfo>, AppError> {
+        let stamp = stat(video_path)?;
+        let cell = {
+            let mut entries = self.entries.lock().unwrap();
+            match entries.get(video_path) {
+                Some(entry) if entry.stamp == stamp => entry.info.clone(),
+                _ => {
+                    let info = Arc::new(OnceCell::new());
+                    let entry = Entry {
+                        stamp,
+                        info: info.clone(),
+                    };
+                    entries.insert(video_path.to_owned(), entry);
+                    info
+                }
+            }
+        };
+
+        let video_path = video_path.to_owned();
+        cell.get_or_try_init(|| async move {
+            task::spawn_blocking(move || haema_ff_sys::probe(&video_path))
+                .await
+                .map_err(|err| AppError::Error(err.to_string()))?
+                .map(Arc::new)
+                .map_err(|err| AppError::Error(format!("hm_probe failed with code {err}")))
+        })
+        .await
+        .cloned()
+    }
+
+    pub fn remove(&self, video_path: &str) {
+        self.entries.lock().unwrap().remove(video_path);
+    }
+}
+
+fn stat(video_path: &str) -> Result<SourceStamp, AppError> {
+    let meta =
+        fs::metadata(video_path).map_err(|_| AppError::VideoNotFound(video_path.to_string()))?;
+    let mtime = meta
+        .modified()
+        .ok()
+        .and_then(|modified| modified.duration_since(UNIX_EPOCH).ok())
+        .map(|d| d.as_secs())
+        .unwrap_or(0);
+    Ok(SourceStamp {
+        mtime,
+        size: meta.len(),
+    })
+}
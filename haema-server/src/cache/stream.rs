@@ -0,0 +1,264 @@
+use std::sync::{
+    Arc,
+    atomic::{AtomicBool, AtomicUsize, Ordering},
+};
+
+use axum::body::Bytes;
+use haema_ff_sys::Interrupt;
+use tokio::sync::{mpsc, watch};
+use tokio_stream::wrappers::ReceiverStream;
+
+use crate::error::AppError;
+
+// chunks buffered per reader before it stops pulling from the segment
+const READER_CHANNEL_SIZE: usize = 16;
+
+#[derive(Default)]
+struct StreamState {
+    chunks: Vec<Bytes>,
+    // the whole segment once the producer is done
+    done: Option<Result<Bytes, AppError>>,
+    // every reader went away before it was done
+    abandoned: bool,
+}
+
+/// output of a segment that is still being produced
+///
+/// every reader gets all chunks written so far and then follows along until
+/// the producer calls `finish`
+///
+/// a segment is abandoned when its last reader goes away before it is done,
+/// the producer is interrupted then. one nobody ever read is produced anyway
+pub struct SegmentStream {
+    state: watch::Sender<StreamState>,
+    // set once a player waits on the segment, raises the producer's job
+    urgent: Arc<AtomicBool>,
+    // set when the segment is abandoned, transcodes of it check it
+    interrupt: Arc<Interrupt>,
+    // readers and waiters right now
+    demand: AtomicUsize,
+}
+
+impl Default for SegmentStream {
+    fn default() -> Self {
+        Self {
+            state: watch::Sender::new(StreamState::default()),
+            urgent: Arc::new(AtomicBool::new(false)),
+            interrupt: Arc::new(Interrupt::default()),
+            demand: AtomicUsize::new(0),
+        }
+    }
+}
+
+impl SegmentStream {
+    pub fn mark_urgent(&self) {
+        self.urgent.store(true, Ordering::Relaxed);
+    }
+
+    /// the flag `mark_urgent` sets, for `Job::promoted_by`
+    pub fn urgent(&self) -> Arc<AtomicBool> {
+        self.urgent.clone()
+    }
+
+    /// the flag set when the segment is abandoned, for
+    /// `HMContext::interrupt_on` and `TranscodeSession::set_interrupt`
+    pub fn interrupt(&self) -> Arc<Interrupt> {
+        self.interrupt.clone()
+    }
+
+    /// stops the producer, readers get its error
+    pub fn abandon(&self) {
+        self.interrupt.interrupt();
+        self.state.send_modify(|state| state.abandoned = true);
+    }
+
+    pub fn is_abandoned(&self) -> bool {
+        self.interrupt.is_interrupted()
+    }
+
+    /// resolves once the segment is abandoned, for producers that are not
+    /// transcoding yet
+    pub async fn abandoned(&self) {
+        let mut rx = self.state.subscribe();
+        // the sender lives as long as self
+        let _ = rx.wait_for(|state| state.abandoned).await;
+    }
+
+    /// counts the caller as a reader until the demand is dropped, `None`
+    /// once the segment is abandoned
+    pub fn join(self: &Arc<Self>) -> Option<Demand> {
+        let mut joined = false;
+        // under the state lock, so the last reader going away either sees
+        // this one or abandoned the segment before it
+        self.state.send_if_modified(|state| {
+            if !state.abandoned {
+                joined = true;
+                self.demand.fetch_add(1, Ordering::Relaxed);
+            }
+            false
+        });
+        joined.then(|| Demand {
+            stream: self.clone(),
+        })
+    }
+
+    pub fn push(&self, chunk: Bytes) {
+        if !chunk.is_empty() {
+            self.state.send_modify(|state| state.chunks.push(chunk));
+        }
+    }
+
+    pub fn finish(&self, result: Result<Bytes, AppError>) {
+        self.state.send_modify(|state| state.done = Some(result));
+    }
+
+    /// chunks written so far as one buffer
+    pub fn collect(&self) -> Bytes {
+        concat(&self.state.borrow().chunks)
+    }
+}
+
+/// a reader of a `SegmentStream`, the segment is abandoned when the last one
+/// goes away before it is done
+pub struct Demand {
+    stream: Arc<SegmentStream>,
+}
+
+impl Demand {
+    pub fn stream(&self) -> &Arc<SegmentStream> {
+        &self.stream
+    }
+
+    /// waits for the producer and returns the whole segment
+    pub async fn wait(self) -> Result<Bytes, AppError> {
+        let mut rx = self.stream.state.subscribe();
+        let state = rx
+            .wait_for(|state| state.done.is_some())
+            .await
+            .map_err(|_| AppError::Error("segment producer went away".into()))?;
+
+        state.done.clone().unwrap()
+    }
+
+    /// waits for the first chunk then streams the segment through a bounded
+    /// channel, errors before any output are returned directly so they can
+    /// become a proper response
+    pub async fn reader(self) -> Result<ReceiverStream<Result<Bytes, AppError>>, AppError> {
+        let mut rx = self.stream.state.subscribe();
+        {
+            let state = rx
+                .wait_for(|state| !state.chunks.is_empty() || state.done.is_some())
+                .await
+                .map_err(|_| AppError::Error("segment producer went away".into()))?;
+            if let (true, Some(Err(err))) = (state.chunks.is_empty(), &state.done) {
+                return Err(err.clone());
+            }
+        }
+
+        let (tx, body_rx) = mpsc::channel(READER_CHANNEL_SIZE);
+        tokio::spawn(async move {
+            let _demand = self;
+            let mut next = 0;
+            loop {
+                let (chunks, done) = {
+                    let state = rx.borrow_and_update();
+                    (state.chunks[next..].to_vec(), state.done.clone())
+                };
+                next += chunks.len();
+                for chunk in chunks {
+                    // the client went away
+                    if tx.send(Ok(chunk)).await.is_err() {
+                        return;
+                    }
+                }
+                match done {
+                    Some(Ok(_)) => return,
+                    Some(Err(err)) => {
+                        let _ = tx.send(Err(err)).await;
+                        return;
+                    }
+                    None => {}
+                }
+                // a client that went away is noticed while nothing is written
+                tokio::select! {
+                    changed = rx.changed() => {
+                        if changed.is_err() {
+                            return;
+                        }
+                    }
+                    _ = tx.closed() => return,
+                }
+            }
+        });
+        Ok(ReceiverStream::new(body_rx))
+    }
+}
+
+impl Clone for Demand {
+    // self keeps the count above 0, a reader can't be the last one meanwhile
+    fn clone(&self) -> Self {
+        self.stream.demand.fetch_add(1, Ordering::Relaxed);
+        Self {
+            stream: self.stream.clone(),
+        }
+    }
+}
+
+impl Drop for Demand {
+    fn drop(&mut self) {
+        let stream = &self.stream;
+        stream.state.send_if_modified(|state| {
+            let last = stream.demand.fetch_sub(1, Ordering::Relaxed) == 1;
+            if !last || state.done.is_some() || state.abandoned {
+                return false;
+            }
+            stream.interrupt.interrupt();
+            state.abandoned = true;
+            true
+        });
+    }
+}
+
+fn concat(chunks: &[Bytes]) -> Bytes {
+    match chunks {
+        [chunk] => chunk.clone(),
+        _ => Bytes::from(chunks.concat()),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[tokio::test]
+    async fn test_demand() {
+        let stream = Arc::new(SegmentStream::default());
+        let first = stream.join().unwrap();
+        let second = first.clone();
+        drop(first);
+        assert!(!stream.is_abandoned());
+
+        // the last reader going away abandons it, nobody joins it after
+        drop(second);
+        assert!(stream.is_abandoned());
+        assert!(stream.join().is_none());
+        stream.abandoned().await;
+    }
+
+    #[tokio::test]
+    async fn test_done() {
+        let stream = Arc::new(SegmentStream::default());
+        let demand = stream.join().unwrap();
+        stream.push(Bytes::from_static(b"ab"));
+        let reader = demand.clone().reader().await.unwrap();
+        stream.push(Bytes::from_static(b"c"));
+        stream.finish(Ok(stream.collect()));
+        assert_eq!(demand.wait().await.unwrap(), "abc");
+        let chunks: Vec<_> = tokio_stream::StreamExt::collect(reader).await;
+        assert_eq!(chunks.len(), 2);
+
+        // a finished segment is not abandoned by its readers going away
+        assert!(!stream.is_abandoned());
+        assert!(stream.join().is_some());
+    }
+}
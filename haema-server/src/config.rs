@@ -0,0 +1,129 @@
+use std::path::PathBuf;
+
+use haema_ff_sys::EncoderProfile;
+
+use crate::domain::{Resolution, parse_encoder_profile};
+
+const DEFAULT_CACHE_LIMIT: u64 = 10 << 30;
+const DEFAULT_MEMORY_CACHE_LIMIT: u64 = 512 << 20;
+const DEFAULT_PREFETCH_SEGMENTS: usize = 3;
+const DEFAULT_RENDITIONS: [Resolution; 3] = [
+    Resolution::Height(1080),
+    Resolution::Height(720),
+    Resolution::Height(480),
+];
+
+/// command line options, see usage in README
+#[derive(Clone, Debug)]
+pub struct Config {
+    pub host: String,
+    pub port: u16,
+    pub target_path: PathBuf,
+    pub db: PathBuf,
+    pub cache: bool,
+    pub cache_path: PathBuf,
+    /// byte budget of the segment cache
+    pub cache_limit: u64,
+    /// byte budget of recently produced segments kept in memory
+    pub memory_cache_limit: u64,
+    /// segments transcoded ahead of sequential playback, 0 disables it
+    pub prefetch_segments: usize,
+    /// sizes offered in the master playlist next to the source size
+    pub renditions: Vec<Resolution>,
+    /// playlists of every stream use fmp4 segments, otherwise only the codecs
+    /// mpegts can't carry do
+    pub fmp4: bool,
+    /// encoder profile of the streams in the master playlist, a stream url
+    /// can ask for another one
+    pub encoder_profile: EncoderProfile,
+    /// transcoded streams start with short segments so playback starts sooner
+    pub fast_start: bool,
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Self {
+            host: "0.0.0.0".to_string(),
+            port: 4001,
+            target_path: PathBuf::from("."),
+            db: PathBuf::from("haema.db"),
+            cache: true,
+            cache_path: PathBuf::from("cache"),
+            cache_limit: DEFAULT_CACHE_LIMIT,
+            memory_cache_limit: DEFAULT_MEMORY_CACHE_LIMIT,
+            prefetch_segments: DEFAULT_PREFETCH_SEGMENTS,
+            renditions: DEFAULT_RENDITIONS.to_vec(),
+            fmp4: false,
+            encoder_profile: EncoderProfile::Latency,
+            fast_start: true,
+        }
+    }
+}
+
+impl Config {
+    pub fn from_args(args: impl Iterator<Item = String>) -> Result<Self, String> {
+        let mut config = Config::default();
+        let mut args = args.skip(1);
+
+        while let Some(flag) = args.next() {
+            let mut value = || args.next().ok_or(format!("missing value for {flag}"));
+            match flag.as_str() {
+                "-p" | "--port" => {
+                    config.port = value()?.parse().map_err(|_| "invalid port")?;
+                }
+                "-h" | "--host" => config.host = value()?,
+                "-t" | "--target_path" => config.target_path = value()?.into(),
+                "--db" => config.db = value()?.into(),
+                "--cache" => {
+                    config.cache = value()?.parse().map_err(|_| "cache must be true or false")?;
+                }
+                "--cache-path" => config.cache_path = value()?.into(),
+                "--cache-limit" => config.cache_limit = parse_size(&value()?)?,
+                "--memory-cache-limit" => config.memory_cache_limit = parse_size(&value()?)?,
+                "--prefetch-segments" => {
+                    config.prefetch_segments =
+                        value()?.parse().map_err(|_| "invalid prefetch segments")?;
+                }
+                "--renditions" => {
+                    config.renditions = value()?
+                        .split(',')
+                        .map(|s| s.parse().map_err(|_| format!("invalid rendition {s}")))
+                        .collect::<Result<_, _>>()?;
+                }
+                "--fmp4" => {
+                    config.fmp4 = value()?.parse().map_err(|_| "fmp4 must be true or false")?;
+                }
+                "--encoder-profile" => {
+                    config.encoder_profile = parse_encoder_profile(&value()?)
+                        .map_err(|_| "encoder profile must be latency or quality")?;
+                }
+                "--fast-start" => {
+                    config.fast_start = value()?
+                        .parse()
+                        .map_err(|_| "fast start must be true or false")?;
+                }
+                _ => return Err(format!("unknown option {flag}")),
+            }
+        }
+        Ok(config)
+    }
+
+    pub fn addr(&self) -> String {
+        format!("{}:{}", self.host, self.port)
+    }
+}
+
+/// parses sizes like "512M", "10G" or plain bytes
+fn parse_size(s: &str) -> Result<u64, String> {
+    let s = s.trim();
+    let (num, shift) = match s.char_indices().last() {
+        Some((i, 'K' | 'k')) => (&s[..i], 10),
+        Some((i, 'M' | 'm')) => (&s[..i], 20),
+        Some((i, 'G' | 'g')) => (&s[..i], 30),
+        Some((i, 'T' | 't')) => (&s[..i], 40),
+        _ => (s, 0),
+    };
+    num.parse::<u64>()
+        .map(|n| n << shift)
+        .map_err(|_| format!("invalid size {s}"))
+}
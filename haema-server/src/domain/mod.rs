@@ -1,7 +1,10 @@
 pub mod models;
 
-use haema_ff_sys::HMContext;
-pub use models::{VideoCodec, AudioCodec, StreamType, SEGMENT_DURATION};
+use haema_ff_sys::{Backend, HMContext};
+pub use models::{
+    VideoCodec, AudioCodec, Resolution, StreamType, SegmentLayout, SegmentRange,
+    SEGMENT_DURATION, parse_encoder_profile,
+};
 
 pub struct HMff(pub HMContext);
 
@@ -14,6 +17,10 @@ impl HMff {
         HMff(HMContext::new())
     }
 
+    pub fn with_backend(backend: Backend, threads: usize) -> Self {
+        HMff(HMContext::with_backend(backend, threads))
+    }
+
     pub fn context(&self) -> &HMContext {
         &self.0
     }
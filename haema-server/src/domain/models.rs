@@ -1,9 +1,19 @@
 use std::{fmt, str::FromStr};
 
+use haema_ff_sys::{Backend, EncoderProfile, Keyframe};
+
 use crate::error::AppError;
 
 pub const SEGMENT_DURATION: f64 = 4.0;
+/// segments a transcoded stream starts with, a player shows the first frame
+/// once the first short one is done instead of a whole `SEGMENT_DURATION`
+pub const FAST_START_DURATIONS: [f64; 3] = [1.0, 1.0, 2.0];
+
+// a keyframe aligned segment never gets longer than this many target
+// durations, longer gops are cut at fixed positions inside the gop
+const MAX_SEGMENT_DURATION_FACTOR: f64 = 2.0;
 
+#[derive(Clone, Debug, PartialEq, Eq, Hash)]
 pub enum VideoCodec {
     AV1,
     H264,
@@ -11,12 +21,51 @@ pub enum VideoCodec {
     None,
 }
 
+impl VideoCodec {
+    /// ffmpeg encoder implementing this codec on `backend`
+    pub fn encoder_name(&self, backend: Backend) -> &'static str {
+        match (self, backend) {
+            (VideoCodec::AV1, Backend::Qsv) => "av1_qsv",
+            (VideoCodec::AV1, Backend::Vaapi) => "av1_vaapi",
+            (VideoCodec::AV1, _) => "libsvtav1",
+            (VideoCodec::H264, Backend::Qsv) => "h264_qsv",
+            (VideoCodec::H264, Backend::Vaapi) => "h264_vaapi",
+            (VideoCodec::H264, _) => "libx264",
+            (VideoCodec::H265, Backend::Qsv) => "hevc_qsv",
+            (VideoCodec::H265, Backend::Vaapi) => "hevc_vaapi",
+            (VideoCodec::H265, _) => "libx265",
+            (VideoCodec::None, _) => "none",
+        }
+    }
+
+    /// whether segments of a source encoded with `source_codec` (ffmpeg codec
+    /// name) can be stream copied, `None` keeps whatever the source has
+    pub fn is_copy_of(&self, source_codec: &str) -> bool {
+        match self {
+            VideoCodec::AV1 => source_codec == "av1",
+            VideoCodec::H264 => source_codec == "h264",
+            VideoCodec::H265 => source_codec == "hevc",
+            VideoCodec::None => true,
+        }
+    }
+
+    /// whether segments of this codec have to be fmp4 since mpegts can't
+    /// carry it in hls, `None` goes by the source
+    pub fn needs_fmp4(&self, source_codec: &str) -> bool {
+        match self {
+            VideoCodec::AV1 | VideoCodec::H265 => true,
+            VideoCodec::H264 => false,
+            VideoCodec::None => matches!(source_codec, "av1" | "hevc" | "vp9"),
+        }
+    }
+}
+
 impl fmt::Display for VideoCodec {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         match self {
-            VideoCodec::AV1 => write!(f, "av1_qsv"),
-            VideoCodec::H264 => write!(f, "h264_qsv"),
-            VideoCodec::H265 => write!(f, "hevc_qsv"),
+            VideoCodec::AV1 => write!(f, "av1"),
+            VideoCodec::H264 => write!(f, "h264"),
+            VideoCodec::H265 => write!(f, "h265"),
             VideoCodec::None => write!(f, "none"),
         }
     }
@@ -36,6 +85,7 @@ impl FromStr for VideoCodec {
     }
 }
 
+#[derive(Clone, Debug, PartialEq, Eq, Hash)]
 pub enum AudioCodec {
     AAC,
     None,
@@ -44,8 +94,8 @@ pub enum AudioCodec {
 impl fmt::Display for AudioCodec {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         match self {
-            AudioCodec::AAC => write!(f, "AAC"),
-            AudioCodec::None => write!(f, "None"),
+            AudioCodec::AAC => write!(f, "aac"),
+            AudioCodec::None => write!(f, "none"),
         }
     }
 }
@@ -62,10 +112,83 @@ impl FromStr for AudioCodec {
     }
 }
 
+/// output size of a stream, "source" or a height like "720p"
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+pub enum Resolution {
+    Source,
+    Height(u32),
+}
+
+// smallest height a stream can be scaled down to
+const MIN_HEIGHT: u32 = 144;
+
+impl Resolution {
+    /// height a `source_height` video is scaled down to, `None` keeps the
+    /// source size since videos are never scaled up
+    pub fn scale_height(&self, source_height: u32) -> Option<u32> {
+        match *self {
+            Resolution::Height(height) if height < source_height => Some(height),
+            _ => None,
+        }
+    }
+
+    /// width and height of a `source_width`x`source_height` video at this
+    /// resolution, rounded like the scaler in hm_transcode.c
+    pub fn output_size(&self, source_width: u32, source_height: u32) -> (u32, u32) {
+        match self.scale_height(source_height) {
+            Some(height) => {
+                let height = height & !1;
+                let width = (source_width as u64 * height as u64
+                    + source_height as u64 / 2)
+                    / source_height as u64;
+                (width as u32 + (width as u32 & 1), height)
+            }
+            None => (source_width, source_height),
+        }
+    }
+}
+
+impl fmt::Display for Resolution {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Resolution::Source => write!(f, "source"),
+            Resolution::Height(height) => write!(f, "{}p", height),
+        }
+    }
+}
+
+impl FromStr for Resolution {
+    type Err = AppError;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        if s == "source" {
+            return Ok(Resolution::Source);
+        }
+        match s.strip_suffix('p').unwrap_or(s).parse::<u32>() {
+            Ok(height) if height >= MIN_HEIGHT => Ok(Resolution::Height(height)),
+            _ => Err(AppError::InvalidStreamType(s.into())),
+        }
+    }
+}
+
+/// parses "latency" or "quality"
+pub fn parse_encoder_profile(s: &str) -> Result<EncoderProfile, AppError> {
+    match s {
+        "latency" => Ok(EncoderProfile::Latency),
+        "quality" => Ok(EncoderProfile::Quality),
+        _ => Err(AppError::InvalidStreamType(s.into())),
+    }
+}
+
+/// "720p,h264,aac" with an optional profile like "720p,h264,aac,quality",
+/// streams of different profiles are different streams so one stream never
+/// mixes the parameter sets of two
+#[derive(Clone, Debug, PartialEq, Eq, Hash)]
 pub struct StreamType {
-    pub resolution: String,
+    pub resolution: Resolution,
     pub video_codec: VideoCodec,
     pub audio_codec: AudioCodec,
+    pub profile: EncoderProfile,
 }
 
 impl FromStr for StreamType {
@@ -73,26 +196,365 @@ impl FromStr for StreamType {
 
     fn from_str(s: &str) -> Result<Self, Self::Err> {
         let parts: Vec<&str> = s.split(",").collect();
-        if parts.len() != 3 {
+        if parts.len() != 3 && parts.len() != 4 {
             return Err(AppError::InvalidStreamType(s.to_string()));
         }
-        let resolution = parts[0].to_string();
+        let resolution: Resolution = parts[0].parse()?;
         let video_codec: VideoCodec = parts[1].parse()?;
         let audio_codec: AudioCodec = parts[2].parse()?;
+        let profile = match parts.get(3) {
+            Some(profile) => parse_encoder_profile(profile)?,
+            None => EncoderProfile::Latency,
+        };
         Ok(StreamType {
             resolution,
             video_codec,
             audio_codec,
+            profile,
         })
     }
 }
 
+// the latency profile is left out, which keeps the names streams had before
+// there were profiles
 impl fmt::Display for StreamType {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         write!(
             f,
             "{},{},{}",
             self.resolution, self.video_codec, self.audio_codec
-        )
+        )?;
+        match self.profile {
+            EncoderProfile::Latency => Ok(()),
+            profile => write!(f, ",{}", profile),
+        }
+    }
+}
+
+/// time range of one segment in seconds since the start of the video stream
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct SegmentRange {
+    pub start: f64,
+    pub duration: f64,
+    /// byte offset of the keyframe at `start` when the segment starts on one
+    pub seek_pos: Option<i64>,
+    /// starts and ends on keyframes so it can be stream copied
+    pub keyframe_aligned: bool,
+}
+
+/// how a video is cut into segments, index i of the layout is {i}.ts or
+/// {i}.m4s
+#[derive(Clone, Debug)]
+pub struct SegmentLayout {
+    starts: Vec<f64>,
+    seek_pos: Vec<Option<i64>>,
+    keyframe: Vec<bool>,
+    video_duration: f64,
+    // where decoding can start, `None` when the first keyframe is too late
+    // for segment 0 to start on it
+    first_keyframe: Option<f64>,
+    // the first segments split by `with_fast_start`
+    fast_start: usize,
+}
+
+impl SegmentLayout {
+    /// `segment_duration` long slices regardless of where keyframes are
+    pub fn fixed(video_duration: f64, segment_duration: f64) -> Self {
+        let mut starts = vec![0.0];
+        let mut cur: f64 = 0.0;
+        while cur + segment_duration < video_duration {
+            cur += segment_duration;
+            starts.push(cur);
+        }
+        let seek_pos = vec![None; starts.len()];
+        let keyframe = vec![false; starts.len()];
+        Self {
+            starts,
+            seek_pos,
+            keyframe,
+            video_duration,
+            first_keyframe: Some(0.0),
+            fast_start: 0,
+        }
+    }
+
+    /// segments of at least `target_duration` that start on keyframes, so
+    /// nothing before the segment has to be decoded
+    pub fn from_keyframes(
+        keyframes: impl Iterator<Item = Keyframe>,
+        video_duration: f64,
+        target_duration: f64,
+    ) -> Self {
+        let max_duration = target_duration * MAX_SEGMENT_DURATION_FACTOR;
+        let mut layout = Self {
+            starts: vec![0.0],
+            seek_pos: vec![None],
+            keyframe: vec![false],
+            video_duration,
+            first_keyframe: Some(0.0),
+            fast_start: 0,
+        };
+        let mut cur: f64 = 0.0;
+        let mut first = true;
+
+        for keyframe in keyframes {
+            let t = keyframe.pts as f64 / 1_000_000.0;
+            let pos = (keyframe.pos >= 0).then_some(keyframe.pos);
+            if first {
+                first = false;
+                // nothing before the first keyframe can be decoded, segment 0
+                // effectively starts on it
+                if t < max_duration {
+                    layout.seek_pos[0] = pos;
+                    layout.keyframe[0] = true;
+                    layout.first_keyframe = Some(t.max(0.0));
+                    continue;
+                }
+                layout.first_keyframe = None;
+            }
+            if t <= cur || t >= video_duration {
+                continue;
+            }
+            while t - cur > max_duration {
+                cur += target_duration;
+                layout.push(cur, None, false);
+            }
+            if t - cur >= target_duration {
+                cur = t;
+                layout.push(cur, pos, true);
+            }
+        }
+        while video_duration - cur > max_duration {
+            cur += target_duration;
+            layout.push(cur, None, false);
+        }
+        layout
+    }
+
+    /// whether `with_fast_start` can split the start, segments before a late
+    /// first keyframe have no frames to split
+    pub fn can_fast_start(&self) -> bool {
+        self.first_keyframe.is_some()
+    }
+
+    /// the same layout starting with segments of `durations` from the first
+    /// keyframe on, the segments after them keep their starts. the first one
+    /// also covers whatever comes before the keyframe, the last one runs up
+    /// to the first regular start. unchanged when `can_fast_start` is false
+    pub fn with_fast_start(&self, durations: &[f64]) -> Self {
+        let Some(first_keyframe) = self.first_keyframe else {
+            return self.clone();
+        };
+        if durations.is_empty() {
+            return self.clone();
+        }
+        let capacity = self.len() + durations.len();
+        let mut layout = Self {
+            starts: Vec::with_capacity(capacity),
+            seek_pos: Vec::with_capacity(capacity),
+            keyframe: Vec::with_capacity(capacity),
+            video_duration: self.video_duration,
+            first_keyframe: self.first_keyframe,
+            fast_start: 0,
+        };
+        // the first one starts where segment 0 did, on its keyframe if any
+        layout.push(0.0, self.seek_pos[0], self.keyframe[0]);
+        let mut cur = first_keyframe + durations[0];
+        let mut keep_from = first_keyframe + durations[0] / 2.0;
+        for duration in &durations[1..] {
+            if cur >= self.video_duration {
+                break;
+            }
+            layout.push(cur, None, false);
+            // a regular start shortly before the end of the last short
+            // segment ends it early instead of being dropped
+            keep_from = cur + duration / 2.0;
+            cur += duration;
+        }
+        layout.fast_start = layout.len();
+
+        for idx in 1..self.len() {
+            if self.starts[idx] >= keep_from {
+                layout.push(self.starts[idx], self.seek_pos[idx], self.keyframe[idx]);
+            }
+        }
+        layout
+    }
+
+    /// whether segment `idx` is one of the short segments of `with_fast_start`
+    pub fn is_fast_start(&self, idx: usize) -> bool {
+        idx < self.fast_start
+    }
+
+    fn push(&mut self, start: f64, seek_pos: Option<i64>, keyframe: bool) {
+        self.starts.push(start);
+        self.seek_pos.push(seek_pos);
+        self.keyframe.push(keyframe);
+    }
+
+    pub fn len(&self) -> usize {
+        self.starts.len()
+    }
+
+    pub fn segment(&self, idx: usize) -> Option<SegmentRange> {
+        let start = *self.starts.get(idx)?;
+        let end = self
+            .starts
+            .get(idx + 1)
+            .copied()
+            .unwrap_or(self.video_duration);
+        Some(SegmentRange {
+            start,
+            duration: end - start,
+            seek_pos: self.seek_pos[idx],
+            keyframe_aligned: self.keyframe[idx]
+                && self.keyframe.get(idx + 1).copied().unwrap_or(true),
+        })
+    }
+
+    pub fn segments(&self) -> impl Iterator<Item = SegmentRange> + '_ {
+        (0..self.len()).filter_map(|idx| self.segment(idx))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn keyframes(times: &[f64]) -> impl Iterator<Item = Keyframe> + '_ {
+        times.iter().map(|&t| Keyframe {
+            pts: (t * 1_000_000.0) as i64,
+            pos: (t * 1000.0) as i64,
+            gop_size: 1,
+        })
+    }
+
+    fn starts(layout: &SegmentLayout) -> Vec<f64> {
+        layout.segments().map(|segment| segment.start).collect()
+    }
+
+    #[test]
+    fn test_from_keyframes_regular_gops() {
+        let times: Vec<f64> = (0..10).map(|i| i as f64 * 2.0).collect();
+        let layout = SegmentLayout::from_keyframes(keyframes(&times), 20.0, 4.0);
+        assert_eq!(starts(&layout), [0.0, 4.0, 8.0, 12.0, 16.0]);
+        for segment in layout.segments() {
+            assert!(segment.keyframe_aligned);
+            assert_eq!(segment.seek_pos, Some((segment.start * 1000.0) as i64));
+            assert_eq!(segment.duration, 4.0);
+        }
+    }
+
+    #[test]
+    fn test_from_keyframes_cuts_long_gops() {
+        let layout = SegmentLayout::from_keyframes(keyframes(&[0.0, 20.0]), 30.0, 4.0);
+        assert_eq!(starts(&layout), [0.0, 4.0, 8.0, 12.0, 20.0, 24.0]);
+        let segments: Vec<_> = layout.segments().collect();
+        assert_eq!(segments[0].seek_pos, Some(0));
+        assert!(!segments[0].keyframe_aligned);
+        assert_eq!(segments[1].seek_pos, None);
+        assert_eq!(segments[3].duration, 8.0);
+        assert_eq!(segments[4].seek_pos, Some(20_000));
+        assert!(!segments[4].keyframe_aligned);
+        assert_eq!(segments[5].duration, 6.0);
+    }
+
+    #[test]
+    fn test_from_keyframes_late_first_keyframe() {
+        let layout = SegmentLayout::from_keyframes(keyframes(&[9.0]), 20.0, 4.0);
+        assert_eq!(starts(&layout), [0.0, 4.0, 9.0, 13.0]);
+        let first = layout.segment(0).unwrap();
+        assert_eq!(first.seek_pos, None);
+        assert!(!first.keyframe_aligned);
+        assert_eq!(layout.segment(2).unwrap().seek_pos, Some(9000));
+    }
+
+    #[test]
+    fn test_from_keyframes_ignores_out_of_range() {
+        let kfs = [
+            Keyframe {
+                pts: 0,
+                pos: -1,
+                gop_size: 1,
+            },
+            Keyframe {
+                pts: 5_000_000,
+                pos: 5000,
+                gop_size: 1,
+            },
+            Keyframe {
+                pts: 12_000_000,
+                pos: 12000,
+                gop_size: 1,
+            },
+        ];
+        let layout = SegmentLayout::from_keyframes(kfs.into_iter(), 8.0, 4.0);
+        assert_eq!(starts(&layout), [0.0, 5.0]);
+        assert_eq!(layout.segment(0).unwrap().seek_pos, None);
+        assert!(layout.segment(0).unwrap().keyframe_aligned);
+        assert_eq!(layout.segment(1).unwrap().duration, 3.0);
+        assert!(layout.segment(2).is_none());
+    }
+
+    #[test]
+    fn test_from_keyframes_without_keyframes() {
+        let layout = SegmentLayout::from_keyframes(keyframes(&[]), 10.0, 4.0);
+        assert_eq!(starts(&layout), [0.0, 4.0]);
+        assert!(layout.segments().all(|segment| !segment.keyframe_aligned));
+    }
+
+    #[test]
+    fn test_with_fast_start() {
+        let times: Vec<f64> = (0..5).map(|i| i as f64 * 4.0).collect();
+        let layout = SegmentLayout::from_keyframes(keyframes(&times), 20.0, 4.0)
+            .with_fast_start(&FAST_START_DURATIONS);
+        assert_eq!(starts(&layout), [0.0, 1.0, 2.0, 4.0, 8.0, 12.0, 16.0]);
+        assert!(layout.is_fast_start(2) && !layout.is_fast_start(3));
+        let first = layout.segment(0).unwrap();
+        assert_eq!(first.seek_pos, Some(0));
+        assert!(!first.keyframe_aligned);
+        assert!(layout.segment(3).unwrap().keyframe_aligned);
+    }
+
+    #[test]
+    fn test_with_fast_start_short_video() {
+        let layout = SegmentLayout::from_keyframes(keyframes(&[0.0]), 1.5, 4.0)
+            .with_fast_start(&FAST_START_DURATIONS);
+        assert_eq!(starts(&layout), [0.0, 1.0]);
+        assert_eq!(layout.segment(1).unwrap().duration, 0.5);
+        assert!(layout.is_fast_start(1));
+    }
+
+    #[test]
+    fn test_with_fast_start_early_regular_start() {
+        // 3.5 ends the last short segment early, 2.5 is before it would
+        // have been half done and is dropped
+        let layout = SegmentLayout::from_keyframes(keyframes(&[0.0, 2.5]), 10.0, 2.0);
+        assert_eq!(starts(&layout), [0.0, 2.5, 4.5, 6.5]);
+        let layout = layout.with_fast_start(&FAST_START_DURATIONS);
+        assert_eq!(starts(&layout), [0.0, 1.0, 2.0, 4.5, 6.5]);
+
+        let layout = SegmentLayout::from_keyframes(keyframes(&[0.0, 3.5]), 10.0, 2.0)
+            .with_fast_start(&FAST_START_DURATIONS);
+        assert_eq!(starts(&layout), [0.0, 1.0, 2.0, 3.5, 5.5, 7.5]);
+        assert_eq!(layout.segment(2).unwrap().duration, 1.5);
+        assert_eq!(layout.fast_start, 3);
+    }
+
+    #[test]
+    fn test_with_fast_start_from_first_keyframe() {
+        let layout = SegmentLayout::from_keyframes(keyframes(&[0.5, 4.5, 8.5]), 12.0, 4.0)
+            .with_fast_start(&FAST_START_DURATIONS);
+        assert_eq!(starts(&layout), [0.0, 1.5, 2.5, 4.5, 8.5]);
+        assert_eq!(layout.segment(0).unwrap().seek_pos, Some(500));
+    }
+
+    #[test]
+    fn test_with_fast_start_late_first_keyframe() {
+        let layout = SegmentLayout::from_keyframes(keyframes(&[9.0]), 20.0, 4.0);
+        assert!(!layout.can_fast_start());
+        let fast = layout.with_fast_start(&FAST_START_DURATIONS);
+        assert_eq!(starts(&fast), starts(&layout));
+        assert!(!fast.is_fast_start(0));
     }
 }
@@ -5,7 +5,7 @@ use axum::{
 use std::error::Error;
 use std::fmt;
 
-#[derive(Debug)]
+#[derive(Clone, Debug)]
 pub enum AppError {
     VideoNotFound(String),
     InvalidSegmentName,
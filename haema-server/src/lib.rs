@@ -1,4 +1,8 @@
+pub mod cache;
+pub mod config;
 pub mod error;
+pub mod library;
+pub mod metrics;
 pub mod state;
 pub mod pool;
 pub mod domain;
@@ -0,0 +1,591 @@
+use std::{
+    collections::{HashMap, HashSet},
+    fs,
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        mpsc,
+    },
+    thread,
+    time::UNIX_EPOCH,
+};
+
+use haema_ff_sys::ProbeInfo;
+use rusqlite::{Connection, params};
+
+use super::{connect, path_id};
+use crate::error::AppError;
+
+// rows committed per transaction, committing every file would wait on a
+// sync per file
+const BATCH_SIZE: usize = 256;
+// probing mostly waits on reading container headers
+const PROBE_WORKERS_PER_CPU: usize = 2;
+const MAX_PROBE_WORKERS: usize = 32;
+pub(crate) const VIDEO_EXTENSIONS: [&str; 9] = [
+    "mp4", "mkv", "webm", "mov", "m4v", "avi", "ts", "flv", "wmv",
+];
+pub(crate) const ARTWORK_EXTENSIONS: [&str; 3] = ["jpg", "png", "webp"];
+
+/// what an `index` run did
+#[derive(Clone, Debug, Default)]
+pub struct IndexStats {
+    /// videos found under the root
+    pub files: usize,
+    /// new or changed videos that were probed and written
+    pub probed: usize,
+    /// videos that failed to probe, they are retried by the next run
+    pub failed: usize,
+    /// videos whose file is gone
+    pub removed: usize,
+    /// paths relative to the root of the videos that were probed or removed,
+    /// whatever was derived from them before is stale
+    pub changed: Vec<String>,
+}
+
+#[derive(Clone, Copy)]
+enum Show {
+    Movie,
+    // index into Scan::series
+    Episode(usize),
+}
+
+struct Series {
+    id: String,
+    // name of the directory, relative to the root
+    title: String,
+    thumbnail: Option<String>,
+    banner: Option<String>,
+}
+
+struct VideoFile {
+    rel_path: String,
+    size: u64,
+    mtime: u64,
+    show: Show,
+}
+
+#[derive(Default)]
+struct Scan {
+    series: Vec<Series>,
+    videos: Vec<VideoFile>,
+}
+
+/// - walks `root` and probes the videos that are new or whose size or mtime
+/// changed since the last run on a bounded pool of worker threads
+/// - rows are written by the calling thread in transactions of `BATCH_SIZE`
+/// videos, videos whose file is gone are removed along with emptied series
+pub(crate) fn index(
+    db_path: &Path,
+    root: &Path,
+    ignore: &[PathBuf],
+) -> Result<IndexStats, AppError> {
+    let mut conn = connect(db_path).map_err(db_err)?;
+    let scan = scan(root, ignore)
+        .map_err(|err| AppError::Error(format!("failed to scan library: {err}")))?;
+    let known = known_videos(&conn, None).map_err(db_err)?;
+    apply(&mut conn, root, &scan, known)
+}
+
+/// like `index` but only looks at `paths`, files or directories under `root`
+/// that were created, changed or removed
+pub(crate) fn update(
+    db_path: &Path,
+    root: &Path,
+    ignore: &[PathBuf],
+    paths: &[PathBuf],
+) -> Result<IndexStats, AppError> {
+    let mut conn = connect(db_path).map_err(db_err)?;
+    let mut rel_paths: Vec<String> = paths
+        .iter()
+        .filter(|path| !ignore.iter().any(|ignored| path.starts_with(ignored)))
+        .filter_map(|path| path.strip_prefix(root).ok()?.to_str().map(str::to_owned))
+        .filter(|rel_path| {
+            !rel_path.is_empty() && !rel_path.split('/').any(|name| name.starts_with('.'))
+        })
+        .collect();
+    // a directory covers everything under it
+    rel_paths.sort();
+    rel_paths.dedup();
+    let all = rel_paths.clone();
+    rel_paths.retain(|path| {
+        !all.iter()
+            .any(|parent| parent != path && is_under(path, parent))
+    });
+
+    let mut scan = Scan::default();
+    let mut series_of = HashMap::new();
+    let mut known = HashMap::new();
+    for rel_path in &rel_paths {
+        known.extend(known_videos(&conn, Some(rel_path)).map_err(db_err)?);
+
+        let path = root.join(rel_path);
+        let Ok(meta) = fs::metadata(&path) else {
+            // gone, its rows are removed
+            continue;
+        };
+        let series_name = match rel_path.split_once('/') {
+            Some((series_name, _)) => series_name,
+            None if meta.is_dir() => rel_path.as_str(),
+            None => {
+                if let Some(video) = video_file(&path, rel_path.clone(), Show::Movie) {
+                    scan.videos.push(video);
+                }
+                continue;
+            }
+        };
+
+        let series = *series_of.entry(series_name.to_owned()).or_insert_with(|| {
+            let dir = root.join(series_name);
+            scan.series.push(series_dir(&dir, series_name));
+            scan.series.len() - 1
+        });
+        if meta.is_dir() {
+            walk(&path, rel_path, series, ignore, &mut scan.videos);
+        } else if let Some(video) = video_file(&path, rel_path.clone(), Show::Episode(series)) {
+            scan.videos.push(video);
+        }
+    }
+    apply(&mut conn, root, &scan, known)
+}
+
+// writes the scanned videos that differ from `known` and removes the known
+// videos missing from the scan
+fn apply(
+    conn: &mut Connection,
+    root: &Path,
+    scan: &Scan,
+    known: HashMap<String, (u64, u64)>,
+) -> Result<IndexStats, AppError> {
+    let changed: Vec<&VideoFile> = scan
+        .videos
+        .iter()
+        .filter(|video| known.get(&video.rel_path) != Some(&(video.size, video.mtime)))
+        .collect();
+    let found: HashSet<&str> = scan
+        .videos
+        .iter()
+        .map(|video| video.rel_path.as_str())
+        .collect();
+    let removed: Vec<&str> = known
+        .keys()
+        .map(String::as_str)
+        .filter(|rel_path| !found.contains(rel_path))
+        .collect();
+
+    let mut stats = IndexStats {
+        files: scan.videos.len(),
+        removed: removed.len(),
+        ..Default::default()
+    };
+    // nothing is written so the db doesn't change under a watcher for nothing
+    if changed.is_empty() && removed.is_empty() && scan.series.is_empty() {
+        return Ok(stats);
+    }
+
+    // episodes reference their series
+    write_series(conn, &scan.series).map_err(db_err)?;
+
+    let workers = thread::available_parallelism()
+        .map(|n| n.get() * PROBE_WORKERS_PER_CPU)
+        .unwrap_or(1)
+        .min(MAX_PROBE_WORKERS)
+        .min(changed.len())
+        .max(1);
+    let next = AtomicUsize::new(0);
+    let (tx, rx) = mpsc::sync_channel(BATCH_SIZE);
+    thread::scope(|s| {
+        for _ in 0..workers {
+            let tx = tx.clone();
+            let (next, changed) = (&next, &changed);
+            s.spawn(move || {
+                while let Some(&video) = changed.get(next.fetch_add(1, Ordering::Relaxed)) {
+                    let path = root.join(&video.rel_path);
+                    let probe = haema_ff_sys::probe(&path.to_string_lossy());
+                    // the writer stopped on an error
+                    if tx.send((video, probe)).is_err() {
+                        return;
+                    }
+                }
+            });
+        }
+        drop(tx);
+        // dropping rx on an error stops the workers
+        write_videos(conn, scan, rx, &mut stats)
+    })
+    .map_err(db_err)?;
+
+    remove_videos(conn, &removed).map_err(db_err)?;
+    stats.changed.extend(removed.into_iter().map(str::to_owned));
+    Ok(stats)
+}
+
+pub(super) fn db_err(err: rusqlite::Error) -> AppError {
+    AppError::Error(format!("library db: {err}"))
+}
+
+// whether `path` is `parent` or inside it, both relative to the root
+fn is_under(path: &str, parent: &str) -> bool {
+    path.strip_prefix(parent)
+        .is_some_and(|rest| rest.is_empty() || rest.starts_with('/'))
+}
+
+fn write_videos(
+    conn: &Connection,
+    scan: &Scan,
+    probes: mpsc::Receiver<(&VideoFile, Result<ProbeInfo, i32>)>,
+    stats: &mut IndexStats,
+) -> rusqlite::Result<()> {
+    let mut pending = 0;
+    conn.execute_batch("BEGIN")?;
+    for (video, probe) in probes {
+        let info = match probe {
+            Ok(info) => info,
+            Err(err) => {
+                println!(
+                    "failed to probe {}: hm_probe failed with code {err}",
+                    video.rel_path
+                );
+                stats.failed += 1;
+                continue;
+            }
+        };
+        if let Err(err) = write_video(conn, scan, video, &info) {
+            let _ = conn.execute_batch("ROLLBACK");
+            return Err(err);
+        }
+        stats.probed += 1;
+        stats.changed.push(video.rel_path.clone());
+
+        pending += 1;
+        if pending == BATCH_SIZE {
+            conn.execute_batch("COMMIT; BEGIN")?;
+            pending = 0;
+        }
+    }
+    conn.execute_batch("COMMIT")
+}
+
+fn write_video(
+    conn: &Connection,
+    scan: &Scan,
+    video: &VideoFile,
+    info: &ProbeInfo,
+) -> rusqlite::Result<()> {
+    let video_id = path_id(&video.rel_path);
+    conn.prepare_cached(
+        "INSERT INTO video (id, path, duration, size, mtime) VALUES (?1, ?2, ?3, ?4, ?5)
+         ON CONFLICT (id) DO UPDATE SET
+            duration = excluded.duration, size = excluded.size, mtime = excluded.mtime",
+    )?
+    .execute(params![
+        video_id,
+        video.rel_path,
+        info.duration,
+        video.size as i64,
+        video.mtime as i64
+    ])?;
+
+    let rel_path = Path::new(&video.rel_path);
+    let title = rel_path
+        .file_stem()
+        .map(|stem| stem.to_string_lossy().into_owned())
+        .unwrap_or_default();
+    match video.show {
+        Show::Movie => {
+            conn.prepare_cached(
+                "INSERT OR REPLACE INTO movie (id, video_id, title) VALUES (?1, ?1, ?2)",
+            )?
+            .execute(params![video_id, title])?;
+        }
+        Show::Episode(series) => {
+            let series = &scan.series[series];
+            // path inside the series without the extension, like "01" or
+            // "season 2/03"
+            let index = rel_path
+                .strip_prefix(&series.title)
+                .unwrap_or(rel_path)
+                .with_extension("")
+                .to_string_lossy()
+                .into_owned();
+            conn.prepare_cached(
+                r#"INSERT OR REPLACE INTO episode (series_id, video_id, "index", title)
+                   VALUES (?1, ?2, ?3, ?4)"#,
+            )?
+            .execute(params![series.id, video_id, index, title])?;
+        }
+    }
+    Ok(())
+}
+
+fn write_series(conn: &mut Connection, series: &[Series]) -> rusqlite::Result<()> {
+    let tx = conn.transaction()?;
+    {
+        let mut stmt = tx.prepare_cached(
+            "INSERT INTO series (id, title, thumbnail, banner) VALUES (?1, ?2, ?3, ?4)
+             ON CONFLICT (id) DO UPDATE SET
+                title = excluded.title, thumbnail = excluded.thumbnail, banner = excluded.banner",
+        )?;
+        for series in series {
+            stmt.execute(params![
+                series.id,
+                series.title,
+                series.thumbnail,
+                series.banner
+            ])?;
+        }
+    }
+    tx.commit()
+}
+
+fn remove_videos(conn: &mut Connection, rel_paths: &[&str]) -> rusqlite::Result<()> {
+    let tx = conn.transaction()?;
+    for rel_path in rel_paths {
+        let video_id = path_id(rel_path);
+        tx.prepare_cached("DELETE FROM episode WHERE video_id = ?1")?
+            .execute([&video_id])?;
+        tx.prepare_cached("DELETE FROM movie WHERE video_id = ?1")?
+            .execute([&video_id])?;
+        tx.prepare_cached("DELETE FROM video WHERE id = ?1")?
+            .execute([&video_id])?;
+    }
+    tx.execute(
+        "DELETE FROM series WHERE id NOT IN (SELECT series_id FROM episode)",
+        [],
+    )?;
+    tx.commit()
+}
+
+// size and mtime of the indexed videos by path, only the ones at or under
+// `under` when it is given
+fn known_videos(
+    conn: &Connection,
+    under: Option<&str>,
+) -> rusqlite::Result<HashMap<String, (u64, u64)>> {
+    let row = |row: &rusqlite::Row| {
+        let size: i64 = row.get(1)?;
+        let mtime: i64 = row.get(2)?;
+        Ok((row.get(0)?, (size as u64, mtime as u64)))
+    };
+    match under {
+        None => conn
+            .prepare_cached("SELECT path, size, mtime FROM video")?
+            .query_map([], row)?
+            .collect(),
+        // no LIKE, paths may contain its wildcards
+        Some(under) => conn
+            .prepare_cached(
+                "SELECT path, size, mtime FROM video
+                 WHERE path = ?1 OR substr(path, 1, length(?1) + 1) = ?1 || '/'",
+            )?
+            .query_map([under], row)?
+            .collect(),
+    }
+}
+
+fn scan(root: &Path, ignore: &[PathBuf]) -> std::io::Result<Scan> {
+    let mut scan = Scan::default();
+    for entry in fs::read_dir(root)?.flatten() {
+        let Some(name) = entry.file_name().to_str().map(str::to_owned) else {
+            println!("skipping {}, name is not utf-8", entry.path().display());
+            continue;
+        };
+        let path = entry.path();
+        if name.starts_with('.') || ignore.contains(&path) {
+            continue;
+        }
+        let Ok(file_type) = entry.file_type() else {
+            continue;
+        };
+
+        if file_type.is_dir() {
+            let series = scan.series.len();
+            let found = scan.videos.len();
+            walk(&path, &name, series, ignore, &mut scan.videos);
+            if scan.videos.len() > found {
+                scan.series.push(series_dir(&path, &name));
+            }
+        } else if let Some(video) = video_file(&path, name, Show::Movie) {
+            scan.videos.push(video);
+        }
+    }
+    Ok(scan)
+}
+
+fn series_dir(dir: &Path, name: &str) -> Series {
+    Series {
+        id: path_id(name),
+        title: name.to_owned(),
+        thumbnail: artwork(dir, name, "thumbnail"),
+        banner: artwork(dir, name, "banner"),
+    }
+}
+
+// collects the videos under a series directory, `rel` is `dir` relative to
+// the root. symlinked directories are not followed so there are no cycles
+fn walk(dir: &Path, rel: &str, series: usize, ignore: &[PathBuf], videos: &mut Vec<VideoFile>) {
+    let entries = match fs::read_dir(dir) {
+        Ok(entries) => entries,
+        Err(err) => {
+            println!("failed to read {}: {err}", dir.display());
+            return;
+        }
+    };
+    for entry in entries.flatten() {
+        let Some(name) = entry.file_name().to_str().map(str::to_owned) else {
+            println!("skipping {}, name is not utf-8", entry.path().display());
+            continue;
+        };
+        if name.starts_with('.') || ignore.contains(&entry.path()) {
+            continue;
+        }
+        let rel_path = format!("{rel}/{name}");
+        match entry.file_type() {
+            Ok(file_type) if file_type.is_dir() => {
+                walk(&entry.path(), &rel_path, series, ignore, videos)
+            }
+            Ok(_) => {
+                if let Some(video) = video_file(&entry.path(), rel_path, Show::Episode(series)) {
+                    videos.push(video);
+                }
+            }
+            Err(_) => {}
+        }
+    }
+}
+
+fn video_file(path: &Path, rel_path: String, show: Show) -> Option<VideoFile> {
+    let extension = path.extension()?.to_str()?.to_ascii_lowercase();
+    if !VIDEO_EXTENSIONS.contains(&extension.as_str()) {
+        return None;
+    }
+    // follows symlinked files
+    let meta = fs::metadata(path).ok().filter(|meta| meta.is_file())?;
+    let mtime = meta
+        .modified()
+        .ok()
+        .and_then(|modified| modified.duration_since(UNIX_EPOCH).ok())
+        .map(|d| d.as_secs())
+        .unwrap_or(0);
+    Some(VideoFile {
+        rel_path,
+        size: meta.len(),
+        mtime,
+        show,
+    })
+}
+
+// `{name}.jpg` and the like inside a series directory
+fn artwork(dir: &Path, rel: &str, name: &str) -> Option<String> {
+    ARTWORK_EXTENSIONS.iter().find_map(|extension| {
+        let file = format!("{name}.{extension}");
+        dir.join(&file).is_file().then(|| format!("{rel}/{file}"))
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn temp_root(name: &str) -> PathBuf {
+        let root = std::env::temp_dir().join(format!("haema-{name}-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&root);
+        fs::create_dir_all(&root).unwrap();
+        root
+    }
+
+    fn touch(root: &Path, rel_path: &str) {
+        let path = root.join(rel_path);
+        fs::create_dir_all(path.parent().unwrap()).unwrap();
+        fs::write(path, b"not a video").unwrap();
+    }
+
+    #[test]
+    fn test_is_under() {
+        assert!(is_under("show", "show"));
+        assert!(is_under("show/01.mp4", "show"));
+        assert!(!is_under("shows/01.mp4", "show"));
+        assert!(!is_under("show", "show/01.mp4"));
+    }
+
+    #[test]
+    fn test_scan() {
+        let root = temp_root("scan");
+        for rel_path in [
+            "movie.MP4",
+            "notes.txt",
+            "show/01.mp4",
+            "show/season 2/03.mkv",
+            "show/thumbnail.jpg",
+            "show/.hidden.mp4",
+            "empty/notes.txt",
+            ".trash/old.mp4",
+            "cache/1-0.ts",
+        ] {
+            touch(&root, rel_path);
+        }
+
+        let scan = scan(&root, &[root.join("cache")]).unwrap();
+        let mut videos: Vec<(&str, Option<usize>)> = scan
+            .videos
+            .iter()
+            .map(|video| match video.show {
+                Show::Movie => (video.rel_path.as_str(), None),
+                Show::Episode(series) => (video.rel_path.as_str(), Some(series)),
+            })
+            .collect();
+        videos.sort();
+        assert_eq!(
+            videos,
+            [
+                ("movie.MP4", None),
+                ("show/01.mp4", Some(0)),
+                ("show/season 2/03.mkv", Some(0)),
+            ]
+        );
+        // directories without videos are no series
+        assert_eq!(scan.series.len(), 1);
+        assert_eq!(scan.series[0].id, path_id("show"));
+        assert_eq!(scan.series[0].title, "show");
+        assert_eq!(
+            scan.series[0].thumbnail.as_deref(),
+            Some("show/thumbnail.jpg")
+        );
+        assert_eq!(scan.series[0].banner, None);
+
+        fs::remove_dir_all(&root).unwrap();
+    }
+
+    #[test]
+    fn test_index() {
+        let root = temp_root("index");
+        let db_path = root.join("haema.db");
+        touch(&root, "show/01.mp4");
+        {
+            let conn = connect(&db_path).unwrap();
+            conn.execute(
+                "INSERT INTO video (id, path, duration, size, mtime) VALUES (?1, ?2, 1, 1, 1)",
+                [path_id("gone.mp4"), "gone.mp4".to_string()],
+            )
+            .unwrap();
+        }
+
+        // the file doesn't probe, it is retried by the next run
+        let stats = index(&db_path, &root, &[db_path.clone()]).unwrap();
+        assert_eq!(stats.files, 1);
+        assert_eq!((stats.probed, stats.failed, stats.removed), (0, 1, 1));
+        assert_eq!(stats.changed, ["gone.mp4"]);
+        let conn = connect(&db_path).unwrap();
+        assert!(known_videos(&conn, None).unwrap().is_empty());
+
+        let stats = index(&db_path, &root, &[db_path.clone()]).unwrap();
+        assert_eq!((stats.probed, stats.failed, stats.removed), (0, 1, 0));
+
+        // only the paths under the update are looked at
+        touch(&root, "other/01.mp4");
+        let stats = update(&db_path, &root, &[], &[root.join("other")]).unwrap();
+        assert_eq!((stats.files, stats.failed), (1, 1));
+
+        fs::remove_dir_all(&root).unwrap();
+    }
+}
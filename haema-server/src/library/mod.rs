@@ -0,0 +1,251 @@
+pub mod indexer;
+
+pub use indexer::IndexStats;
+
+use std::{
+    collections::HashMap,
+    path::{Path, PathBuf},
+    sync::{Mutex, RwLock},
+};
+
+use rusqlite::{Connection, OptionalExtension};
+
+use crate::error::AppError;
+
+// "index" is a keyword, the column is quoted everywhere
+const SCHEMA: &str = r#"
+CREATE TABLE IF NOT EXISTS series (
+    id TEXT PRIMARY KEY,
+    title TEXT NOT NULL,
+    thumbnail TEXT,
+    banner TEXT
+);
+CREATE TABLE IF NOT EXISTS episode (
+    series_id TEXT NOT NULL,
+    video_id TEXT NOT NULL,
+    "index" TEXT NOT NULL,
+    title TEXT NOT NULL,
+    FOREIGN KEY (series_id) REFERENCES series (id),
+    FOREIGN KEY (video_id) REFERENCES video (id),
+    PRIMARY KEY (series_id, video_id)
+);
+CREATE TABLE IF NOT EXISTS movie (
+    id TEXT PRIMARY KEY,
+    video_id TEXT,
+    title TEXT NOT NULL,
+    thumbnail TEXT,
+    banner TEXT,
+    FOREIGN KEY (video_id) REFERENCES video (id)
+);
+CREATE TABLE IF NOT EXISTS video (
+    id TEXT PRIMARY KEY,
+    path TEXT NOT NULL UNIQUE,
+    duration REAL NOT NULL,
+    size INTEGER NOT NULL,
+    mtime INTEGER NOT NULL
+);
+"#;
+
+/// opens the db with the schema in place, readers and the indexer each get
+/// their own connection so lookups don't wait on index transactions
+pub(crate) fn connect(db_path: &Path) -> rusqlite::Result<Connection> {
+    let conn = Connection::open(db_path)?;
+    conn.execute_batch(
+        "PRAGMA journal_mode = WAL;
+         PRAGMA synchronous = NORMAL;
+         PRAGMA foreign_keys = ON;",
+    )?;
+    conn.execute_batch(SCHEMA)?;
+    Ok(conn)
+}
+
+/// shows and videos found under `target_path`, the file structure is the
+/// source of truth and the db is rebuilt from it by `index`
+///
+/// - every directory directly under the root is a series of the videos
+/// inside it, videos directly under the root are movies
+/// - video paths are stored relative to the root
+/// - `ignore` holds paths under the root that aren't part of the library like
+/// the cache directory
+/// - the video paths are kept in memory and updated after every index run, so
+/// requests look them up without touching the db
+pub struct Library {
+    root: PathBuf,
+    db_path: PathBuf,
+    ignore: Vec<PathBuf>,
+    conn: Mutex<Connection>,
+    // video ids to paths relative to the root, mirrors the video table
+    paths: RwLock<HashMap<String, String>>,
+}
+
+impl Library {
+    pub fn open(db_path: &Path, root: &Path, ignore: &[&Path]) -> rusqlite::Result<Self> {
+        let conn = connect(db_path)?;
+        // watcher events carry absolute paths
+        let root = root.canonicalize().unwrap_or_else(|_| root.to_path_buf());
+        let ignore = ignore
+            .iter()
+            .filter_map(|path| path.canonicalize().ok())
+            .collect();
+        let paths = video_paths(&conn)?;
+        Ok(Self {
+            root,
+            db_path: db_path.to_path_buf(),
+            ignore,
+            conn: Mutex::new(conn),
+            paths: RwLock::new(paths),
+        })
+    }
+
+    pub fn root(&self) -> &Path {
+        &self.root
+    }
+
+    /// path of the source of `video_id`
+    pub fn video_path(&self, video_id: &str) -> Result<String, AppError> {
+        match self.paths.read().unwrap().get(video_id) {
+            Some(rel_path) => Ok(self.root.join(rel_path).to_string_lossy().into_owned()),
+            None => Err(AppError::VideoNotFound(video_id.to_string())),
+        }
+    }
+
+    /// brings the db up to date with the files under the root, blocks for as
+    /// long as probing the new and changed files takes
+    pub fn index(&self) -> Result<IndexStats, AppError> {
+        let result = indexer::index(&self.db_path, &self.root, &self.ignore);
+        // a failed run may still have written some of the videos
+        let paths = video_paths(&self.conn.lock().unwrap()).map_err(indexer::db_err)?;
+        *self.paths.write().unwrap() = paths;
+        result
+    }
+
+    /// like `index` for the files and directories at `paths` only
+    pub fn update(&self, paths: &[PathBuf]) -> Result<IndexStats, AppError> {
+        let stats = indexer::update(&self.db_path, &self.root, &self.ignore, paths)?;
+        self.sync_paths(&stats.changed)?;
+        Ok(stats)
+    }
+
+    // looks up the videos at `rel_paths` again after they changed
+    fn sync_paths(&self, rel_paths: &[String]) -> Result<(), AppError> {
+        let found = {
+            let conn = self.conn.lock().unwrap();
+            let mut stmt = conn
+                .prepare_cached("SELECT path FROM video WHERE id = ?1")
+                .map_err(indexer::db_err)?;
+            rel_paths
+                .iter()
+                .map(|rel_path| {
+                    let video_id = path_id(rel_path);
+                    let found: Option<String> = stmt
+                        .query_row([&video_id], |row| row.get(0))
+                        .optional()
+                        .map_err(indexer::db_err)?;
+                    Ok((video_id, found))
+                })
+                .collect::<Result<Vec<_>, AppError>>()?
+        };
+        let mut paths = self.paths.write().unwrap();
+        for (video_id, found) in found {
+            match found {
+                Some(rel_path) => paths.insert(video_id, rel_path),
+                None => paths.remove(&video_id),
+            };
+        }
+        Ok(())
+    }
+
+    /// whether a change at `path` can matter to the library, files other than
+    /// videos and artwork are left out unless they are gone
+    pub fn is_relevant(&self, path: &Path) -> bool {
+        let Ok(rel_path) = path.strip_prefix(&self.root) else {
+            return false;
+        };
+        if self.ignore.iter().any(|ignored| path.starts_with(ignored))
+            || rel_path
+                .components()
+                .any(|name| name.as_os_str().to_string_lossy().starts_with('.'))
+        {
+            return false;
+        }
+        match std::fs::metadata(path) {
+            Ok(meta) if meta.is_dir() => true,
+            Ok(_) => path
+                .extension()
+                .and_then(|extension| extension.to_str())
+                .is_some_and(|extension| {
+                    let extension = extension.to_ascii_lowercase();
+                    indexer::VIDEO_EXTENSIONS.contains(&extension.as_str())
+                        || indexer::ARTWORK_EXTENSIONS.contains(&extension.as_str())
+                }),
+            Err(_) => true,
+        }
+    }
+
+    /// id of the video at `rel_path`, a path relative to the root
+    pub fn video_id(rel_path: &str) -> String {
+        path_id(rel_path)
+    }
+}
+
+fn video_paths(conn: &Connection) -> rusqlite::Result<HashMap<String, String>> {
+    conn.prepare_cached("SELECT id, path FROM video")?
+        .query_map([], |row| Ok((row.get(0)?, row.get(1)?)))?
+        .collect()
+}
+
+/// stable id of a path relative to the root, 64 bit fnv-1a in hex
+pub(crate) fn path_id(rel_path: &str) -> String {
+    let mut hash: u64 = 0xcbf29ce484222325;
+    for b in rel_path.bytes() {
+        hash ^= b as u64;
+        hash = hash.wrapping_mul(0x100000001b3);
+    }
+    format!("{hash:016x}")
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_path_id() {
+        // fnv-1a test vectors
+        assert_eq!(path_id(""), "cbf29ce484222325");
+        assert_eq!(path_id("a"), "af63dc4c8601ec8c");
+        assert_eq!(path_id("foobar"), "85944171f73967e8");
+        assert_ne!(path_id("show/01.mp4"), path_id("show/02.mp4"));
+    }
+
+    #[test]
+    fn test_video_path() {
+        let dir = std::env::temp_dir().join(format!("haema-library-test-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&dir);
+        std::fs::create_dir_all(&dir).unwrap();
+        let db_path = dir.join("haema.db");
+        connect(&db_path)
+            .unwrap()
+            .execute(
+                "INSERT INTO video (id, path, duration, size, mtime) VALUES (?1, ?2, 1, 1, 1)",
+                [path_id("show/01.mp4"), "show/01.mp4".to_string()],
+            )
+            .unwrap();
+
+        let library = Library::open(&db_path, &dir, &[]).unwrap();
+        let root = dir.canonicalize().unwrap();
+        assert_eq!(
+            library.video_path(&path_id("show/01.mp4")).unwrap(),
+            root.join("show/01.mp4").to_string_lossy()
+        );
+        assert!(matches!(
+            library.video_path(&path_id("show/02.mp4")),
+            Err(AppError::VideoNotFound(_))
+        ));
+
+        // the file is gone, the next run drops it
+        library.index().unwrap();
+        assert!(library.video_path(&path_id("show/01.mp4")).is_err());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
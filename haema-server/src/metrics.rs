@@ -0,0 +1,572 @@
+use std::{
+    fmt::Write,
+    sync::atomic::{AtomicU64, Ordering},
+    time::{Duration, Instant},
+};
+
+use haema_ff_sys::{Format, NB_STAGES, TranscodeStats};
+
+use crate::{
+    cache::segment_extension,
+    domain::{AudioCodec, Resolution, StreamType, VideoCodec},
+    pool::JobClass,
+    state::AppState,
+};
+
+// upper bounds of the latency buckets in seconds, one more bucket takes the
+// rest
+const LATENCY_BUCKETS: [f64; 12] = [
+    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0,
+];
+
+// label values in the order of `video_codec_idx` and `audio_codec_idx`
+const VIDEO_CODECS: [VideoCodec; 4] = [
+    VideoCodec::AV1,
+    VideoCodec::H264,
+    VideoCodec::H265,
+    VideoCodec::None,
+];
+const AUDIO_CODECS: [AudioCodec; 2] = [AudioCodec::AAC, AudioCodec::None];
+const FORMATS: [Format; 2] = [Format::MpegTs, Format::Fmp4];
+
+/// request latency with fixed buckets
+#[derive(Default)]
+pub struct Histogram {
+    // not cumulative, the last one is +Inf
+    buckets: [AtomicU64; LATENCY_BUCKETS.len() + 1],
+    // microseconds
+    sum: AtomicU64,
+}
+
+impl Histogram {
+    pub fn observe(&self, elapsed: Duration) {
+        let secs = elapsed.as_secs_f64();
+        let idx = LATENCY_BUCKETS
+            .iter()
+            .position(|le| secs <= *le)
+            .unwrap_or(LATENCY_BUCKETS.len());
+        self.buckets[idx].fetch_add(1, Ordering::Relaxed);
+        self.sum
+            .fetch_add(elapsed.as_micros() as u64, Ordering::Relaxed);
+    }
+
+    /// observes the time until the timer is dropped, a request that fails or
+    /// is cancelled is observed as well
+    pub fn start_timer(&self) -> Timer<'_> {
+        Timer {
+            histogram: self,
+            start: Instant::now(),
+        }
+    }
+
+    fn count(&self) -> u64 {
+        self.buckets
+            .iter()
+            .map(|bucket| bucket.load(Ordering::Relaxed))
+            .sum()
+    }
+
+    fn render(&self, out: &mut String, name: &str, labels: &str) {
+        let sep = if labels.is_empty() { "" } else { "," };
+        let mut count = 0;
+        for (idx, bucket) in self.buckets.iter().enumerate() {
+            count += bucket.load(Ordering::Relaxed);
+            let le = match LATENCY_BUCKETS.get(idx) {
+                Some(le) => le.to_string(),
+                None => "+Inf".to_string(),
+            };
+            let _ = writeln!(out, "{name}_bucket{{{labels}{sep}le=\"{le}\"}} {count}");
+        }
+        let sum = self.sum.load(Ordering::Relaxed) as f64 / 1e6;
+        let _ = writeln!(out, "{} {sum}", series(&format!("{name}_sum"), labels));
+        let _ = writeln!(out, "{} {count}", series(&format!("{name}_count"), labels));
+    }
+}
+
+pub struct Timer<'a> {
+    histogram: &'a Histogram,
+    start: Instant,
+}
+
+impl Drop for Timer<'_> {
+    fn drop(&mut self) {
+        self.histogram.observe(self.start.elapsed());
+    }
+}
+
+/// one histogram for every stream type, the set is fixed when the server
+/// starts so no lock is taken. resolutions outside of the ladder share the
+/// "other" label, the url can't grow the number of series
+struct ByStreamType {
+    resolutions: Vec<Resolution>,
+    histograms: Vec<Histogram>,
+}
+
+impl ByStreamType {
+    fn new(resolutions: &[Resolution]) -> Self {
+        let len = (resolutions.len() + 1) * VIDEO_CODECS.len() * AUDIO_CODECS.len();
+        Self {
+            resolutions: resolutions.to_vec(),
+            histograms: (0..len).map(|_| Histogram::default()).collect(),
+        }
+    }
+
+    fn get(&self, stream_type: &StreamType) -> &Histogram {
+        let resolution = self
+            .resolutions
+            .iter()
+            .position(|resolution| *resolution == stream_type.resolution)
+            .unwrap_or(self.resolutions.len());
+        let video = video_codec_idx(&stream_type.video_codec);
+        let audio = audio_codec_idx(&stream_type.audio_codec);
+        &self.histograms[(resolution * VIDEO_CODECS.len() + video) * AUDIO_CODECS.len() + audio]
+    }
+
+    // stream types that were never requested are left out
+    fn render(&self, out: &mut String, name: &str) {
+        for (idx, histogram) in self.histograms.iter().enumerate() {
+            if histogram.count() == 0 {
+                continue;
+            }
+            let audio = &AUDIO_CODECS[idx % AUDIO_CODECS.len()];
+            let video = &VIDEO_CODECS[idx / AUDIO_CODECS.len() % VIDEO_CODECS.len()];
+            let resolution = match self
+                .resolutions
+                .get(idx / (AUDIO_CODECS.len() * VIDEO_CODECS.len()))
+            {
+                Some(resolution) => resolution.to_string(),
+                None => "other".to_string(),
+            };
+            let labels = format!(
+                "resolution=\"{resolution}\",video_codec=\"{video}\",audio_codec=\"{audio}\""
+            );
+            histogram.render(out, name, &labels);
+        }
+    }
+}
+
+fn video_codec_idx(codec: &VideoCodec) -> usize {
+    match codec {
+        VideoCodec::AV1 => 0,
+        VideoCodec::H264 => 1,
+        VideoCodec::H265 => 2,
+        VideoCodec::None => 3,
+    }
+}
+
+fn audio_codec_idx(codec: &AudioCodec) -> usize {
+    match codec {
+        AudioCodec::AAC => 0,
+        AudioCodec::None => 1,
+    }
+}
+
+fn format_idx(format: Format) -> usize {
+    match format {
+        Format::MpegTs => 0,
+        Format::Fmp4 => 1,
+    }
+}
+
+/// sums of the `TranscodeStats` of every timed transcode
+#[derive(Default)]
+struct TranscodeTotals {
+    segments: AtomicU64,
+    // wall microseconds in the order of `TranscodeStats::stages`, both are
+    // NB_STAGES long so the zips below cover every stage
+    stages: [AtomicU64; NB_STAGES],
+    total: AtomicU64,
+    packets_read: AtomicU64,
+    frames_decoded: AtomicU64,
+    frames_discarded: AtomicU64,
+    frames_skipped: AtomicU64,
+    frames_encoded: AtomicU64,
+    bytes_out: AtomicU64,
+}
+
+/// counters behind /metrics, everything on the request path is a relaxed
+/// atomic add. gauges of the pool and the caches are read on scrape
+pub struct Metrics {
+    master_playlist: Histogram,
+    media_playlist: ByStreamType,
+    segment: ByStreamType,
+    segment_bytes: [AtomicU64; FORMATS.len()],
+    transcode: TranscodeTotals,
+}
+
+impl Metrics {
+    /// `renditions` are the configured heights, they and the source size
+    /// are the resolutions that get their own label
+    pub fn new(renditions: &[Resolution]) -> Self {
+        let mut resolutions = vec![Resolution::Source];
+        for resolution in renditions {
+            if !resolutions.contains(resolution) {
+                resolutions.push(*resolution);
+            }
+        }
+        Self {
+            master_playlist: Histogram::default(),
+            media_playlist: ByStreamType::new(&resolutions),
+            segment: ByStreamType::new(&resolutions),
+            segment_bytes: Default::default(),
+            transcode: TranscodeTotals::default(),
+        }
+    }
+
+    pub fn master_playlist(&self) -> &Histogram {
+        &self.master_playlist
+    }
+
+    pub fn media_playlist(&self, stream_type: &StreamType) -> &Histogram {
+        self.media_playlist.get(stream_type)
+    }
+
+    /// time until the response starts, a segment that is still being
+    /// produced goes on streaming after that
+    pub fn segment(&self, stream_type: &StreamType) -> &Histogram {
+        self.segment.get(stream_type)
+    }
+
+    pub fn add_segment_bytes(&self, format: Format, bytes: usize) {
+        self.segment_bytes[format_idx(format)].fetch_add(bytes as u64, Ordering::Relaxed);
+    }
+
+    pub fn add_transcode(&self, stats: &TranscodeStats) {
+        let totals = &self.transcode;
+        totals.segments.fetch_add(1, Ordering::Relaxed);
+        for (sum, (_, time)) in totals.stages.iter().zip(stats.stages()) {
+            sum.fetch_add(time.wall as u64, Ordering::Relaxed);
+        }
+        totals
+            .total
+            .fetch_add(stats.total.wall as u64, Ordering::Relaxed);
+        totals
+            .packets_read
+            .fetch_add(stats.packets_read as u64, Ordering::Relaxed);
+        totals
+            .frames_decoded
+            .fetch_add(stats.frames_decoded as u64, Ordering::Relaxed);
+        totals
+            .frames_discarded
+            .fetch_add(stats.frames_discarded as u64, Ordering::Relaxed);
+        totals
+            .frames_skipped
+            .fetch_add(stats.frames_skipped as u64, Ordering::Relaxed);
+        totals
+            .frames_encoded
+            .fetch_add(stats.frames_encoded as u64, Ordering::Relaxed);
+        totals
+            .bytes_out
+            .fetch_add(stats.bytes_out as u64, Ordering::Relaxed);
+    }
+}
+
+/// every metric of the server in the prometheus text format
+pub fn render(state: &AppState) -> String {
+    let metrics = &state.metrics;
+    let mut out = String::new();
+
+    let name = "haema_master_playlist_request_seconds";
+    header(
+        &mut out,
+        name,
+        "histogram",
+        "latency of master playlist requests",
+    );
+    metrics.master_playlist.render(&mut out, name, "");
+    let name = "haema_media_playlist_request_seconds";
+    header(
+        &mut out,
+        name,
+        "histogram",
+        "latency of media playlist requests",
+    );
+    metrics.media_playlist.render(&mut out, name);
+    let name = "haema_segment_request_seconds";
+    header(
+        &mut out,
+        name,
+        "histogram",
+        "time until a segment response starts",
+    );
+    metrics.segment.render(&mut out, name);
+
+    let served = FORMATS.map(|format| {
+        let bytes = &metrics.segment_bytes[format_idx(format)];
+        (
+            format!("format=\"{}\"", segment_extension(format)),
+            load(bytes),
+        )
+    });
+    family(
+        &mut out,
+        "haema_segment_bytes_served_total",
+        "counter",
+        "bytes of segments sent to clients",
+        served,
+    );
+
+    let pool = &state.hmff_pool;
+    for (name, help, value) in [
+        ("haema_transcoders", "transcoders in the pool", pool.size()),
+        (
+            "haema_transcoders_in_use",
+            "transcoders handed out",
+            pool.in_use(),
+        ),
+    ] {
+        family(
+            &mut out,
+            name,
+            "gauge",
+            help,
+            [(String::new(), value as f64)],
+        );
+    }
+    let waiters = JobClass::ALL.map(|class| {
+        let labels = format!("class=\"{}\"", class.name());
+        (labels, pool.waiters(class) as f64)
+    });
+    family(
+        &mut out,
+        "haema_transcoder_waiters",
+        "gauge",
+        "jobs waiting for a transcoder",
+        waiters,
+    );
+
+    let cache = &state.segment_cache;
+    let stats = cache.stats();
+    let lookups = [
+        ("memory", &stats.memory_hits),
+        ("disk", &stats.disk_hits),
+        ("inflight", &stats.inflight_hits),
+        ("miss", &stats.misses),
+    ]
+    .map(|(result, count)| (format!("result=\"{result}\""), load(count)));
+    family(
+        &mut out,
+        "haema_segment_cache_lookups_total",
+        "counter",
+        "segment lookups by where they were served from",
+        lookups,
+    );
+    family(
+        &mut out,
+        "haema_segment_cache_abandoned_total",
+        "counter",
+        "segments whose readers all went away before they were produced",
+        [(String::new(), load(&stats.abandoned))],
+    );
+    let mut evictions = vec![(tier("memory"), cache.memory().evictions() as f64)];
+    let mut sizes = vec![(tier("memory"), cache.memory().size() as f64)];
+    if let Some(disk) = cache.disk() {
+        evictions.push((tier("disk"), disk.evictions() as f64));
+        sizes.push((tier("disk"), disk.size() as f64));
+    }
+    family(
+        &mut out,
+        "haema_segment_cache_evictions_total",
+        "counter",
+        "segments dropped to stay within the cache limit",
+        evictions,
+    );
+    family(
+        &mut out,
+        "haema_segment_cache_bytes",
+        "gauge",
+        "size of the cached segments",
+        sizes,
+    );
+
+    render_transcode(&mut out, &metrics.transcode);
+    out
+}
+
+// stage times are wall clock, the server does not have hm_transcode.c measure
+// process cpu time, it costs a syscall per frame and is shared by every
+// transcode running at once
+fn render_transcode(out: &mut String, totals: &TranscodeTotals) {
+    let stages = totals
+        .stages
+        .iter()
+        .zip(TranscodeStats::default().stages())
+        .map(|(sum, (stage, _))| (format!("stage=\"{stage}\""), load(sum) / 1e6));
+    family(
+        out,
+        "haema_transcode_stage_seconds_total",
+        "counter",
+        "wall time of timed transcodes by stage",
+        stages,
+    );
+    family(
+        out,
+        "haema_transcode_seconds_total",
+        "counter",
+        "wall time of timed transcodes",
+        [(String::new(), load(&totals.total) / 1e6)],
+    );
+
+    for (name, help, counter) in [
+        (
+            "haema_transcode_segments_total",
+            "timed transcodes",
+            &totals.segments,
+        ),
+        (
+            "haema_transcode_packets_read_total",
+            "packets demuxed",
+            &totals.packets_read,
+        ),
+        (
+            "haema_transcode_frames_decoded_total",
+            "frames decoded",
+            &totals.frames_decoded,
+        ),
+        (
+            "haema_transcode_frames_discarded_total",
+            "decoded frames outside their segment",
+            &totals.frames_discarded,
+        ),
+        (
+            "haema_transcode_frames_skipped_total",
+            "frames outside their segment skipped instead of decoded",
+            &totals.frames_skipped,
+        ),
+        (
+            "haema_transcode_frames_encoded_total",
+            "frames encoded",
+            &totals.frames_encoded,
+        ),
+        (
+            "haema_transcode_bytes_out_total",
+            "bytes muxed",
+            &totals.bytes_out,
+        ),
+    ] {
+        family(out, name, "counter", help, [(String::new(), load(counter))]);
+    }
+}
+
+fn load(counter: &AtomicU64) -> f64 {
+    counter.load(Ordering::Relaxed) as f64
+}
+
+fn tier(tier: &str) -> String {
+    format!("tier=\"{tier}\"")
+}
+
+fn header(out: &mut String, name: &str, kind: &str, help: &str) {
+    let _ = writeln!(out, "# HELP {name} {help}");
+    let _ = writeln!(out, "# TYPE {name} {kind}");
+}
+
+// `samples` are (labels, value) pairs, labels without the braces
+fn family(
+    out: &mut String,
+    name: &str,
+    kind: &str,
+    help: &str,
+    samples: impl IntoIterator<Item = (String, f64)>,
+) {
+    header(out, name, kind, help);
+    for (labels, value) in samples {
+        let _ = writeln!(out, "{} {value}", series(name, &labels));
+    }
+}
+
+fn series(name: &str, labels: &str) -> String {
+    if labels.is_empty() {
+        name.to_string()
+    } else {
+        format!("{name}{{{labels}}}")
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn stream_type(s: &str) -> StreamType {
+        s.parse().unwrap()
+    }
+
+    fn millis(ms: u64) -> Duration {
+        Duration::from_millis(ms)
+    }
+
+    #[test]
+    fn test_histogram() {
+        let histogram = Histogram::default();
+        histogram.observe(millis(3));
+        histogram.observe(millis(50));
+        histogram.observe(Duration::from_secs(60));
+        let mut out = String::new();
+        histogram.render(&mut out, "latency", "");
+
+        let lines: Vec<&str> = out.lines().collect();
+        assert_eq!(lines.len(), LATENCY_BUCKETS.len() + 3);
+        // buckets are cumulative and their bounds inclusive
+        assert_eq!(lines[0], "latency_bucket{le=\"0.005\"} 1");
+        assert_eq!(lines[2], "latency_bucket{le=\"0.025\"} 1");
+        assert_eq!(lines[3], "latency_bucket{le=\"0.05\"} 2");
+        assert_eq!(lines[11], "latency_bucket{le=\"30\"} 2");
+        assert_eq!(lines[12], "latency_bucket{le=\"+Inf\"} 3");
+        assert_eq!(lines[13], "latency_sum 60.053");
+        assert_eq!(lines[14], "latency_count 3");
+    }
+
+    #[test]
+    fn test_by_stream_type() {
+        let metrics = Metrics::new(&[Resolution::Height(720), Resolution::Height(480)]);
+        let hd = stream_type("720p,h264,aac");
+        metrics.segment(&hd).observe(millis(3));
+        metrics.segment(&hd).observe(millis(30));
+        metrics.segment(&hd).observe(millis(40));
+        // not in the ladder, shares the "other" label
+        metrics
+            .segment(&stream_type("1080p,av1,none"))
+            .observe(millis(2000));
+        metrics
+            .segment(&stream_type("360p,av1,none"))
+            .observe(millis(4));
+        // a different histogram than the segments of the same stream type
+        metrics
+            .media_playlist(&stream_type("480p,h265,aac"))
+            .observe(millis(1));
+
+        let mut out = String::new();
+        metrics.segment.render(&mut out, "segment");
+        let labels = "resolution=\"720p\",video_codec=\"h264\",audio_codec=\"aac\"";
+        for (le, count) in [("0.005", 1), ("0.025", 1), ("0.05", 3), ("+Inf", 3)] {
+            let line = format!("segment_bucket{{{labels},le=\"{le}\"}} {count}");
+            assert!(out.lines().any(|l| l == line), "{line} missing in\n{out}");
+        }
+        let other = "resolution=\"other\",video_codec=\"av1\",audio_codec=\"none\"";
+        for (le, count) in [("0.005", 1), ("1", 1), ("2.5", 2), ("+Inf", 2)] {
+            let line = format!("segment_bucket{{{other},le=\"{le}\"}} {count}");
+            assert!(out.lines().any(|l| l == line), "{line} missing in\n{out}");
+        }
+        // stream types that were never requested are left out
+        let counts: Vec<&str> = out
+            .lines()
+            .filter(|line| line.starts_with("segment_count"))
+            .collect();
+        assert_eq!(
+            counts,
+            [
+                format!("segment_count{{{labels}}} 3"),
+                format!("segment_count{{{other}}} 2"),
+            ]
+        );
+
+        let mut out = String::new();
+        metrics.media_playlist.render(&mut out, "playlist");
+        let labels = "resolution=\"480p\",video_codec=\"h265\",audio_codec=\"aac\"";
+        assert!(out.contains(&format!("playlist_count{{{labels}}} 1\n")));
+        assert_eq!(
+            out.lines().filter(|line| line.contains("_count")).count(),
+            1
+        );
+    }
+}
@@ -1,14 +1,171 @@
 use std::{
+    collections::HashMap,
+    net::IpAddr,
     ops::{Deref, DerefMut},
-    sync::{Arc, Mutex},
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicBool, Ordering},
+    },
+    time::Instant,
 };
-use tokio::sync::{OwnedSemaphorePermit, Semaphore};
+use tokio::sync::oneshot;
+
+/// how urgent a job is, an item only goes to a class while no job of a
+/// higher one is waiting
+#[derive(Clone, Copy, Debug, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub enum JobClass {
+    /// a player is waiting on it
+    Playback,
+    /// ahead of a player
+    Prefetch,
+    /// pre-transcoding and other work nobody waits on
+    Batch,
+}
+
+impl JobClass {
+    pub const ALL: [JobClass; 3] = [JobClass::Playback, JobClass::Prefetch, JobClass::Batch];
+
+    pub fn name(&self) -> &'static str {
+        match self {
+            JobClass::Playback => "playback",
+            JobClass::Prefetch => "prefetch",
+            JobClass::Batch => "batch",
+        }
+    }
+}
+
+/// what an item of the pool is wanted for
+///
+/// waiting jobs are ordered by class, then by the number of items their
+/// client already holds so one client can't take every item while others
+/// wait, then by deadline
+#[derive(Clone, Debug)]
+pub struct Job {
+    pub class: JobClass,
+    pub deadline: Instant,
+    pub client: Option<IpAddr>,
+    // raises the job to playback while it waits, set when a player starts
+    // waiting on its output
+    urgent: Option<Arc<AtomicBool>>,
+}
+
+impl Job {
+    pub fn playback(client: Option<IpAddr>) -> Self {
+        Self::new(JobClass::Playback, Instant::now(), client)
+    }
+
+    /// `deadline` is when the player is expected to get to the output
+    pub fn prefetch(client: Option<IpAddr>, deadline: Instant) -> Self {
+        Self::new(JobClass::Prefetch, deadline, client)
+    }
+
+    pub fn batch() -> Self {
+        Self::new(JobClass::Batch, Instant::now(), None)
+    }
+
+    fn new(class: JobClass, deadline: Instant, client: Option<IpAddr>) -> Self {
+        Self {
+            class,
+            deadline,
+            client,
+            urgent: None,
+        }
+    }
+
+    /// the job counts as playback once `urgent` is set
+    pub fn promoted_by(mut self, urgent: Arc<AtomicBool>) -> Self {
+        self.urgent = Some(urgent);
+        self
+    }
+
+    fn effective_class(&self) -> JobClass {
+        match &self.urgent {
+            Some(urgent) if urgent.load(Ordering::Relaxed) => JobClass::Playback,
+            _ => self.class,
+        }
+    }
+}
+
+struct Waiter<T> {
+    job: Job,
+    seq: u64,
+    tx: oneshot::Sender<T>,
+}
+
+struct State<T> {
+    // idle items, never non-empty while jobs wait
+    items: Vec<T>,
+    waiters: Vec<Waiter<T>>,
+    // items handed out per client
+    held: HashMap<IpAddr, usize>,
+    seq: u64,
+}
+
+impl<T> State<T> {
+    fn held(&self, client: Option<IpAddr>) -> usize {
+        client.and_then(|c| self.held.get(&c).copied()).unwrap_or(0)
+    }
+
+    fn hold(&mut self, client: Option<IpAddr>) {
+        if let Some(client) = client {
+            *self.held.entry(client).or_default() += 1;
+        }
+    }
+
+    fn unhold(&mut self, client: Option<IpAddr>) {
+        if let Some(client) = client {
+            if let Some(held) = self.held.get_mut(&client) {
+                *held -= 1;
+                if *held == 0 {
+                    self.held.remove(&client);
+                }
+            }
+        }
+    }
+
+    // hands the item to the next waiting job, a job that went away in the
+    // meantime is skipped
+    fn hand_over(&mut self, mut item: T) {
+        while let Some(waiter) = self.take_next_waiter() {
+            match waiter.tx.send(item) {
+                Ok(()) => {
+                    self.hold(waiter.job.client);
+                    return;
+                }
+                Err(returned) => item = returned,
+            }
+        }
+        self.items.push(item);
+    }
+
+    // the queue is short, it is scanned since the held counts and urgency
+    // change while jobs wait
+    fn take_next_waiter(&mut self) -> Option<Waiter<T>> {
+        let idx = self
+            .waiters
+            .iter()
+            .enumerate()
+            .min_by_key(|(_, waiter)| {
+                (
+                    waiter.job.effective_class(),
+                    self.held(waiter.job.client),
+                    waiter.job.deadline,
+                    waiter.seq,
+                )
+            })
+            .map(|(idx, _)| idx)?;
+        Some(self.waiters.swap_remove(idx))
+    }
+}
 
 struct Inner<T> {
-    items: Mutex<Vec<T>>,
-    semaphore: Arc<Semaphore>,
+    state: Mutex<State<T>>,
+    size: usize,
 }
 
+/// fixed set of items handed out to one job at a time, see `Job` for the
+/// order waiting jobs get them in. an item is only handed over when it is
+/// released, a running job is never preempted
 pub struct Pool<T> {
     inner: Arc<Inner<T>>,
 }
@@ -31,51 +188,134 @@ impl<T: Send> Pool<T> {
 
         Pool {
             inner: Arc::new(Inner {
-                items: Mutex::new(items_vec),
-                semaphore: Arc::new(Semaphore::new(size)),
+                state: Mutex::new(State {
+                    items: items_vec,
+                    waiters: Vec::new(),
+                    held: HashMap::new(),
+                    seq: 0,
+                }),
+                size,
             }),
         }
     }
 
-    pub async fn get(&self) -> PoolGuard<T> {
-        let permit = self
-            .inner
-            .semaphore
-            .clone()
-            .acquire_owned()
-            .await
-            .expect("Semaphore closed");
+    pub async fn get(&self, job: Job) -> PoolGuard<T> {
+        let client = job.client;
+        let (rx, seq) = {
+            let mut state = self.inner.state.lock().unwrap();
+            if let Some(item) = state.items.pop() {
+                state.hold(client);
+                return self.guard(item, client);
+            }
+            state.seq += 1;
+            let seq = state.seq;
+            let (tx, rx) = oneshot::channel();
+            state.waiters.push(Waiter { job, seq, tx });
+            (rx, seq)
+        };
 
-        let item = self
-            .inner
-            .items
-            .lock()
-            .unwrap()
-            .pop()
-            .expect("Pool is empty despite holding a permit");
+        let mut waiting = Waiting {
+            pool: self,
+            rx,
+            seq,
+            client,
+            done: false,
+        };
+        let item = (&mut waiting.rx).await.expect("Pool dropped a waiting job");
+        waiting.done = true;
+        self.guard(item, client)
+    }
 
+    fn guard(&self, item: T, client: Option<IpAddr>) -> PoolGuard<T> {
         PoolGuard {
             item: Some(item),
             pool: self.clone(),
-            _permit: permit,
+            client,
         }
     }
 
-    fn release(&self, item: T) {
-        self.inner.items.lock().unwrap().push(item);
+    /// number of items not handed out right now
+    pub fn available(&self) -> usize {
+        self.inner.state.lock().unwrap().items.len()
+    }
+
+    pub fn size(&self) -> usize {
+        self.inner.size
+    }
+
+    /// number of items handed out right now
+    pub fn in_use(&self) -> usize {
+        self.inner.size - self.available()
+    }
+
+    /// number of jobs of `class` waiting in `get`
+    pub fn waiters(&self, class: JobClass) -> usize {
+        let state = self.inner.state.lock().unwrap();
+        state
+            .waiters
+            .iter()
+            .filter(|waiter| waiter.job.effective_class() == class)
+            .count()
+    }
+
+    /// runs `f` on every item that is not handed out. they are taken out of
+    /// the pool while it runs so `get` and `release` don't wait on `f`, jobs
+    /// that come in meanwhile get them once they are back
+    pub fn for_each_idle(&self, f: impl Fn(&T)) {
+        let items = std::mem::take(&mut self.inner.state.lock().unwrap().items);
+        items.iter().for_each(f);
+        let mut state = self.inner.state.lock().unwrap();
+        for item in items {
+            state.hand_over(item);
+        }
+    }
+
+    fn release(&self, item: T, client: Option<IpAddr>) {
+        let mut state = self.inner.state.lock().unwrap();
+        state.unhold(client);
+        state.hand_over(item);
+    }
+}
+
+// takes a cancelled `get` out of the queue or gives back the item that was
+// handed to it after all
+struct Waiting<'a, T: Send> {
+    pool: &'a Pool<T>,
+    rx: oneshot::Receiver<T>,
+    seq: u64,
+    client: Option<IpAddr>,
+    done: bool,
+}
+
+impl<T: Send> Drop for Waiting<'_, T> {
+    fn drop(&mut self) {
+        if self.done {
+            return;
+        }
+        {
+            let mut state = self.pool.inner.state.lock().unwrap();
+            if let Some(idx) = state.waiters.iter().position(|w| w.seq == self.seq) {
+                state.waiters.swap_remove(idx);
+                return;
+            }
+        }
+        self.rx.close();
+        if let Ok(item) = self.rx.try_recv() {
+            self.pool.release(item, self.client);
+        }
     }
 }
 
 pub struct PoolGuard<T: Send> {
     item: Option<T>,
     pool: Pool<T>,
-    _permit: OwnedSemaphorePermit,
+    client: Option<IpAddr>,
 }
 
 impl<T: Send> Drop for PoolGuard<T> {
     fn drop(&mut self) {
         if let Some(item) = self.item.take() {
-            self.pool.release(item);
+            self.pool.release(item, self.client);
         }
     }
 }
@@ -94,3 +334,163 @@ impl<T: Send> DerefMut for PoolGuard<T> {
     }
 }
 
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::{net::Ipv4Addr, time::Duration};
+
+    fn client(n: u8) -> Option<IpAddr> {
+        Some(IpAddr::V4(Ipv4Addr::new(10, 0, 0, n)))
+    }
+
+    fn waiting(pool: &Pool<u32>) -> usize {
+        JobClass::ALL.iter().map(|class| pool.waiters(*class)).sum()
+    }
+
+    // polls `get` once so its job is queued
+    async fn queue<F: Future>(get: &mut std::pin::Pin<Box<F>>) {
+        tokio::select! {
+            biased;
+            _ = get.as_mut() => panic!("got an item while none was idle"),
+            _ = std::future::ready(()) => {}
+        }
+    }
+
+    #[tokio::test]
+    async fn test_order() {
+        let pool = Pool::new(|| 0u32, 2);
+        let _a = pool.get(Job::playback(client(1))).await;
+        let b = pool.get(Job::playback(client(2))).await;
+
+        let now = Instant::now();
+        let after = |secs| now + Duration::from_secs(secs);
+        let jobs = [
+            ("batch", Job::batch()),
+            ("held", Job::prefetch(client(1), now)),
+            ("late", Job::prefetch(None, after(2))),
+            ("early", Job::prefetch(client(3), after(1))),
+            ("playback", Job::playback(client(1))),
+        ];
+        let order = Arc::new(Mutex::new(Vec::new()));
+        let mut tasks = Vec::new();
+        for (i, (name, job)) in jobs.into_iter().enumerate() {
+            let (task_pool, order) = (pool.clone(), order.clone());
+            tasks.push(tokio::spawn(async move {
+                let _item = task_pool.get(job).await;
+                order.lock().unwrap().push(name);
+            }));
+            while waiting(&pool) <= i {
+                tokio::task::yield_now().await;
+            }
+        }
+
+        // client 1 still holds an item, so its prefetch goes after the
+        // others of its class despite the earliest deadline
+        drop(b);
+        for task in tasks {
+            task.await.unwrap();
+        }
+        assert_eq!(
+            *order.lock().unwrap(),
+            ["playback", "early", "late", "held", "batch"]
+        );
+        assert_eq!(pool.available(), 1);
+    }
+
+    #[tokio::test]
+    async fn test_release_hands_over() {
+        let pool = Pool::new(|| 0u32, 1);
+        let mut guard = pool.get(Job::playback(None)).await;
+        *guard = 7;
+        let mut get = Box::pin(pool.get(Job::batch()));
+        queue(&mut get).await;
+
+        drop(guard);
+        // the item went straight to the waiting job
+        assert_eq!(pool.available(), 0);
+        assert_eq!(waiting(&pool), 0);
+        assert_eq!(*get.await, 7);
+        assert_eq!(pool.available(), 1);
+    }
+
+    #[tokio::test]
+    async fn test_cancel() {
+        let pool = Pool::new(|| 0u32, 1);
+        let guard = pool.get(Job::playback(None)).await;
+
+        // dropped while queued
+        let mut get = Box::pin(pool.get(Job::batch()));
+        queue(&mut get).await;
+        assert_eq!(pool.waiters(JobClass::Batch), 1);
+        drop(get);
+        assert_eq!(waiting(&pool), 0);
+
+        // dropped after the item was handed to it
+        let mut get = Box::pin(pool.get(Job::batch()));
+        queue(&mut get).await;
+        drop(guard);
+        assert_eq!(pool.available(), 0);
+        drop(get);
+        assert_eq!(pool.available(), 1);
+
+        // the handed over item goes on to the next job
+        let guard = pool.get(Job::playback(None)).await;
+        let mut first = Box::pin(pool.get(Job::playback(None)));
+        let mut second = Box::pin(pool.get(Job::batch()));
+        queue(&mut first).await;
+        queue(&mut second).await;
+        drop(guard);
+        drop(first);
+        assert_eq!(pool.available(), 0);
+        drop(second.await);
+        assert_eq!(pool.available(), 1);
+    }
+
+    #[tokio::test]
+    async fn test_urgent() {
+        let pool = Pool::new(|| 0u32, 1);
+        let guard = pool.get(Job::playback(None)).await;
+        let urgent = Arc::new(AtomicBool::new(false));
+        let mut prefetch = Box::pin(pool.get(Job::prefetch(None, Instant::now())));
+        let mut batch = Box::pin(pool.get(Job::batch().promoted_by(urgent.clone())));
+        queue(&mut prefetch).await;
+        queue(&mut batch).await;
+        assert_eq!(pool.waiters(JobClass::Batch), 1);
+
+        urgent.store(true, Ordering::Relaxed);
+        assert_eq!(pool.waiters(JobClass::Batch), 0);
+        assert_eq!(pool.waiters(JobClass::Playback), 1);
+
+        // the promoted job goes first, the prefetch waits for it
+        drop(guard);
+        let item = batch.await;
+        assert_eq!(pool.waiters(JobClass::Prefetch), 1);
+        drop(item);
+        drop(prefetch.await);
+    }
+
+    #[tokio::test]
+    async fn test_for_each_idle() {
+        let pool = Pool::new(|| 0u32, 3);
+        let guard = pool.get(Job::playback(None)).await;
+        let get = Mutex::new(None);
+        pool.for_each_idle(|_| {
+            // the pool is not locked and its idle items are out meanwhile
+            assert_eq!(pool.available(), 0);
+            let mut get = get.lock().unwrap();
+            if get.is_none() {
+                let mut queued = Box::pin(pool.get(Job::batch()));
+                let mut cx = std::task::Context::from_waker(std::task::Waker::noop());
+                assert!(queued.as_mut().poll(&mut cx).is_pending());
+                *get = Some(queued);
+            }
+        });
+
+        // the job that came in meanwhile got one of them when they were back
+        assert_eq!(pool.available(), 1);
+        let item = get.into_inner().unwrap().unwrap().await;
+        drop(item);
+        drop(guard);
+        assert_eq!(pool.available(), 3);
+    }
+}
@@ -0,0 +1,13 @@
+use crate::{metrics, state::AppState};
+use axum::{Router, extract::State, http::header, response::Response, routing::get};
+
+pub fn create_router() -> Router<AppState> {
+    Router::new().route("/metrics", get(get_metrics))
+}
+
+pub async fn get_metrics(State(state): State<AppState>) -> Response<String> {
+    Response::builder()
+        .header(header::CONTENT_TYPE, "text/plain; version=0.0.4")
+        .body(metrics::render(&state))
+        .unwrap()
+}
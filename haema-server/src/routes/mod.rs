@@ -8,11 +8,13 @@ use axum::{
     Router
 };
 
+pub mod metrics_routes;
 pub mod video_routes;
 
 pub fn create_router() -> Router<AppState> {
     Router::new()
         .merge(video_routes::create_router())
+        .merge(metrics_routes::create_router())
         .route("/", get(root))
 }
 
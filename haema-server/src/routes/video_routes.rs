@@ -1,16 +1,25 @@
-use crate::domain::SEGMENT_DURATION;
+use std::{net::SocketAddr, sync::Arc};
+
+use crate::cache::{SegmentBody, SegmentKey};
+use crate::metrics::Metrics;
+use crate::pool::Job;
 use crate::services::{
-    compute_video_segment, create_hls_media_playlist, get_video_duration, parse_segment_filename,
+    SegmentFile, create_hls_master_playlist, create_hls_media_playlist, get_segment_layout,
+    get_source_mtime, has_fast_start, parse_segment_filename, rendition_ladder, segment_encoding,
+    segment_format, stream_layout, stream_video_segment,
 };
 use crate::state::AppState;
 use crate::{domain::StreamType, error::AppError};
 use axum::{
     Router,
-    extract::{Path, State},
+    body::{Body, Bytes},
+    extract::{ConnectInfo, Path, State},
     http::{HeaderValue, header},
     response::{IntoResponse, Response},
     routing::get,
 };
+use haema_ff_sys::Format;
+use tokio_stream::{Stream, StreamExt};
 
 pub fn create_router() -> Router<AppState> {
     Router::new()
@@ -30,32 +39,42 @@ pub fn create_router() -> Router<AppState> {
 
 pub async fn get_video_master_playlist(
     Path(video_id): Path<String>,
+    State(state): State<AppState>,
 ) -> Result<Response<String>, AppError> {
-    // let _video_info = get_video_info(&video_id).await?;
+    let _timer = state.metrics.master_playlist().start_timer();
+    let video_path = state.library.video_path(&video_id)?;
+
+    let source = state.probe_cache.get(&video_path).await?;
+    let ladder = rendition_ladder(&state.config.renditions, source.height);
+    let playlist = create_hls_master_playlist(&ladder, &source, state.config.encoder_profile);
     let res = Response::builder()
         .header(header::CONTENT_TYPE, "application/vnd.apple.mpegurl")
-        .body(video_id)
+        .body(playlist)
         .unwrap();
     Ok(res)
 }
 
 pub async fn get_video_media_playlist(
-    Path((_video_id, stream_type)): Path<(String, String)>,
-    State(_state): State<AppState>,
+    Path((video_id, stream_type)): Path<(String, String)>,
+    State(state): State<AppState>,
 ) -> Result<Response<String>, AppError> {
-    let _stream_type: StreamType = stream_type.parse()?;
-    // let video_path = "/mnt/d/vod/25.08.12 뀨.mp4";
-    let video_path = "/mnt/d/anime/01.mp4";
-
-    // TODO: cache this result
-    let video_duration = get_video_duration(video_path)?;
+    let stream_type: StreamType = stream_type.parse()?;
+    let _timer = state.metrics.media_playlist(&stream_type).start_timer();
+    let video_path = state.library.video_path(&video_id)?;
 
-    // TODO: configurable segment duration
-    let playlist = tokio::task::spawn_blocking(move || {
-        create_hls_media_playlist(video_duration, SEGMENT_DURATION)
-    })
-    .await
-    .map_err(|err| AppError::Error(err.to_string()))?;
+    let mtime = get_source_mtime(&video_path)?;
+    let video_layout = get_segment_layout(&state, &video_id, &video_path, mtime).await?;
+    let source = state.probe_cache.get(&video_path).await?;
+    let layout = stream_layout(
+        &video_layout,
+        state.config.fast_start,
+        &stream_type,
+        &source,
+    );
+    let format = segment_format(&state.config, &stream_type, &source);
+    let playlist = create_hls_media_playlist(&layout, format, |idx, segment| {
+        segment_encoding(&layout, idx, segment, &stream_type, &source)
+    });
     let res = Response::builder()
         .header(header::CONTENT_TYPE, "application/vnd.apple.mpegurl")
         .body(playlist)
@@ -65,30 +84,223 @@ pub async fn get_video_media_playlist(
 }
 
 pub async fn get_video_segment(
-    Path((_video_id, stream_type, segment_filename)): Path<(String, String, String)>,
+    Path((video_id, stream_type, segment_filename)): Path<(String, String, String)>,
     State(state): State<AppState>,
+    ConnectInfo(client): ConnectInfo<SocketAddr>,
 ) -> Result<Response, AppError> {
     let stream_type: StreamType = stream_type.parse()?;
-    let segment_idx = parse_segment_filename(&segment_filename)?;
-    // let video_path = "/mnt/d/vod/25.08.12 뀨.mp4";
-    let video_path = "/mnt/d/anime/01.mp4";
-
-    let video_duration = get_video_duration(video_path)?;
+    let _timer = state.metrics.segment(&stream_type).start_timer();
+    let file = parse_segment_filename(&segment_filename)?;
+    let video_path = state.library.video_path(&video_id)?;
 
-    let hmff = state.hmff_pool.get().await;
-    let segment = compute_video_segment(
-        hmff,
-        video_path,
+    let (segment_idx, format) = match file {
+        SegmentFile::Media(idx, format) => (idx, format),
+        SegmentFile::Init(idx) => (idx, Format::Fmp4),
+    };
+    let mtime = get_source_mtime(&video_path)?;
+    // copied streams and ones a late first keyframe keeps from a fast start
+    // are keyed like the regular layout they are served in
+    let fast_start = state.config.fast_start && {
+        let video_layout = get_segment_layout(&state, &video_id, &video_path, mtime).await?;
+        let source = state.probe_cache.get(&video_path).await?;
+        has_fast_start(true, &video_layout, &stream_type, &source)
+    };
+    let key = SegmentKey {
+        video_id,
         stream_type,
-        video_duration,
-        SEGMENT_DURATION,
         segment_idx,
-    )
-    .await?;
+        format,
+        mtime,
+        fast_start,
+    };
 
-    let mut res = segment.into_response();
+    // the init segment is the head of its fmp4 segment, it is sent as soon as
+    // the muxer wrote it
+    if let SegmentFile::Init(_) = file {
+        let job = Job::playback(Some(client.ip()));
+        let init = match stream_video_segment(&state, &key, &video_path, job) {
+            SegmentBody::Ready(segment) => segment.slice(..init_size(&segment)?),
+            SegmentBody::Streaming(demand) => {
+                // the player asks for the segment itself next, it is finished
+                // for that request to join
+                let wait = demand.clone();
+                tokio::spawn(async move {
+                    let _ = wait.wait().await;
+                });
+                read_init(demand.reader().await?).await?
+            }
+        };
+        state.metrics.add_segment_bytes(format, init.len());
+        let mut res = init.into_response();
+        res.headers_mut()
+            .insert(header::CONTENT_TYPE, HeaderValue::from_static("video/mp4"));
+        return Ok(res);
+    }
+
+    state
+        .prefetcher
+        .on_segment_request(&state, &key, &video_path, client.ip());
+    let job = Job::playback(Some(client.ip()));
+    let segment = stream_video_segment(&state, &key, &video_path, job);
+
+    segment_response(segment, format, state.metrics.clone()).await
+}
+
+// a segment still being produced is sent with chunked transfer as it is muxed
+async fn segment_response(
+    segment: SegmentBody,
+    format: Format,
+    metrics: Arc<Metrics>,
+) -> Result<Response, AppError> {
+    let mut res = match (segment, format) {
+        (SegmentBody::Ready(segment), Format::MpegTs) => {
+            metrics.add_segment_bytes(format, segment.len());
+            segment.into_response()
+        }
+        (SegmentBody::Ready(segment), Format::Fmp4) => {
+            let offset = media_offset(&segment)?;
+            metrics.add_segment_bytes(format, segment.len() - offset);
+            segment.slice(offset..).into_response()
+        }
+        (SegmentBody::Streaming(demand), Format::MpegTs) => {
+            let chunks = demand.reader().await?;
+            Body::from_stream(count_bytes(chunks, format, metrics)).into_response()
+        }
+        (SegmentBody::Streaming(demand), Format::Fmp4) => {
+            let chunks = skip_init(demand.reader().await?);
+            Body::from_stream(count_bytes(chunks, format, metrics)).into_response()
+        }
+    };
+    let content_type = match format {
+        Format::MpegTs => "video/MP2T",
+        Format::Fmp4 => "video/iso.segment",
+    };
     res.headers_mut()
-        .insert(header::CONTENT_TYPE, HeaderValue::from_static("video/MP2T"));
+        .insert(header::CONTENT_TYPE, HeaderValue::from_static(content_type));
     Ok(res)
 }
 
+// chunks are counted as they are handed to the body
+fn count_bytes(
+    chunks: impl Stream<Item = Result<Bytes, AppError>>,
+    format: Format,
+    metrics: Arc<Metrics>,
+) -> impl Stream<Item = Result<Bytes, AppError>> {
+    chunks.map(move |chunk| {
+        if let Ok(chunk) = &chunk {
+            metrics.add_segment_bytes(format, chunk.len());
+        }
+        chunk
+    })
+}
+
+fn media_offset(segment: &[u8]) -> Result<usize, AppError> {
+    haema_ff_sys::media_offset(segment).ok_or_else(no_moof)
+}
+
+fn init_size(segment: &[u8]) -> Result<usize, AppError> {
+    haema_ff_sys::init_size(segment).ok_or_else(no_moov)
+}
+
+fn no_moof() -> AppError {
+    AppError::Error("fmp4 segment without a moof box".into())
+}
+
+fn no_moov() -> AppError {
+    AppError::Error("fmp4 segment without a moov box".into())
+}
+
+// reads the chunks of a fmp4 segment up to the end of its init segment
+async fn read_init(chunks: impl Stream<Item = Result<Bytes, AppError>>) -> Result<Bytes, AppError> {
+    let mut chunks = std::pin::pin!(chunks);
+    let mut head = Vec::new();
+    while let Some(chunk) = chunks.next().await {
+        head.extend_from_slice(&chunk?);
+        if let Some(size) = haema_ff_sys::init_size(&head) {
+            return Ok(Bytes::from(head).slice(..size));
+        }
+    }
+    Err(no_moov())
+}
+
+// fmp4 segments are produced with their init segment in front, the chunks
+// are held back until the first moof shows up. a segment that ends before
+// one is an error instead of an empty body
+fn skip_init(
+    chunks: impl Stream<Item = Result<Bytes, AppError>>,
+) -> impl Stream<Item = Result<Bytes, AppError>> {
+    let mut head = Some(Vec::new());
+    chunks
+        .map(Some)
+        .chain(tokio_stream::once(None))
+        .filter_map(move |chunk| {
+            let Some(buf) = head.as_mut() else {
+                return chunk;
+            };
+            let chunk = match chunk {
+                Some(Ok(chunk)) => chunk,
+                Some(Err(err)) => {
+                    head = None;
+                    return Some(Err(err));
+                }
+                None => return Some(Err(no_moof())),
+            };
+            buf.extend_from_slice(&chunk);
+            let offset = haema_ff_sys::media_offset(buf)?;
+            let buf = Bytes::from(head.take().unwrap());
+            Some(Ok(buf.slice(offset..)))
+        })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn mp4_box(kind: &[u8; 4], payload: usize) -> Vec<u8> {
+        let mut buf = ((8 + payload) as u32).to_be_bytes().to_vec();
+        buf.extend_from_slice(kind);
+        buf.resize(8 + payload, 0);
+        buf
+    }
+
+    // the segment in chunks of `chunk_size`
+    fn chunks(segment: &[u8], chunk_size: usize) -> impl Stream<Item = Result<Bytes, AppError>> {
+        let chunks: Vec<_> = segment
+            .chunks(chunk_size)
+            .map(|chunk| Ok(Bytes::copy_from_slice(chunk)))
+            .collect();
+        tokio_stream::iter(chunks)
+    }
+
+    async fn body(
+        chunks: impl Stream<Item = Result<Bytes, AppError>>,
+    ) -> Result<Vec<u8>, AppError> {
+        let mut chunks = std::pin::pin!(chunks);
+        let mut body = Vec::new();
+        while let Some(chunk) = chunks.next().await {
+            body.extend_from_slice(&chunk?);
+        }
+        Ok(body)
+    }
+
+    #[tokio::test]
+    async fn test_init_and_media() {
+        let init = [mp4_box(b"ftyp", 16), mp4_box(b"moov", 100)].concat();
+        let media = [mp4_box(b"moof", 20), mp4_box(b"mdat", 50)].concat();
+        let segment = [init.clone(), media.clone()].concat();
+        for chunk_size in [1, 7, segment.len()] {
+            let head = read_init(chunks(&segment, chunk_size)).await.unwrap();
+            assert_eq!(head, init);
+            let tail = body(skip_init(chunks(&segment, chunk_size))).await.unwrap();
+            assert_eq!(tail, media);
+        }
+    }
+
+    #[tokio::test]
+    async fn test_truncated_segment() {
+        let init = [mp4_box(b"ftyp", 16), mp4_box(b"moov", 100)].concat();
+        assert!(read_init(chunks(&init[..init.len() - 1], 7)).await.is_err());
+        assert!(body(skip_init(chunks(&init, 7))).await.is_err());
+        assert!(body(skip_init(chunks(&[], 7))).await.is_err());
+    }
+}
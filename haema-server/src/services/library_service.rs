@@ -0,0 +1,166 @@
+use std::{collections::HashSet, path::PathBuf, sync::Arc, time::Duration};
+
+use notify::{Event, EventKind, RecommendedWatcher, RecursiveMode, Watcher};
+use tokio::{
+    sync::mpsc,
+    time::{self, Instant},
+};
+
+use crate::{
+    error::AppError,
+    library::{IndexStats, Library},
+    state::AppState,
+};
+
+// a batch of changes is applied once the library was quiet for DEBOUNCE, a
+// file that keeps changing is picked up after MAX_DEBOUNCE at the latest
+const DEBOUNCE: Duration = Duration::from_secs(2);
+const MAX_DEBOUNCE: Duration = Duration::from_secs(30);
+
+/// changed paths collected between two updates
+#[derive(Default)]
+struct Batch {
+    paths: HashSet<PathBuf>,
+    rescan: bool,
+}
+
+impl Batch {
+    fn add(&mut self, event: notify::Result<Event>) {
+        match event {
+            Ok(event) if event.need_rescan() => self.rescan = true,
+            Ok(Event {
+                kind: EventKind::Access(_),
+                ..
+            }) => {}
+            Ok(event) => self.paths.extend(event.paths),
+            Err(err) => {
+                println!("library watcher error: {err}");
+                self.rescan = true;
+            }
+        }
+    }
+}
+
+/// indexes the library and keeps it up to date with the files under its
+/// root (inotify on linux)
+///
+/// - the watcher is up before the full index so nothing changed during it is
+/// missed
+/// - only the changed files are probed and indexed, their probes, keyframe
+/// indexes and cached segments are dropped
+pub fn spawn_library_tasks(state: AppState) {
+    let (tx, rx) = mpsc::unbounded_channel();
+    let watcher = notify::recommended_watcher(move |event: notify::Result<Event>| {
+        let _ = tx.send(event);
+    })
+    .and_then(|mut watcher: RecommendedWatcher| {
+        watcher.watch(state.library.root(), RecursiveMode::Recursive)?;
+        Ok(watcher)
+    });
+    let watcher = match watcher {
+        Ok(watcher) => Some(watcher),
+        Err(err) => {
+            println!("not watching the library for changes: {err}");
+            None
+        }
+    };
+
+    tokio::spawn(async move {
+        apply(&state, None).await;
+        // events stop when the watcher is dropped
+        if let Some(_watcher) = watcher {
+            watch(&state, rx).await;
+        }
+    });
+}
+
+async fn watch(state: &AppState, mut rx: mpsc::UnboundedReceiver<notify::Result<Event>>) {
+    while let Some(event) = rx.recv().await {
+        let mut batch = Batch::default();
+        batch.add(event);
+        let deadline = Instant::now() + MAX_DEBOUNCE;
+        loop {
+            let quiet = (Instant::now() + DEBOUNCE).min(deadline);
+            match time::timeout_at(quiet, rx.recv()).await {
+                Ok(Some(event)) => batch.add(event),
+                Ok(None) | Err(_) => break,
+            }
+        }
+
+        if batch.rescan {
+            apply(state, None).await;
+        } else if !batch.paths.is_empty() {
+            apply(state, Some(batch.paths.into_iter().collect())).await;
+        }
+    }
+}
+
+// indexes `paths` or the whole library when it is `None`, then drops what
+// was derived from the videos that changed
+async fn apply(state: &AppState, paths: Option<Vec<PathBuf>>) {
+    let full = paths.is_none();
+    let library = state.library.clone();
+    let started = Instant::now();
+    let result = tokio::task::spawn_blocking(move || update(&library, paths))
+        .await
+        .map_err(|err| AppError::Error(err.to_string()))
+        .and_then(|result| result);
+
+    let stats = match result {
+        Ok(Some(stats)) => stats,
+        Ok(None) => return,
+        Err(err) => {
+            println!("failed to index library: {err}");
+            return;
+        }
+    };
+    if !full && stats.changed.is_empty() && stats.failed == 0 {
+        return;
+    }
+    println!(
+        "indexed {} videos under {} in {:.1?}: {} probed, {} failed, {} removed",
+        stats.files,
+        state.library.root().display(),
+        started.elapsed(),
+        stats.probed,
+        stats.failed,
+        stats.removed
+    );
+
+    if stats.changed.is_empty() {
+        return;
+    }
+    // the first index of a library changes every video, everything below
+    // goes over the caches once for all of them
+    for rel_path in &stats.changed {
+        let video_path = state.library.root().join(rel_path);
+        state.probe_cache.remove(&video_path.to_string_lossy());
+    }
+    let video_ids: HashSet<String> = stats
+        .changed
+        .iter()
+        .map(|rel_path| Library::video_id(rel_path))
+        .collect();
+    if let Err(err) = state.keyframe_store.remove(&video_ids) {
+        println!("failed to remove keyframe indexes: {err}");
+    }
+    state.segment_cache.invalidate(&video_ids).await;
+}
+
+// `None` when none of `paths` can matter to the library
+fn update(
+    library: &Arc<Library>,
+    paths: Option<Vec<PathBuf>>,
+) -> Result<Option<IndexStats>, AppError> {
+    let Some(paths) = paths else {
+        return library.index().map(Some);
+    };
+    let paths: Vec<PathBuf> = paths
+        .into_iter()
+        .filter(|path| library.is_relevant(path))
+        .collect();
+    if paths.is_empty() {
+        return Ok(None);
+    }
+    library.update(&paths).map(Some)
+}
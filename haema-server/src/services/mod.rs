@@ -1,8 +1,28 @@
+pub mod library_service;
+pub mod prefetch_service;
 pub mod video_service;
 
+pub use library_service::spawn_library_tasks;
+pub use prefetch_service::Prefetcher;
 pub use video_service::{
-    get_video_duration, 
+    get_source_mtime,
+    get_segment_layout,
     compute_video_segment, 
+    compute_video_renditions,
+    open_video_session,
+    next_session_segment,
+    needs_transcode,
+    is_copy,
+    has_fast_start,
+    stream_layout,
+    segment_encoding,
+    segment_format,
+    SegmentFile,
+    remux_video_segment,
+    load_video_segment,
+    stream_video_segment,
     parse_segment_filename, 
-    create_hls_media_playlist
+    create_hls_media_playlist,
+    create_hls_master_playlist,
+    rendition_ladder
 };
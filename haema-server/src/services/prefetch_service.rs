@@ -0,0 +1,403 @@
+use std::{
+    collections::HashMap,
+    net::IpAddr,
+    sync::{Arc, Mutex},
+    time::{Duration, Instant},
+};
+
+use haema_ff_sys::{ProbeInfo, TranscodeSession};
+use tokio::{sync::watch, task::AbortHandle, time};
+
+use crate::{
+    cache::SegmentKey,
+    domain::{SegmentLayout, StreamType},
+    pool::Job,
+    services::video_service::{
+        get_segment_layout, load_video_segment, needs_transcode, next_session_segment,
+        open_video_session, stream_layout,
+    },
+    state::AppState,
+};
+
+// a session with no requests for this long is considered abandoned
+const SESSION_IDLE_TIMEOUT: Duration = Duration::from_secs(30);
+const SWEEP_INTERVAL: Duration = Duration::from_secs(10);
+
+#[derive(Clone, PartialEq, Eq, Hash)]
+struct SessionKey {
+    video_id: String,
+    stream_type: StreamType,
+    client: IpAddr,
+}
+
+struct Session {
+    last_idx: usize,
+    last_seen: Instant,
+    // segment the client is playing, the prefetch task stays `window` ahead
+    playhead: Option<watch::Sender<usize>>,
+    task: Option<AbortHandle>,
+}
+
+impl Session {
+    fn new() -> Self {
+        // usize::MAX makes a request for segment 0 count as sequential
+        Self {
+            last_idx: usize::MAX,
+            last_seen: Instant::now(),
+            playhead: None,
+            task: None,
+        }
+    }
+
+    // moves the window to a request for segment `idx`, true when a prefetch
+    // task has to be started for it
+    fn request(&mut self, idx: usize) -> bool {
+        // a retry of the last segment doesn't break the sequence
+        let sequential = self.last_idx == idx || self.last_idx.wrapping_add(1) == idx;
+        self.last_idx = idx;
+        self.last_seen = Instant::now();
+
+        if !sequential {
+            self.cancel();
+            return false;
+        }
+        if self.is_prefetching() {
+            if let Some(playhead) = &self.playhead {
+                playhead.send_replace(idx);
+            }
+            return false;
+        }
+        true
+    }
+
+    fn cancel(&mut self) {
+        self.playhead = None;
+        if let Some(task) = self.task.take() {
+            task.abort();
+        }
+    }
+
+    fn is_prefetching(&self) -> bool {
+        self.task.as_ref().is_some_and(|task| !task.is_finished())
+    }
+}
+
+/// transcodes the next `window` segments ahead of clients playing a stream
+/// in order
+///
+/// - prefetching starts when a client requests the first segment or on its
+/// second sequential request
+/// - a request out of order (seek) or `SESSION_IDLE_TIMEOUT` without requests
+/// cancels the window
+/// - prefetch jobs wait for a transcoder behind every segment a player is
+/// waiting for, the segment the client gets to first goes first
+/// - transcoded streams are prefetched by one session that keeps its decoder
+/// and encoder running from one segment into the next
+pub struct Prefetcher {
+    window: usize,
+    sessions: Mutex<HashMap<SessionKey, Session>>,
+}
+
+impl Prefetcher {
+    pub fn new(window: usize) -> Self {
+        Self {
+            window,
+            sessions: Mutex::new(HashMap::new()),
+        }
+    }
+
+    pub fn on_segment_request(
+        &self,
+        state: &AppState,
+        key: &SegmentKey,
+        video_path: &str,
+        client: IpAddr,
+    ) {
+        if self.window == 0 {
+            return;
+        }
+
+        let session_key = SessionKey {
+            video_id: key.video_id.clone(),
+            stream_type: key.stream_type.clone(),
+            client,
+        };
+        let idx = key.segment_idx;
+        let mut sessions = self.sessions.lock().unwrap();
+        let session = sessions.entry(session_key).or_insert_with(Session::new);
+        if !session.request(idx) {
+            return;
+        }
+
+        let (playhead_tx, playhead_rx) = watch::channel(idx);
+        let task = tokio::spawn(prefetch(
+            state.clone(),
+            key.clone(),
+            video_path.to_owned(),
+            client,
+            self.window,
+            playhead_rx,
+        ));
+        session.playhead = Some(playhead_tx);
+        session.task = Some(task.abort_handle());
+    }
+
+    fn sweep(&self) {
+        let now = Instant::now();
+        self.sessions.lock().unwrap().retain(|_, session| {
+            let idle = now.duration_since(session.last_seen) > SESSION_IDLE_TIMEOUT;
+            if idle {
+                session.cancel();
+            }
+            !idle
+        });
+    }
+
+    pub fn spawn_sweeper(self: &Arc<Self>) {
+        let prefetcher = Arc::downgrade(self);
+        tokio::spawn(async move {
+            let mut interval = time::interval(SWEEP_INTERVAL);
+            loop {
+                interval.tick().await;
+                match prefetcher.upgrade() {
+                    Some(prefetcher) => prefetcher.sweep(),
+                    None => return,
+                }
+            }
+        });
+    }
+}
+
+async fn prefetch(
+    state: AppState,
+    mut key: SegmentKey,
+    video_path: String,
+    client: IpAddr,
+    window: usize,
+    mut playhead: watch::Receiver<usize>,
+) {
+    let Ok(video_layout) = get_segment_layout(&state, &key.video_id, &video_path, key.mtime).await
+    else {
+        return;
+    };
+    let Ok(source) = state.probe_cache.get(&video_path).await else {
+        return;
+    };
+    let layout =
+        stream_layout(&video_layout, key.fast_start, &key.stream_type, &source).into_owned();
+    if needs_transcode(&key.stream_type, &source) {
+        return prefetch_session(
+            state, key, video_path, client, layout, source, window, playhead,
+        )
+        .await;
+    }
+
+    let last_idx = layout.len() - 1;
+    let mut next = key.segment_idx + 1;
+    while let Some(idx) = next_in_window(&mut playhead, next, window, last_idx).await {
+        key.segment_idx = idx;
+        let job = prefetch_job(client, &layout, *playhead.borrow(), idx);
+        if let Err(err) = load_video_segment(&state, &key, &video_path, job).await {
+            println!("failed to prefetch segment {}: {err}", key.rel_path());
+            return;
+        }
+        next = idx + 1;
+    }
+}
+
+/// segments come out of one session, it is reopened with a seek only when the
+/// segment wanted next is not the one it cuts next. the short segments of a
+/// fast start are encoded for latency one by one, the session starts after
+/// them
+async fn prefetch_session(
+    state: AppState,
+    mut key: SegmentKey,
+    video_path: String,
+    client: IpAddr,
+    layout: SegmentLayout,
+    source: Arc<ProbeInfo>,
+    window: usize,
+    mut playhead: watch::Receiver<usize>,
+) {
+    let last_idx = layout.len() - 1;
+    let mut next = key.segment_idx + 1;
+    // the session and the index of the segment it cuts next
+    let mut session: Option<(TranscodeSession, usize)> = None;
+
+    while let Some(idx) = next_in_window(&mut playhead, next, window, last_idx).await {
+        next = idx + 1;
+
+        key.segment_idx = idx;
+        if layout.is_fast_start(idx) {
+            let job = prefetch_job(client, &layout, *playhead.borrow(), idx);
+            if let Err(err) = load_video_segment(&state, &key, &video_path, job).await {
+                println!("failed to prefetch segment {}: {err}", key.rel_path());
+                return;
+            }
+            continue;
+        }
+        // cached or already requested by a player, the session skips it
+        let Some(claim) = state.segment_cache.claim(&key) else {
+            continue;
+        };
+        // a player asking for the segment meanwhile waits on the claim
+        let job = prefetch_job(client, &layout, *playhead.borrow(), idx)
+            .promoted_by(claim.stream().urgent());
+
+        let running = match session.take() {
+            Some((running, at)) if at == idx => Ok(running),
+            _ => {
+                let hmff = state.hmff_pool.get(job.clone()).await;
+                open_video_session(
+                    hmff,
+                    &video_path,
+                    &key.stream_type,
+                    key.format,
+                    &source,
+                    &layout,
+                    idx,
+                )
+                .await
+            }
+        };
+        let result = match running {
+            Ok(mut running) => {
+                // a player that waited on the segment and went away stops it
+                running.set_interrupt(claim.stream().interrupt());
+                next_session_segment(state.hmff_pool.get(job).await, running).await
+            }
+            Err(err) => Err(err),
+        };
+        match result {
+            Ok((running, segment)) => {
+                claim.complete(Ok(segment));
+                session = Some((running, idx + 1));
+            }
+            Err(err) => {
+                println!("failed to prefetch segment {}: {err}", key.rel_path());
+                claim.complete(Err(err));
+                return;
+            }
+        }
+    }
+}
+
+// the first segment from `next` on that is inside the window, waits for the
+// client to move on and is `None` once the session is cancelled
+async fn next_in_window(
+    playhead: &mut watch::Receiver<usize>,
+    mut next: usize,
+    window: usize,
+    last_idx: usize,
+) -> Option<usize> {
+    loop {
+        let head = *playhead.borrow_and_update();
+        next = next.max(head + 1);
+        if next <= head + window && next <= last_idx {
+            return Some(next);
+        }
+        playhead.changed().await.ok()?;
+    }
+}
+
+// the deadline is when the client playing segment `head` gets to `idx`
+fn prefetch_job(client: IpAddr, layout: &SegmentLayout, head: usize, idx: usize) -> Job {
+    let ahead = match (layout.segment(head), layout.segment(idx)) {
+        (Some(head), Some(segment)) => (segment.start - head.start).max(0.0),
+        _ => 0.0,
+    };
+    Job::prefetch(
+        Some(client),
+        Instant::now() + Duration::from_secs_f64(ahead),
+    )
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tokio::task::{self, JoinHandle};
+
+    // stands in for the prefetch task of `session`, runs until it is aborted
+    fn start(session: &mut Session, idx: usize) -> (watch::Receiver<usize>, JoinHandle<()>) {
+        let (playhead_tx, playhead_rx) = watch::channel(idx);
+        let task = tokio::spawn(std::future::pending());
+        session.playhead = Some(playhead_tx);
+        session.task = Some(task.abort_handle());
+        (playhead_rx, task)
+    }
+
+    #[tokio::test]
+    async fn test_sequential() {
+        let mut session = Session::new();
+        // the first segment starts prefetching right away
+        assert!(session.request(0));
+        let (mut playhead, task) = start(&mut session, 0);
+
+        // a retry moves nothing, the next segment moves the window
+        assert!(!session.request(0));
+        assert_eq!(*playhead.borrow_and_update(), 0);
+        assert!(!session.request(1));
+        assert_eq!(*playhead.borrow_and_update(), 1);
+        assert!(session.is_prefetching());
+
+        // once the task is done the next request starts another one
+        task.abort();
+        let _ = task.await;
+        assert!(!session.is_prefetching());
+        assert!(session.request(2));
+    }
+
+    #[tokio::test]
+    async fn test_seek() {
+        let mut session = Session::new();
+        assert!(session.request(0));
+        let (mut playhead, task) = start(&mut session, 0);
+
+        // a seek cancels the window
+        assert!(!session.request(5));
+        assert!(task.await.unwrap_err().is_cancelled());
+        assert!(playhead.changed().await.is_err());
+        assert!(!session.is_prefetching());
+
+        // and the second sequential request after it starts it again
+        assert!(session.request(6));
+
+        // a stream joined in the middle starts on its second request too
+        let mut session = Session::new();
+        assert!(!session.request(3));
+        assert!(session.request(4));
+    }
+
+    #[tokio::test]
+    async fn test_next_in_window() {
+        let (playhead_tx, mut playhead) = watch::channel(0);
+        assert_eq!(next_in_window(&mut playhead, 1, 3, 10).await, Some(1));
+        assert_eq!(next_in_window(&mut playhead, 3, 3, 10).await, Some(3));
+        // a playhead past `next` skips the segments behind it
+        playhead_tx.send_replace(5);
+        assert_eq!(next_in_window(&mut playhead, 2, 3, 10).await, Some(6));
+
+        // waits for the playhead once the window is full
+        let waiter = tokio::spawn(async move {
+            let next = next_in_window(&mut playhead, 9, 3, 10).await;
+            (next, playhead)
+        });
+        task::yield_now().await;
+        assert!(!waiter.is_finished());
+        playhead_tx.send_replace(6);
+        let (next, mut playhead) = waiter.await.unwrap();
+        assert_eq!(next, Some(9));
+
+        // the window ends at the last segment
+        playhead_tx.send_replace(7);
+        assert_eq!(next_in_window(&mut playhead, 10, 3, 10).await, Some(10));
+        let waiter = tokio::spawn(async move { next_in_window(&mut playhead, 11, 3, 10).await });
+        playhead_tx.send_replace(9);
+        task::yield_now().await;
+        assert!(!waiter.is_finished());
+
+        // and is closed when the session is cancelled
+        drop(playhead_tx);
+        assert_eq!(waiter.await.unwrap(), None);
+    }
+}
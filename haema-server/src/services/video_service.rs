@@ -1,30 +1,91 @@
 use crate::{
-    domain::{HMff, StreamType},
+    cache::{SegmentBody, SegmentKey, SegmentStream, segment_extension},
+    config::Config,
+    domain::{
+        AudioCodec, FAST_START_DURATIONS, HMff, Resolution, SEGMENT_DURATION, SegmentLayout,
+        SegmentRange, StreamType, VideoCodec,
+    },
     error::AppError,
-    pool::PoolGuard,
+    pool::{Job, JobClass, PoolGuard},
+    state::AppState,
+};
+use axum::body::Bytes;
+use haema_ff_sys::{
+    self, AVERROR_EXIT, Backend, EncoderOptions, EncoderProfile, Format, Interrupt, ProbeInfo,
+    Rendition, TranscodeSession, TranscodeStats,
 };
-use haema_ff_sys;
 use regex::Regex;
-use tokio::task;
+use std::{borrow::Cow, cmp::Reverse, fs, sync::Arc, time::UNIX_EPOCH};
+use tokio::{sync::OwnedSemaphorePermit, task};
+
+// variants of the master playlist, h264 in mpegts plays everywhere
+const MASTER_VIDEO_CODEC: VideoCodec = VideoCodec::H264;
+const MASTER_AUDIO_CODEC: AudioCodec = AudioCodec::AAC;
+// BANDWIDTH of a variant is guessed from its size and frame rate since
+// nothing is encoded when the playlist is served
+const BITS_PER_PIXEL: f64 = 0.1;
+// used when the source's frame rate is unknown
+const ASSUMED_FRAME_RATE: f64 = 30.0;
+const AUDIO_BANDWIDTH: u64 = 128_000;
+// CODECS of a transcoded variant, h264 high profile at the lowest level that
+// fits its size and frame rate, which is what the encoders pick
+const MASTER_CODECS_PROFILE: &str = "avc1.6400";
+// h264 levels as (level_idc, max macroblocks per second, max frame size in
+// macroblocks)
+const H264_LEVELS: [(u32, f64, u64); 9] = [
+    (30, 40_500.0, 1_620),
+    (31, 108_000.0, 3_600),
+    (32, 216_000.0, 5_120),
+    (40, 245_760.0, 8_192),
+    (42, 522_240.0, 8_704),
+    (50, 589_824.0, 22_080),
+    (51, 983_040.0, 36_864),
+    (52, 2_073_600.0, 36_864),
+    (60, 4_177_920.0, 139_264),
+];
 
-pub fn parse_segment_filename(segment_filename: &String) -> Result<usize, AppError> {
-    let re = Regex::new(r"(\d+)\.ts$").unwrap();
+/// what a segment url of a media playlist asks for
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum SegmentFile {
+    /// {idx}.ts or {idx}.m4s
+    Media(usize, Format),
+    /// init-{idx}.mp4, the init segment in front of the fmp4 segment idx
+    Init(usize),
+}
+
+pub fn parse_segment_filename(segment_filename: &String) -> Result<SegmentFile, AppError> {
+    let re = Regex::new(r"(init-)?(\d+)\.(ts|m4s|mp4)$").unwrap();
     let caps = re
         .captures(&segment_filename)
         .ok_or(AppError::InvalidSegmentName)?;
-    let idx: usize = caps[1].parse().map_err(|_| AppError::InvalidSegmentName)?;
-    Ok(idx)
+    let idx: usize = caps[2].parse().map_err(|_| AppError::InvalidSegmentName)?;
+    match (caps.get(1).is_some(), &caps[3]) {
+        (false, "ts") => Ok(SegmentFile::Media(idx, Format::MpegTs)),
+        (false, "m4s") => Ok(SegmentFile::Media(idx, Format::Fmp4)),
+        (true, "mp4") => Ok(SegmentFile::Init(idx)),
+        _ => Err(AppError::InvalidSegmentName),
+    }
 }
 
-pub fn create_hls_media_playlist(video_duration: f64, segment_duration: f64) -> String {
-    let mut durations: Vec<f64> = vec![];
-    let mut cur: f64 = 0.0;
-
-    while cur + segment_duration < video_duration {
-        durations.push(segment_duration);
-        cur += segment_duration;
+/// container of the segments in the media playlists of `stream_type`
+pub fn segment_format(config: &Config, stream_type: &StreamType, source: &ProbeInfo) -> Format {
+    if config.fmp4 || stream_type.video_codec.needs_fmp4(&source.video_codec) {
+        Format::Fmp4
+    } else {
+        Format::MpegTs
     }
-    durations.push(video_duration - cur);
+}
+
+/// fmp4 segments that are copied and the ones that are transcoded with
+/// another profile have different parameter sets, each run of them gets its
+/// own init segment after a discontinuity. `encoding` is what segment idx is
+/// transcoded with, see `segment_encoding`
+pub fn create_hls_media_playlist(
+    layout: &SegmentLayout,
+    format: Format,
+    encoding: impl Fn(usize, &SegmentRange) -> Option<EncoderProfile>,
+) -> String {
+    let durations: Vec<f64> = layout.segments().map(|segment| segment.duration).collect();
 
     let target_duration: u32 = durations
         .iter()
@@ -37,48 +98,706 @@ pub fn create_hls_media_playlist(video_duration: f64, segment_duration: f64) ->
     playlist += "#EXTM3U\n";
     playlist += "#EXT-X-PLAYLIST-TYPE:VOD\n";
     playlist += format!("#EXT-X-TARGETDURATION:{}\n", target_duration).as_str();
-    playlist += "#EXT-X-VERSION:4\n";
+    // EXT-X-MAP of fmp4 segments needs version 6
+    let version = match format {
+        Format::MpegTs => 4,
+        Format::Fmp4 => 7,
+    };
+    playlist += format!("#EXT-X-VERSION:{}\n", version).as_str();
     playlist += "#EXT-X-MEDIA-SEQUENCE:0\n";
-    durations.iter().enumerate().for_each(|(idx, duration)| {
-        // playlist += "#EXT-X-DISCONTINUITY\n";
-        playlist += format!("#EXTINF:{}\n", duration).as_str();
-        playlist += format!("{}.ts\n", idx).as_str();
+    let mut init_encoding = None;
+    layout.segments().enumerate().for_each(|(idx, segment)| {
+        if format == Format::Fmp4 {
+            let encoding = encoding(idx, &segment);
+            if init_encoding != Some(encoding) {
+                if init_encoding.is_some() {
+                    playlist += "#EXT-X-DISCONTINUITY\n";
+                }
+                playlist += format!("#EXT-X-MAP:URI=\"init-{}.mp4\"\n", idx).as_str();
+                init_encoding = Some(encoding);
+            }
+        }
+        playlist += format!("#EXTINF:{}\n", segment.duration).as_str();
+        playlist += format!("{}.{}\n", idx, segment_extension(format)).as_str();
     });
     playlist += "#EXT-X-ENDLIST\n";
     playlist
 }
 
-pub fn get_video_duration(video_path: &str) -> Result<f64, AppError> {
-    let video_path = video_path.to_owned();
-    Ok(haema_ff_sys::get_video_duration(&video_path))
+/// sizes offered for a `source_height` video, the source itself followed by
+/// every configured height below it from large to small
+pub fn rendition_ladder(renditions: &[Resolution], source_height: u32) -> Vec<Resolution> {
+    let mut heights: Vec<u32> = renditions
+        .iter()
+        .filter_map(|resolution| resolution.scale_height(source_height))
+        .collect();
+    heights.sort_by_key(|height| Reverse(*height));
+    heights.dedup();
+
+    let mut ladder = vec![Resolution::Source];
+    ladder.extend(heights.into_iter().map(Resolution::Height));
+    ladder
 }
 
+/// every variant is encoded with `profile`
+pub fn create_hls_master_playlist(
+    ladder: &[Resolution],
+    source: &ProbeInfo,
+    profile: EncoderProfile,
+) -> String {
+    let mut playlist = String::from("");
+    playlist += "#EXTM3U\n";
+    playlist += "#EXT-X-VERSION:4\n";
+    for resolution in ladder {
+        let (width, height) = resolution.output_size(source.width, source.height);
+        let frame_rate = match source.frame_rate {
+            rate if rate > 0.0 => rate,
+            _ => ASSUMED_FRAME_RATE,
+        };
+        let bandwidth = (width as f64 * height as f64 * frame_rate * BITS_PER_PIXEL) as u64
+            + AUDIO_BANDWIDTH;
+        let stream_type = StreamType {
+            resolution: *resolution,
+            video_codec: MASTER_VIDEO_CODEC,
+            audio_codec: MASTER_AUDIO_CODEC,
+            profile,
+        };
+        playlist += format!(
+            "#EXT-X-STREAM-INF:BANDWIDTH={},RESOLUTION={}x{}",
+            bandwidth, width, height
+        )
+        .as_str();
+        if let Some(codecs) = variant_codecs(&stream_type, source, width, height, frame_rate) {
+            playlist += format!(",CODECS=\"{}\"", codecs).as_str();
+        }
+        playlist += "\n";
+        playlist += format!("{}/stream.m3u8\n", stream_type).as_str();
+    }
+    playlist
+}
+
+// CODECS of a variant, left out unless every codec of it is known: a copied
+// video keeps the source's profile and level, which the probe doesn't report.
+// audio is always copied from the source
+fn variant_codecs(
+    stream_type: &StreamType,
+    source: &ProbeInfo,
+    width: u32,
+    height: u32,
+    frame_rate: f64,
+) -> Option<String> {
+    if !needs_transcode(stream_type, source) {
+        return None;
+    }
+    let video = h264_codecs(width, height, frame_rate);
+    match &source.audio_codec {
+        None => Some(video),
+        Some(audio) => audio_codecs(audio).map(|audio| format!("{video},{audio}")),
+    }
+}
+
+// codecs string of an ffmpeg audio codec name
+fn audio_codecs(codec: &str) -> Option<&'static str> {
+    match codec {
+        // the probe has no profile, lc is by far the most common
+        "aac" => Some("mp4a.40.2"),
+        "mp3" => Some("mp4a.40.34"),
+        "ac3" => Some("ac-3"),
+        "eac3" => Some("ec-3"),
+        "opus" => Some("Opus"),
+        "flac" => Some("fLaC"),
+        _ => None,
+    }
+}
+
+// avc1 codecs string of a `width` x `height` variant at `frame_rate`
+fn h264_codecs(width: u32, height: u32, frame_rate: f64) -> String {
+    let frame_size = (width as u64).div_ceil(16) * (height as u64).div_ceil(16);
+    let level = H264_LEVELS
+        .iter()
+        .find(|(_, max_rate, max_size)| {
+            frame_size <= *max_size && frame_size as f64 * frame_rate <= *max_rate
+        })
+        .map_or(H264_LEVELS[H264_LEVELS.len() - 1].0, |(level, _, _)| *level);
+    format!("{MASTER_CODECS_PROFILE}{level:02x}")
+}
+
+/// modification time of the source in seconds, part of every cache key
+pub fn get_source_mtime(video_path: &str) -> Result<u64, AppError> {
+    let modified = fs::metadata(video_path)
+        .and_then(|meta| meta.modified())
+        .map_err(|_| AppError::VideoNotFound(video_path.to_string()))?;
+    Ok(modified
+        .duration_since(UNIX_EPOCH)
+        .map(|d| d.as_secs())
+        .unwrap_or(0))
+}
+
+/// keyframe aligned layout of the video, the keyframe index is built on first
+/// use. a source without one fails the request instead of falling back to
+/// fixed slices, segment keys don't tell the two layouts apart
+pub async fn get_segment_layout(
+    state: &AppState,
+    video_id: &str,
+    video_path: &str,
+    mtime: u64,
+) -> Result<SegmentLayout, AppError> {
+    let video_duration = state.probe_cache.get(video_path).await?.duration;
+    let index = state
+        .keyframe_store
+        .open_or_build(video_id, mtime, video_path)
+        .await?;
+
+    task::spawn_blocking(move || {
+        SegmentLayout::from_keyframes(index.iter(), video_duration, SEGMENT_DURATION)
+    })
+    .await
+    .map_err(|err| AppError::Error(err.to_string()))
+}
+
+/// whether the segments of `stream_type` start with the short
+/// `FAST_START_DURATIONS` ones when `fast_start` is on. a stream whose first
+/// segment of `layout` is copied has it at once and keeps the regular layout,
+/// so does a video whose first keyframe is late
+pub fn has_fast_start(
+    fast_start: bool,
+    layout: &SegmentLayout,
+    stream_type: &StreamType,
+    source: &ProbeInfo,
+) -> bool {
+    fast_start
+        && layout.can_fast_start()
+        && layout
+            .segment(0)
+            .is_some_and(|segment| !is_copy(&segment, stream_type, source))
+}
+
+/// the video's `layout` as the segments of `stream_type` are indexed in
+pub fn stream_layout<'a>(
+    layout: &'a SegmentLayout,
+    fast_start: bool,
+    stream_type: &StreamType,
+    source: &ProbeInfo,
+) -> Cow<'a, SegmentLayout> {
+    if has_fast_start(fast_start, layout, stream_type, source) {
+        Cow::Owned(layout.with_fast_start(&FAST_START_DURATIONS))
+    } else {
+        Cow::Borrowed(layout)
+    }
+}
+
+/// profile segment `idx` of the stream's `layout` is transcoded with, `None`
+/// when it is copied. the short segments of a fast start are always encoded
+/// for latency since a player is waiting to show anything
+pub fn segment_encoding(
+    layout: &SegmentLayout,
+    idx: usize,
+    segment: &SegmentRange,
+    stream_type: &StreamType,
+    source: &ProbeInfo,
+) -> Option<EncoderProfile> {
+    if is_copy(segment, stream_type, source) {
+        None
+    } else if layout.is_fast_start(idx) {
+        Some(EncoderProfile::Latency)
+    } else {
+        Some(stream_type.profile)
+    }
+}
+
+/// transcodes `segment` into `out`, the returned stats time every stage of it.
+/// gives up as soon as `out` is abandoned
 pub async fn compute_video_segment(
     hmff: PoolGuard<HMff>,
     video_path: &str,
     stream_type: StreamType,
-    video_duration: f64,
-    segment_duration: f64,
-    segment_idx: usize,
-) -> Result<Vec<u8>, AppError> {
-    let start: f64 = segment_duration * (segment_idx as f64);
-    let duration: f64 = if start + segment_duration < video_duration {
-        segment_duration
-    } else {
-        video_duration - start
+    profile: EncoderProfile,
+    format: Format,
+    source: &ProbeInfo,
+    segment: SegmentRange,
+    out: Arc<SegmentStream>,
+    streaming: bool,
+) -> Result<TranscodeStats, AppError> {
+    let video_path = video_path.to_owned();
+    let source_codec = source.video_codec.clone();
+    let height = stream_type.resolution.scale_height(source.height).unwrap_or(0);
+    let options = EncoderOptions::profile(profile);
+    let interrupt = out.interrupt();
+
+    task::spawn_blocking(move || {
+        let ctx = hmff.context();
+        let _interrupt = ctx.interrupt_on(&interrupt);
+        let encoder_name = encoder_name(&stream_type.video_codec, &source_codec, ctx.backend());
+        if streaming {
+            ctx.transcode_segment_to_with_stats(
+                &video_path,
+                encoder_name,
+                &options,
+                height,
+                format,
+                segment.start,
+                segment.duration,
+                segment.seek_pos,
+                |chunk| out.push(Bytes::copy_from_slice(chunk)),
+            )
+        } else {
+            ctx.transcode_segment_with_stats(
+                &video_path,
+                encoder_name,
+                &options,
+                height,
+                format,
+                segment.start,
+                segment.duration,
+                segment.seek_pos,
+            )
+            .map(|(buffer, stats)| {
+                out.push(Bytes::from(buffer));
+                stats
+            })
+        }
+    })
+    .await
+    .map_err(|e| AppError::Error(e.to_string()))?
+    .map_err(|err| ff_error("hm_transcode", err))
+}
+
+/// transcodes `segment` once for every height in `heights` (0 keeps the
+/// source size) decoding the source a single time, the outputs are in the
+/// order of `heights`. gives up once `interrupt` is set
+pub async fn compute_video_renditions(
+    hmff: PoolGuard<HMff>,
+    video_path: &str,
+    video_codec: VideoCodec,
+    profile: EncoderProfile,
+    format: Format,
+    source: &ProbeInfo,
+    heights: Vec<u32>,
+    segment: SegmentRange,
+    interrupt: Arc<Interrupt>,
+) -> Result<Vec<Bytes>, AppError> {
+    let video_path = video_path.to_owned();
+    let source_codec = source.video_codec.clone();
+    let options = EncoderOptions::profile(profile);
+
+    task::spawn_blocking(move || {
+        let ctx = hmff.context();
+        let _interrupt = ctx.interrupt_on(&interrupt);
+        let encoder_name = encoder_name(&video_codec, &source_codec, ctx.backend());
+        let renditions: Vec<Rendition> = heights
+            .iter()
+            .map(|&height| Rendition {
+                encoder_name,
+                options: &options,
+                height,
+            })
+            .collect();
+        ctx.transcode_renditions(
+            &video_path,
+            &renditions,
+            format,
+            segment.start,
+            segment.duration,
+            segment.seek_pos,
+        )
+        .map(|buffers| buffers.into_iter().map(Bytes::from).collect())
+    })
+    .await
+    .map_err(|e| AppError::Error(e.to_string()))?
+    .map_err(|err| ff_error("hm_transcode", err))
+}
+
+/// opens a session that transcodes the segments of `layout` from `first` to
+/// the end in one pass, segments are cut from it with `next_session_segment`
+pub async fn open_video_session(
+    hmff: PoolGuard<HMff>,
+    video_path: &str,
+    stream_type: &StreamType,
+    format: Format,
+    source: &ProbeInfo,
+    layout: &SegmentLayout,
+    first: usize,
+) -> Result<TranscodeSession, AppError> {
+    let segments: Vec<SegmentRange> = (first..layout.len())
+        .filter_map(|idx| layout.segment(idx))
+        .collect();
+    let Some(last) = segments.last() else {
+        return Err(AppError::InvalidSegmentName);
     };
+    let starts: Vec<f64> = segments.iter().map(|segment| segment.start).collect();
+    let end = last.start + last.duration;
+    let seek_pos = segments[0].seek_pos;
     let video_path = video_path.to_owned();
+    let video_codec = stream_type.video_codec.clone();
+    let source_codec = source.video_codec.clone();
+    let height = stream_type.resolution.scale_height(source.height).unwrap_or(0);
+    let options = EncoderOptions::profile(stream_type.profile);
 
     task::spawn_blocking(move || {
-        hmff.context().transcode_segment(
+        let ctx = hmff.context();
+        let encoder_name = encoder_name(&video_codec, &source_codec, ctx.backend());
+        ctx.open_session(
             &video_path,
-            &stream_type.video_codec.to_string(),
-            start,
-            duration,
+            encoder_name,
+            &options,
+            height,
+            format,
+            &starts,
+            end,
+            seek_pos,
         )
     })
     .await
     .map_err(|e| AppError::Error(e.to_string()))?
-    .map_err(|err| AppError::Error(format!("hm_transcode failed with code {err}")))
+    .map_err(|err| AppError::Error(format!("hm_session_open failed with code {err}")))
+}
+
+/// runs `session` until its next segment is cut, `hmff` is only held to
+/// keep the number of busy transcoders within the pool. a session that
+/// failed or was interrupted is dropped since it can't go on
+pub async fn next_session_segment(
+    hmff: PoolGuard<HMff>,
+    mut session: TranscodeSession,
+) -> Result<(TranscodeSession, Bytes), AppError> {
+    task::spawn_blocking(move || {
+        let segment = match session.next_segment() {
+            Some(segment) => segment,
+            None => {
+                return Err(AppError::Error(
+                    "transcode session has no segments left".into(),
+                ));
+            }
+        };
+        drop(hmff);
+        segment
+            .map(|buffer| (session, Bytes::from(buffer)))
+            .map_err(|err| ff_error("hm_session_next", err))
+    })
+    .await
+    .map_err(|e| AppError::Error(e.to_string()))?
+}
+
+fn ff_error(call: &str, err: i32) -> AppError {
+    if err == AVERROR_EXIT {
+        AppError::Error(format!("{call} was interrupted"))
+    } else {
+        AppError::Error(format!("{call} failed with code {err}"))
+    }
+}
+
+fn encoder_name<'a>(video_codec: &VideoCodec, source_codec: &'a str, backend: Backend) -> &'a str {
+    match video_codec {
+        // keep the source codec, only segments that can't be copied end up here
+        VideoCodec::None => source_codec,
+        codec => codec.encoder_name(backend),
+    }
+}
+
+/// copies a keyframe aligned segment without a transcoder while it holds a
+/// `remux_permits` permit. gives up as soon as `out` is abandoned
+pub async fn remux_video_segment(
+    permit: OwnedSemaphorePermit,
+    video_path: &str,
+    format: Format,
+    segment: SegmentRange,
+    out: Arc<SegmentStream>,
+    streaming: bool,
+) -> Result<(), AppError> {
+    let video_path = video_path.to_owned();
+    let interrupt = out.interrupt();
+
+    task::spawn_blocking(move || {
+        let _permit = permit;
+        if streaming {
+            haema_ff_sys::remux_segment_to(
+                &video_path,
+                format,
+                segment.start,
+                segment.duration,
+                segment.seek_pos,
+                Some(&interrupt),
+                |chunk| out.push(Bytes::copy_from_slice(chunk)),
+            )
+        } else {
+            haema_ff_sys::remux_segment(
+                &video_path,
+                format,
+                segment.start,
+                segment.duration,
+                segment.seek_pos,
+                Some(&interrupt),
+            )
+            .map(|buffer| out.push(Bytes::from(buffer)))
+        }
+    })
+    .await
+    .map_err(|e| AppError::Error(e.to_string()))?
+    .map_err(|err| ff_error("hm_remux", err))
+}
+
+/// serves the segment of `key` from the segment cache, a miss starts producing
+/// it from `video_path` and returns the output while it is being written.
+/// `job` is what a transcode waits for a transcoder as
+pub fn stream_video_segment(
+    state: &AppState,
+    key: &SegmentKey,
+    video_path: &str,
+    job: Job,
+) -> SegmentBody {
+    get_or_produce_video_segment(state, key, video_path, job, true)
+}
+
+/// like `stream_video_segment` but waits for the whole segment, a miss is
+/// produced into one buffer that is handed over without copying
+pub async fn load_video_segment(
+    state: &AppState,
+    key: &SegmentKey,
+    video_path: &str,
+    job: Job,
+) -> Result<Bytes, AppError> {
+    get_or_produce_video_segment(state, key, video_path, job, false)
+        .bytes()
+        .await
+}
+
+fn get_or_produce_video_segment(
+    state: &AppState,
+    key: &SegmentKey,
+    video_path: &str,
+    job: Job,
+    streaming: bool,
+) -> SegmentBody {
+    let task_state = state.clone();
+    let task_key = key.clone();
+    let video_path = video_path.to_owned();
+    let playback = job.class == JobClass::Playback;
+
+    let body = state.segment_cache.get_or_produce(key, move |out| async move {
+        produce_video_segment(&task_state, &task_key, &video_path, job, out, streaming).await
+    });
+    // a player joining a prefetch raises it to playback
+    if let (SegmentBody::Streaming(demand), true) = (&body, playback) {
+        demand.stream().mark_urgent();
+    }
+    body
+}
+
+async fn produce_video_segment(
+    state: &AppState,
+    key: &SegmentKey,
+    video_path: &str,
+    job: Job,
+    out: Arc<SegmentStream>,
+    streaming: bool,
+) -> Result<(), AppError> {
+    let video_layout = get_segment_layout(state, &key.video_id, video_path, key.mtime).await?;
+    let source = state.probe_cache.get(video_path).await?;
+    let stream_type = key.stream_type.clone();
+    let layout = stream_layout(&video_layout, key.fast_start, &stream_type, &source);
+    let segment = layout
+        .segment(key.segment_idx)
+        .ok_or(AppError::InvalidSegmentName)?;
+
+    let Some(profile) = segment_encoding(&layout, key.segment_idx, &segment, &stream_type, &source)
+    else {
+        let permit = tokio::select! {
+            permit = state.remux_permits.clone().acquire_owned() => {
+                permit.map_err(|err| AppError::Error(err.to_string()))?
+            }
+            _ = out.abandoned() => return Err(AppError::Error("segment was abandoned".into())),
+        };
+        return remux_video_segment(permit, video_path, key.format, segment, out, streaming).await;
+    };
+
+    // nobody waits on the chunks of a buffered segment, so the rest of the
+    // ladder is encoded in the same pass. the short segments of a fast start
+    // are wanted as soon as possible and go alone
+    let siblings = if streaming || layout.is_fast_start(key.segment_idx) {
+        Vec::new()
+    } else {
+        missing_renditions(state, key, &video_layout, &segment, &source)
+    };
+    // a segment abandoned while it waits never takes a transcoder
+    let hmff = tokio::select! {
+        hmff = state.hmff_pool.get(job.promoted_by(out.urgent())) => hmff,
+        _ = out.abandoned() => return Err(AppError::Error("segment was abandoned".into())),
+    };
+    if siblings.is_empty() {
+        let stats = compute_video_segment(
+            hmff,
+            video_path,
+            stream_type,
+            profile,
+            key.format,
+            &source,
+            segment,
+            out,
+            streaming,
+        )
+        .await?;
+        state.metrics.add_transcode(&stats);
+        return Ok(());
+    }
+
+    let heights = std::iter::once(&stream_type)
+        .chain(siblings.iter().map(|sibling| &sibling.stream_type))
+        .map(|stream_type| stream_type.resolution.scale_height(source.height).unwrap_or(0))
+        .collect();
+    let mut outputs = compute_video_renditions(
+        hmff,
+        video_path,
+        stream_type.video_codec,
+        profile,
+        key.format,
+        &source,
+        heights,
+        segment,
+        out.interrupt(),
+    )
+    .await?
+    .into_iter();
+    out.push(outputs.next().unwrap_or_default());
+    for (sibling, output) in siblings.into_iter().zip(outputs) {
+        state.segment_cache.put(sibling, output);
+    }
+    Ok(())
+}
+
+/// whether `segment` is stream copied instead of transcoded
+pub fn is_copy(segment: &SegmentRange, stream_type: &StreamType, source: &ProbeInfo) -> bool {
+    segment.keyframe_aligned && !needs_transcode(stream_type, source)
+}
+
+/// whether `stream_type` differs from the source, segments of it are
+/// transcoded wherever they fall
+pub fn needs_transcode(stream_type: &StreamType, source: &ProbeInfo) -> bool {
+    !stream_type.video_codec.is_copy_of(&source.video_codec)
+        || stream_type.resolution.scale_height(source.height).is_some()
 }
 
+// the same segment in the other sizes of the ladder that have to be
+// transcoded and are neither cached nor being produced. a size whose stream
+// is laid out differently numbers its segments differently and is left out
+fn missing_renditions(
+    state: &AppState,
+    key: &SegmentKey,
+    video_layout: &SegmentLayout,
+    segment: &SegmentRange,
+    source: &ProbeInfo,
+) -> Vec<SegmentKey> {
+    let fast_start = |stream_type: &StreamType| {
+        has_fast_start(state.config.fast_start, video_layout, stream_type, source)
+    };
+    let height = key.stream_type.resolution.scale_height(source.height);
+    let ladder = rendition_ladder(&state.config.renditions, source.height);
+    if !ladder
+        .iter()
+        .any(|resolution| resolution.scale_height(source.height) == height)
+    {
+        return Vec::new();
+    }
+
+    ladder
+        .into_iter()
+        .filter(|resolution| resolution.scale_height(source.height) != height)
+        .map(|resolution| {
+            let stream_type = StreamType {
+                resolution,
+                ..key.stream_type.clone()
+            };
+            SegmentKey {
+                fast_start: fast_start(&stream_type),
+                stream_type,
+                ..key.clone()
+            }
+        })
+        .filter(|sibling| {
+            !is_copy(segment, &sibling.stream_type, source)
+                && sibling.fast_start == key.fast_start
+                && !state.segment_cache.contains(sibling)
+        })
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_segment_filename() {
+        let parse = |name: &str| parse_segment_filename(&name.to_string()).ok();
+        assert_eq!(parse("0.ts"), Some(SegmentFile::Media(0, Format::MpegTs)));
+        assert_eq!(parse("12.m4s"), Some(SegmentFile::Media(12, Format::Fmp4)));
+        assert_eq!(parse("init-3.mp4"), Some(SegmentFile::Init(3)));
+        assert_eq!(parse("3.mp4"), None);
+        assert_eq!(parse("init-3.ts"), None);
+        assert_eq!(parse("init-3.m4s"), None);
+        assert_eq!(parse("a.ts"), None);
+        assert_eq!(parse("99999999999999999999999.ts"), None);
+    }
+
+    #[test]
+    fn test_h264_codecs() {
+        assert_eq!(h264_codecs(1280, 720, 30.0), "avc1.64001f");
+        assert_eq!(h264_codecs(1920, 1080, 30.0), "avc1.640028");
+        assert_eq!(h264_codecs(1920, 1080, 60.0), "avc1.64002a");
+        assert_eq!(h264_codecs(3840, 2160, 30.0), "avc1.640033");
+        assert_eq!(h264_codecs(7680, 4320, 120.0), "avc1.64003c");
+    }
+
+    fn source(video_codec: &str, audio_codec: Option<&str>) -> ProbeInfo {
+        ProbeInfo {
+            duration: 60.0,
+            start_time: 0.0,
+            video_codec: video_codec.to_string(),
+            width: 1920,
+            height: 1080,
+            frame_rate: 30.0,
+            audio_codec: audio_codec.map(str::to_string),
+            audio_tracks: audio_codec.is_some() as u32,
+            bit_rate: 0,
+        }
+    }
+
+    // the CODECS of every variant of the master playlist, in ladder order
+    fn master_codecs(source: &ProbeInfo) -> Vec<Option<String>> {
+        let ladder = [Resolution::Source, Resolution::Height(720)];
+        create_hls_master_playlist(&ladder, source, EncoderProfile::Latency)
+            .lines()
+            .filter(|line| line.starts_with("#EXT-X-STREAM-INF"))
+            .map(|line| {
+                line.split_once("CODECS=")
+                    .map(|(_, codecs)| codecs.trim_matches('"').to_string())
+            })
+            .collect()
+    }
+
+    #[test]
+    fn test_master_codecs() {
+        // the source size is copied, its profile and level are unknown
+        assert_eq!(
+            master_codecs(&source("h264", Some("aac"))),
+            [None, Some("avc1.64001f,mp4a.40.2".to_string())]
+        );
+        assert_eq!(
+            master_codecs(&source("h264", Some("ac3"))),
+            [None, Some("avc1.64001f,ac-3".to_string())]
+        );
+        assert_eq!(
+            master_codecs(&source("hevc", Some("opus"))),
+            [
+                Some("avc1.640028,Opus".to_string()),
+                Some("avc1.64001f,Opus".to_string())
+            ]
+        );
+        assert_eq!(
+            master_codecs(&source("hevc", None)),
+            [
+                Some("avc1.640028".to_string()),
+                Some("avc1.64001f".to_string())
+            ]
+        );
+        // an audio codec without a known codecs string leaves CODECS out
+        assert_eq!(master_codecs(&source("hevc", Some("dts"))), [None, None]);
+    }
+}
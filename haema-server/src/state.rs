@@ -1,18 +1,160 @@
 use std::sync::Arc;
+use std::thread;
+use std::time::Duration;
 
-use crate::{domain::HMff, pool::Pool};
+use haema_ff_sys::Backend;
+use tokio::sync::Semaphore;
+
+use crate::{
+    cache::{DiskCache, KeyframeStore, ProbeCache, SegmentCache},
+    config::Config,
+    domain::HMff,
+    library::Library,
+    metrics::Metrics,
+    pool::Pool,
+    services::{Prefetcher, spawn_library_tasks},
+};
+
+// threads given to each software transcode, the rest of the cores are used
+// by running more transcodes in parallel
+const SW_THREADS_PER_TRANSCODE: usize = 4;
+
+// sources each transcoder keeps open for the next segment of the same file
+const INPUTS_PER_TRANSCODE: usize = 2;
+const INPUT_IDLE_TIMEOUT: Duration = Duration::from_secs(30);
+const INPUT_SWEEP_INTERVAL: Duration = Duration::from_secs(10);
+
+// stream copies run next to the transcoders, they mostly wait on the disk so
+// a few per core are allowed
+const REMUXES_PER_CPU: usize = 2;
+
+const CACHE_INDEX_PERSIST_INTERVAL: Duration = Duration::from_secs(30);
+const KEYFRAME_DIR: &str = "keyframes";
 
 #[derive(Clone)]
 pub struct AppState {
+    pub config: Arc<Config>,
     pub hmff_pool: Arc<Pool<HMff>>,
+    /// bounds the stream copies running at once
+    pub remux_permits: Arc<Semaphore>,
+    pub segment_cache: Arc<SegmentCache>,
+    pub keyframe_store: Arc<KeyframeStore>,
+    pub probe_cache: Arc<ProbeCache>,
+    pub prefetcher: Arc<Prefetcher>,
+    pub library: Arc<Library>,
+    pub metrics: Arc<Metrics>,
 }
 
 impl AppState {
-    pub fn new() -> Self {
-        // TODO: get number of cpus
-        let hmff_pool = Arc::new(Pool::new(HMff::new, 10));
+    pub fn new(config: Config) -> Self {
+        let state = Self::without_library_tasks(config);
+        spawn_library_tasks(state.clone());
+        state
+    }
+
+    /// the state without the library indexer and watcher, for benches that
+    /// pass their sources by path
+    pub fn without_library_tasks(config: Config) -> Self {
+        let cpus = thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1);
+        let backend = haema_ff_sys::probe_backend();
+        let (pool_size, threads) = match backend {
+            Backend::Software => {
+                let threads = SW_THREADS_PER_TRANSCODE.min(cpus);
+                (cpus / threads, threads)
+            }
+            _ => (cpus, 0),
+        };
+        println!("using {backend} backend with {pool_size} transcoders");
+
+        let hmff_pool = Arc::new(Pool::new(
+            move || {
+                let hmff = HMff::with_backend(backend, threads);
+                hmff.context().set_input_cache(INPUTS_PER_TRANSCODE, INPUT_IDLE_TIMEOUT);
+                hmff
+            },
+            pool_size,
+        ));
+        spawn_input_sweeper(hmff_pool.clone());
+        let remux_permits = Arc::new(Semaphore::new(cpus * REMUXES_PER_CPU));
+
+        let disk_cache = if config.cache {
+            match DiskCache::open(&config.cache_path, config.cache_limit) {
+                Ok(cache) => Some(spawn_disk_cache_tasks(Arc::new(cache))),
+                Err(err) => {
+                    println!("disk cache disabled, failed to open: {err}");
+                    None
+                }
+            }
+        } else {
+            None
+        };
 
-        Self { hmff_pool }
+        let segment_cache = Arc::new(SegmentCache::new(config.memory_cache_limit, disk_cache));
+
+        // keyframe indexes are small and expensive to rebuild, they are kept
+        // even when the segment cache is disabled
+        let keyframe_store = Arc::new(
+            KeyframeStore::new(&config.cache_path.join(KEYFRAME_DIR))
+                .expect("failed to create keyframe index directory"),
+        );
+
+        let probe_cache = Arc::new(ProbeCache::default());
+
+        let prefetcher = Arc::new(Prefetcher::new(config.prefetch_segments));
+        prefetcher.spawn_sweeper();
+
+        // the cache and the db may live under the target path
+        let library = Arc::new(
+            Library::open(
+                &config.db,
+                &config.target_path,
+                &[&config.cache_path, &config.db],
+            )
+            .expect("failed to open library db"),
+        );
+
+        let metrics = Arc::new(Metrics::new(&config.renditions));
+
+        Self {
+            config: Arc::new(config),
+            hmff_pool,
+            remux_permits,
+            segment_cache,
+            keyframe_store,
+            probe_cache,
+            prefetcher,
+            library,
+            metrics,
+        }
     }
 }
 
+fn spawn_disk_cache_tasks(cache: Arc<DiskCache>) -> Arc<DiskCache> {
+    let task_cache = cache.clone();
+    tokio::spawn(async move {
+        if let Err(err) = task_cache.reconcile().await {
+            println!("failed to reconcile disk cache: {err}");
+        }
+        let mut interval = tokio::time::interval(CACHE_INDEX_PERSIST_INTERVAL);
+        loop {
+            interval.tick().await;
+            if let Err(err) = task_cache.persist_index().await {
+                println!("failed to persist disk cache index: {err}");
+            }
+        }
+    });
+    cache
+}
+
+// transcoders that sit idle never get to close their expired inputs
+fn spawn_input_sweeper(pool: Arc<Pool<HMff>>) {
+    tokio::spawn(async move {
+        let mut interval = tokio::time::interval(INPUT_SWEEP_INTERVAL);
+        loop {
+            interval.tick().await;
+            pool.for_each_idle(|hmff| hmff.context().expire_inputs());
+        }
+    });
+}